@@ -20,7 +20,10 @@ CREATE TABLE IF NOT EXISTS metrics_state (
 -- Grafana requires the time column be in the UTC timezone
    time_utc             DATETIME NOT NULL,
    device_time          DATETIME,
-   INDEX metrics_state_time_index (time_utc)
+-- Last 4 bytes of the weather station MAC address, e.g. '69:12:ab:cd'
+   station_mac          CHAR(11),
+   INDEX metrics_state_time_index (time_utc),
+   INDEX metrics_state_station_index (station_mac, time_utc)
 );
 
 CREATE TABLE IF NOT EXISTS sensor_reading (
@@ -57,6 +60,9 @@ CREATE TABLE IF NOT EXISTS sensor_reading_debug(
 --
 -- ALTER TABLE sensor_reading ADD COLUMN battery_low BIT(1);
 --
+-- ALTER TABLE metrics_state ADD COLUMN station_mac CHAR(11);
+-- CREATE INDEX metrics_state_station_index ON metrics_state(station_mac, time_utc);
+--
 
 --------------------------------------------------------------------
 -- The tables below are work in progress
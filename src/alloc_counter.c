@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "alloc_counter.h"
+
+#include <stddef.h>
+
+#ifdef DEBUG_ALLOCATIONS
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static unsigned long allocation_count = 0;
+
+void *__wrap_malloc(size_t size)
+{
+        allocation_count++;
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+        allocation_count++;
+        return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+        allocation_count++;
+        return __real_realloc(ptr, size);
+}
+
+unsigned long get_allocation_count()
+{
+        return allocation_count;
+}
+
+#else
+
+// ISO C forbids an empty translation unit
+typedef int alloc_counter_disabled;
+
+#endif
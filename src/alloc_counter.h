@@ -0,0 +1,29 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Counting of memory allocations, enabled with "make DEBUG_ALLOCATIONS=1".
+ * The program is then linked with -Wl,--wrap=malloc etc., so that all calls
+ * to malloc(), calloc() and realloc() go through this module.
+ */
+
+#ifdef DEBUG_ALLOCATIONS
+unsigned long get_allocation_count();
+#endif
@@ -0,0 +1,532 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Micro-benchmarks of the packet handling path, run with "make bench".
+ *
+ * Every benchmark runs over a corpus of packets in the format sent by the
+ * weather station for at least BENCH_MIN_TIME_MS. Reported are the time and
+ * the number of memory allocations per operation and, if the kernel allows
+ * perf_event_open(), the number of instructions per operation. The results
+ * are printed as JSON on standard output and as a table on standard error.
+ *
+ * The latency statistics of the stages of the program (see src/latency.h)
+ * gathered while running process_incoming_packet() are printed too.
+ */
+
+// syscall()
+#define _GNU_SOURCE
+
+// The benchmark is always linked with the allocation counter
+#ifndef DEBUG_ALLOCATIONS
+#define DEBUG_ALLOCATIONS
+#endif
+
+#include "emax_em3371.h"
+#include "alloc_counter.h"
+#include "latency.h"
+#include "log.h"
+#include "output_csv.h"
+#include "output_json.h"
+#include "output_sql.h"
+#include "psychrometrics.h"
+#include "scratch_arena.h"
+#include "sink.h"
+#include "station_registry.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_MIN_TIME_MS 200
+
+// Checksums and final delimiters are added when parsing
+static const char *const corpus_hex[] = {
+        // Ping packet
+        "3c 57 01 69 a1 b2 c3 00 00 00 00 00",
+        // Station sensor only
+        "3c 57 01 69 a1 b2 c3 01 00 00 39 00 02 0c 14 0c "
+        "0f 0a 1e 00 00 5a 06 2d 66 06 31 4b 06 27 ff ff "
+        "ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff "
+        "ff ff ff ff ff ff ff ff ff 00 00 f5 03 10 ff ff "
+        "ff ff ff ff ff",
+        // Station sensor and a remote sensor with low battery
+        "3c 57 01 69 a1 b2 c3 01 00 00 39 00 02 0c 14 0c "
+        "0f 0a 1e 00 00 2a 06 34 36 06 38 1b 06 2e 20 05 "
+        "51 2c 05 55 11 05 4b ff ff ff ff ff ff ff ff ff "
+        "ff ff ff ff ff ff ff ff ff 02 00 f5 03 10 ff ff "
+        "ff ff ff ff ff",
+        // All sensors
+        "3c 57 01 69 a1 b2 c4 01 00 00 39 00 02 0c 14 0c "
+        "0f 0a 1e 00 00 58 06 28 64 06 2c 49 06 22 c8 05 "
+        "3f d4 05 43 b9 05 39 51 04 5c 5d 04 60 42 04 56 "
+        "ea 06 23 f6 06 27 db 06 1d 00 00 e6 03 20 ff ff "
+        "ff ff ff ff ff",
+        // Winter: temperatures below 0°C, a lost sensor
+        "3c 57 01 69 a1 b2 c5 01 00 00 39 00 02 0c 14 0c "
+        "0f 0a 1e 00 00 1a 06 26 26 06 2a 0b 06 20 24 04 "
+        "58 30 04 5c 15 04 52 ff ff ff ff ff ff ff ff ff "
+        "b6 03 61 c2 03 65 a7 03 5b 08 04 07 04 40 ff ff "
+        "ff ff ff ff ff",
+};
+#define CORPUS_SIZE (sizeof(corpus_hex) / sizeof(corpus_hex[0]))
+
+struct corpus_packet {
+        unsigned char data[RECEIVE_PACKET_SIZE];
+        size_t size;
+};
+
+static struct corpus_packet corpus[CORPUS_SIZE];
+static size_t corpus_size = 0;
+
+// Decoded sensor data packets from the corpus
+static struct device_sensor_state corpus_states[CORPUS_SIZE];
+static size_t corpus_state_count = 0;
+
+// Measurements with both temperature and humidity, for dew point benchmarks
+static struct device_single_measurement corpus_measurements[4 * CORPUS_SIZE];
+static size_t corpus_measurement_count = 0;
+
+static FILE *null_stream = NULL;
+static struct sql_statements_list sql_statements;
+
+// Results are accumulated here, so that the compiler does not optimize the
+// benchmarked calls away
+static volatile double result_sink;
+
+// process_incoming_packet() writes measurements to a CSV file only
+static struct program_options process_options;
+static const struct sockaddr_in packet_source = {
+        .sin_family = AF_INET,
+        .sin_port = 0x6842,     // 17000 in network byte order
+};
+
+static bool parse_corpus_packet(struct corpus_packet *packet, const char *hex)
+{
+        char *end;
+
+        packet->size = 0;
+        while (*hex != 0) {
+                unsigned long byte = strtoul(hex, &end, 16);
+                if (end == hex || byte > 0xff
+                                || packet->size + 2 >= sizeof(packet->data)) {
+                        return false;
+                }
+                packet->data[packet->size++] = byte;
+                hex = end;
+        }
+
+        unsigned char sum = 0;
+        for (size_t i = 0; i < packet->size; i++) {
+                sum += packet->data[i];
+        }
+        packet->data[packet->size++] = sum;
+        packet->data[packet->size++] = '>';
+        return true;
+}
+
+static void add_corpus_measurement(const struct device_single_measurement *measurement)
+{
+        if (measurement->humidity != DEVICE_INCORRECT_HUMIDITY
+                        && measurement->humidity != 0
+                        && !DEVICE_IS_INCORRECT_TEMPERATURE(measurement->temperature)) {
+                corpus_measurements[corpus_measurement_count++] = *measurement;
+        }
+}
+
+static bool load_corpus()
+{
+        for (size_t i = 0; i < CORPUS_SIZE; i++) {
+                struct corpus_packet *packet = &corpus[corpus_size];
+                if (!parse_corpus_packet(packet, corpus_hex[i])
+                                || !is_packet_correct(packet->data, packet->size)) {
+                        fprintf(stderr, "Incorrect packet %zu in the corpus\n", i);
+                        return false;
+                }
+                corpus_size++;
+
+                if (packet->size < 65) {
+                        continue;
+                }
+                struct device_sensor_state *state = &corpus_states[corpus_state_count++];
+                memset(state, 0, sizeof(*state));
+                decode_sensor_state(state, packet->data, packet->size);
+
+                add_corpus_measurement(&state->station_sensor.current);
+                for (int j = 0; j < 3; j++) {
+                        add_corpus_measurement(&state->remote_sensors[j].current);
+                }
+        }
+        return true;
+}
+
+static double temperature_to_double(device_temperature_t temperature)
+{
+#ifdef FIXED_POINT_MEASUREMENTS
+        return temperature / 100.;
+#else
+        return temperature;
+#endif
+}
+
+static int temperature_to_hundredths(device_temperature_t temperature)
+{
+#ifdef FIXED_POINT_MEASUREMENTS
+        return temperature;
+#else
+        return lroundf(temperature * 100.f);
+#endif
+}
+
+/*
+ * Every benchmark makes one pass over the corpus and returns the number of
+ * operations done.
+ */
+
+static size_t bench_is_packet_correct()
+{
+        int correct = 0;
+        for (size_t i = 0; i < corpus_size; i++) {
+                correct += is_packet_correct(corpus[i].data, corpus[i].size);
+        }
+        result_sink += correct;
+        return corpus_size;
+}
+
+static size_t bench_decode_sensor_state()
+{
+        struct device_sensor_state state;
+        size_t count = 0;
+
+        for (size_t i = 0; i < corpus_size; i++) {
+                if (corpus[i].size < 65) {
+                        continue;
+                }
+                decode_sensor_state(&state, corpus[i].data, corpus[i].size);
+                result_sink += state.atmospheric_pressure;
+                count++;
+        }
+        return count;
+}
+
+static size_t bench_dew_point()
+{
+        for (size_t i = 0; i < corpus_measurement_count; i++) {
+                const struct device_single_measurement *measurement = &corpus_measurements[i];
+                result_sink += dew_point(temperature_to_double(measurement->temperature),
+                                measurement->humidity);
+        }
+        return corpus_measurement_count;
+}
+
+static size_t bench_dew_point_from_table()
+{
+        for (size_t i = 0; i < corpus_measurement_count; i++) {
+                const struct device_single_measurement *measurement = &corpus_measurements[i];
+                result_sink += dew_point_from_table(
+                                temperature_to_hundredths(measurement->temperature),
+                                measurement->humidity);
+        }
+        return corpus_measurement_count;
+}
+
+static size_t bench_get_sensor_state_sql()
+{
+        for (size_t i = 0; i < corpus_state_count; i++) {
+                sql_statements_list_construct(&sql_statements);
+                get_sensor_state_sql(&sql_statements, &corpus_states[i]);
+                result_sink += sql_statements.count;
+        }
+        return corpus_state_count;
+}
+
+static size_t bench_display_sensor_state_CSV()
+{
+        for (size_t i = 0; i < corpus_state_count; i++) {
+                display_sensor_state_CSV(&corpus_states[i]);
+        }
+        return corpus_state_count;
+}
+
+static size_t bench_display_sensor_state_json()
+{
+        for (size_t i = 0; i < corpus_state_count; i++) {
+                display_sensor_state_json(null_stream, &corpus_states[i]);
+        }
+        return corpus_state_count;
+}
+
+static size_t bench_process_incoming_packet()
+{
+        for (size_t i = 0; i < corpus_size; i++) {
+                process_incoming_packet(-1, &packet_source, corpus[i].data, corpus[i].size,
+                                1609502400, latency_now_ns(), &process_options);
+        }
+        return corpus_size;
+}
+
+static size_t bench_log_hexdump()
+{
+        for (size_t i = 0; i < corpus_size; i++) {
+                log_hexdump("2021-01-01 12:00:00 received a packet from 192.168.1.2:17000 :",
+                                corpus[i].data, corpus[i].size);
+        }
+        return corpus_size;
+}
+
+struct benchmark {
+        const char *name;
+        size_t (*run)();
+};
+
+static const struct benchmark benchmarks[] = {
+        { "is_packet_correct", bench_is_packet_correct },
+        { "decode_sensor_state", bench_decode_sensor_state },
+        { "dew_point", bench_dew_point },
+        { "dew_point_from_table", bench_dew_point_from_table },
+        { "get_sensor_state_sql", bench_get_sensor_state_sql },
+        { "display_sensor_state_CSV", bench_display_sensor_state_CSV },
+        { "display_sensor_state_json", bench_display_sensor_state_json },
+        { "process_incoming_packet", bench_process_incoming_packet },
+        { "log_hexdump", bench_log_hexdump },
+};
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+struct benchmark_result {
+        unsigned long operations;
+        double ns_per_operation;
+        double allocations_per_operation;
+        bool have_instructions;
+        double instructions_per_operation;
+};
+
+static struct benchmark_result results[BENCHMARK_COUNT];
+
+static uint64_t now_ns()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns -1 if instructions cannot be counted (e.g. in a container or
+// a virtual machine, or if perf_event_paranoid does not allow it)
+static int open_instruction_counter()
+{
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif
+}
+
+static void run_benchmark(const struct benchmark *benchmark,
+                struct benchmark_result *result, int instruction_counter)
+{
+        // Warm up: fill caches, the dew point table and stdio buffers
+        benchmark->run();
+
+        unsigned long operations = 0;
+        unsigned long allocations = get_allocation_count();
+#ifdef __linux__
+        if (instruction_counter != -1) {
+                ioctl(instruction_counter, PERF_EVENT_IOC_RESET, 0);
+                ioctl(instruction_counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+        uint64_t start = now_ns();
+        uint64_t end;
+
+        do {
+                operations += benchmark->run();
+                end = now_ns();
+        } while (end - start < BENCH_MIN_TIME_MS * 1000000ULL);
+
+        allocations = get_allocation_count() - allocations;
+        result->have_instructions = false;
+#ifdef __linux__
+        if (instruction_counter != -1) {
+                uint64_t instructions;
+                ioctl(instruction_counter, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(instruction_counter, &instructions, sizeof(instructions))
+                                == sizeof(instructions)) {
+                        result->have_instructions = true;
+                        result->instructions_per_operation =
+                                (double) instructions / operations;
+                }
+        }
+#else
+        (void) instruction_counter;
+#endif
+
+        result->operations = operations;
+        result->ns_per_operation = (double) (end - start) / operations;
+        result->allocations_per_operation = (double) allocations / operations;
+}
+
+static void print_results_json(FILE *stream)
+{
+        fprintf(stream, "{\n  \"fixed_point_measurements\": %s,\n  \"benchmarks\": [\n",
+#ifdef FIXED_POINT_MEASUREMENTS
+                        "true"
+#else
+                        "false"
+#endif
+                        );
+
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+                const struct benchmark_result *result = &results[i];
+
+                fprintf(stream, "    { \"name\": \"%s\", \"operations\": %lu, "
+                                "\"ns_per_op\": %.2f, \"allocations_per_op\": %.3f, "
+                                "\"instructions_per_op\": ",
+                                benchmarks[i].name, result->operations,
+                                result->ns_per_operation,
+                                result->allocations_per_operation);
+                if (result->have_instructions) {
+                        fprintf(stream, "%.1f", result->instructions_per_operation);
+                } else {
+                        fputs("null", stream);
+                }
+                fprintf(stream, " }%s\n", i + 1 < BENCHMARK_COUNT ? "," : "");
+        }
+
+        fputs("  ],\n  \"latency\": [\n", stream);
+
+        bool first = true;
+        for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+                const struct latency_histogram *histogram = get_latency_histogram(stage);
+                if (histogram->count == 0) {
+                        continue;
+                }
+                fprintf(stream, "%s    { \"stage\": \"%s\", \"count\": %" PRIu64 ", "
+                                "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+                                "\"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 " }",
+                                first ? "" : ",\n",
+                                latency_stage_name(stage), histogram->count,
+                                latency_percentile(histogram, 50.0),
+                                latency_percentile(histogram, 99.0),
+                                latency_percentile(histogram, 99.9),
+                                histogram->max_ns);
+                first = false;
+        }
+
+        fputs("\n  ]\n}\n", stream);
+}
+
+static void print_results_table(FILE *stream)
+{
+        fprintf(stream, "%-28s %12s %12s %14s\n",
+                        "benchmark", "ns/op", "allocs/op", "instructions/op");
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+                const struct benchmark_result *result = &results[i];
+
+                fprintf(stream, "%-28s %12.1f %12.3f ", benchmarks[i].name,
+                                result->ns_per_operation,
+                                result->allocations_per_operation);
+                if (result->have_instructions) {
+                        fprintf(stream, "%14.1f\n", result->instructions_per_operation);
+                } else {
+                        fprintf(stream, "%14s\n", "-");
+                }
+        }
+}
+
+int main()
+{
+        // Warnings about odd measurements would be printed on every pass
+        set_log_level(LOG_LEVEL_ERROR);
+
+        if (!load_corpus()) {
+                return 1;
+        }
+
+        null_stream = fopen("/dev/null", "w");
+        if (null_stream == NULL) {
+                perror("Cannot open /dev/null");
+                return 1;
+        }
+
+        // Also used by display_sensor_state_CSV()
+        memset(&process_options, 0, sizeof(process_options));
+        process_options.csv_output_path = "/dev/null";
+        process_options.csv_flush_policy = (struct flush_policy) DEFAULT_FLUSH_POLICY;
+        process_options.max_stations = DEFAULT_MAX_STATIONS;
+        if (!init_sinks(&process_options)) {
+                return 1;
+        }
+
+        // log_hexdump() writes directly to the standard error
+        int saved_stderr = dup(STDERR_FILENO);
+        if (saved_stderr == -1 || dup2(fileno(null_stream), STDERR_FILENO) == -1) {
+                perror("Cannot redirect standard error");
+                return 1;
+        }
+
+        if (!init_scratch_arena(SCRATCH_ARENA_SIZE)) {
+                return 1;
+        }
+        init_device_logic(&process_options, -1);
+
+        int instruction_counter = open_instruction_counter();
+
+        // Only process_incoming_packet() records latency statistics
+        reset_latency_stats();
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+                run_benchmark(&benchmarks[i], &results[i], instruction_counter);
+        }
+
+        if (instruction_counter != -1) {
+                close(instruction_counter);
+        }
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+
+        shutdown_device_logic();
+        shutdown_scratch_arena();
+        shutdown_sinks();
+        fclose(null_stream);
+
+        print_results_table(stderr);
+        fputc('\n', stderr);
+        dump_latency_stats(stderr);
+        print_results_json(stdout);
+
+        return 0;
+}
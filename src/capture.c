@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+#include "event_loop.h"
+#include "log.h"
+#include "pcapng.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+static FILE *capture_file = NULL;
+static const char *capture_path = NULL;
+static char capture_buffer[CAPTURE_BUFFER_SIZE];
+// Address the socket is bound to, usually 0.0.0.0
+static struct sockaddr_in local_address;
+static struct event_timer flush_timer;
+static bool write_error_reported = false;
+
+static void on_flush_timer(void *data)
+{
+        (void) data;
+        if (capture_file != NULL && fflush(capture_file) != 0
+                        && !write_error_reported) {
+                log_error("Cannot write to capture file '%s'\n", capture_path);
+                write_error_reported = true;
+        }
+}
+
+bool init_capture(const char *path, int udp_socket)
+{
+        memset(&local_address, 0, sizeof(local_address));
+        socklen_t address_length = sizeof(local_address);
+        if (getsockname(udp_socket, (struct sockaddr *) &local_address,
+                                &address_length) != 0) {
+                perror("Cannot get the local address of the socket");
+                return false;
+        }
+
+        capture_file = fopen(path, "ab");
+        if (capture_file == NULL) {
+                char error_msg[1000];
+                snprintf(error_msg, sizeof(error_msg),
+                                "Cannot open capture file '%s'", path);
+                perror(error_msg);
+                return false;
+        }
+        capture_path = path;
+        setvbuf(capture_file, capture_buffer, _IOFBF, sizeof(capture_buffer));
+
+        // When appending, this starts a new section of the file
+        if (!pcapng_write_header(capture_file) || fflush(capture_file) != 0) {
+                fprintf(stderr, "Cannot write to capture file '%s'\n", path);
+                fclose(capture_file);
+                capture_file = NULL;
+                return false;
+        }
+
+        event_timer_init(&flush_timer, on_flush_timer, NULL);
+        return true;
+}
+
+void shutdown_capture()
+{
+        if (capture_file == NULL) {
+                return;
+        }
+        event_timer_cancel(&flush_timer);
+        if (fclose(capture_file) != 0) {
+                fprintf(stderr, "Cannot write to capture file '%s'\n", capture_path);
+        }
+        capture_file = NULL;
+}
+
+static void capture_packet(enum pcapng_direction direction,
+                const struct sockaddr_in *source, const struct sockaddr_in *destination,
+                const unsigned char *data, size_t size)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t timestamp_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+        if (!pcapng_write_udp_packet(capture_file, timestamp_ns, direction,
+                                source, destination, data, size)
+                        && !write_error_reported) {
+                log_error("Cannot write to capture file '%s'\n", capture_path);
+                write_error_reported = true;
+        }
+
+        if (!event_timer_is_scheduled(&flush_timer)) {
+                event_timer_schedule(&flush_timer, CAPTURE_FLUSH_INTERVAL_MS);
+        }
+}
+
+void capture_incoming_packet(const struct sockaddr_in *source,
+                const unsigned char *data, size_t size)
+{
+        if (capture_file != NULL) {
+                capture_packet(PCAPNG_DIRECTION_INBOUND, source, &local_address,
+                                data, size);
+        }
+}
+
+void capture_outgoing_packet(const struct sockaddr_in *destination,
+                const unsigned char *data, size_t size)
+{
+        if (capture_file != NULL) {
+                capture_packet(PCAPNG_DIRECTION_OUTBOUND, &local_address, destination,
+                                data, size);
+        }
+}
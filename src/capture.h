@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Saving all received and sent packets to a pcapng file (see pcapng.h),
+ * for debugging and for replaying them later (see replay.h).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// Buffered data is written to the file at least this often
+#define CAPTURE_FLUSH_INTERVAL_MS 1000
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+// The file is appended to. udp_socket is used to find the local address.
+bool init_capture(const char *path, int udp_socket);
+void shutdown_capture();
+
+void capture_incoming_packet(const struct sockaddr_in *source,
+                const unsigned char *data, size_t size);
+void capture_outgoing_packet(const struct sockaddr_in *destination,
+                const unsigned char *data, size_t size);
@@ -0,0 +1,55 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "crc32.h"
+
+#include <stdbool.h>
+
+static uint32_t crc32_table[256];
+static bool crc32_table_ready = false;
+
+static void init_crc32_table()
+{
+        for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; bit++) {
+                        if (crc & 1) {
+                                crc = (crc >> 1) ^ 0xedb88320;
+                        } else {
+                                crc >>= 1;
+                        }
+                }
+                crc32_table[i] = crc;
+        }
+        crc32_table_ready = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+        const unsigned char *bytes = data;
+
+        if (!crc32_table_ready) {
+                init_crc32_table();
+        }
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+                crc = crc32_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+}
@@ -0,0 +1,39 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Prints the dew point table (see psychrometrics.h) as a C initializer.
+ * Run on the build machine by "make DEW_POINT_TABLE=static".
+ */
+
+#include "psychrometrics.h"
+
+#include <stdio.h>
+
+int main()
+{
+        static int16_t table[DEW_POINT_TABLE_ENTRIES];
+        fill_dew_point_table(table);
+
+        printf("// Generated by dew_point_table_gen, do not edit\n");
+        for (int i = 0; i < DEW_POINT_TABLE_ENTRIES; i++) {
+                printf("%d,%c", table[i],
+                                (i + 1) % DEW_POINT_TABLE_POINTS == 0 ? '\n' : ' ');
+        }
+        return 0;
+}
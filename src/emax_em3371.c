@@ -25,6 +25,14 @@
 #include "emax_em3371.h"
 #include "main.h"
 #include "psychrometrics.h"
+#include "event_loop.h"
+#include "station_registry.h"
+#include "udp_batch.h"
+#include "scratch_arena.h"
+#include "log.h"
+#include "latency.h"
+#include "metrics.h"
+#include "sink.h"
 
 #include <assert.h>
 #include <stdbool.h>
@@ -46,11 +54,107 @@
  * Therefore I'm parsing the packet by hand.
  */
 
+#ifdef FIXED_POINT_MEASUREMENTS
+
+// The device sends temperature in degrees Fahrenheit
+// modified by a linear function: raw / 10 - 90 °F.
+//
+// In hundredths of °C this is (raw - 1220) * 50 / 9, calculated here with
+// integers only and rounded to nearest. The remainder is never exactly half,
+// so the result is the same as of the floating point version below.
+static device_temperature_t raw_temperature_to_celcius(uint16_t raw_temperature)
+{
+        int32_t numerator = ((int32_t) raw_temperature - 1220) * 50;
+        int32_t temperature = numerator >= 0 ? (numerator + 4) / 9 : (numerator - 4) / 9;
+
+        if (temperature > INT16_MAX) {
+                return DEVICE_INCORRECT_TEMPERATURE;
+        }
+        return temperature;
+}
+
+static uint16_t celcius_to_raw_temperature(device_temperature_t temperature)
+{
+        int32_t numerator = (int32_t) temperature * 9;
+        int32_t offset = numerator >= 0 ? (numerator + 25) / 50 : (numerator - 25) / 50;
+        return offset + 1220;
+}
+
+void temperature_to_string(device_temperature_t temperature,
+                char *temperature_out, size_t buffer_size)
+{
+        int value = temperature;
+        const char *sign = "";
+        if (value < 0) {
+                sign = "-";
+                value = -value;
+        }
+        snprintf(temperature_out, buffer_size, "%s%d.%02d", sign, value / 100, value % 100);
+}
+
+static device_temperature_t measurement_dew_point(device_temperature_t temperature,
+                uint16_t humidity)
+{
+#ifndef NO_DEW_POINT_TABLE
+        int16_t table_value = dew_point_from_table(temperature, humidity);
+        if (table_value != DEW_POINT_NOT_IN_TABLE) {
+                return table_value;
+        }
+#endif
+
+        // Uses floating point calculations, but only for readings outside of
+        // the range of the sensors
+        double value = dew_point(temperature / 100., humidity);
+        if (isnan(value)) {
+                return DEVICE_INCORRECT_TEMPERATURE;
+        }
+        return lround(value * 100.);
+}
+
+#else
+
 static float fahrenheit_to_celcius(float temperature_fahrenheit)
 {
         return (temperature_fahrenheit - 32.) * 5./9.;
 }
 
+// The device sends temperature in degrees Fahrenheit
+// modified by a linear function.
+//
+// When the device is configured to display temperature in °F,
+// the temperature calculated this way matches exactly the one
+// displayed on the device's screen.
+static device_temperature_t raw_temperature_to_celcius(uint16_t raw_temperature)
+{
+        float temperature_fahrenheit = (float) raw_temperature / 10. - 90.;
+        return fahrenheit_to_celcius(temperature_fahrenheit);
+}
+
+static uint16_t celcius_to_raw_temperature(device_temperature_t temperature)
+{
+        return lround(((double) temperature * 9. / 5. + 32. + 90.) * 10.);
+}
+
+void temperature_to_string(device_temperature_t temperature,
+                char *temperature_out, size_t buffer_size)
+{
+        snprintf(temperature_out, buffer_size, "%.2f", (double) temperature);
+}
+
+static device_temperature_t measurement_dew_point(device_temperature_t temperature,
+                uint16_t humidity)
+{
+#ifndef NO_DEW_POINT_TABLE
+        int16_t table_value = dew_point_from_table(lroundf(temperature * 100.f), humidity);
+        if (table_value != DEW_POINT_NOT_IN_TABLE) {
+                return table_value / 100.f;
+        }
+#endif
+        return dew_point(temperature, humidity);
+}
+
+#endif
+
 /*
  * Accesses three bytes from raw_data.
  * Returns true if at least some data is present.
@@ -68,24 +172,16 @@ static bool decode_single_measurement(struct device_single_measurement *measurem
 
 	if (raw_data[0] == 0xff && raw_data[1] == 0xff) {
 		measurement->temperature = DEVICE_INCORRECT_TEMPERATURE;
-		fprintf(stderr, "Weird: measurement contains humidity, but not temperature.\n");
+		log_warning("Weird: measurement contains humidity, but not temperature.\n");
 	} else {
 		// Trying to be endianness-agnostic
 		uint16_t raw_temperature = raw_data[0] + ((int)raw_data[1]) * 256;
-
-		// The device sends temperature in degrees Fahrenheit
-                // modified by a linear function.
-                //
-                // When the device is configured to display temperature in °F,
-                // the temperature calculated this way matches exactly the one
-                // displayed on the device's screen.
-                float temperature_fahrenheit = (float) raw_temperature / 10. - 90.;
-		measurement->temperature = fahrenheit_to_celcius(temperature_fahrenheit);
+		measurement->temperature = raw_temperature_to_celcius(raw_temperature);
 	}
 
 	if (raw_data[2] == 0xff) {
 		measurement->humidity = DEVICE_INCORRECT_HUMIDITY;
-		fprintf(stderr, "Weird: measurement contains temperature but not humidity.\n");
+		log_warning("Weird: measurement contains temperature but not humidity.\n");
 	} else {
 		measurement->humidity = raw_data[2];
 	}
@@ -93,7 +189,8 @@ static bool decode_single_measurement(struct device_single_measurement *measurem
         // It would be more elegant to calculate the dew point in functions that
         // handle data presentation, but is done here for performance reasons.
         // It is a time-consuming calculation on devices with software floating
-        // point emulation.
+        // point emulation, unless it can be taken from the dew point table
+        // (see psychrometrics.h).
         //
         // Calculating dew point for min/max measurements does not make
         // sense as min humidity and min temperature do not correspond to each
@@ -102,8 +199,8 @@ static bool decode_single_measurement(struct device_single_measurement *measurem
                 && !DEVICE_IS_INCORRECT_TEMPERATURE(measurement->temperature)
                 && calculate_dew_point) {
 
-                measurement->dew_point =
-                        dew_point(measurement->temperature, measurement->humidity);
+                measurement->dew_point = measurement_dew_point(
+                                measurement->temperature, measurement->humidity);
         } else {
                 measurement->dew_point = DEVICE_INCORRECT_TEMPERATURE;
         }
@@ -118,15 +215,25 @@ static void check_measurement_ordering(
         const char *bigger_description
         )
 {
-        const float temperature_epsilon = 0.01;
+#ifdef FIXED_POINT_MEASUREMENTS
+        const device_temperature_t temperature_epsilon = 0;
+#else
+        const device_temperature_t temperature_epsilon = 0.01;
+#endif
         if (!DEVICE_IS_INCORRECT_TEMPERATURE(smaller->temperature)
                 && !DEVICE_IS_INCORRECT_TEMPERATURE(bigger->temperature)) {
                 if (smaller->temperature > bigger->temperature + temperature_epsilon) {
-                        fprintf(stderr,
-                                "Warning: %s temperature (%.2f°C) is bigger "
-                                "then %s temperature (%.2f°C).\n",
-                                smaller_description, (double) smaller->temperature,
-                                bigger_description, (double) bigger->temperature
+                        char smaller_temperature[TEMPERATURE_STRING_SIZE];
+                        char bigger_temperature[TEMPERATURE_STRING_SIZE];
+                        temperature_to_string(smaller->temperature,
+                                        smaller_temperature, sizeof(smaller_temperature));
+                        temperature_to_string(bigger->temperature,
+                                        bigger_temperature, sizeof(bigger_temperature));
+                        log_warning(
+                                "Warning: %s temperature (%s°C) is bigger "
+                                "then %s temperature (%s°C).\n",
+                                smaller_description, smaller_temperature,
+                                bigger_description, bigger_temperature
                                 );
                 }
         }
@@ -134,7 +241,7 @@ static void check_measurement_ordering(
         if (smaller->humidity != DEVICE_INCORRECT_HUMIDITY
                 && bigger->humidity != DEVICE_INCORRECT_HUMIDITY) {
                 if (smaller->humidity > bigger->humidity) {
-                        fprintf(stderr,
+                        log_warning(
                                 "Warning: %s humidity (%d%%)is bigger "
                                 "then %s humidity (%d%%).\n",
                                 smaller_description, (int) smaller->humidity,
@@ -204,11 +311,11 @@ static void decode_device_time(struct device_sensor_state *state,
         state->device_time = mktime(&device_time_tm);
 }
 
-static void decode_sensor_state(struct device_sensor_state *state, const unsigned char *received_packet,
+void decode_sensor_state(struct device_sensor_state *state, const unsigned char *received_packet,
 		const size_t received_packet_size)
 {
 	if (received_packet_size <= 61) {
-		fprintf(stderr, "Packet is too short!\n");
+		log_warning("Packet is too short!\n");
 		return;
 	}
 
@@ -231,20 +338,145 @@ static void decode_sensor_state(struct device_sensor_state *state, const unsigne
 	}
 
         state->payload_byte_0x31 = received_packet[61];
+        state->station_mac = get_packet_station_mac(received_packet);
 
         decode_device_time(state, received_packet, received_packet_size);
 }
 
-static bool is_packet_correct(const unsigned char *received_packet,
+static void pack_single_measurement(unsigned char *raw_data,
+                const struct device_single_measurement *measurement)
+{
+        uint16_t raw_temperature = 0xffff;
+        if (!DEVICE_IS_INCORRECT_TEMPERATURE(measurement->temperature)) {
+                raw_temperature = celcius_to_raw_temperature(measurement->temperature);
+        }
+        raw_data[0] = raw_temperature & 0xff;
+        raw_data[1] = raw_temperature >> 8;
+
+        if (measurement->humidity == DEVICE_INCORRECT_HUMIDITY) {
+                raw_data[2] = 0xff;
+        } else {
+                raw_data[2] = measurement->humidity;
+        }
+}
+
+// Like decode_single_measurement(), but without warnings - they have already
+// been printed when the packet was received.
+static bool unpack_single_measurement(struct device_single_measurement *measurement,
+                const unsigned char *raw_data, bool calculate_dew_point)
+{
+        uint16_t raw_temperature = raw_data[0] + ((int)raw_data[1]) * 256;
+
+        if (raw_temperature == 0xffff) {
+                measurement->temperature = DEVICE_INCORRECT_TEMPERATURE;
+        } else {
+                measurement->temperature = raw_temperature_to_celcius(raw_temperature);
+        }
+
+        if (raw_data[2] == 0xff) {
+                measurement->humidity = DEVICE_INCORRECT_HUMIDITY;
+        } else {
+                measurement->humidity = raw_data[2];
+        }
+
+        if (measurement->humidity != DEVICE_INCORRECT_HUMIDITY
+                && !DEVICE_IS_INCORRECT_TEMPERATURE(measurement->temperature)
+                && calculate_dew_point) {
+
+                measurement->dew_point = measurement_dew_point(
+                                measurement->temperature, measurement->humidity);
+        } else {
+                measurement->dew_point = DEVICE_INCORRECT_TEMPERATURE;
+        }
+
+        return raw_temperature != 0xffff || raw_data[2] != 0xff;
+}
+
+static uint32_t pack_time(time_t time)
+{
+        if (time < 0 || (uint64_t) time >= UINT32_MAX) {
+                return UINT32_MAX;
+        }
+        return time;
+}
+
+static time_t unpack_time(uint32_t time)
+{
+        if (time == UINT32_MAX) {
+                return (time_t) -1;
+        }
+        return time;
+}
+
+void pack_sensor_state(struct device_sensor_state_compact *out,
+                const struct device_sensor_state *state)
+{
+        memset(out, 0, sizeof(*out));
+
+        out->packet_arrival_time = pack_time(state->packet_arrival_time);
+        out->device_time = pack_time(state->device_time);
+        out->station_mac = state->station_mac;
+        out->atmospheric_pressure = state->atmospheric_pressure;
+        out->payload_byte_0x31 = state->payload_byte_0x31;
+
+        for (int i = 0; i < 4; i++) {
+                const struct device_single_sensor_data *sensor =
+                        i == 0 ? &state->station_sensor : &state->remote_sensors[i-1];
+                unsigned char *raw_data = out->sensors + i*9;
+
+                if (!sensor->any_data_present) {
+                        memset(raw_data, 0xff, 9);
+                        continue;
+                }
+                pack_single_measurement(raw_data,     &sensor->current);
+                pack_single_measurement(raw_data + 3, &sensor->historical_max);
+                pack_single_measurement(raw_data + 6, &sensor->historical_min);
+
+                if (sensor->battery_low) {
+                        out->battery_low_bitmask |= 1 << i;
+                }
+        }
+}
+
+void unpack_sensor_state(struct device_sensor_state *state,
+                const struct device_sensor_state_compact *in)
+{
+        state->packet_arrival_time = unpack_time(in->packet_arrival_time);
+        state->device_time = unpack_time(in->device_time);
+        state->arrival_ns = 0;
+        state->station_mac = in->station_mac;
+        state->station_index = SIZE_MAX;
+        state->atmospheric_pressure = in->atmospheric_pressure;
+        state->payload_byte_0x31 = in->payload_byte_0x31;
+
+        for (int i = 0; i < 4; i++) {
+                struct device_single_sensor_data *sensor =
+                        i == 0 ? &state->station_sensor : &state->remote_sensors[i-1];
+                const unsigned char *raw_data = in->sensors + i*9;
+
+                bool have_current_data =
+                        unpack_single_measurement(&sensor->current, raw_data, true);
+                bool have_historical_max_data =
+                        unpack_single_measurement(&sensor->historical_max, raw_data + 3, false);
+                bool have_historical_min_data =
+                        unpack_single_measurement(&sensor->historical_min, raw_data + 6, false);
+
+                sensor->any_data_present = have_current_data
+                        || have_historical_max_data || have_historical_min_data;
+                sensor->battery_low = (in->battery_low_bitmask >> i) & 0x1;
+        }
+}
+
+bool is_packet_correct(const unsigned char *received_packet,
 		const size_t received_packet_size)
 {
         if (received_packet[0] != '<') {
-                fprintf(stderr, "Incorrect first byte of packet\n");
+                log_warning("Incorrect first byte of packet\n");
                 return false;
         }
 
         if (received_packet[received_packet_size-1] != '>') {
-                fprintf(stderr, "Incorrect last byte of packet\n");
+                log_warning("Incorrect last byte of packet\n");
                 return false;
         }
 
@@ -253,14 +485,29 @@ static bool is_packet_correct(const unsigned char *received_packet,
                 sum+=received_packet[i];
         }
         if (received_packet[received_packet_size-2] != sum) {
-                fprintf(stderr, "Incorrect packet checksum\n");
+                log_warning("Incorrect packet checksum\n");
                 return false;
         }
-        fprintf(stderr, "Packet appears valid\n");
+        log_debug("Packet appears valid\n");
         return true;
 }
 
-void init_device_logic(struct program_options *options)
+uint32_t get_packet_station_mac(const unsigned char *received_packet)
+{
+        return ((uint32_t) received_packet[0x03] << 24)
+                | ((uint32_t) received_packet[0x04] << 16)
+                | ((uint32_t) received_packet[0x05] << 8)
+                | (uint32_t) received_packet[0x06];
+}
+
+static int device_udp_socket = -1;
+
+static void on_injection_input(int fd, unsigned int events, void *data);
+static void on_injection_timer(void *data);
+static struct event_timer injection_timer;
+static bool injection_input_open = false;
+
+void init_device_logic(const struct program_options *options, int udp_socket)
 {
         if (nan("") == 0 || !isnan(nan(""))) {
                 //Are there any embedded architectures without support for NaN?
@@ -275,26 +522,55 @@ void init_device_logic(struct program_options *options)
                 exit(1);
         }
 
+        device_udp_socket = udp_socket;
+
+        event_timer_init(&injection_timer, on_injection_timer, NULL);
+
         if (options->allow_injecting_packets) {
                 int current_flags = fcntl(0, F_GETFL);
                 fcntl(0, F_SETFL, current_flags | O_NONBLOCK);
+
+                if (!event_loop_add_fd(0, EVENT_READ, on_injection_input, NULL)) {
+                        exit(1);
+                }
+                injection_input_open = true;
+        }
+
+        if (!init_station_registry(options->max_stations)) {
+                exit(1);
         }
 }
 
-static bool send_timesync_packet(int udp_socket, const struct sockaddr_in *packet_source,
-		const unsigned char *received_packet, const size_t received_packet_size)
+void shutdown_device_logic()
 {
-        if (received_packet_size <= 8) {
-                // TODO: print a warning message
-                fputs("Error in send_timesync_packet: received_packet_size too small\n", stderr);
-                return false;
+        event_timer_cancel(&injection_timer);
+
+        for (struct station_state *station = get_next_station(NULL);
+                        station != NULL; station = get_next_station(station)) {
+                event_timer_cancel(&station->timesync_timer);
         }
 
+        shutdown_station_registry();
+}
+
+static void fill_packet_header(unsigned char *buffer, uint32_t station_mac)
+{
+        buffer[0] = '<';
+        buffer[1] = 'W';
+        buffer[2] = 0x01;
+        buffer[3] = (station_mac >> 24) & 0xff;
+        buffer[4] = (station_mac >> 16) & 0xff;
+        buffer[5] = (station_mac >> 8) & 0xff;
+        buffer[6] = station_mac & 0xff;
+}
+
+static bool send_timesync_packet(int udp_socket, const struct station_state *station)
+{
         unsigned char buffer[22];
 
         memset(buffer, 0, sizeof(buffer));
         // First 7 bytes contain preamble and last 4 bytes of device's MAC address
-        memcpy(buffer, received_packet, 7);
+        fill_packet_header(buffer, station->mac);
         // Setting this to 0x40 causes the device to respond with an error message
         // same with 0x81
         buffer[7] = 0x80;
@@ -358,12 +634,36 @@ static bool send_timesync_packet(int udp_socket, const struct sockaddr_in *packe
         buffer[20] = sum;
         buffer[21] = '>';
 
-	dump_packet(stderr, packet_source, buffer, sizeof(buffer), false);
-        send_udp_packet(udp_socket, packet_source, buffer, sizeof(buffer));
+	log_packet(LOG_LEVEL_INFO, &station->last_address, buffer, sizeof(buffer), false);
+        send_udp_packet(udp_socket, &station->last_address, buffer, sizeof(buffer));
 
         return true;
 }
 
+static void on_timesync_timer(void *data)
+{
+        struct station_state *station = data;
+
+        log_info("Injecting timesync data into the device\n");
+        if (send_timesync_packet(device_udp_socket, station)) {
+                station->has_timesync_packet_been_sent = true;
+        } else {
+                event_timer_schedule(&station->timesync_timer,
+                                TIMESYNC_RETRY_INTERVAL_MS);
+        }
+}
+
+static void schedule_timesync(struct station_state *station)
+{
+        if (station->has_timesync_packet_been_sent
+                        || event_timer_is_scheduled(&station->timesync_timer)) {
+                return;
+        }
+
+        event_timer_init(&station->timesync_timer, on_timesync_timer, station);
+        event_timer_schedule(&station->timesync_timer, 0);
+}
+
 unsigned char decode_hex_digit(char digit)
 {
         digit = tolower(digit);
@@ -384,25 +684,57 @@ bool decode_hex(const char *buffer, unsigned char *out) {
         return true;
 }
 
-static bool inject_packets(int udp_socket, const struct sockaddr_in *packet_source)
+/*
+ * Packets to inject are read from standard input as soon as they are
+ * available and sent to the weather station after it has sent a sensor
+ * data packet, one packet per second.
+ */
+#define INJECTION_QUEUE_SIZE 16
+
+struct injected_packet {
+        unsigned char data[100];
+        size_t size;
+};
+
+static struct injected_packet injection_queue[INJECTION_QUEUE_SIZE];
+static unsigned int injection_queue_start = 0;
+static unsigned int injection_queue_length = 0;
+
+// The station that has most recently sent sensor data
+static struct station_state *injection_station = NULL;
+
+enum injection_read_result {
+        INJECTION_PACKET_READ,
+        INJECTION_LINE_SKIPPED,
+        INJECTION_NO_DATA,
+        INJECTION_END_OF_INPUT,
+};
+
+static enum injection_read_result read_packet_to_inject(struct injected_packet *packet)
 {
         char hex_buffer[200];
 #warning mixing read and fread may cause trouble (see "man stderr")
+        errno = 0;
         char *ret = fgets(hex_buffer, sizeof(hex_buffer), stdin);
         if (ret == NULL) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        return false;
+                enum injection_read_result result = INJECTION_END_OF_INPUT;
+
+                if (feof(stdin)) {
+                        result = INJECTION_END_OF_INPUT;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        result = INJECTION_NO_DATA;
                 } else {
                         perror("Reading packets to inject failed!");
-                        return false;
                 }
+                clearerr(stdin);
+                return result;
         }
 
-        unsigned char output_buffer[100];
+        unsigned char *output_buffer = packet->data;
         size_t output_buffer_size = 0;
         char *hex_buffer_ptr=hex_buffer;
 
-        while (*hex_buffer_ptr != 0 && output_buffer_size < sizeof(output_buffer)) {
+        while (*hex_buffer_ptr != 0 && output_buffer_size < sizeof(packet->data)) {
                 if (!isxdigit(*hex_buffer_ptr)) {
                         hex_buffer_ptr++;
                 } else if (decode_hex(hex_buffer_ptr, &output_buffer[output_buffer_size])) {
@@ -413,12 +745,12 @@ static bool inject_packets(int udp_socket, const struct sockaddr_in *packet_sour
                 }
         }
         if (output_buffer_size == 0) {
-                return false;
+                return INJECTION_LINE_SKIPPED;
         }
 
-        if (output_buffer_size + 2 > sizeof(output_buffer)) {
+        if (output_buffer_size + 2 > sizeof(packet->data)) {
                 fprintf(stderr, "Packet to inject too big\n");
-                return false;
+                return INJECTION_LINE_SKIPPED;
         }
 
         unsigned char sum = 0;
@@ -428,17 +760,80 @@ static bool inject_packets(int udp_socket, const struct sockaddr_in *packet_sour
         output_buffer[output_buffer_size++] = sum;
         output_buffer[output_buffer_size++] = '>';
 
+        packet->size = output_buffer_size;
+        return INJECTION_PACKET_READ;
+}
 
-        fprintf(stderr, "Injecting packet:\n");
-	dump_packet(stderr, packet_source, output_buffer, output_buffer_size, false);
-        send_udp_packet(udp_socket, packet_source, output_buffer, output_buffer_size);
+static void on_injection_input(int fd, unsigned int events, void *data)
+{
+        (void) events;
+        (void) data;
+
+        while (injection_queue_length < INJECTION_QUEUE_SIZE) {
+                unsigned int position = (injection_queue_start + injection_queue_length)
+                                % INJECTION_QUEUE_SIZE;
+
+                switch (read_packet_to_inject(&injection_queue[position])) {
+                case INJECTION_PACKET_READ:
+                        injection_queue_length++;
+                        break;
+                case INJECTION_LINE_SKIPPED:
+                        break;
+                case INJECTION_NO_DATA:
+                        return;
+                case INJECTION_END_OF_INPUT:
+                        fputs("No more packets to inject\n", stderr);
+                        event_loop_remove_fd(fd);
+                        injection_input_open = false;
+                        return;
+                }
+        }
 
-        return true;
+        // Stop reading until some packets are sent
+        event_loop_modify_fd(fd, 0);
+}
+
+static void on_injection_timer(void *data)
+{
+        (void) data;
+
+        if (injection_queue_length == 0 || injection_station == NULL) {
+                return;
+        }
+
+        struct injected_packet *packet = &injection_queue[injection_queue_start];
+        const struct sockaddr_in *destination = &injection_station->last_address;
+
+        log_info("Injecting packet:\n");
+	log_packet(LOG_LEVEL_INFO, destination, packet->data, packet->size, false);
+        send_udp_packet(device_udp_socket, destination, packet->data, packet->size);
+
+        injection_queue_start = (injection_queue_start + 1) % INJECTION_QUEUE_SIZE;
+        injection_queue_length--;
+
+        if (injection_input_open) {
+                // There is space in the queue again. Some lines may be
+                // already buffered by stdio, so do not wait for the event.
+                event_loop_modify_fd(0, EVENT_READ);
+                on_injection_input(0, EVENT_READ, NULL);
+        }
+
+        if (injection_queue_length > 0) {
+                event_timer_schedule(&injection_timer, INJECTION_INTERVAL_MS);
+        }
 }
 
-static unsigned char fuzzing_function_no = 0x03;
+static void schedule_injection(struct station_state *station)
+{
+        injection_station = station;
+
+        if (injection_queue_length > 0 && !event_timer_is_scheduled(&injection_timer)) {
+                event_timer_schedule(&injection_timer, 0);
+        }
+}
 
-void fuzz_station(int udp_socket, const struct sockaddr_in *packet_source,
+void fuzz_station(int udp_socket, struct station_state *station,
+                const struct sockaddr_in *packet_source,
 		unsigned char *received_packet, const size_t received_packet_size)
 {
         unsigned char output_buffer[300];
@@ -452,7 +847,7 @@ void fuzz_station(int udp_socket, const struct sockaddr_in *packet_source,
         memcpy(output_buffer, received_packet, 7);
         output_buffer_size=7;
 
-        output_buffer[output_buffer_size++] = fuzzing_function_no++;
+        output_buffer[output_buffer_size++] = station->fuzzing_function_no++;
         output_buffer[output_buffer_size++] = 0x00;
         output_buffer[output_buffer_size++] = 0x00;
 
@@ -472,62 +867,101 @@ void fuzz_station(int udp_socket, const struct sockaddr_in *packet_source,
         output_buffer[output_buffer_size++] = sum;
         output_buffer[output_buffer_size++] = '>';
 
-        fprintf(stderr, "Injecting fuzzing packet:\n");
-	dump_packet(stderr, packet_source, output_buffer, output_buffer_size, false);
+        log_info("Injecting fuzzing packet:\n");
+	log_packet(LOG_LEVEL_INFO, packet_source, output_buffer, output_buffer_size, false);
         send_udp_packet(udp_socket, packet_source, output_buffer, output_buffer_size);
 }
 
 
-static int has_timesync_packet_been_sent = 0;
+static void update_station_report_interval(struct station_state *station,
+                const time_t packet_arrival_time)
+{
+        if (station->last_sensor_packet_time != 0
+                        && packet_arrival_time > station->last_sensor_packet_time) {
+                station->report_interval =
+                        packet_arrival_time - station->last_sensor_packet_time;
+        }
+        station->last_sensor_packet_time = packet_arrival_time;
+}
 
 // Main program logic
 void process_incoming_packet(int udp_socket, const struct sockaddr_in *packet_source,
 		const unsigned char *received_packet, const size_t received_packet_size,
-                const time_t packet_arrival_time,
+                const time_t packet_arrival_time, uint64_t arrival_ns,
                 const struct program_options *options)
 {
-	dump_packet(stderr, packet_source, received_packet, received_packet_size, true);
+	log_packet(LOG_LEVEL_DEBUG, packet_source, received_packet, received_packet_size, true);
+        metrics_count(METRICS_PACKETS_RECEIVED);
+        if (received_packet_size < DEVICE_MIN_PACKET_SIZE) {
+                log_warning("Packet is too short\n");
+                metrics_count(METRICS_PACKETS_TOO_SHORT);
+                return;
+        }
+        uint64_t stage_start_ns = latency_now_ns();
         if (!is_packet_correct(received_packet, received_packet_size)) {
+                metrics_count(METRICS_PACKETS_INVALID);
                 return;
         }
+        latency_record_since(LATENCY_VALIDATE, stage_start_ns);
+
+        struct station_state *station = find_or_add_station(
+                        get_packet_station_mac(received_packet),
+                        packet_arrival_time);
+        if (station == NULL) {
+                metrics_count(METRICS_PACKETS_REJECTED);
+                return;
+        }
+        station->packets_received++;
+        station->last_packet_time = packet_arrival_time;
+        memcpy(&station->last_address, packet_source, sizeof(*packet_source));
 
 	if (received_packet_size < 20
-                        && received_packet_size > 0x07
                         && received_packet[0x07] <= 0x01) {
+                station->ping_packets_received++;
                 if (options->reply_to_ping_packets) {
-                        fputs("Handling the received packet "
-                                "as a ping packet, sending it back\n", stderr);
-                        send_udp_packet(udp_socket, packet_source,
-                                        received_packet, received_packet_size);
+                        log_debug("Handling the received packet "
+                                "as a ping packet, sending it back\n");
+                        if (queue_udp_packet(udp_socket, packet_source,
+                                        received_packet, received_packet_size) == 0) {
+                                metrics_count(METRICS_PINGS_ANSWERED);
+                        }
                 }
 	} else if (received_packet_size >= 65) {
 
 
+		size_t scratch = scratch_mark();
 		struct device_sensor_state *sensor_state;
-		sensor_state = malloc(sizeof(struct device_sensor_state));
+		sensor_state = scratch_alloc(sizeof(struct device_sensor_state));
                 if (sensor_state == NULL){
 		        fprintf(stderr, "process_incoming_packet: Cannot allocate memory!\n");
                         return;
                 }
 
+                station->sensor_packets_received++;
+                update_station_report_interval(station, packet_arrival_time);
+
                 sensor_state->packet_arrival_time = packet_arrival_time;
+                sensor_state->arrival_ns = arrival_ns;
+                sensor_state->station_index = station->index;
+                stage_start_ns = latency_now_ns();
 		decode_sensor_state(sensor_state, received_packet, received_packet_size);
-                handle_decoded_sensor_state(sensor_state, options);
-		free(sensor_state);
+                latency_record_since(LATENCY_DECODE, stage_start_ns);
+                submit_to_sinks(sensor_state);
+
+                memcpy(&station->last_sensor_state, sensor_state, sizeof(*sensor_state));
+                station->has_last_sensor_state = true;
+		scratch_release(scratch);
 
+                // Both are sent from the event loop, after all packets
+                // that have already been received are handled.
                 if (options->allow_injecting_packets) {
-                        while (inject_packets(udp_socket, packet_source)) {
-                                sleep(1);
-                        }
-                        //fuzz_station(udp_socket, packet_source);
+                        schedule_injection(station);
+                        //fuzz_station(udp_socket, station, packet_source,
+                        //      received_packet, received_packet_size);
                 }
 
-                        if (!has_timesync_packet_been_sent && options->set_weather_station_time) {
-                                fputs("Injecting timesync data into the device\n", stderr);
-                                if (send_timesync_packet(udp_socket, packet_source,
-                                                received_packet, received_packet_size)) {
-                                        has_timesync_packet_been_sent = 1;
-                                }
-                        }
+                if (options->set_weather_station_time) {
+                        schedule_timesync(station);
+                }
 	}
 }
@@ -30,17 +30,41 @@ struct device_sensor_state;
 #include <netinet/ip.h>
 #include <netinet/in.h>
 
-struct device_single_measurement {
-	float temperature;
-	uint16_t humidity;
-        float dew_point;
-};
+#ifdef FIXED_POINT_MEASUREMENTS
+/*
+ * Temperature in hundredths of °C. Built with "make FIXED_POINT_MEASUREMENTS=1"
+ * for devices without an FPU, where floating point calculations are emulated
+ * in software and slow. Readings above 327.67°C are treated as incorrect.
+ */
+typedef int16_t device_temperature_t;
+
+//First two macros are also for dew_point
+#define DEVICE_INCORRECT_TEMPERATURE INT16_MIN
+#define DEVICE_IS_INCORRECT_TEMPERATURE(x) ((x) == INT16_MIN)
+#else
+// Temperature in °C
+typedef float device_temperature_t;
 
 //First two macros are also for dew_point
 #define DEVICE_INCORRECT_TEMPERATURE (nan(""))
 #define DEVICE_IS_INCORRECT_TEMPERATURE(x) (isnan(x))
+#endif
 #define DEVICE_INCORRECT_HUMIDITY UINT16_MAX
 
+struct device_single_measurement {
+	device_temperature_t temperature;
+	uint16_t humidity;
+        device_temperature_t dew_point;
+};
+
+// Enough for any temperature the device can report
+#define TEMPERATURE_STRING_SIZE 12
+
+// Formats the temperature with two decimal places, like "%.2f". Outputs
+// should use it, so that they do not depend on the representation.
+void temperature_to_string(device_temperature_t temperature,
+                char *temperature_out, size_t buffer_size);
+
 struct device_single_sensor_data {
 	bool any_data_present;
         bool battery_low;
@@ -69,15 +93,66 @@ struct device_sensor_state {
         // TODO: device_timezone
         time_t device_time;
         time_t packet_arrival_time;
+        // CLOCK_MONOTONIC nanoseconds, for latency statistics (see latency.h).
+        // 0 if not known.
+        uint64_t arrival_ns;
+
+        // Last 4 bytes of the weather station's MAC address, most significant
+        // byte first - just as at offset 0x03 of the packet.
+        uint32_t station_mac;
+        // See struct station_state in station_registry.h. SIZE_MAX if not
+        // known.
+        size_t station_index;
 };
 #define DEVICE_INCORRECT_PRESSURE UINT16_MAX
 
+/*
+ * struct device_sensor_state in about a quarter of the space, for keeping
+ * many measurements in memory. Sensor data is kept in the format used in
+ * packets: 9 bytes per sensor, with current, maximum and minimum measurements
+ * of 3 bytes each. Dew point is calculated again when unpacking.
+ */
+struct device_sensor_state_compact {
+        uint32_t packet_arrival_time;
+        uint32_t device_time;
+        uint32_t station_mac;
+        uint16_t atmospheric_pressure;
+        // Bit 0 for the station sensor, then remote sensors
+        unsigned char battery_low_bitmask;
+        unsigned char payload_byte_0x31;
+        unsigned char sensors[4 * 9];
+};
+
+void pack_sensor_state(struct device_sensor_state_compact *out,
+                const struct device_sensor_state *state);
+void unpack_sensor_state(struct device_sensor_state *state,
+                const struct device_sensor_state_compact *in);
+
+// Header, checksum and the final delimiter, without any payload
+#define DEVICE_MIN_PACKET_SIZE 14
+
+struct station_state;
+
+
+// If setting the time of the weather station fails (e.g. because the local
+// clock has not been set yet), it is retried after this time.
+#define TIMESYNC_RETRY_INTERVAL_MS (60 * 1000)
+#define INJECTION_INTERVAL_MS 1000
 
-void init_device_logic(struct program_options *options);
+void init_device_logic(const struct program_options *options, int udp_socket);
+void shutdown_device_logic();
+uint32_t get_packet_station_mac(const unsigned char *received_packet);
+// Steps of process_incoming_packet(), also used by the benchmarks
+bool is_packet_correct(const unsigned char *received_packet,
+		const size_t received_packet_size);
+void decode_sensor_state(struct device_sensor_state *state,
+                const unsigned char *received_packet,
+		const size_t received_packet_size);
 void process_incoming_packet(int udp_socket, const struct sockaddr_in *packet_source,
 		const unsigned char *received_packet, const size_t received_packet_size,
-                const time_t packet_arrival_time,
+                const time_t packet_arrival_time, uint64_t arrival_ns,
                 const struct program_options *options);
 
-void fuzz_station(int udp_socket, const struct sockaddr_in *packet_source,
+void fuzz_station(int udp_socket, struct station_state *station,
+                const struct sockaddr_in *packet_source,
 		unsigned char *received_packet, const size_t received_packet_size);
@@ -0,0 +1,881 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * An emulator of EM3371-compatible weather stations, for testing and load
+ * testing this program without the hardware.
+ *
+ * It implements the device side of Documentation/device_protocol.md:
+ * every emulated station sends ping packets and, as long as they are sent
+ * back, sensor data packets every 12.5 s. After its clock has been set
+ * (function 0x80), the station reports only every 107 s, like the real one.
+ * It also responds to function 0x90 with sensor data immediately, to
+ * 0x20 with its time and to the other functions found by fuzzing.
+ *
+ * All stations, each with a different MAC address, share a single UDP
+ * socket. The collector replies to the address packets came from, and
+ * replies are matched to stations by the MAC address in them.
+ *
+ * The emulator counts the packets sent and the replies received, so that
+ * packet loss under load can be measured: every ping should be answered,
+ * the number of sensor data packets can be compared with what the
+ * collector has stored.
+ */
+
+// clock_gettime, gmtime_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "event_loop.h"
+#include "main.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#define DEFAULT_STATION_COUNT 1
+#define DEFAULT_FIRST_MAC 0x69000000U
+// The interval between pings of the real device is not known exactly
+#define DEFAULT_PING_INTERVAL_MS 12500
+#define DEFAULT_REPORT_INTERVAL_MS 12500
+// After the clock of the station has been set
+#define DEFAULT_SLOW_REPORT_INTERVAL_MS 107000
+#define DEFAULT_STATS_INTERVAL_S 10
+
+#define PACKET_HEADER_SIZE 0x0c
+// Checksum and the final delimiter
+#define PACKET_TRAILER_SIZE 2
+#define MAX_PACKET_SIZE 256
+#define SENSOR_DATA_PAYLOAD_SIZE 0x39
+#define TIME_PAYLOAD_SIZE 8
+
+#define FUNCTION_PING 0x00
+#define FUNCTION_SENSOR_DATA 0x01
+#define FUNCTION_UNKNOWN_0x02 0x02
+#define FUNCTION_QUERY_TIME 0x20
+#define FUNCTION_SET_TIME 0x80
+#define FUNCTION_QUERY_SENSOR_DATA 0x90
+#define FUNCTION_ERROR 0xee
+
+// Error code sent when the packet is longer than its payload size implies
+#define ERROR_WRONG_PAYLOAD_SIZE 0x02
+
+// The date the device sets after powering on: 2016-01-01 00:00:00
+#define POWER_ON_DEVICE_TIME 1451606400
+
+struct emulator_options {
+        struct sockaddr_in collector_address;
+        unsigned int station_count;
+        uint32_t first_mac;
+        unsigned int ping_interval_ms;
+        unsigned int report_interval_ms;
+        unsigned int slow_report_interval_ms;
+        unsigned int duration_s;
+        unsigned int stats_interval_s;
+};
+
+struct emulated_sensor {
+        // In the device format, see decode_sensor_data()
+        uint16_t temperature;
+        uint16_t temperature_min;
+        uint16_t temperature_max;
+        unsigned char humidity;
+        unsigned char humidity_min;
+        unsigned char humidity_max;
+};
+
+struct emulated_station {
+        uint32_t mac;
+        struct event_timer ping_timer;
+        struct event_timer report_timer;
+
+        // Sensor data is sent only while the collector sends pings back
+        bool reporting;
+        bool ping_outstanding;
+        uint64_t ping_sent_us;
+
+        bool clock_set;
+        // The device clock shows local time, it is kept as time_t in UTC
+        time_t clock_offset;
+        unsigned char timezone;
+
+        // The station itself and the remote sensor on channel 1
+        struct emulated_sensor sensors[2];
+        uint16_t atmospheric_pressure;
+        uint32_t random_state;
+};
+
+struct emulator_stats {
+        unsigned long pings_sent;
+        unsigned long reports_sent;
+        unsigned long replies_sent;
+        unsigned long send_errors;
+
+        unsigned long ping_replies;
+        unsigned long pings_lost;
+        unsigned long time_set_requests;
+        unsigned long queries;
+        unsigned long other_requests;
+        unsigned long bad_packets;
+
+        uint64_t ping_rtt_sum_us;
+        uint64_t ping_rtt_max_us;
+};
+
+static struct emulator_options options;
+static struct emulated_station *stations = NULL;
+static int udp_socket = -1;
+
+static struct emulator_stats stats;
+static struct emulator_stats last_stats;
+// The maximum for the last statistics interval only
+static uint64_t interval_rtt_max_us = 0;
+static struct event_timer stats_timer;
+static struct event_timer duration_timer;
+
+static volatile bool stop_execution = false;
+
+static uint64_t now_us()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// xorshift32, good enough for sensor noise
+static uint32_t next_random(struct emulated_station *station)
+{
+        uint32_t x = station->random_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        station->random_state = x;
+        return x;
+}
+
+// Returns -1, 0 or 1
+static int random_step(struct emulated_station *station)
+{
+        return (int) (next_random(station) % 3) - 1;
+}
+
+static unsigned char calculate_checksum(const unsigned char *data, size_t size)
+{
+        unsigned char sum = 0;
+        for (size_t i = 0; i < size; i++) {
+                sum += data[i];
+        }
+        return sum;
+}
+
+// Returns the size of the packet
+static size_t build_packet(unsigned char *buffer, uint32_t mac, unsigned char function,
+                const unsigned char *payload, unsigned char payload_size)
+{
+        buffer[0] = '<';
+        buffer[1] = 'W';
+        buffer[2] = 0x01;
+        buffer[3] = (mac >> 24) & 0xff;
+        buffer[4] = (mac >> 16) & 0xff;
+        buffer[5] = (mac >> 8) & 0xff;
+        buffer[6] = mac & 0xff;
+        buffer[7] = function;
+        buffer[8] = 0x00;
+        buffer[9] = 0x00;
+        buffer[10] = payload_size;
+        buffer[11] = 0x00;
+        // payload is NULL for pings
+        if (payload_size > 0) {
+                memcpy(buffer + PACKET_HEADER_SIZE, payload, payload_size);
+        }
+
+        size_t size = PACKET_HEADER_SIZE + payload_size;
+        buffer[size] = calculate_checksum(buffer, size);
+        buffer[size + 1] = '>';
+        return size + PACKET_TRAILER_SIZE;
+}
+
+static bool send_packet(const unsigned char *data, size_t size)
+{
+        long int ret = sendto(udp_socket, data, size, 0,
+                        (const struct sockaddr *) &options.collector_address,
+                        sizeof(options.collector_address));
+        if (ret != (long int) size) {
+                // Counted, the collector will not see this packet
+                stats.send_errors++;
+                return false;
+        }
+        return true;
+}
+
+static void send_function(struct emulated_station *station, unsigned char function,
+                const unsigned char *payload, unsigned char payload_size)
+{
+        unsigned char buffer[MAX_PACKET_SIZE];
+        size_t size = build_packet(buffer, station->mac, function, payload, payload_size);
+        send_packet(buffer, size);
+}
+
+// Fields of the device time: timezone, year after 2000, month, day, hour,
+// minute, seconds * 2. The same in sensor data and function 0x80.
+static void encode_device_time(const struct emulated_station *station, unsigned char *out)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        time_t device_time = now.tv_sec + station->clock_offset;
+
+        struct tm device_tm;
+        gmtime_r(&device_time, &device_tm);
+
+        out[0] = station->timezone;
+        out[1] = device_tm.tm_year - 100;
+        out[2] = device_tm.tm_mon + 1;
+        out[3] = device_tm.tm_mday;
+        out[4] = device_tm.tm_hour;
+        out[5] = device_tm.tm_min;
+        out[6] = device_tm.tm_sec * 2 + (now.tv_nsec >= 500000000 ? 1 : 0);
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+static long days_from_civil(int year, unsigned int month, unsigned int day)
+{
+        year -= month <= 2;
+        const long era = (year >= 0 ? year : year - 399) / 400;
+        const unsigned int year_of_era = year - era * 400;
+        const unsigned int day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5
+                + day - 1;
+        const unsigned int day_of_era = year_of_era * 365 + year_of_era / 4
+                - year_of_era / 100 + day_of_year;
+        return era * 146097 + (long) day_of_era - 719468;
+}
+
+static bool decode_device_time(const unsigned char *in, time_t *out)
+{
+        if (in[2] < 1 || in[2] > 12 || in[3] < 1 || in[3] > 31
+                        || in[4] > 23 || in[5] > 59 || in[6] / 2 > 60) {
+                return false;
+        }
+        *out = days_from_civil(2000 + in[1], in[2], in[3]) * 86400
+                + in[4] * 3600 + in[5] * 60 + in[6] / 2;
+        return true;
+}
+
+static void encode_measurement(unsigned char *out, uint16_t temperature,
+                unsigned char humidity)
+{
+        out[0] = temperature & 0xff;
+        out[1] = temperature >> 8;
+        out[2] = humidity;
+}
+
+static void update_sensor(struct emulated_station *station, struct emulated_sensor *sensor)
+{
+        sensor->temperature += random_step(station);
+        int humidity = sensor->humidity + random_step(station);
+        if (humidity >= 20 && humidity <= 95) {
+                sensor->humidity = humidity;
+        }
+
+        if (sensor->temperature < sensor->temperature_min) {
+                sensor->temperature_min = sensor->temperature;
+        }
+        if (sensor->temperature > sensor->temperature_max) {
+                sensor->temperature_max = sensor->temperature;
+        }
+        if (sensor->humidity < sensor->humidity_min) {
+                sensor->humidity_min = sensor->humidity;
+        }
+        if (sensor->humidity > sensor->humidity_max) {
+                sensor->humidity_max = sensor->humidity;
+        }
+}
+
+static void send_sensor_data(struct emulated_station *station)
+{
+        unsigned char payload[SENSOR_DATA_PAYLOAD_SIZE];
+        memset(payload, 0xff, sizeof(payload));
+
+        payload[0x00] = 0x02;
+        encode_device_time(station, payload + 0x01);
+        payload[0x08] = 0x00;
+
+        for (int i = 0; i < 2; i++) {
+                struct emulated_sensor *sensor = &station->sensors[i];
+                update_sensor(station, sensor);
+
+                unsigned char *out = payload + 0x09 + i * 9;
+                encode_measurement(out, sensor->temperature, sensor->humidity);
+                encode_measurement(out + 3, sensor->temperature_max, sensor->humidity_max);
+                encode_measurement(out + 6, sensor->temperature_min, sensor->humidity_min);
+        }
+        // Sensors on channels 2 and 3 are not present
+
+        payload[0x2d] = 0x00;
+        payload[0x2e] = 0x00;
+        station->atmospheric_pressure += random_step(station);
+        payload[0x2f] = station->atmospheric_pressure & 0xff;
+        payload[0x30] = station->atmospheric_pressure >> 8;
+        payload[0x31] = 0x10;
+
+        send_function(station, FUNCTION_SENSOR_DATA, payload, sizeof(payload));
+        stats.reports_sent++;
+}
+
+static unsigned int current_report_interval(const struct emulated_station *station)
+{
+        return station->clock_set ? options.slow_report_interval_ms
+                : options.report_interval_ms;
+}
+
+static void on_report_timer(void *data)
+{
+        struct emulated_station *station = data;
+
+        if (!station->reporting) {
+                return;
+        }
+        send_sensor_data(station);
+        event_timer_schedule(&station->report_timer, current_report_interval(station));
+}
+
+static void on_ping_timer(void *data)
+{
+        struct emulated_station *station = data;
+
+        if (station->ping_outstanding) {
+                stats.pings_lost++;
+                // Like the real device, stop sending data until pings are
+                // answered again
+                station->reporting = false;
+                event_timer_cancel(&station->report_timer);
+        }
+
+        send_function(station, FUNCTION_PING, NULL, 0);
+        stats.pings_sent++;
+        station->ping_outstanding = true;
+        station->ping_sent_us = now_us();
+
+        event_timer_schedule(&station->ping_timer, options.ping_interval_ms);
+}
+
+static void handle_ping_reply(struct emulated_station *station)
+{
+        if (!station->ping_outstanding) {
+                return;
+        }
+
+        stats.ping_replies++;
+        uint64_t rtt = now_us() - station->ping_sent_us;
+        stats.ping_rtt_sum_us += rtt;
+        if (rtt > stats.ping_rtt_max_us) {
+                stats.ping_rtt_max_us = rtt;
+        }
+        if (rtt > interval_rtt_max_us) {
+                interval_rtt_max_us = rtt;
+        }
+        station->ping_outstanding = false;
+
+        if (!station->reporting) {
+                station->reporting = true;
+                send_sensor_data(station);
+                event_timer_schedule(&station->report_timer,
+                                current_report_interval(station));
+        }
+}
+
+static void handle_set_time(struct emulated_station *station,
+                unsigned char *packet, size_t packet_size)
+{
+        time_t new_time;
+        if (!decode_device_time(packet + PACKET_HEADER_SIZE, &new_time)) {
+                stats.bad_packets++;
+                return;
+        }
+        stats.time_set_requests++;
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        station->clock_offset = new_time - now.tv_sec;
+        station->timezone = packet[PACKET_HEADER_SIZE];
+
+        // The same packet is sent back, with byte 0x08 cleared
+        packet[0x08] = 0x00;
+        packet[packet_size - 2] = calculate_checksum(packet, packet_size - 2);
+        if (send_packet(packet, packet_size)) {
+                stats.replies_sent++;
+        }
+
+        if (!station->clock_set) {
+                station->clock_set = true;
+                if (station->reporting) {
+                        event_timer_schedule(&station->report_timer,
+                                        current_report_interval(station));
+                }
+        }
+}
+
+static void handle_packet(unsigned char *packet, size_t size)
+{
+        if (size < PACKET_HEADER_SIZE + PACKET_TRAILER_SIZE
+                        || packet[0] != '<' || packet[1] != 'W'
+                        || packet[size - 1] != '>') {
+                stats.bad_packets++;
+                return;
+        }
+
+        uint32_t mac = ((uint32_t) packet[3] << 24) | ((uint32_t) packet[4] << 16)
+                | ((uint32_t) packet[5] << 8) | packet[6];
+        uint32_t index = mac - options.first_mac;
+        if (index >= options.station_count) {
+                stats.bad_packets++;
+                return;
+        }
+        struct emulated_station *station = &stations[index];
+
+        unsigned char function = packet[7];
+        size_t payload_size = packet[10];
+        size_t expected_size = PACKET_HEADER_SIZE + payload_size + PACKET_TRAILER_SIZE;
+        if (size > expected_size) {
+                const unsigned char error = ERROR_WRONG_PAYLOAD_SIZE;
+                send_function(station, FUNCTION_ERROR, &error, 1);
+                stats.replies_sent++;
+                stats.bad_packets++;
+                return;
+        }
+        if (size < expected_size
+                        || packet[size - 2] != calculate_checksum(packet, size - 2)) {
+                stats.bad_packets++;
+                return;
+        }
+
+        // The packet matches its declared payload size here. A payload longer
+        // than the function needs (e.g. of setting the time) is accepted, the
+        // rest of it is ignored.
+        switch (function) {
+        case FUNCTION_PING:
+        case FUNCTION_SENSOR_DATA:
+                if (payload_size == 0) {
+                        handle_ping_reply(station);
+                } else {
+                        stats.bad_packets++;
+                }
+                break;
+        case FUNCTION_SET_TIME:
+                if (payload_size >= TIME_PAYLOAD_SIZE) {
+                        handle_set_time(station, packet, size);
+                } else {
+                        stats.bad_packets++;
+                }
+                break;
+        case FUNCTION_QUERY_SENSOR_DATA:
+                stats.queries++;
+                send_sensor_data(station);
+                break;
+        case FUNCTION_QUERY_TIME: {
+                unsigned char payload[TIME_PAYLOAD_SIZE];
+                encode_device_time(station, payload);
+                payload[7] = 0x00;
+                send_function(station, function, payload, sizeof(payload));
+                stats.other_requests++;
+                stats.replies_sent++;
+                break;
+        }
+        case FUNCTION_UNKNOWN_0x02: {
+                const unsigned char payload[3] = { 0xff, 0xff, 0xff };
+                send_function(station, function, payload, sizeof(payload));
+                stats.other_requests++;
+                stats.replies_sent++;
+                break;
+        }
+        case 0x21:
+        case 0x22:
+        case 0x23:
+        case 0x24:
+                send_function(station, function, NULL, 0);
+                stats.other_requests++;
+                stats.replies_sent++;
+                break;
+        default:
+                stats.bad_packets++;
+                break;
+        }
+}
+
+static void on_socket_readable(int fd, unsigned int events, void *data)
+{
+        (void) events;
+        (void) data;
+
+        while (true) {
+                unsigned char buffer[RECEIVE_PACKET_SIZE];
+                long int ret = recv(fd, buffer, sizeof(buffer), 0);
+                if (ret == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                                perror("Receiving packets failed");
+                        }
+                        return;
+                }
+                handle_packet(buffer, ret);
+        }
+}
+
+static void print_stats(FILE *stream, const struct emulator_stats *current,
+                const struct emulator_stats *previous, uint64_t rtt_max_us,
+                const char *prefix)
+{
+        unsigned long ping_replies = current->ping_replies - previous->ping_replies;
+        uint64_t rtt_sum = current->ping_rtt_sum_us - previous->ping_rtt_sum_us;
+
+        fprintf(stream, "%ssent %lu pings, %lu sensor data packets, %lu replies "
+                        "(%lu send errors); received %lu ping replies "
+                        "(%lu pings lost, average RTT %.3f ms, max %.3f ms), "
+                        "%lu time set, %lu queries, %lu other requests, "
+                        "%lu incorrect packets\n",
+                        prefix,
+                        current->pings_sent - previous->pings_sent,
+                        current->reports_sent - previous->reports_sent,
+                        current->replies_sent - previous->replies_sent,
+                        current->send_errors - previous->send_errors,
+                        ping_replies,
+                        current->pings_lost - previous->pings_lost,
+                        ping_replies > 0 ? rtt_sum / 1000.0 / ping_replies : 0.0,
+                        rtt_max_us / 1000.0,
+                        current->time_set_requests - previous->time_set_requests,
+                        current->queries - previous->queries,
+                        current->other_requests - previous->other_requests,
+                        current->bad_packets - previous->bad_packets);
+}
+
+static void on_stats_timer(void *data)
+{
+        (void) data;
+
+        char prefix[50];
+        snprintf(prefix, sizeof(prefix), "Last %u s: ", options.stats_interval_s);
+        print_stats(stderr, &stats, &last_stats, interval_rtt_max_us, prefix);
+
+        last_stats = stats;
+        interval_rtt_max_us = 0;
+        event_timer_schedule(&stats_timer, options.stats_interval_s * 1000);
+}
+
+static void on_duration_timer(void *data)
+{
+        (void) data;
+        stop_execution = true;
+}
+
+static void init_stations()
+{
+        stations = calloc(options.station_count, sizeof(*stations));
+        if (stations == NULL) {
+                fputs("Cannot allocate memory for stations\n", stderr);
+                exit(1);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        for (unsigned int i = 0; i < options.station_count; i++) {
+                struct emulated_station *station = &stations[i];
+                station->mac = options.first_mac + i;
+                station->random_state = station->mac | 1;
+                station->clock_offset = POWER_ON_DEVICE_TIME - now.tv_sec;
+                // GMT
+                station->timezone = 0x0c;
+                station->atmospheric_pressure = 1000 + next_random(station) % 30;
+
+                // Around 21 °C indoors and 10 °C outdoors, in 0.1 °F + 900
+                static const uint16_t initial_temperatures[2] = { 1598, 1400 };
+                for (int j = 0; j < 2; j++) {
+                        struct emulated_sensor *sensor = &station->sensors[j];
+                        sensor->temperature = initial_temperatures[j]
+                                + next_random(station) % 50;
+                        sensor->humidity = 40 + next_random(station) % 30;
+                        sensor->temperature_min = sensor->temperature;
+                        sensor->temperature_max = sensor->temperature;
+                        sensor->humidity_min = sensor->humidity;
+                        sensor->humidity_max = sensor->humidity;
+                }
+
+                event_timer_init(&station->ping_timer, on_ping_timer, station);
+                event_timer_init(&station->report_timer, on_report_timer, station);
+                // Spread the stations evenly, so that they do not send at once
+                event_timer_schedule(&station->ping_timer, (uint64_t) i
+                                * options.ping_interval_ms / options.station_count);
+        }
+}
+
+static void on_interrupt(int signum)
+{
+        (void) signum;
+        stop_execution = true;
+}
+
+static void print_help(FILE *stream, char *argv0)
+{
+fprintf(stream, "%s: emulates EM3371-compatible weather stations, for testing\n"
+        "\tem3371-controller without the hardware\n\n"
+        "Parameters:\n"
+        "\t-a, --address\n"
+        "\t\tIPv4 address of the program receiving data. By default 127.0.0.1.\n"
+        "\n"
+        "\t-p, --port\n"
+        "\t\tport number of the program receiving data. By default %d.\n"
+        "\n"
+        "\t-n, --stations=count\n"
+        "\t\tNumber of weather stations to emulate, with consecutive MAC\n"
+        "\t\taddresses. By default %d.\n"
+        "\n"
+        "\t--first-mac=hex\n"
+        "\t\tLast 4 bytes of the MAC address of the first station, in\n"
+        "\t\thexadecimal. By default %08x.\n"
+        "\n"
+        "\t--ping-interval=ms\n"
+        "\t\tHow often every station sends a ping packet. By default %d.\n"
+        "\n"
+        "\t--report-interval=ms\n"
+        "\t\tHow often every station sends sensor data, while its pings are\n"
+        "\t\tsent back. By default %d, like the real device.\n"
+        "\n"
+        "\t--slow-report-interval=ms\n"
+        "\t\tHow often every station sends sensor data after its clock has been\n"
+        "\t\tset. By default %d, like the real device.\n"
+        "\n"
+        "\t-d, --duration=seconds\n"
+        "\t\tExit after this time. By default run until interrupted.\n"
+        "\n"
+        "\t--stats-interval=seconds\n"
+        "\t\tPrint statistics this often, 0 disables. By default %d.\n"
+        "\n"
+        "\t--help\n"
+        "\t\tThis message\n"
+        , argv0, DEFAULT_BIND_PORT, DEFAULT_STATION_COUNT, DEFAULT_FIRST_MAC,
+        DEFAULT_PING_INTERVAL_MS, DEFAULT_REPORT_INTERVAL_MS,
+        DEFAULT_SLOW_REPORT_INTERVAL_MS, DEFAULT_STATS_INTERVAL_S);
+}
+
+enum long_only_options {
+        OPTION_FIRST_MAC = 256,
+        OPTION_PING_INTERVAL,
+        OPTION_REPORT_INTERVAL,
+        OPTION_SLOW_REPORT_INTERVAL,
+        OPTION_STATS_INTERVAL,
+};
+
+// Exits on incorrect values
+static unsigned long parse_number(const char *text, int base, unsigned long min,
+                unsigned long max, const char *description)
+{
+        char *endptr = NULL;
+        errno = 0;
+        unsigned long value = strtoul(text, &endptr, base);
+        if (*text == '\0' || *endptr != 0 || errno != 0 || value < min || value > max) {
+                fprintf(stderr, "Incorrect %s specified on command line!\n", description);
+                exit(1);
+        }
+        return value;
+}
+
+static void parse_emulator_options(const int argc, char **argv)
+{
+        static struct option long_options[] = {
+                { "address",      required_argument, NULL, 'a' },
+                { "port",         required_argument, NULL, 'p' },
+                { "stations",     required_argument, NULL, 'n' },
+                { "first-mac",    required_argument, NULL, OPTION_FIRST_MAC },
+                { "ping-interval", required_argument, NULL, OPTION_PING_INTERVAL },
+                { "report-interval", required_argument, NULL, OPTION_REPORT_INTERVAL },
+                { "slow-report-interval", required_argument, NULL, OPTION_SLOW_REPORT_INTERVAL },
+                { "duration",     required_argument, NULL, 'd' },
+                { "stats-interval", required_argument, NULL, OPTION_STATS_INTERVAL },
+                { "help",         no_argument,       NULL, 'h' },
+                {0, 0, 0, 0}
+        };
+
+        memset(&options, 0, sizeof(options));
+        options.collector_address.sin_family = AF_INET;
+        options.collector_address.sin_port = htons(DEFAULT_BIND_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &options.collector_address.sin_addr);
+        options.station_count = DEFAULT_STATION_COUNT;
+        options.first_mac = DEFAULT_FIRST_MAC;
+        options.ping_interval_ms = DEFAULT_PING_INTERVAL_MS;
+        options.report_interval_ms = DEFAULT_REPORT_INTERVAL_MS;
+        options.slow_report_interval_ms = DEFAULT_SLOW_REPORT_INTERVAL_MS;
+        options.duration_s = 0;
+        options.stats_interval_s = DEFAULT_STATS_INTERVAL_S;
+
+        while (true) {
+                int option_index = 0;
+                int ret = getopt_long(argc, argv, "a:p:n:d:h", long_options, &option_index);
+                if (ret == -1) {
+                        break;
+                }
+
+                switch (ret) {
+                case 'a':
+                        if (inet_pton(AF_INET, optarg,
+                                        &options.collector_address.sin_addr) != 1) {
+                                fputs("Incorrect address specified on command line!\n",
+                                                stderr);
+                                exit(1);
+                        }
+                        break;
+                case 'p':
+                        options.collector_address.sin_port = htons(
+                                parse_number(optarg, 10, 1, 65535, "port"));
+                        break;
+                case 'n':
+                        options.station_count = parse_number(optarg, 10, 1, 1000000,
+                                        "number of stations");
+                        break;
+                case OPTION_FIRST_MAC:
+                        options.first_mac = parse_number(optarg, 16, 0, UINT32_MAX,
+                                        "MAC address");
+                        break;
+                case OPTION_PING_INTERVAL:
+                        options.ping_interval_ms = parse_number(optarg, 10, 1,
+                                        3600 * 1000, "ping interval");
+                        break;
+                case OPTION_REPORT_INTERVAL:
+                        options.report_interval_ms = parse_number(optarg, 10, 1,
+                                        3600 * 1000, "report interval");
+                        break;
+                case OPTION_SLOW_REPORT_INTERVAL:
+                        options.slow_report_interval_ms = parse_number(optarg, 10, 1,
+                                        3600 * 1000, "slow report interval");
+                        break;
+                case 'd':
+                        options.duration_s = parse_number(optarg, 10, 0,
+                                        365 * 24 * 3600, "duration");
+                        break;
+                case OPTION_STATS_INTERVAL:
+                        options.stats_interval_s = parse_number(optarg, 10, 0,
+                                        24 * 3600, "statistics interval");
+                        break;
+                case 'h':
+                        print_help(stderr, argv[0]);
+                        exit(1);
+                        break;
+                case '?':
+                        exit(1);
+                        break;
+                default:
+                        fputs("Incorrect command line parameters!\n", stderr);
+                        exit(1);
+                }
+        }
+
+        if (optind < argc) {
+                fputs("Incorrect command line parameters!\n", stderr);
+                exit(1);
+        }
+
+        if ((uint64_t) options.first_mac + options.station_count - 1 > UINT32_MAX) {
+                fputs("Too many stations for the first MAC address given!\n", stderr);
+                exit(1);
+        }
+}
+
+int main(int argc, char **argv)
+{
+        parse_emulator_options(argc, argv);
+
+        udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_socket == -1) {
+                perror("Cannot create socket");
+                exit(1);
+        }
+        int socket_flags = fcntl(udp_socket, F_GETFL);
+        if (socket_flags == -1
+                        || fcntl(udp_socket, F_SETFL, socket_flags | O_NONBLOCK) == -1) {
+                perror("Cannot set socket to non-blocking mode");
+                exit(1);
+        }
+
+        if (!init_event_loop()) {
+                exit(1);
+        }
+        if (!event_loop_add_fd(udp_socket, EVENT_READ, on_socket_readable, NULL)) {
+                exit(1);
+        }
+
+        struct sigaction signal_action;
+        memset(&signal_action, 0, sizeof(signal_action));
+        signal_action.sa_handler = on_interrupt;
+        sigemptyset(&signal_action.sa_mask);
+        sigaction(SIGINT, &signal_action, NULL);
+        sigaction(SIGTERM, &signal_action, NULL);
+
+        init_stations();
+
+        event_timer_init(&stats_timer, on_stats_timer, NULL);
+        if (options.stats_interval_s > 0) {
+                event_timer_schedule(&stats_timer, options.stats_interval_s * 1000);
+        }
+        event_timer_init(&duration_timer, on_duration_timer, NULL);
+        if (options.duration_s > 0) {
+                event_timer_schedule(&duration_timer, options.duration_s * 1000ULL);
+        }
+
+        uint64_t start_ms = event_loop_now_ms();
+        while (!stop_execution) {
+                event_loop_run_once();
+        }
+        uint64_t elapsed_ms = event_loop_now_ms() - start_ms;
+
+        // Replies to the last pings may still be on their way
+        unsigned long pings_in_flight = 0;
+        for (unsigned int i = 0; i < options.station_count; i++) {
+                if (stations[i].ping_outstanding) {
+                        pings_in_flight++;
+                }
+        }
+
+        static const struct emulator_stats no_stats;
+        print_stats(stderr, &stats, &no_stats, stats.ping_rtt_max_us, "Total: ");
+        fprintf(stderr, "%u stations in %.1f s, %lu pings without reply yet, "
+                        "%.1f packets/s sent\n",
+                        options.station_count, elapsed_ms / 1000.0, pings_in_flight,
+                        elapsed_ms > 0 ? (stats.pings_sent + stats.reports_sent
+                                + stats.replies_sent) * 1000.0 / elapsed_ms : 0.0);
+
+        for (unsigned int i = 0; i < options.station_count; i++) {
+                event_timer_cancel(&stations[i].ping_timer);
+                event_timer_cancel(&stations[i].report_timer);
+        }
+        event_timer_cancel(&stats_timer);
+        event_timer_cancel(&duration_timer);
+        shutdown_event_loop();
+        free(stations);
+        close(udp_socket);
+
+        return 0;
+}
@@ -0,0 +1,429 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A minimal single-threaded event loop.
+ *
+ * It waits for readiness of file descriptors (the UDP socket, standard input
+ * when injecting packets, database connections) and for timers, so that
+ * nothing on the packet receive path needs to call sleep().
+ *
+ * epoll is used on Linux, poll() elsewhere or when USE_POLL is defined.
+ * Timers are kept in a binary heap ordered by expiry time.
+ */
+
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "event_loop.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(USE_POLL)
+# define USE_EPOLL
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+
+struct event_fd {
+        bool in_use;
+        int fd;
+        unsigned int events;
+        event_fd_handler handler;
+        void *data;
+};
+
+static struct event_fd event_fds[MAX_EVENT_LOOP_FDS];
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+#endif
+
+static struct event_timer **timer_heap = NULL;
+static long timer_heap_size = 0;
+static long timer_heap_capacity = 0;
+
+uint64_t event_loop_now_ms()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool init_event_loop()
+{
+        memset(event_fds, 0, sizeof(event_fds));
+
+#ifdef USE_EPOLL
+        epoll_fd = epoll_create(MAX_EVENT_LOOP_FDS);
+        if (epoll_fd == -1) {
+                perror("Cannot create epoll instance");
+                return false;
+        }
+#endif
+        timer_heap_size = 0;
+        return true;
+}
+
+void shutdown_event_loop()
+{
+#ifdef USE_EPOLL
+        if (epoll_fd != -1) {
+                close(epoll_fd);
+                epoll_fd = -1;
+        }
+#endif
+        for (long i = 0; i < timer_heap_size; i++) {
+                timer_heap[i]->heap_index = -1;
+        }
+        free(timer_heap);
+        timer_heap = NULL;
+        timer_heap_size = 0;
+        timer_heap_capacity = 0;
+
+        memset(event_fds, 0, sizeof(event_fds));
+}
+
+static struct event_fd *find_event_fd(int fd)
+{
+        for (int i = 0; i < MAX_EVENT_LOOP_FDS; i++) {
+                if (event_fds[i].in_use && event_fds[i].fd == fd) {
+                        return &event_fds[i];
+                }
+        }
+        return NULL;
+}
+
+#ifdef USE_EPOLL
+static bool update_epoll(int operation, struct event_fd *entry)
+{
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+
+        if (entry->events & EVENT_READ) {
+                event.events |= EPOLLIN;
+        }
+        if (entry->events & EVENT_WRITE) {
+                event.events |= EPOLLOUT;
+        }
+        event.data.ptr = entry;
+
+        if (epoll_ctl(epoll_fd, operation, entry->fd, &event) != 0) {
+                perror("epoll_ctl failed");
+                return false;
+        }
+        return true;
+}
+#endif
+
+bool event_loop_add_fd(int fd, unsigned int events,
+                event_fd_handler handler, void *data)
+{
+        if (find_event_fd(fd) != NULL) {
+                return event_loop_modify_fd(fd, events);
+        }
+
+        struct event_fd *entry = NULL;
+        for (int i = 0; i < MAX_EVENT_LOOP_FDS && entry == NULL; i++) {
+                if (!event_fds[i].in_use) {
+                        entry = &event_fds[i];
+                }
+        }
+        if (entry == NULL) {
+                fputs("Too many file descriptors in the event loop\n", stderr);
+                return false;
+        }
+
+        entry->fd = fd;
+        entry->events = events;
+        entry->handler = handler;
+        entry->data = data;
+
+#ifdef USE_EPOLL
+        if (!update_epoll(EPOLL_CTL_ADD, entry)) {
+                return false;
+        }
+#endif
+        entry->in_use = true;
+        return true;
+}
+
+bool event_loop_modify_fd(int fd, unsigned int events)
+{
+        struct event_fd *entry = find_event_fd(fd);
+        if (entry == NULL) {
+                return false;
+        }
+        if (entry->events == events) {
+                return true;
+        }
+
+        entry->events = events;
+#ifdef USE_EPOLL
+        return update_epoll(EPOLL_CTL_MOD, entry);
+#else
+        return true;
+#endif
+}
+
+void event_loop_remove_fd(int fd)
+{
+        struct event_fd *entry = find_event_fd(fd);
+        if (entry == NULL) {
+                return;
+        }
+
+#ifdef USE_EPOLL
+        // The file descriptor may have already been closed, ignore errors
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+        entry->in_use = false;
+}
+
+/*
+ * Timers
+ */
+
+static void heap_swap(long a, long b)
+{
+        struct event_timer *tmp = timer_heap[a];
+        timer_heap[a] = timer_heap[b];
+        timer_heap[b] = tmp;
+
+        timer_heap[a]->heap_index = a;
+        timer_heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(long position)
+{
+        while (position > 0) {
+                long parent = (position - 1) / 2;
+                if (timer_heap[parent]->expiry_ms <= timer_heap[position]->expiry_ms) {
+                        break;
+                }
+                heap_swap(parent, position);
+                position = parent;
+        }
+}
+
+static void heap_sift_down(long position)
+{
+        while (true) {
+                long smallest = position;
+                long left = 2 * position + 1;
+                long right = 2 * position + 2;
+
+                if (left < timer_heap_size
+                                && timer_heap[left]->expiry_ms < timer_heap[smallest]->expiry_ms) {
+                        smallest = left;
+                }
+                if (right < timer_heap_size
+                                && timer_heap[right]->expiry_ms < timer_heap[smallest]->expiry_ms) {
+                        smallest = right;
+                }
+                if (smallest == position) {
+                        break;
+                }
+                heap_swap(smallest, position);
+                position = smallest;
+        }
+}
+
+void event_timer_init(struct event_timer *timer,
+                event_timer_handler handler, void *data)
+{
+        timer->handler = handler;
+        timer->data = data;
+        timer->expiry_ms = 0;
+        timer->heap_index = -1;
+}
+
+bool event_timer_is_scheduled(const struct event_timer *timer)
+{
+        return timer->heap_index >= 0;
+}
+
+bool event_timer_schedule(struct event_timer *timer, uint64_t delay_ms)
+{
+        event_timer_cancel(timer);
+
+        if (timer_heap_size >= timer_heap_capacity) {
+                // The heap only grows, so after some time of operation
+                // scheduling timers does not allocate memory.
+                long new_capacity = timer_heap_capacity ? timer_heap_capacity * 2 : 16;
+                struct event_timer **new_heap =
+                        realloc(timer_heap, new_capacity * sizeof(*timer_heap));
+                if (new_heap == NULL) {
+                        fputs("Cannot allocate memory for timers\n", stderr);
+                        return false;
+                }
+                timer_heap = new_heap;
+                timer_heap_capacity = new_capacity;
+        }
+
+        timer->expiry_ms = event_loop_now_ms() + delay_ms;
+        timer->heap_index = timer_heap_size;
+        timer_heap[timer_heap_size++] = timer;
+        heap_sift_up(timer->heap_index);
+
+        return true;
+}
+
+void event_timer_cancel(struct event_timer *timer)
+{
+        long position = timer->heap_index;
+        if (position < 0) {
+                return;
+        }
+        assert(position < timer_heap_size && timer_heap[position] == timer);
+
+        timer_heap_size--;
+        if (position != timer_heap_size) {
+                heap_swap(position, timer_heap_size);
+                heap_sift_down(position);
+                heap_sift_up(position);
+        }
+        timer->heap_index = -1;
+}
+
+static void run_expired_timers()
+{
+        uint64_t now = event_loop_now_ms();
+
+        while (timer_heap_size > 0 && timer_heap[0]->expiry_ms <= now) {
+                struct event_timer *timer = timer_heap[0];
+                event_timer_cancel(timer);
+                // The handler may schedule the timer again
+                timer->handler(timer->data);
+        }
+}
+
+static int get_wait_timeout_ms()
+{
+        if (timer_heap_size == 0) {
+                return -1;
+        }
+
+        uint64_t now = event_loop_now_ms();
+        if (timer_heap[0]->expiry_ms <= now) {
+                return 0;
+        }
+
+        uint64_t timeout = timer_heap[0]->expiry_ms - now;
+        if (timeout > 60 * 1000) {
+                timeout = 60 * 1000;
+        }
+        return (int) timeout;
+}
+
+#ifdef USE_EPOLL
+static void wait_for_events(int timeout_ms)
+{
+        struct epoll_event events[MAX_EVENT_LOOP_FDS];
+
+        int ret = epoll_wait(epoll_fd, events, MAX_EVENT_LOOP_FDS, timeout_ms);
+        if (ret == -1) {
+                if (errno != EINTR) {
+                        perror("epoll_wait failed");
+                }
+                return;
+        }
+
+        for (int i = 0; i < ret; i++) {
+                struct event_fd *entry = events[i].data.ptr;
+                unsigned int ready = 0;
+
+                // Errors and hang ups are reported as readiness, so that the
+                // handler can notice them while reading or writing.
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                        ready |= EVENT_READ;
+                }
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                        ready |= EVENT_WRITE;
+                }
+                ready &= entry->events;
+
+                // The entry may have been removed by a previous handler
+                if (entry->in_use && ready != 0) {
+                        entry->handler(entry->fd, ready, entry->data);
+                }
+        }
+}
+#else
+static void wait_for_events(int timeout_ms)
+{
+        struct pollfd poll_fds[MAX_EVENT_LOOP_FDS];
+        struct event_fd *entries[MAX_EVENT_LOOP_FDS];
+        nfds_t count = 0;
+
+        for (int i = 0; i < MAX_EVENT_LOOP_FDS; i++) {
+                if (!event_fds[i].in_use) {
+                        continue;
+                }
+                poll_fds[count].fd = event_fds[i].fd;
+                poll_fds[count].events = 0;
+                poll_fds[count].revents = 0;
+                if (event_fds[i].events & EVENT_READ) {
+                        poll_fds[count].events |= POLLIN;
+                }
+                if (event_fds[i].events & EVENT_WRITE) {
+                        poll_fds[count].events |= POLLOUT;
+                }
+                entries[count] = &event_fds[i];
+                count++;
+        }
+
+        int ret = poll(poll_fds, count, timeout_ms);
+        if (ret == -1) {
+                if (errno != EINTR) {
+                        perror("poll failed");
+                }
+                return;
+        }
+
+        for (nfds_t i = 0; i < count; i++) {
+                struct event_fd *entry = entries[i];
+                unsigned int ready = 0;
+
+                if (poll_fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                        ready |= EVENT_READ;
+                }
+                if (poll_fds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                        ready |= EVENT_WRITE;
+                }
+                ready &= entry->events;
+
+                if (entry->in_use && entry->fd == poll_fds[i].fd && ready != 0) {
+                        entry->handler(entry->fd, ready, entry->data);
+                }
+        }
+}
+#endif
+
+void event_loop_run_once()
+{
+        wait_for_events(get_wait_timeout_ms());
+        run_expired_timers();
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EVENT_READ      0x01
+#define EVENT_WRITE     0x02
+
+#define MAX_EVENT_LOOP_FDS 32
+
+typedef void (*event_fd_handler)(int fd, unsigned int events, void *data);
+typedef void (*event_timer_handler)(void *data);
+
+/*
+ * A timer is owned by the caller, usually embedded in some bigger structure,
+ * so that scheduling it does not allocate memory.
+ */
+struct event_timer {
+        event_timer_handler handler;
+        void *data;
+
+// private
+        uint64_t expiry_ms;
+        long heap_index;
+};
+
+bool init_event_loop();
+void shutdown_event_loop();
+
+bool event_loop_add_fd(int fd, unsigned int events,
+                event_fd_handler handler, void *data);
+bool event_loop_modify_fd(int fd, unsigned int events);
+void event_loop_remove_fd(int fd);
+
+void event_timer_init(struct event_timer *timer,
+                event_timer_handler handler, void *data);
+// Reschedules the timer if it has already been scheduled
+bool event_timer_schedule(struct event_timer *timer, uint64_t delay_ms);
+void event_timer_cancel(struct event_timer *timer);
+bool event_timer_is_scheduled(const struct event_timer *timer);
+
+// Milliseconds from CLOCK_MONOTONIC
+uint64_t event_loop_now_ms();
+
+// Waits for file descriptor events or the nearest timer and runs their
+// handlers. Returns early when interrupted by a signal.
+void event_loop_run_once();
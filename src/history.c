@@ -0,0 +1,413 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Encoding and decoding blocks of the measurement history, the format is
+ * described in history.h.
+ */
+
+#include "history.h"
+#include "crc32.h"
+
+#include <string.h>
+
+#define HISTORY_VERSION 1
+
+// Offsets in the header
+#define OFFSET_SECTION_SIZES 32
+#define OFFSET_MIN (OFFSET_SECTION_SIZES + 2 * (1 + HISTORY_COLUMN_COUNT))
+#define OFFSET_MAX (OFFSET_MIN + 2 * HISTORY_COLUMN_COUNT)
+#define OFFSET_CRC (OFFSET_MAX + 2 * HISTORY_COLUMN_COUNT)
+
+#if OFFSET_CRC + 4 != HISTORY_HEADER_SIZE
+#error HISTORY_HEADER_SIZE does not match the header
+#endif
+
+static void put_le(unsigned char *out, uint64_t value, int size)
+{
+        for (int i = 0; i < size; i++) {
+                out[i] = value >> (8 * i);
+        }
+}
+
+static uint64_t get_le(const unsigned char *data, int size)
+{
+        uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+                value |= (uint64_t) data[i] << (8 * i);
+        }
+        return value;
+}
+
+static uint64_t zigzag_encode(int64_t value)
+{
+        return value < 0 ? ((uint64_t) -(value + 1) << 1) | 1 : (uint64_t) value << 1;
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+        return value & 1 ? -(int64_t) (value >> 1) - 1 : (int64_t) (value >> 1);
+}
+
+// Bits are written from the most significant one of every byte
+struct bit_writer {
+        unsigned char *data;
+        size_t size;
+        size_t bit_position;
+        bool overflow;
+};
+
+static void put_bits(struct bit_writer *writer, uint64_t value, int count)
+{
+        for (int i = count - 1; i >= 0; i--) {
+                size_t byte = writer->bit_position / 8;
+                int shift = 7 - writer->bit_position % 8;
+
+                if (byte >= writer->size) {
+                        writer->overflow = true;
+                        return;
+                }
+                if (shift == 7) {
+                        writer->data[byte] = 0;
+                }
+                writer->data[byte] |= ((value >> i) & 1) << shift;
+                writer->bit_position++;
+        }
+}
+
+// Returns the size of the section in bytes
+static size_t end_section(struct bit_writer *writer, size_t section_start)
+{
+        writer->bit_position = (writer->bit_position + 7) / 8 * 8;
+        return writer->bit_position / 8 - section_start;
+}
+
+struct bit_reader {
+        const unsigned char *data;
+        size_t size_bits;
+        size_t bit_position;
+};
+
+static bool get_bits(struct bit_reader *reader, int count, uint64_t *value)
+{
+        if (reader->bit_position + count > reader->size_bits) {
+                return false;
+        }
+
+        *value = 0;
+        for (int i = 0; i < count; i++) {
+                size_t byte = reader->bit_position / 8;
+                int shift = 7 - reader->bit_position % 8;
+
+                *value = (*value << 1) | ((reader->data[byte] >> shift) & 1);
+                reader->bit_position++;
+        }
+        return true;
+}
+
+// Reads up to max_ones bits until a 0 bit, returns the number of 1 bits
+// before it or -1 on end of data
+static int get_prefix(struct bit_reader *reader, int max_ones)
+{
+        int ones = 0;
+        uint64_t bit;
+
+        while (ones < max_ones) {
+                if (!get_bits(reader, 1, &bit)) {
+                        return -1;
+                }
+                if (bit == 0) {
+                        break;
+                }
+                ones++;
+        }
+        return ones;
+}
+
+// Bits of the delta of delta of timestamps after a prefix of 0-4 ones
+static const int timestamp_bits[] = { 0, 7, 12, 20, 32 };
+
+static void encode_timestamps(struct bit_writer *writer,
+                const struct history_record *records, unsigned int count)
+{
+        int64_t previous_delta = 0;
+
+        for (unsigned int i = 1; i < count; i++) {
+                int64_t delta = records[i].time - records[i - 1].time;
+                uint64_t encoded = zigzag_encode(delta - previous_delta);
+                previous_delta = delta;
+
+                int prefix = 0;
+                while (prefix < 4 && encoded >> timestamp_bits[prefix] != 0) {
+                        prefix++;
+                }
+                // 0, 10, 110, 1110 or 1111
+                if (prefix < 4) {
+                        put_bits(writer, (1 << (prefix + 1)) - 2, prefix + 1);
+                } else {
+                        put_bits(writer, 0xf, 4);
+                }
+                put_bits(writer, encoded, timestamp_bits[prefix]);
+        }
+}
+
+static bool decode_timestamps(struct bit_reader *reader,
+                const struct history_block_header *header,
+                struct history_record *records)
+{
+        int64_t previous_delta = 0;
+
+        records[0].time = header->first_time;
+        for (unsigned int i = 1; i < header->record_count; i++) {
+                int prefix = get_prefix(reader, 4);
+                uint64_t encoded = 0;
+
+                if (prefix < 0 || !get_bits(reader, timestamp_bits[prefix], &encoded)) {
+                        return false;
+                }
+                previous_delta += zigzag_decode(encoded);
+                if (previous_delta < 0 || previous_delta > HISTORY_MAX_BLOCK_SPAN_S) {
+                        return false;
+                }
+                records[i].time = records[i - 1].time + previous_delta;
+        }
+
+        return records[header->record_count - 1].time == header->last_time;
+}
+
+static void encode_column(struct bit_writer *writer, int column,
+                const struct history_record *records, unsigned int count)
+{
+        int16_t previous = HISTORY_MISSING;
+
+        for (unsigned int i = 0; i < count; i++) {
+                int16_t value = records[i].values[column];
+                int32_t delta = (int32_t) value - previous;
+
+                if (value == previous) {
+                        put_bits(writer, 0x0, 1);
+                } else if (value == HISTORY_MISSING) {
+                        put_bits(writer, 0xf, 4);
+                } else if (previous != HISTORY_MISSING
+                                && delta >= -32 && delta < 32) {
+                        put_bits(writer, 0x2, 2);
+                        put_bits(writer, zigzag_encode(delta), 6);
+                } else if (previous != HISTORY_MISSING
+                                && delta >= -512 && delta < 512) {
+                        put_bits(writer, 0x6, 3);
+                        put_bits(writer, zigzag_encode(delta), 10);
+                } else {
+                        put_bits(writer, 0xe, 4);
+                        put_bits(writer, (uint16_t) value, 16);
+                }
+                previous = value;
+        }
+}
+
+static bool decode_column(struct bit_reader *reader, int column,
+                const struct history_block_header *header,
+                struct history_record *records)
+{
+        int16_t previous = HISTORY_MISSING;
+
+        for (unsigned int i = 0; i < header->record_count; i++) {
+                int prefix = get_prefix(reader, 4);
+                uint64_t bits;
+                int32_t value = previous;
+
+                switch (prefix) {
+                case 0:
+                        break;
+                case 1:
+                case 2:
+                        if (previous == HISTORY_MISSING
+                                        || !get_bits(reader, prefix == 1 ? 6 : 10, &bits)) {
+                                return false;
+                        }
+                        value = previous + zigzag_decode(bits);
+                        break;
+                case 3:
+                        if (!get_bits(reader, 16, &bits)) {
+                                return false;
+                        }
+                        value = (int16_t) bits;
+                        break;
+                case 4:
+                        value = HISTORY_MISSING;
+                        break;
+                default:
+                        return false;
+                }
+
+                if (value < INT16_MIN || value > INT16_MAX) {
+                        return false;
+                }
+                // The header is checked as well, a valid CRC does not
+                // guarantee that the block was written by this code
+                if (value != HISTORY_MISSING
+                                && (value < header->min[column] || value > header->max[column])) {
+                        return false;
+                }
+                records[i].values[column] = previous = value;
+        }
+        return true;
+}
+
+// Checked before subtracting, as the times may be anything in a corrupted file
+static bool valid_time_range(int64_t first_time, int64_t last_time)
+{
+        return first_time >= 0 && first_time <= last_time
+                && last_time <= HISTORY_MAX_TIME
+                && (uint64_t) last_time - (uint64_t) first_time <= HISTORY_MAX_BLOCK_SPAN_S;
+}
+
+size_t history_encode_block(unsigned char *out, size_t out_size,
+                uint32_t station_mac,
+                const struct history_record *records, unsigned int count)
+{
+        if (count == 0 || count > HISTORY_MAX_BLOCK_RECORDS
+                        || out_size < HISTORY_HEADER_SIZE
+                        || !valid_time_range(records[0].time, records[count - 1].time)) {
+                return 0;
+        }
+
+        struct bit_writer writer = {
+                .data = out + HISTORY_HEADER_SIZE,
+                .size = out_size - HISTORY_HEADER_SIZE,
+        };
+        size_t section_start = 0;
+
+        for (unsigned int i = 1; i < count; i++) {
+                if (records[i].time < records[i - 1].time) {
+                        return 0;
+                }
+        }
+        encode_timestamps(&writer, records, count);
+        put_le(out + OFFSET_SECTION_SIZES, end_section(&writer, section_start), 2);
+        section_start = writer.bit_position / 8;
+
+        for (int column = 0; column < HISTORY_COLUMN_COUNT; column++) {
+                int16_t min = INT16_MAX, max = INT16_MIN;
+
+                for (unsigned int i = 0; i < count; i++) {
+                        int16_t value = records[i].values[column];
+                        if (value == HISTORY_MISSING) {
+                                continue;
+                        }
+                        if (value < min) {
+                                min = value;
+                        }
+                        if (value > max) {
+                                max = value;
+                        }
+                }
+                put_le(out + OFFSET_MIN + 2 * column, (uint16_t) min, 2);
+                put_le(out + OFFSET_MAX + 2 * column, (uint16_t) max, 2);
+
+                encode_column(&writer, column, records, count);
+                put_le(out + OFFSET_SECTION_SIZES + 2 * (1 + column),
+                                end_section(&writer, section_start), 2);
+                section_start = writer.bit_position / 8;
+        }
+
+        if (writer.overflow) {
+                return 0;
+        }
+
+        size_t payload_size = writer.bit_position / 8;
+
+        memcpy(out, HISTORY_MAGIC, HISTORY_MAGIC_SIZE);
+        out[4] = HISTORY_VERSION;
+        out[5] = HISTORY_COLUMN_COUNT;
+        put_le(out + 6, count, 2);
+        put_le(out + 8, station_mac, 4);
+        put_le(out + 12, records[0].time, 8);
+        put_le(out + 20, records[count - 1].time, 8);
+        put_le(out + 28, payload_size, 4);
+
+        uint32_t crc = crc32_update(0, out, OFFSET_CRC);
+        crc = crc32_update(crc, out + HISTORY_HEADER_SIZE, payload_size);
+        put_le(out + OFFSET_CRC, crc, 4);
+
+        return HISTORY_HEADER_SIZE + payload_size;
+}
+
+bool history_parse_header(const unsigned char *data,
+                struct history_block_header *header)
+{
+        if (memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_SIZE) != 0
+                        || data[4] != HISTORY_VERSION
+                        || data[5] != HISTORY_COLUMN_COUNT) {
+                return false;
+        }
+
+        header->record_count = get_le(data + 6, 2);
+        header->station_mac = get_le(data + 8, 4);
+        header->first_time = get_le(data + 12, 8);
+        header->last_time = get_le(data + 20, 8);
+        header->payload_size = get_le(data + 28, 4);
+
+        uint32_t sections_size = 0;
+        for (int i = 0; i < 1 + HISTORY_COLUMN_COUNT; i++) {
+                header->section_sizes[i] = get_le(data + OFFSET_SECTION_SIZES + 2 * i, 2);
+                sections_size += header->section_sizes[i];
+        }
+        for (int i = 0; i < HISTORY_COLUMN_COUNT; i++) {
+                header->min[i] = get_le(data + OFFSET_MIN + 2 * i, 2);
+                header->max[i] = get_le(data + OFFSET_MAX + 2 * i, 2);
+        }
+        header->crc = get_le(data + OFFSET_CRC, 4);
+
+        return header->record_count > 0
+                && header->record_count <= HISTORY_MAX_BLOCK_RECORDS
+                && valid_time_range(header->first_time, header->last_time)
+                && header->payload_size == sections_size;
+}
+
+bool history_decode_block(const unsigned char *data,
+                const struct history_block_header *header,
+                struct history_record *records)
+{
+        const unsigned char *payload = data + HISTORY_HEADER_SIZE;
+
+        uint32_t crc = crc32_update(0, data, OFFSET_CRC);
+        crc = crc32_update(crc, payload, header->payload_size);
+        if (crc != header->crc) {
+                return false;
+        }
+
+        struct bit_reader reader = {
+                .data = payload,
+                .size_bits = 8 * header->section_sizes[0],
+        };
+        if (!decode_timestamps(&reader, header, records)) {
+                return false;
+        }
+
+        for (int column = 0; column < HISTORY_COLUMN_COUNT; column++) {
+                payload += reader.size_bits / 8;
+                reader.data = payload;
+                reader.size_bits = 8 * header->section_sizes[1 + column];
+                reader.bit_position = 0;
+
+                if (!decode_column(&reader, column, header, records)) {
+                        return false;
+                }
+        }
+        return true;
+}
@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * The format of the local measurement history (--history-output): an
+ * append-only file of compressed blocks, read with em3371-history.
+ *
+ * Every block holds up to HISTORY_MAX_BLOCK_RECORDS measurements of a single
+ * weather station. Its header has the time range and the minimum and maximum
+ * of every column, so that readers can skip blocks without decoding them,
+ * and a CRC-32 of the whole block. All integers are little-endian:
+ *
+ *      offset  size
+ *      0       4       magic "EMH1"
+ *      4       1       format version, 1
+ *      5       1       number of value columns, HISTORY_COLUMN_COUNT
+ *      6       2       number of records
+ *      8       4       station MAC address (the last 4 bytes)
+ *      12      8       time of the first record, seconds since the epoch
+ *      20      8       time of the last record
+ *      28      4       size of the payload
+ *      32      28      size of every payload section
+ *      60      26      minimum of every column
+ *      86      26      maximum of every column
+ *      112     4       CRC-32 of the above and the payload
+ *
+ * The payload is stored column by column, every section starting at a byte
+ * boundary: first the timestamps, then the values of every column. As in
+ * Facebook's Gorilla, timestamps are stored as differences between
+ * consecutive deltas, which are mostly 0 for stations sending data at
+ * a fixed interval:
+ *
+ *      0                       same delta as before
+ *      10 + 7 bits             zigzag-encoded difference of deltas
+ *      110 + 12 bits
+ *      1110 + 20 bits
+ *      1111 + 32 bits
+ *
+ * Measurements are integers here, so instead of XOR-ing floating point
+ * numbers, values are stored as a difference from the previous value in the
+ * column (which is "missing" before the first record):
+ *
+ *      0                       same as before
+ *      10 + 6 bits             zigzag-encoded difference
+ *      110 + 10 bits
+ *      1110 + 16 bits          the value itself
+ *      1111                    the value is missing
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Same order as in CSV files
+enum history_column {
+        HISTORY_PRESSURE,
+        // Of the station, followed by the same columns for remote sensors 1-3
+        HISTORY_TEMPERATURE,
+        HISTORY_HUMIDITY,
+        HISTORY_DEW_POINT,
+};
+#define HISTORY_COLUMN_COUNT (1 + 4 * 3)
+// sensor is 0 for the station, 1-3 for remote sensors
+#define HISTORY_SENSOR_COLUMN(sensor, column) ((column) + 3 * (sensor))
+
+// A value that has not been measured, e.g. of a sensor that is not present
+#define HISTORY_MISSING INT16_MIN
+
+struct history_record {
+        // Seconds since the epoch
+        int64_t time;
+        // Temperatures and dew points in hundredths of °C, humidity in %,
+        // pressure as sent by the station
+        int16_t values[HISTORY_COLUMN_COUNT];
+};
+
+struct history_block_header {
+        uint32_t station_mac;
+        unsigned int record_count;
+        int64_t first_time;
+        int64_t last_time;
+        // Bytes following the header
+        uint32_t payload_size;
+        // Of the timestamps and then of every column
+        uint16_t section_sizes[1 + HISTORY_COLUMN_COUNT];
+        // min > max if all values in the column are missing
+        int16_t min[HISTORY_COLUMN_COUNT];
+        int16_t max[HISTORY_COLUMN_COUNT];
+        uint32_t crc;
+};
+
+#define HISTORY_MAGIC "EMH1"
+#define HISTORY_MAGIC_SIZE 4
+#define HISTORY_HEADER_SIZE 116
+#define HISTORY_MAX_BLOCK_RECORDS 4096
+// Records further apart must go to separate blocks, so that timestamps can
+// be encoded in at most 36 bits
+#define HISTORY_MAX_BLOCK_SPAN_S (1L << 30)
+// Records must be from 1970-01-01 to 9999-12-31 23:59:59 UTC
+#define HISTORY_MAX_TIME 253402300799L
+// Values take at most 20 bits, the sections are padded to full bytes
+#define HISTORY_MAX_BLOCK_SIZE(records) (HISTORY_HEADER_SIZE               \
+                + ((records) * (36 + 20 * HISTORY_COLUMN_COUNT)) / 8    \
+                + 1 + HISTORY_COLUMN_COUNT)
+
+// Records must be sorted by time, at most HISTORY_MAX_BLOCK_SPAN_S apart and
+// not after HISTORY_MAX_TIME.
+// Returns the size of the block written to out, or 0 if out_size is too small
+// (see HISTORY_MAX_BLOCK_SIZE) or the records cannot be stored.
+size_t history_encode_block(unsigned char *out, size_t out_size,
+                uint32_t station_mac,
+                const struct history_record *records, unsigned int count);
+
+// Reads HISTORY_HEADER_SIZE bytes. Returns false if they are not a valid
+// header.
+bool history_parse_header(const unsigned char *data,
+                struct history_block_header *header);
+// data points to the header followed by the payload, records must have
+// space for header->record_count elements. Returns false if the checksum does
+// not match or the payload is corrupted.
+bool history_decode_block(const unsigned char *data,
+                const struct history_block_header *header,
+                struct history_record *records);
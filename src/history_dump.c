@@ -0,0 +1,348 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Reads the history file written with --history-output (see history.h) and
+ * prints the measurements as CSV, in the format of --csv-output.
+ *
+ * Blocks of other stations or outside of the requested time range are
+ * skipped using their headers alone, without reading or decoding the data.
+ * The checksum of every block that is read is verified.
+ */
+
+// localtime_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "history.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct {
+        const char *path;
+        int64_t from;
+        int64_t to;
+        bool station_given;
+        uint32_t station_mac;
+        bool stats;
+} options;
+
+static void print_help(FILE *stream, const char *argv0)
+{
+        fprintf(stream, "%s: Prints measurements stored by em3371-controller\n"
+        "\t--history-output as CSV.\n\n"
+        "Usage: %s [options] history.bin\n\n"
+        "Parameters:\n"
+        "\t--from=time\n"
+        "\t--to=time\n"
+        "\t\tPrint only measurements in this time range (inclusive). time is\n"
+        "\t\t\"YYYY-MM-DD[ HH:MM[:SS]]\" in local time or seconds since the\n"
+        "\t\tepoch.\n"
+        "\n"
+        "\t--station=hex\n"
+        "\t\tPrint only measurements of the station with these last 4 bytes of\n"
+        "\t\tthe MAC address, e.g. 00112233 or 00:11:22:33.\n"
+        "\n"
+        "\t--stats\n"
+        "\t\tInstead of measurements, print a line for every block and the\n"
+        "\t\tsize per measurement. Blocks are not verified then.\n"
+        "\n"
+        "\t--help\n"
+        "\t\tThis message\n"
+        , argv0, argv0);
+}
+
+enum long_only_options {
+        OPTION_FROM = 256,
+        OPTION_TO,
+        OPTION_STATION,
+        OPTION_STATS,
+};
+
+// Exits on incorrect values
+static int64_t parse_time(const char *text)
+{
+        struct tm time_tm;
+        char end;
+        int fields;
+
+        memset(&time_tm, 0, sizeof(time_tm));
+        fields = sscanf(text, "%d-%d-%d %d:%d:%d%c", &time_tm.tm_year, &time_tm.tm_mon,
+                        &time_tm.tm_mday, &time_tm.tm_hour, &time_tm.tm_min,
+                        &time_tm.tm_sec, &end);
+        if (fields == 3 || fields == 5 || fields == 6) {
+                time_tm.tm_year -= 1900;
+                time_tm.tm_mon -= 1;
+                time_tm.tm_isdst = -1;
+                return mktime(&time_tm);
+        }
+
+        char *endptr = NULL;
+        errno = 0;
+        long long value = strtoll(text, &endptr, 10);
+        if (*text == '\0' || *endptr != 0 || errno != 0) {
+                fprintf(stderr, "Incorrect time '%s' specified on command line!\n", text);
+                exit(1);
+        }
+        return value;
+}
+
+static uint32_t parse_station_mac(const char *text)
+{
+        char digits[9];
+        size_t count = 0;
+
+        for (const char *c = text; *c != '\0'; c++) {
+                if (*c == ':') {
+                        continue;
+                }
+                if (count == 8 || strchr("0123456789abcdefABCDEF", *c) == NULL) {
+                        count = 0;
+                        break;
+                }
+                digits[count++] = *c;
+        }
+        if (count != 8) {
+                fputs("Incorrect station MAC address specified on command line!\n", stderr);
+                exit(1);
+        }
+        digits[count] = '\0';
+        return strtoul(digits, NULL, 16);
+}
+
+static void parse_history_options(const int argc, char **argv)
+{
+        static struct option long_options[] = {
+                { "from",         required_argument, NULL, OPTION_FROM },
+                { "to",           required_argument, NULL, OPTION_TO },
+                { "station",      required_argument, NULL, OPTION_STATION },
+                { "stats",        no_argument,       NULL, OPTION_STATS },
+                { "help",         no_argument,       NULL, 'h' },
+                {0, 0, 0, 0}
+        };
+
+        memset(&options, 0, sizeof(options));
+        options.from = INT64_MIN;
+        options.to = INT64_MAX;
+
+        while (true) {
+                int option_index = 0;
+                int ret = getopt_long(argc, argv, "h", long_options, &option_index);
+                if (ret == -1) {
+                        break;
+                }
+
+                switch (ret) {
+                case OPTION_FROM:
+                        options.from = parse_time(optarg);
+                        break;
+                case OPTION_TO:
+                        options.to = parse_time(optarg);
+                        break;
+                case OPTION_STATION:
+                        options.station_given = true;
+                        options.station_mac = parse_station_mac(optarg);
+                        break;
+                case OPTION_STATS:
+                        options.stats = true;
+                        break;
+                case 'h':
+                        print_help(stderr, argv[0]);
+                        exit(1);
+                        break;
+                case '?':
+                        exit(1);
+                        break;
+                default:
+                        fputs("Incorrect command line parameters!\n", stderr);
+                        exit(1);
+                }
+        }
+
+        if (optind != argc - 1) {
+                print_help(stderr, argv[0]);
+                exit(1);
+        }
+        options.path = argv[optind];
+}
+
+// As station_mac_to_string(), without linking the station registry
+#define STATION_MAC_STRING_SIZE 12
+
+static void station_mac_to_string(uint32_t mac, char *mac_out, size_t buffer_size)
+{
+        snprintf(mac_out, buffer_size, "%02x:%02x:%02x:%02x",
+                        (unsigned int) (mac >> 24) & 0xff,
+                        (unsigned int) (mac >> 16) & 0xff,
+                        (unsigned int) (mac >> 8) & 0xff,
+                        (unsigned int) mac & 0xff);
+}
+
+static void print_time(int64_t time_in)
+{
+        time_t time = time_in;
+        struct tm time_tm;
+        char time_string[30];
+
+        localtime_r(&time, &time_tm);
+        strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", &time_tm);
+        fputs(time_string, stdout);
+}
+
+static void print_value(int16_t value, bool hundredths)
+{
+        if (value == HISTORY_MISSING) {
+                fputs(";", stdout);
+        } else if (hundredths) {
+                int absolute = value < 0 ? -value : value;
+                printf("%s%d.%02d;", value < 0 ? "-" : "", absolute / 100, absolute % 100);
+        } else {
+                printf("%d;", value);
+        }
+}
+
+static void print_records(const struct history_block_header *header,
+                const struct history_record *records)
+{
+        char station_mac[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(header->station_mac, station_mac, sizeof(station_mac));
+
+        for (unsigned int i = 0; i < header->record_count; i++) {
+                const struct history_record *record = &records[i];
+                if (record->time < options.from || record->time > options.to) {
+                        continue;
+                }
+
+                print_time(record->time);
+                fputs(";", stdout);
+                print_value(record->values[HISTORY_PRESSURE], false);
+                for (int sensor = 0; sensor < 4; sensor++) {
+                        const int16_t *values =
+                                &record->values[HISTORY_SENSOR_COLUMN(sensor, 0)];
+                        print_value(values[HISTORY_TEMPERATURE], true);
+                        print_value(values[HISTORY_HUMIDITY], false);
+                        print_value(values[HISTORY_DEW_POINT], true);
+                }
+                printf("%s;\n", station_mac);
+        }
+}
+
+static void print_block_stats(long offset, const struct history_block_header *header)
+{
+        char station_mac[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(header->station_mac, station_mac, sizeof(station_mac));
+
+        printf("%ld;%s;", offset, station_mac);
+        print_time(header->first_time);
+        fputs(";", stdout);
+        print_time(header->last_time);
+        printf(";%u;%lu;\n", header->record_count,
+                        (unsigned long) HISTORY_HEADER_SIZE + header->payload_size);
+}
+
+static bool block_wanted(const struct history_block_header *header)
+{
+        return (!options.station_given || header->station_mac == options.station_mac)
+                && header->last_time >= options.from
+                && header->first_time <= options.to;
+}
+
+int main(int argc, char **argv)
+{
+        parse_history_options(argc, argv);
+
+        FILE *stream = fopen(options.path, "rb");
+        if (stream == NULL) {
+                perror("Cannot open the history file");
+                return 1;
+        }
+
+        static unsigned char block[HISTORY_MAX_BLOCK_SIZE(HISTORY_MAX_BLOCK_RECORDS)];
+        static struct history_record records[HISTORY_MAX_BLOCK_RECORDS];
+        struct history_block_header header;
+        unsigned long total_records = 0, total_bytes = 0;
+        bool ok = true;
+
+        if (options.stats) {
+                puts("offset;station_mac;first_time;last_time;records;bytes;");
+        } else {
+                puts("time;atmospheric_pressure;"
+                        "station_temp;station_humidity;station_dew_point;"
+                        "sensor1_temp;sensor1_humidity;sensor1_dew_point;"
+                        "sensor2_temp;sensor2_humidity;sensor2_dew_point;"
+                        "sensor3_temp;sensor3_humidity;sensor3_dew_point;"
+                        "station_mac;");
+        }
+
+        while (true) {
+                long offset = ftell(stream);
+                size_t read = fread(block, 1, HISTORY_HEADER_SIZE, stream);
+                if (read == 0 && feof(stream)) {
+                        break;
+                }
+                if (read != HISTORY_HEADER_SIZE || !history_parse_header(block, &header)
+                                || HISTORY_HEADER_SIZE + header.payload_size > sizeof(block)) {
+                        fprintf(stderr, "Incomplete or corrupted block at offset %ld\n",
+                                        offset);
+                        ok = false;
+                        break;
+                }
+
+                if (!block_wanted(&header)) {
+                        if (fseek(stream, header.payload_size, SEEK_CUR) != 0) {
+                                perror("Cannot seek in the history file");
+                                ok = false;
+                                break;
+                        }
+                        continue;
+                }
+
+                if (options.stats) {
+                        print_block_stats(offset, &header);
+                        total_records += header.record_count;
+                        total_bytes += HISTORY_HEADER_SIZE + header.payload_size;
+                        fseek(stream, header.payload_size, SEEK_CUR);
+                        continue;
+                }
+
+                if (fread(block + HISTORY_HEADER_SIZE, 1, header.payload_size, stream)
+                                        != header.payload_size
+                                || !history_decode_block(block, &header, records)) {
+                        fprintf(stderr, "Incomplete or corrupted block at offset %ld\n",
+                                        offset);
+                        ok = false;
+                        break;
+                }
+                print_records(&header, records);
+        }
+
+        if (options.stats && total_records > 0) {
+                fprintf(stderr, "%lu measurements in %lu bytes, %.2f bytes per measurement\n",
+                                total_records, total_bytes,
+                                (double) total_bytes / total_records);
+        }
+
+        fclose(stream);
+        return ok ? 0 : 1;
+}
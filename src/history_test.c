@@ -0,0 +1,174 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "history.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_RECORDS HISTORY_MAX_BLOCK_RECORDS
+
+static struct history_record records[TEST_RECORDS];
+static struct history_record decoded[TEST_RECORDS];
+static unsigned char block[HISTORY_MAX_BLOCK_SIZE(TEST_RECORDS)];
+
+// Measurements every 48 s with some jitter, slowly changing values, a remote
+// sensor that disappears for a while and occasional large jumps
+static void generate_records(unsigned int count)
+{
+        srand(1);
+        int64_t time = 1609459200;
+
+        for (unsigned int i = 0; i < count; i++) {
+                time += 48 + (rand() % 8 == 0 ? rand() % 5 - 2 : 0);
+                if (i % 1000 == 999) {
+                        time += 100000;
+                }
+                records[i].time = time;
+
+                records[i].values[HISTORY_PRESSURE] = 1013 + (i / 50) % 7;
+                for (int sensor = 0; sensor < 4; sensor++) {
+                        int16_t *values = &records[i].values[HISTORY_SENSOR_COLUMN(sensor, 0)];
+
+                        if (sensor == 3 || (sensor == 2 && i % 700 > 600)) {
+                                values[HISTORY_TEMPERATURE] = HISTORY_MISSING;
+                                values[HISTORY_HUMIDITY] = HISTORY_MISSING;
+                                values[HISTORY_DEW_POINT] = HISTORY_MISSING;
+                                continue;
+                        }
+                        values[HISTORY_TEMPERATURE] = 2000 - 500 * sensor + (i % 300) * 3
+                                + (i % 97 == 0 ? -3000 : 0);
+                        values[HISTORY_HUMIDITY] = 40 + (i / 20) % 30;
+                        values[HISTORY_DEW_POINT] = 900 + rand() % 40;
+                }
+        }
+}
+
+static bool records_equal(unsigned int count)
+{
+        for (unsigned int i = 0; i < count; i++) {
+                if (records[i].time != decoded[i].time
+                                || memcmp(records[i].values, decoded[i].values,
+                                        sizeof(records[i].values)) != 0) {
+                        fprintf(stdout, "Record %u differs after decoding\n", i);
+                        return false;
+                }
+        }
+        return true;
+}
+
+static bool test_roundtrip(unsigned int count)
+{
+        struct history_block_header header;
+
+        size_t size = history_encode_block(block, sizeof(block), 0x12345678, records, count);
+        if (size == 0) {
+                fprintf(stdout, "Encoding %u records failed\n", count);
+                return false;
+        }
+        if (!history_parse_header(block, &header)
+                        || header.record_count != count
+                        || header.station_mac != 0x12345678
+                        || header.first_time != records[0].time
+                        || header.last_time != records[count - 1].time
+                        || HISTORY_HEADER_SIZE + header.payload_size != size) {
+                fprintf(stdout, "Wrong header of a block with %u records\n", count);
+                return false;
+        }
+        if (header.min[HISTORY_SENSOR_COLUMN(3, HISTORY_TEMPERATURE)]
+                        <= header.max[HISTORY_SENSOR_COLUMN(3, HISTORY_TEMPERATURE)]) {
+                fprintf(stdout, "Column without values has a minimum and maximum\n");
+                return false;
+        }
+
+        memset(decoded, 0, sizeof(decoded));
+        if (!history_decode_block(block, &header, decoded) || !records_equal(count)) {
+                fprintf(stdout, "Decoding %u records failed\n", count);
+                return false;
+        }
+
+        fprintf(stdout, "%u records: %zu bytes, %.2f bytes per record\n",
+                        count, size, (double) size / count);
+        return true;
+}
+
+// Every flipped bit must be detected
+static bool test_corruption(unsigned int count)
+{
+        struct history_block_header header;
+        size_t size = history_encode_block(block, sizeof(block), 1, records, count);
+
+        for (size_t bit = 0; bit < 8 * size; bit++) {
+                block[bit / 8] ^= 1 << (bit % 8);
+                if (history_parse_header(block, &header)
+                                && HISTORY_HEADER_SIZE + header.payload_size <= sizeof(block)
+                                && history_decode_block(block, &header, decoded)) {
+                        fprintf(stdout, "Corrupted bit %zu not detected\n", bit);
+                        return false;
+                }
+                block[bit / 8] ^= 1 << (bit % 8);
+        }
+        return true;
+}
+
+int main()
+{
+        bool ok = true;
+
+        generate_records(TEST_RECORDS);
+
+        ok = test_roundtrip(1) && ok;
+        ok = test_roundtrip(2) && ok;
+        ok = test_roundtrip(512) && ok;
+        ok = test_roundtrip(TEST_RECORDS) && ok;
+        ok = test_corruption(100) && ok;
+
+        // Too long time span
+        records[1].time = records[0].time + HISTORY_MAX_BLOCK_SPAN_S + 1;
+        if (history_encode_block(block, sizeof(block), 1, records, 2) != 0) {
+                fprintf(stdout, "Records too far apart were encoded\n");
+                ok = false;
+        }
+
+        // Times out of range, their difference would overflow
+        records[0].time = INT64_MIN;
+        records[1].time = 1;
+        if (history_encode_block(block, sizeof(block), 1, records, 2) != 0) {
+                fprintf(stdout, "Records before 1970 were encoded\n");
+                ok = false;
+        }
+        generate_records(2);
+        if (history_encode_block(block, sizeof(block), 1, records, 2) == 0) {
+                fprintf(stdout, "Failed to encode 2 records\n");
+                ok = false;
+        }
+        memset(block + 12, 0x80, 8);
+        struct history_block_header header;
+        if (history_parse_header(block, &header)) {
+                fprintf(stdout, "Header with the first time before 1970 was accepted\n");
+                ok = false;
+        }
+
+        if (!ok) {
+                fprintf(stdout, "History encoding tests failed!\n");
+                return 1;
+        }
+        fprintf(stdout, "History encoding tests passed\n");
+        return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "latency.h"
+
+#include <string.h>
+#include <time.h>
+
+static struct latency_histogram histograms[LATENCY_STAGE_COUNT];
+
+static const char *const stage_names[LATENCY_STAGE_COUNT] = {
+        [LATENCY_RECEIVE] = "receive",
+        [LATENCY_HANDLED] = "handled",
+        [LATENCY_COMMIT] = "commit",
+        [LATENCY_VALIDATE] = "validate",
+        [LATENCY_DECODE] = "decode",
+        [LATENCY_OUTPUT_LOG] = "output_log",
+        [LATENCY_OUTPUT_CSV] = "output_csv",
+        [LATENCY_OUTPUT_RAW_SQL] = "output_raw_sql",
+        [LATENCY_OUTPUT_STATUS_FILE] = "output_status_file",
+        [LATENCY_OUTPUT_MYSQL] = "output_mysql",
+        [LATENCY_OUTPUT_HISTORY] = "output_history",
+};
+
+uint64_t latency_now_ns()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static unsigned int bucket_index(uint64_t value)
+{
+        if (value < LATENCY_SUB_BUCKETS) {
+                return value;
+        }
+
+        unsigned int exponent = 63 - __builtin_clzll(value);
+        if (exponent > LATENCY_MAX_EXPONENT) {
+                return LATENCY_BUCKETS - 1;
+        }
+        // The highest bit is always set, the next ones select the sub-bucket
+        unsigned int sub_bucket = (value >> (exponent - LATENCY_SUB_BUCKET_BITS))
+                & (LATENCY_SUB_BUCKETS - 1);
+        return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS
+                + sub_bucket;
+}
+
+// The highest value counted in the bucket
+static uint64_t bucket_upper_bound(unsigned int index)
+{
+        if (index < LATENCY_SUB_BUCKETS) {
+                return index;
+        }
+
+        unsigned int exponent = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+        uint64_t sub_bucket = index % LATENCY_SUB_BUCKETS;
+        unsigned int shift = exponent - LATENCY_SUB_BUCKET_BITS;
+        return ((LATENCY_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void latency_record(enum latency_stage stage, uint64_t duration_ns)
+{
+        struct latency_histogram *histogram = &histograms[stage];
+
+        if (histogram->count == 0 || duration_ns < histogram->min_ns) {
+                histogram->min_ns = duration_ns;
+        }
+        if (duration_ns > histogram->max_ns) {
+                histogram->max_ns = duration_ns;
+        }
+        histogram->count++;
+        histogram->sum_ns += duration_ns;
+        histogram->buckets[bucket_index(duration_ns)]++;
+}
+
+void latency_record_since(enum latency_stage stage, uint64_t start_ns)
+{
+        if (start_ns == 0) {
+                return;
+        }
+
+        uint64_t now = latency_now_ns();
+        latency_record(stage, now > start_ns ? now - start_ns : 0);
+}
+
+const char *latency_stage_name(enum latency_stage stage)
+{
+        return stage_names[stage];
+}
+
+const struct latency_histogram *get_latency_histogram(enum latency_stage stage)
+{
+        return &histograms[stage];
+}
+
+uint64_t latency_percentile(const struct latency_histogram *histogram,
+                double percentile)
+{
+        if (histogram->count == 0) {
+                return 0;
+        }
+
+        uint64_t rank = histogram->count * percentile / 100.0;
+        if (rank >= histogram->count) {
+                rank = histogram->count - 1;
+        }
+
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+                seen += histogram->buckets[i];
+                if (seen > rank) {
+                        uint64_t value = bucket_upper_bound(i);
+                        return value < histogram->max_ns ? value : histogram->max_ns;
+                }
+        }
+        return histogram->max_ns;
+}
+
+void dump_latency_stats(FILE *stream)
+{
+        fprintf(stream, "Latency in microseconds:\n%-20s %10s %10s %10s %10s %10s "
+                        "%10s %10s %10s\n", "stage", "count", "min", "mean", "p50",
+                        "p90", "p99", "p99.9", "max");
+
+        for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+                const struct latency_histogram *histogram = &histograms[i];
+                if (histogram->count == 0) {
+                        continue;
+                }
+
+                fprintf(stream, "%-20s %10llu %10.1f %10.1f %10.1f %10.1f "
+                                "%10.1f %10.1f %10.1f\n",
+                                stage_names[i], (unsigned long long) histogram->count,
+                                histogram->min_ns / 1000.0,
+                                (double) histogram->sum_ns / histogram->count / 1000.0,
+                                latency_percentile(histogram, 50) / 1000.0,
+                                latency_percentile(histogram, 90) / 1000.0,
+                                latency_percentile(histogram, 99) / 1000.0,
+                                latency_percentile(histogram, 99.9) / 1000.0,
+                                histogram->max_ns / 1000.0);
+        }
+}
+
+void reset_latency_stats()
+{
+        memset(histograms, 0, sizeof(histograms));
+}
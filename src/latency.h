@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Latency of handling packets, from their arrival in the kernel
+ * (SO_TIMESTAMPNS) until the measurements are committed in the database.
+ *
+ * Times are nanoseconds of CLOCK_MONOTONIC. Every stage has a histogram
+ * with logarithmic buckets: each power of two is split into
+ * LATENCY_SUB_BUCKETS linear buckets, as in HdrHistogram. Percentiles are
+ * then accurate to about 6% over the whole range, and recording a value
+ * takes constant time without allocating memory.
+ *
+ * The statistics are printed on SIGUSR1 and at the end of a replay.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum latency_stage {
+        // Time from the arrival of the packet in the kernel:
+        // until it has been read by this program,
+        LATENCY_RECEIVE,
+        // until all outputs have handled it (or queued it, if they have
+        // their own thread, see sink.h),
+        LATENCY_HANDLED,
+        // until the measurement has been committed in the database.
+        LATENCY_COMMIT,
+
+        // Time taken by a single step
+        LATENCY_VALIDATE,
+        LATENCY_DECODE,
+        LATENCY_OUTPUT_LOG,
+        LATENCY_OUTPUT_CSV,
+        LATENCY_OUTPUT_RAW_SQL,
+        LATENCY_OUTPUT_STATUS_FILE,
+        LATENCY_OUTPUT_MYSQL,
+        LATENCY_OUTPUT_HISTORY,
+
+        LATENCY_STAGE_COUNT
+};
+
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+// 2^40 ns is about 18 minutes, longer times go to the last bucket
+#define LATENCY_MAX_EXPONENT 40
+#define LATENCY_BUCKETS                                                 \
+        ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+        uint64_t count;
+        uint64_t sum_ns;
+        uint64_t min_ns;
+        uint64_t max_ns;
+        uint64_t buckets[LATENCY_BUCKETS];
+};
+
+uint64_t latency_now_ns();
+
+void latency_record(enum latency_stage stage, uint64_t duration_ns);
+// Records the time from start_ns until now. 0 means that the start is not
+// known, e.g. for measurements loaded from the MySQL buffer file.
+void latency_record_since(enum latency_stage stage, uint64_t start_ns);
+
+const char *latency_stage_name(enum latency_stage stage);
+const struct latency_histogram *get_latency_histogram(enum latency_stage stage);
+// percentile is from 0 to 100. Returns the highest value that falls into
+// the same bucket as the value at the percentile, at most the maximum.
+uint64_t latency_percentile(const struct latency_histogram *histogram,
+                double percentile);
+
+void dump_latency_stats(FILE *stream);
+void reset_latency_stats();
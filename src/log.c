@@ -0,0 +1,162 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEXDUMP_BYTES_PER_LINE 8
+// "00000008  00 00 39 00 02 0c 14 0c  |..9.....|\n"
+#define HEXDUMP_LINE_SIZE (8 + 2 + 3 * HEXDUMP_BYTES_PER_LINE + 2 \
+                + HEXDUMP_BYTES_PER_LINE + 2)
+#define HEXDUMP_OUTPUT_SIZE 4096
+
+int current_log_level = LOG_LEVEL_DEBUG;
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+void set_log_level(int level)
+{
+        current_log_level = level;
+}
+
+int log_level_from_string(const char *name)
+{
+        static const char *const level_names[] = {
+                [LOG_LEVEL_DEBUG] = "debug",
+                [LOG_LEVEL_INFO] = "info",
+                [LOG_LEVEL_WARNING] = "warning",
+                [LOG_LEVEL_ERROR] = "error",
+        };
+
+        for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+                if (strcmp(name, level_names[i]) == 0) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+static void write_all(const char *data, size_t size)
+{
+        while (size > 0) {
+                ssize_t ret = write(STDERR_FILENO, data, size);
+                if (ret == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        // Nowhere to report the error
+                        return;
+                }
+                data += ret;
+                size -= ret;
+        }
+}
+
+void log_write(const char *format, ...)
+{
+        char message[LOG_MESSAGE_MAX_SIZE];
+        va_list args;
+
+        va_start(args, format);
+        int length = vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+
+        if (length < 0) {
+                return;
+        }
+        if ((size_t) length >= sizeof(message)) {
+                length = sizeof(message) - 1;
+        }
+        write_all(message, length);
+}
+
+static char *format_hexdump_line(char *out, size_t offset,
+                const unsigned char *data, size_t size)
+{
+        for (int shift = 28; shift >= 0; shift -= 4) {
+                *out++ = hex_digits[(offset >> shift) & 0xf];
+        }
+        *out++ = ' ';
+        *out++ = ' ';
+
+        for (size_t i = 0; i < HEXDUMP_BYTES_PER_LINE; i++) {
+                if (i < size) {
+                        *out++ = hex_digits[data[i] >> 4];
+                        *out++ = hex_digits[data[i] & 0xf];
+                } else {
+                        // last line padding
+                        *out++ = ' ';
+                        *out++ = ' ';
+                }
+                *out++ = ' ';
+        }
+
+        *out++ = ' ';
+        *out++ = '|';
+        for (size_t i = 0; i < HEXDUMP_BYTES_PER_LINE; i++) {
+                if (i >= size) {
+                        *out++ = ' ';
+                } else if (data[i] >= 0x20 && data[i] < 0x7f) {
+                        *out++ = data[i];
+                } else {
+                        *out++ = '.';
+                }
+        }
+        *out++ = '|';
+        *out++ = '\n';
+
+        return out;
+}
+
+void log_hexdump(const char *header, const unsigned char *buffer,
+                size_t buffer_size)
+{
+        char output[HEXDUMP_OUTPUT_SIZE];
+        size_t output_size = 0;
+
+        int header_length = snprintf(output, sizeof(output) - HEXDUMP_LINE_SIZE,
+                        "%s\n", header);
+        if (header_length < 0) {
+                header_length = 0;
+        } else if ((size_t) header_length >= sizeof(output) - HEXDUMP_LINE_SIZE) {
+                header_length = sizeof(output) - HEXDUMP_LINE_SIZE - 1;
+        }
+        output_size = header_length;
+
+        for (size_t i = 0; i < buffer_size; i += HEXDUMP_BYTES_PER_LINE) {
+                if (output_size + HEXDUMP_LINE_SIZE > sizeof(output)) {
+                        write_all(output, output_size);
+                        output_size = 0;
+                }
+
+                size_t line_size = buffer_size - i;
+                if (line_size > HEXDUMP_BYTES_PER_LINE) {
+                        line_size = HEXDUMP_BYTES_PER_LINE;
+                }
+                char *end = format_hexdump_line(output + output_size, i,
+                                buffer + i, line_size);
+                output_size = end - output;
+        }
+
+        write_all(output, output_size);
+}
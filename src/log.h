@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Leveled logging to standard error.
+ *
+ * Messages below the level set with set_log_level() are skipped at run
+ * time. Messages below LOG_MIN_LEVEL are removed at compile time, together
+ * with the code that prepares them - for example, "make LOG_MIN_LEVEL=INFO"
+ * builds a program without hexdumps of every packet.
+ */
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int current_log_level;
+
+void set_log_level(int level);
+// Accepts "debug", "info", "warning" and "error". Returns -1 for other names.
+int log_level_from_string(const char *name);
+
+#define log_enabled(level) \
+        ((level) >= LOG_MIN_LEVEL && (level) >= current_log_level)
+
+// Writes the message with a single write() call. Messages longer than
+// LOG_MESSAGE_MAX_SIZE are truncated.
+#define LOG_MESSAGE_MAX_SIZE 1024
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#define log_message(level, ...)                                         \
+        do {                                                            \
+                if (log_enabled(level)) {                               \
+                        log_write(__VA_ARGS__);                         \
+                }                                                       \
+        } while (0)
+
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Writes the header line followed by a hexdump of the buffer, 8 bytes per
+// line. Short buffers (such as packets from weather stations) are written
+// with a single write() call.
+void log_hexdump(const char *header, const unsigned char *buffer,
+                size_t buffer_size);
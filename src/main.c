@@ -20,16 +20,22 @@
 
 #include "main.h"
 #include "emax_em3371.h"
-#include "output_json.h"
-#include "output_csv.h"
-#include "output_raw_sql.h"
+#include "event_loop.h"
+#include "history.h"
+#include "station_registry.h"
+#include "udp_batch.h"
+#include "scratch_arena.h"
+#include "alloc_counter.h"
+#include "log.h"
+#include "capture.h"
+#include "replay.h"
+#include "latency.h"
+#include "metrics.h"
+#include "sink.h"
+#include "output_history.h"
 
-#ifdef HAVE_MYSQL
-# include "output_mysql.h"
-#endif
-
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -44,28 +50,25 @@
 #include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 
 
 volatile bool stop_execution = false;
 volatile int stop_execution_signal = 0;
+// Set on SIGUSR1
+static volatile bool dump_stats_requested = false;
+// Set on SIGHUP
+static volatile bool reload_requested = false;
 
-// Returned value must be disposed of by free()
-static char *packet_source_to_string(const struct sockaddr_in *packet_source)
+static void packet_source_to_string(const struct sockaddr_in *packet_source,
+                char *packet_source_string, const size_t packet_source_string_size)
 {
-        const size_t packet_source_string_size = 50;
-	char *packet_source_string = malloc(packet_source_string_size);
-        if (packet_source_string == NULL) {
-                return NULL;
-        }
-
-	int ret = 0;
-
 	if (packet_source->sin_family != AF_INET) {
-		ret = snprintf(packet_source_string,
-                               packet_source_string_size,
-                               "(weird src_addr family %ld)",
-                               (long int) packet_source->sin_family);
+		snprintf(packet_source_string,
+                         packet_source_string_size,
+                         "(weird src_addr family %ld)",
+                         (long int) packet_source->sin_family);
 	} else {
                 char source_ip[INET_ADDRSTRLEN];
 
@@ -76,25 +79,17 @@ static char *packet_source_to_string(const struct sockaddr_in *packet_source)
 
                 if (inet_ret == NULL) {
                         perror("Cannot convert source IP address to string");
-                        goto err;
+                        snprintf(packet_source_string, packet_source_string_size,
+                                        "(unknown)");
+                        return;
                 }
 
 		uint16_t source_port = ntohs(packet_source->sin_port);
 
-		ret = snprintf(packet_source_string,
-                               packet_source_string_size,
-                               "%s:%d", source_ip, (int) source_port);
+		snprintf(packet_source_string,
+                         packet_source_string_size,
+                         "%s:%d", source_ip, (int) source_port);
 	}
-
-	if (ret == -1) {
-                goto err;
-        }
-
-	return packet_source_string;
-
-err:
-        free(packet_source_string);
-        return NULL;
 }
 
 static void initialize_TZ_env()
@@ -187,52 +182,22 @@ void current_time_to_string(char *time_out, const size_t buffer_size,
 }
 
 
-static void hexdump_buffer(FILE *stream, const unsigned char *buffer,
-                size_t buffer_size, const int bytes_per_line)
-{
-	// TODO: make the function more readable
-	// TODO: replace fprintf with something faster, like sprintf
-	for (size_t i = 0; i < buffer_size; i+=bytes_per_line) {
-		fprintf(stream, "%08x  ", (unsigned int) i);
-
-		for (size_t j = i; j < i + bytes_per_line && j < buffer_size; j++) {
-			fprintf(stream, "%02x ", (unsigned int) buffer[j]);
-		}
-		// last line padding
-		for (size_t j = buffer_size; j < i + bytes_per_line; j++) {
-			fputs("   ", stream);
-		}
-
-		fprintf(stream, " |");
-		for (size_t j = i; j < i+bytes_per_line && j < buffer_size; j++) {
-			if (isprint(buffer[j])) {
-				fputc(buffer[j], stream);
-			} else {
-				fputc('.', stream);
-			}
-		}
-		// last line padding
-		for (size_t j = buffer_size; j < i+bytes_per_line; j++) {
-			fputs(" ", stream);
-		}
-		fprintf(stream, "|\n");
-	}
-}
-
-void dump_packet(FILE *stream, const struct sockaddr_in *packet_source,
+void dump_packet(const struct sockaddr_in *packet_source,
         const unsigned char *received_packet, const size_t received_packet_size,
         bool is_incoming)
 {
-	char *packet_source_text = packet_source_to_string(packet_source);
+	char packet_source_text[50];
+	packet_source_to_string(packet_source, packet_source_text,
+                        sizeof(packet_source_text));
 	char current_time[30];
 	current_time_to_string(current_time, sizeof(current_time), true);
 
-	fprintf(stream, "%s %s %s :\n", current_time,
+	char header[128];
+	snprintf(header, sizeof(header), "%s %s %s :", current_time,
                         is_incoming ? "received a packet from" : "sending a packet to",
                         packet_source_text);
 
-	hexdump_buffer(stream, received_packet, received_packet_size, 8);
-	free(packet_source_text);
+	log_hexdump(header, received_packet, received_packet_size);
 }
 
 
@@ -254,6 +219,7 @@ int send_udp_packet(int udp_socket, const struct sockaddr_in *destination,
 		}
 		return -1;
 	}
+	capture_outgoing_packet(destination, payload, payload_size);
 	return 0;
 }
 
@@ -290,66 +256,22 @@ void close_output_file(FILE **output_stream, bool *output_close_on_exit) {
         }
 }
 
-static void init_logging(const struct program_options *options)
-{
-        fprintf(stderr, "Warning: output formats are subject to change\n");
-        if (options->csv_output_path) {
-                bool ret = init_CSV_output(options->csv_output_path);
-                if (ret == false) {
-                        exit(2);
-                }
-        }
-
-        if (options->raw_sql_output_path) {
-                bool ret = init_sql_output(options->raw_sql_output_path);
-                if (ret == false) {
-                        exit(2);
-                }
-        }
-
-#ifdef HAVE_MYSQL
-        if (options->mysql_server != NULL) {
-                bool ret = init_mysql_output(options);
-                if (ret == false) {
-                        exit(2);
-                }
-        }
-#endif
-}
-
-static void shutdown_logging()
+static void on_interrupt(int signum)
 {
-        shutdown_sql_output();
-        shutdown_CSV_output();
-
-#ifdef HAVE_MYSQL
-        shutdown_mysql_output();
-#endif
+        stop_execution = true;
+        stop_execution_signal = signum;
 }
 
-void handle_decoded_sensor_state(const struct device_sensor_state *sensor_state,
-                const struct program_options *options)
+static void on_dump_stats_signal(int signum)
 {
-        display_sensor_state_json(stderr, sensor_state);
-        if (options->csv_output_path) {
-                display_sensor_state_CSV(sensor_state);
-        }
-        if (options->raw_sql_output_path) {
-                display_sensor_state_sql(sensor_state);
-        }
-        update_status_file(options->status_file_path, sensor_state);
-
-#ifdef HAVE_MYSQL
-        if (options->mysql_server != NULL) {
-                store_sensor_state_mysql(sensor_state);
-        }
-#endif
+        (void) signum;
+        dump_stats_requested = true;
 }
 
-static void on_interrupt(int signum)
+static void on_reload_signal(int signum)
 {
-        stop_execution = true;
-        stop_execution_signal = signum;
+        (void) signum;
+        reload_requested = true;
 }
 
 static void init_signals()
@@ -370,8 +292,13 @@ static void init_signals()
         }
 
         INSTALL_SIGNAL(SIGTERM)
-        INSTALL_SIGNAL(SIGHUP)
         INSTALL_SIGNAL(SIGINT)
+
+        signal_action.sa_handler = on_dump_stats_signal;
+        INSTALL_SIGNAL(SIGUSR1)
+
+        signal_action.sa_handler = on_reload_signal;
+        INSTALL_SIGNAL(SIGHUP)
 }
 
 
@@ -409,6 +336,38 @@ fprintf(stream, "%s: A program to capture data from some\n"
         "\t\tsave the data in a SQL file for piping into a MySQL/MariaDB client\n"
         "\t\tprogram. Use '-' for standard output\n"
         "\n"
+        "\t--csv-flush=policy\n"
+        "\t--raw-sql-flush=policy\n"
+        "\t\tWhen to write buffered measurements to the CSV or SQL file, to avoid\n"
+        "\t\tmany small writes to flash memory. policy is a comma-separated list\n"
+        "\t\tof: records=count (after count measurements), interval=ms (when the\n"
+        "\t\toldest one waits ms milliseconds), bytes=size[k|M] (when a buffer of\n"
+        "\t\tsize bytes, e.g. the erase block size, is full; not for standard\n"
+        "\t\toutput) and sync=ms (also call fdatasync() at most every ms\n"
+        "\t\tmilliseconds). By default records=1. Everything is written out when\n"
+        "\t\tthe program terminates, e.g. on SIGTERM.\n"
+        "\n"
+        "\t--csv-rotate=policy\n"
+        "\t--raw-sql-rotate=policy\n"
+        "\t\tStart a new CSV or SQL file, renaming the old one to e.g.\n"
+        "\t\tlog.csv.20210301-000000, when it reaches size=size[k|M] or\n"
+        "\t\tevery period=hourly|daily. With compress=gzip, the files are\n"
+        "\t\tcompressed while they are written (name them e.g. log.csv.gz).\n"
+        "\t\tpolicy is a comma-separated list of these settings.\n"
+        "\n"
+        "\t--history-output=history.bin\n"
+        "\t\tkeep the history of measurements in a compact binary file, read it\n"
+        "\t\twith em3371-history. Use '-' for standard output\n"
+        "\n"
+        "\t--history-block=count\n"
+        "\t\tnumber of measurements of a station compressed together, at most\n"
+        "\t\t%d. Larger blocks compress better. By default %d.\n"
+        "\n"
+        "\t--history-max-age=seconds\n"
+        "\t\twrite a block when its oldest measurement is this old, 0 to write\n"
+        "\t\tonly full blocks. Unwritten measurements are lost if the program\n"
+        "\t\tcrashes. By default %d.\n"
+        "\n"
         "\t--mysql-server\n"
         "\t\tconnect to a MySQL/MariaDB server and send data into it.\n"
         "\t\tDatabase schema is in output_sql_db_schema.sql.\n"
@@ -422,19 +381,154 @@ fprintf(stream, "%s: A program to capture data from some\n"
         "\t\tinto a buffer of size_in_kb size. When the db server becomes available\n"
         "\t\tagain, the program will upload data in the buffer.\n"
         "\n"
+        "\t--max-stations=count\n"
+        "\t\tMaximum number of weather stations (identified by their MAC\n"
+        "\t\taddresses) that may send data to this program. By default %d.\n"
+        "\n"
+        "\t--receive-batch=count\n"
+        "\t\tReceive up to count packets with a single system call and send\n"
+        "\t\treplies to ping packets in batches. Useful when many weather stations\n"
+        "\t\tsend data to this program. By default %d (disabled).\n"
+        "\n"
+        "\t--mysql-async\n"
+        "\t\tStore data in the MySQL/MariaDB database using non-blocking\n"
+        "\t\tcalls, so that a slow database server does not delay handling\n"
+        "\t\tof packets. Measurements wait in the buffer (see above, by default\n"
+        "\t\t%d kB) until they are stored.\n"
+        "\n"
+        "\t--mysql-buffer-file=path\n"
+        "\t\tKeep the buffer (see above, by default %d kB) in a memory-mapped\n"
+        "\t\tfile, so that measurements not stored yet survive a restart. They\n"
+        "\t\tare loaded again on startup. The file may be on flash (e.g. /jffs)\n"
+        "\t\tor on tmpfs.\n"
+        "\n"
+        "\t--mysql-buffer-sync=seconds\n"
+        "\t\tWrite changes of the buffer file to disk at most every seconds,\n"
+        "\t\tto limit wear of flash memory. 0 writes after every change.\n"
+        "\t\tBy default %d.\n"
+        "\n"
+        "\t--mysql-drain-batch=count\n"
+        "\t\tWhen the MySQL/MariaDB server becomes available again, upload up to\n"
+        "\t\tcount buffered measurements in a single transaction, using multi-row\n"
+        "\t\tINSERT statements. 1 stores every measurement separately.\n"
+        "\t\tBy default %d.\n"
+        "\n"
+        "\t--mysql-drain-budget=ms\n"
+        "\t\tUpload the buffer in slices of about ms milliseconds, handling\n"
+        "\t\tincoming packets in between. 0 uploads one batch per slice.\n"
+        "\t\tBy default %d.\n"
+        "\n"
+        "\t--mysql-prepared\n"
+        "\t\tStore data using prepared statements and the binary protocol\n"
+        "\t\tinstead of SQL text. Not used with --mysql-async.\n"
+        "\n"
+        "\t--mysql-multi-statement\n"
+        "\t\tSend all statements for a measurement to the MySQL/MariaDB server\n"
+        "\t\tat once, in a single round trip. Useful when the database server\n"
+        "\t\tis far away. Not used with --mysql-async, cannot be used with\n"
+        "\t\t--mysql-prepared.\n"
+        "\n"
         "\t-t,--set-time\n"
         "\t\tSet the weather station time from current clock and timezone.\n"
         "\n"
+        "\t--log-level=level\n"
+        "\t\tWhich messages to print on standard error: debug (all messages,\n"
+        "\t\tincluding hexdumps of packets), info (also the measurements\n"
+        "\t\treceived), warning or error. By default debug. On slow devices,\n"
+        "\t\tuse warning to save CPU time.\n"
+        "\n"
+        "\t--output-threads=csv,raw_sql,status_file|all\n"
+        "\t\tWrite to the listed outputs from separate threads, so that a slow\n"
+        "\t\tdisk does not delay replies to weather stations or other outputs.\n"
+        "\t\tMeasurements wait for every thread in a queue.\n"
+        "\n"
+        "\t--output-queue-size=count\n"
+        "\t\tMaximum number of measurements waiting for an output thread.\n"
+        "\t\tBy default %d.\n"
+        "\n"
+        "\t--output-queue-policy=drop-oldest|drop-newest|block\n"
+        "\t\tWhen the queue of an output thread is full, discard the oldest\n"
+        "\t\tmeasurement in it (the default), the new one, or wait.\n"
+        "\n"
+        "\t--metrics-port=port\n"
+        "\t\tServe metrics for Prometheus on http://address:port/metrics, where\n"
+        "\t\taddress is the one given with --bind-address: the last measurements\n"
+        "\t\tof every weather station, numbers of packets received, answered and\n"
+        "\t\tinvalid, errors of outputs and the state of the MySQL buffer.\n"
+        "\n"
+        "\t--capture=file.pcapng\n"
+        "\t\tAppend all received and sent packets to a pcapng file, which can be\n"
+        "\t\topened e.g. in Wireshark or replayed with --replay.\n"
+        "\n"
+        "\t--replay=file.pcapng\n"
+        "\t\tDo not listen on the network, handle packets sent to this program\n"
+        "\t\tfrom a pcapng file instead (saved with --capture or e.g. by tcpdump)\n"
+        "\t\tand exit. Measurements are saved to all configured outputs, with\n"
+        "\t\tarrival times from the file. Nothing is sent to weather stations.\n"
+        "\n"
+        "\t--replay-pace=fast|original\n"
+        "\t\tReplay packets as fast as possible (the default) or with the\n"
+        "\t\tintervals between them from the file.\n"
+        "\n"
         "\t--inject\n"
         "\t\tExperimental: send raw data to the device as specified on standard\n"
         "\t\tinput. Only for debugging\n"
         "\n"
+        "\t--config=file\n"
+        "\t\tRead options from a file, one long option per line without the\n"
+        "\t\tleading dashes, e.g. csv-output=/jffs/log.csv. Lines starting with\n"
+        "\t\t# are ignored. Options given on the command line take precedence.\n"
+        "\n"
         "\t--help\n"
         "\t\tThis message\n"
-        , argv0, DEFAULT_BIND_PORT);
+        "\n"
+        "Signals:\n"
+        "\tSIGUSR1\n"
+        "\t\tPrint statistics of the latency of handling packets, from their\n"
+        "\t\tarrival until they are stored, on standard error.\n"
+        "\n"
+        "\tSIGHUP\n"
+        "\t\tReopen output files (e.g. after logrotate) and read the --config\n"
+        "\t\tfile again. Outputs and their settings, MySQL/MariaDB connection\n"
+        "\t\tparameters and the log level are changed without a restart; the\n"
+        "\t\tMySQL buffer is kept. Other options cannot be changed this way.\n"
+        , argv0, DEFAULT_BIND_PORT, HISTORY_MAX_BLOCK_RECORDS,
+        DEFAULT_HISTORY_BLOCK_RECORDS, DEFAULT_HISTORY_MAX_AGE_S, DEFAULT_MAX_STATIONS,
+        DEFAULT_RECEIVE_BATCH_SIZE, MYSQL_ASYNC_DEFAULT_BUFFER_SIZE / 1024,
+        MYSQL_ASYNC_DEFAULT_BUFFER_SIZE / 1024, DEFAULT_MYSQL_BUFFER_SYNC_INTERVAL_S,
+        DEFAULT_MYSQL_DRAIN_BATCH_SIZE, DEFAULT_MYSQL_DRAIN_TIME_BUDGET_MS,
+        DEFAULT_OUTPUT_QUEUE_SIZE);
 }
 
-static void parse_program_options(const int argc, char **argv,
+// Options without a short equivalent
+enum long_only_options {
+        OPTION_MYSQL_ASYNC = 256,
+        OPTION_MYSQL_PREPARED,
+        OPTION_MYSQL_DRAIN_BATCH,
+        OPTION_MYSQL_DRAIN_BUDGET,
+        OPTION_MYSQL_BUFFER_FILE,
+        OPTION_MYSQL_BUFFER_SYNC,
+        OPTION_MYSQL_MULTI_STATEMENT,
+        OPTION_LOG_LEVEL,
+        OPTION_CAPTURE,
+        OPTION_REPLAY,
+        OPTION_REPLAY_PACE,
+        OPTION_METRICS_PORT,
+        OPTION_OUTPUT_THREADS,
+        OPTION_OUTPUT_QUEUE_SIZE,
+        OPTION_OUTPUT_QUEUE_POLICY,
+        OPTION_CSV_FLUSH,
+        OPTION_RAW_SQL_FLUSH,
+        OPTION_CSV_ROTATE,
+        OPTION_RAW_SQL_ROTATE,
+        OPTION_CONFIG,
+        OPTION_HISTORY_OUTPUT,
+        OPTION_HISTORY_BLOCK,
+        OPTION_HISTORY_MAX_AGE,
+};
+
+// Prints a message and returns false on errors
+static bool parse_program_options(const int argc, char **argv,
                 struct program_options *options)
 {
         int ret;
@@ -446,18 +540,44 @@ static void parse_program_options(const int argc, char **argv,
                 { "status-file",  required_argument, NULL, 's' },
                 { "csv-output",   required_argument, NULL, 'c' },
                 { "raw-sql-output",required_argument, NULL, 'b' },
+                { "csv-flush",    required_argument, NULL, OPTION_CSV_FLUSH },
+                { "raw-sql-flush", required_argument, NULL, OPTION_RAW_SQL_FLUSH },
+                { "csv-rotate",   required_argument, NULL, OPTION_CSV_ROTATE },
+                { "raw-sql-rotate", required_argument, NULL, OPTION_RAW_SQL_ROTATE },
+                { "history-output", required_argument, NULL, OPTION_HISTORY_OUTPUT },
+                { "history-block", required_argument, NULL, OPTION_HISTORY_BLOCK },
+                { "history-max-age", required_argument, NULL, OPTION_HISTORY_MAX_AGE },
                 { "mysql-server", required_argument, NULL, 'x' },
                 { "mysql-user",   required_argument, NULL, 'y' },
                 { "mysql-password", required_argument, NULL, 'z' },
                 { "mysql-database", required_argument, NULL, 'v' },
                 { "mysql-buffer-size", required_argument, NULL, 'u' },
+                { "mysql-async",  no_argument,       NULL, OPTION_MYSQL_ASYNC },
+                { "mysql-prepared", no_argument,     NULL, OPTION_MYSQL_PREPARED },
+                { "mysql-drain-batch", required_argument, NULL, OPTION_MYSQL_DRAIN_BATCH },
+                { "mysql-drain-budget", required_argument, NULL, OPTION_MYSQL_DRAIN_BUDGET },
+                { "mysql-buffer-file", required_argument, NULL, OPTION_MYSQL_BUFFER_FILE },
+                { "mysql-buffer-sync", required_argument, NULL, OPTION_MYSQL_BUFFER_SYNC },
+                { "mysql-multi-statement", no_argument, NULL, OPTION_MYSQL_MULTI_STATEMENT },
+                { "max-stations", required_argument, NULL, 'm' },
+                { "receive-batch", required_argument, NULL, 'n' },
                 { "set-time",     no_argument,       NULL, 't' },
                 { "inject",       no_argument,       NULL, 'i' },
+                { "log-level",    required_argument, NULL, OPTION_LOG_LEVEL },
+                { "capture",      required_argument, NULL, OPTION_CAPTURE },
+                { "replay",       required_argument, NULL, OPTION_REPLAY },
+                { "replay-pace",  required_argument, NULL, OPTION_REPLAY_PACE },
+                { "metrics-port", required_argument, NULL, OPTION_METRICS_PORT },
+                { "output-threads", required_argument, NULL, OPTION_OUTPUT_THREADS },
+                { "output-queue-size", required_argument, NULL, OPTION_OUTPUT_QUEUE_SIZE },
+                { "output-queue-policy", required_argument, NULL, OPTION_OUTPUT_QUEUE_POLICY },
+                { "config",       required_argument, NULL, OPTION_CONFIG },
                 { "help",         no_argument,       NULL, 'h' },
                 {0, 0, 0, 0}
         };
 
         // Set defaults
+        options->config_path = NULL;
         inet_pton(AF_INET, "0.0.0.0", &(options->bind_address));
         options->bind_port = DEFAULT_BIND_PORT;
 
@@ -465,8 +585,25 @@ static void parse_program_options(const int argc, char **argv,
         options->status_file_path = NULL;
         options->csv_output_path = NULL;
         options->raw_sql_output_path = NULL;
+        options->csv_flush_policy = (struct flush_policy) DEFAULT_FLUSH_POLICY;
+        options->raw_sql_flush_policy = (struct flush_policy) DEFAULT_FLUSH_POLICY;
+        memset(&options->csv_rotation, 0, sizeof(options->csv_rotation));
+        memset(&options->raw_sql_rotation, 0, sizeof(options->raw_sql_rotation));
+        options->history_output_path = NULL;
+        options->history_block_records = DEFAULT_HISTORY_BLOCK_RECORDS;
+        options->history_max_age_s = DEFAULT_HISTORY_MAX_AGE_S;
         options->allow_injecting_packets = false;
         options->set_weather_station_time = false;
+        options->max_stations = DEFAULT_MAX_STATIONS;
+        options->receive_batch_size = DEFAULT_RECEIVE_BATCH_SIZE;
+        options->log_level = LOG_LEVEL_DEBUG;
+        options->capture_path = NULL;
+        options->replay_path = NULL;
+        options->replay_original_pace = false;
+        options->metrics_port = 0;
+        options->output_threads = NULL;
+        options->output_queue_size = DEFAULT_OUTPUT_QUEUE_SIZE;
+        options->output_queue_policy = SINK_QUEUE_DROP_OLDEST;
 
 #ifdef HAVE_MYSQL
         options->mysql_server = NULL;
@@ -474,8 +611,18 @@ static void parse_program_options(const int argc, char **argv,
         options->mysql_password = NULL;
         options->mysql_database = NULL;
         options->mysql_buffer_size = 0;
+        options->mysql_async = false;
+        options->mysql_prepared = false;
+        options->mysql_multi_statements = false;
+        options->mysql_drain_batch_size = DEFAULT_MYSQL_DRAIN_BATCH_SIZE;
+        options->mysql_drain_time_budget_ms = DEFAULT_MYSQL_DRAIN_TIME_BUDGET_MS;
+        options->mysql_buffer_file = NULL;
+        options->mysql_buffer_sync_interval_s = DEFAULT_MYSQL_BUFFER_SYNC_INTERVAL_S;
 #endif
 
+        // The options may be parsed several times, see read_program_options()
+        optind = 1;
+
         // The following is vaguely based on the example code in
         // https://www.gnu.org/software/libc/manual/html_node/Getopt-Long-Option-Example.html
         while (true) {
@@ -493,7 +640,7 @@ static void parse_program_options(const int argc, char **argv,
                         if (inet_pton(AF_INET, optarg, &(options->bind_address)) == 0) {
                                 fputs("Incorrect bind address specified on command line!\n",
                                                 stderr);
-                                exit(1);
+                                return false;
                         }
                         break;
 
@@ -503,12 +650,12 @@ static void parse_program_options(const int argc, char **argv,
                         if (*endptr != 0) {
                                 fputs("Incorrect listen port specified on command line!\n",
                                                 stderr);
-                                exit(1);
+                                return false;
                         }
                         if (port_number > 65535 || port_number <= 0 ) {
                                 fputs("Listen port passed on command line out of range!\n",
                                                 stderr);
-                                exit(1);
+                                return false;
                         }
                         options->bind_port = port_number;
                         break;
@@ -540,6 +687,55 @@ static void parse_program_options(const int argc, char **argv,
                 case 'b':
                         options->raw_sql_output_path = optarg;
                         break;
+                case OPTION_CSV_FLUSH:
+                        if (!parse_flush_policy(optarg, &options->csv_flush_policy,
+                                                "--csv-flush")) {
+                                return false;
+                        }
+                        break;
+                case OPTION_RAW_SQL_FLUSH:
+                        if (!parse_flush_policy(optarg, &options->raw_sql_flush_policy,
+                                                "--raw-sql-flush")) {
+                                return false;
+                        }
+                        break;
+                case OPTION_CSV_ROTATE:
+                        if (!parse_rotation_policy(optarg, &options->csv_rotation,
+                                                "--csv-rotate")) {
+                                return false;
+                        }
+                        break;
+                case OPTION_RAW_SQL_ROTATE:
+                        if (!parse_rotation_policy(optarg, &options->raw_sql_rotation,
+                                                "--raw-sql-rotate")) {
+                                return false;
+                        }
+                        break;
+                case OPTION_HISTORY_OUTPUT:
+                        options->history_output_path = optarg;
+                        break;
+                case OPTION_HISTORY_BLOCK:
+                        endptr = NULL;
+                        long block_records = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || block_records <= 0
+                                        || block_records > HISTORY_MAX_BLOCK_RECORDS) {
+                                fprintf(stderr, "Incorrect history block size specified "
+                                        "on command line! It must be between 1 and %d.\n",
+                                        HISTORY_MAX_BLOCK_RECORDS);
+                                return false;
+                        }
+                        options->history_block_records = block_records;
+                        break;
+                case OPTION_HISTORY_MAX_AGE:
+                        endptr = NULL;
+                        long max_age = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || max_age < 0 || max_age > INT_MAX / 1000) {
+                                fputs("Incorrect maximum age of history blocks specified "
+                                        "on command line!\n", stderr);
+                                return false;
+                        }
+                        options->history_max_age_s = max_age;
+                        break;
 
                 case 's':
                         options->status_file_path = optarg;
@@ -549,6 +745,97 @@ static void parse_program_options(const int argc, char **argv,
                         options->set_weather_station_time = true;
                         break;
 
+                case 'm':
+                        endptr = NULL;
+                        long max_stations = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || max_stations <= 0) {
+                                fputs("Incorrect maximum number of weather stations "
+                                        "specified on command line!\n", stderr);
+                                return false;
+                        }
+                        options->max_stations = max_stations;
+                        break;
+
+                case 'n':
+                        endptr = NULL;
+                        long batch_size = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || batch_size <= 0
+                                        || batch_size > MAX_RECEIVE_BATCH_SIZE) {
+                                fprintf(stderr, "Incorrect receive batch size specified "
+                                        "on command line! It must be between 1 and %d.\n",
+                                        MAX_RECEIVE_BATCH_SIZE);
+                                return false;
+                        }
+                        options->receive_batch_size = batch_size;
+                        break;
+
+                case OPTION_LOG_LEVEL:
+                        options->log_level = log_level_from_string(optarg);
+                        if (options->log_level == -1) {
+                                fputs("Incorrect log level specified on command line! "
+                                        "Use debug, info, warning or error.\n", stderr);
+                                return false;
+                        }
+                        break;
+
+                case OPTION_METRICS_PORT:
+                        endptr = NULL;
+                        port_number = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || port_number > 65535 || port_number <= 0) {
+                                fputs("Incorrect metrics port specified on command line!\n",
+                                                stderr);
+                                return false;
+                        }
+                        options->metrics_port = port_number;
+                        break;
+
+                case OPTION_OUTPUT_THREADS:
+                        options->output_threads = optarg;
+                        break;
+                case OPTION_OUTPUT_QUEUE_SIZE:
+                        endptr = NULL;
+                        long queue_size = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || queue_size <= 0
+                                        || queue_size > MAX_OUTPUT_QUEUE_SIZE) {
+                                fprintf(stderr, "Incorrect output queue size specified "
+                                        "on command line! It must be between 1 and %d.\n",
+                                        MAX_OUTPUT_QUEUE_SIZE);
+                                return false;
+                        }
+                        options->output_queue_size = queue_size;
+                        break;
+                case OPTION_OUTPUT_QUEUE_POLICY:
+                        options->output_queue_policy = sink_queue_policy_from_string(optarg);
+                        if (options->output_queue_policy == -1) {
+                                fputs("Incorrect output queue policy specified on command "
+                                        "line! Use drop-oldest, drop-newest or block.\n",
+                                        stderr);
+                                return false;
+                        }
+                        break;
+
+                case OPTION_CONFIG:
+                        options->config_path = optarg;
+                        break;
+
+                case OPTION_CAPTURE:
+                        options->capture_path = optarg;
+                        break;
+                case OPTION_REPLAY:
+                        options->replay_path = optarg;
+                        break;
+                case OPTION_REPLAY_PACE:
+                        if (strcmp(optarg, "fast") == 0) {
+                                options->replay_original_pace = false;
+                        } else if (strcmp(optarg, "original") == 0) {
+                                options->replay_original_pace = true;
+                        } else {
+                                fputs("Incorrect replay pace specified on command line! "
+                                        "Use fast or original.\n", stderr);
+                                return false;
+                        }
+                        break;
+
 #ifdef HAVE_MYSQL
                 case 'x':
                         options->mysql_server = optarg;
@@ -568,17 +855,61 @@ static void parse_program_options(const int argc, char **argv,
                         if (*endptr != 0) {
                                 fputs("Incorrect MySQL buffer size specified on command line!\n",
                                                 stderr);
-                                exit(1);
+                                return false;
                         }
 
                         if (buffer_size < 0) {
                                 fputs("MySQL buffer size must be positive!\n",
                                                 stderr);
-                                exit(1);
+                                return false;
                         }
 
                         options->mysql_buffer_size = buffer_size * 1024;
 
+                        break;
+                case OPTION_MYSQL_ASYNC:
+                        options->mysql_async = true;
+                        break;
+                case OPTION_MYSQL_PREPARED:
+                        options->mysql_prepared = true;
+                        break;
+                case OPTION_MYSQL_MULTI_STATEMENT:
+                        options->mysql_multi_statements = true;
+                        break;
+                case OPTION_MYSQL_DRAIN_BATCH:
+                        endptr = NULL;
+                        long drain_batch_size = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || drain_batch_size <= 0
+                                        || drain_batch_size > MAX_MYSQL_DRAIN_BATCH_SIZE) {
+                                fprintf(stderr, "Incorrect MySQL drain batch size specified "
+                                        "on command line! It must be between 1 and %d.\n",
+                                        MAX_MYSQL_DRAIN_BATCH_SIZE);
+                                return false;
+                        }
+                        options->mysql_drain_batch_size = drain_batch_size;
+                        break;
+                case OPTION_MYSQL_DRAIN_BUDGET:
+                        endptr = NULL;
+                        long drain_budget = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || drain_budget < 0 || drain_budget > 60 * 1000) {
+                                fputs("Incorrect MySQL drain time budget specified "
+                                        "on command line!\n", stderr);
+                                return false;
+                        }
+                        options->mysql_drain_time_budget_ms = drain_budget;
+                        break;
+                case OPTION_MYSQL_BUFFER_FILE:
+                        options->mysql_buffer_file = optarg;
+                        break;
+                case OPTION_MYSQL_BUFFER_SYNC:
+                        endptr = NULL;
+                        long sync_interval = strtol(optarg, &endptr, 10);
+                        if (*endptr != 0 || sync_interval < 0 || sync_interval > 24 * 3600) {
+                                fputs("Incorrect MySQL buffer sync interval specified "
+                                        "on command line!\n", stderr);
+                                return false;
+                        }
+                        options->mysql_buffer_sync_interval_s = sync_interval;
                         break;
 #else
                 case 'x':
@@ -586,30 +917,34 @@ static void parse_program_options(const int argc, char **argv,
                 case 'z':
                 case 'v':
                 case 'u':
+                case OPTION_MYSQL_ASYNC:
+                case OPTION_MYSQL_PREPARED:
+                case OPTION_MYSQL_DRAIN_BATCH:
+                case OPTION_MYSQL_DRAIN_BUDGET:
+                case OPTION_MYSQL_BUFFER_FILE:
+                case OPTION_MYSQL_BUFFER_SYNC:
+                case OPTION_MYSQL_MULTI_STATEMENT:
                         fputs("MySQL / MariaDB support not compiled in!\n", stderr);
-                        exit(1);
-                        break;
+                        return false;
 #endif
 
                 case 'h':
                         print_help(stderr, argv[0]);
-                        exit(1);
-                        break;
+                        return false;
                 case 'i':
                         options->allow_injecting_packets = true;
                         break;
                 case '?':
-                        exit(1);
-                        break;
+                        return false;
                 default:
                         fputs("Incorrect command line parameters!\n", stderr);
-                        exit(1);
+                        return false;
                 }
         }
 
         if (optind < argc) {
                 fputs("Incorrect command line parameters!\n", stderr);
-                exit(1);
+                return false;
         }
 
 #ifdef HAVE_MYSQL
@@ -617,7 +952,8 @@ static void parse_program_options(const int argc, char **argv,
                 || options->mysql_user != NULL
                 || options->mysql_password != NULL
                 || options->mysql_database != NULL
-                || options->mysql_buffer_size != 0) {
+                || options->mysql_buffer_size != 0
+                || options->mysql_buffer_file != NULL) {
 
                 if (options->mysql_server == NULL) {
                         options->mysql_server = "localhost";
@@ -626,33 +962,308 @@ static void parse_program_options(const int argc, char **argv,
                 if (options->mysql_user == NULL) {
                         fputs("Incorrect command line parameters: "
                                 "No MySQL / MariaDB user name provided!\n", stderr);
-                        exit(1);
+                        return false;
                 }
 
                 if (options->mysql_database == NULL) {
                         fputs("Incorrect command line parameters: "
                                 "No MySQL / MariaDB database name provided!\n", stderr);
-                        exit(1);
+                        return false;
                 }
         }
+
+        if (options->mysql_prepared && options->mysql_multi_statements) {
+                fputs("Incorrect command line parameters: --mysql-prepared "
+                        "and --mysql-multi-statement cannot be used together!\n",
+                        stderr);
+                return false;
+        }
 #endif
 
         if (options->set_weather_station_time && !options->reply_to_ping_packets) {
                 fputs("--set-time and --no-reply command line options cannot "
                       "be used together\n", stderr);
-                exit(1);
+                return false;
+        }
+
+        if (options->replay_path != NULL) {
+                if (options->set_weather_station_time || options->allow_injecting_packets
+                                || options->capture_path != NULL) {
+                        fputs("--replay cannot be used together with --set-time, "
+                              "--inject or --capture\n", stderr);
+                        return false;
+                }
+                // There is nobody to reply to
+                options->reply_to_ping_packets = false;
         }
+        return true;
 }
 
-int main(int argc, char **argv)
+/*
+ * Arguments built from the configuration file: argv[0], the options from the
+ * file and then the original arguments, so that they take precedence. The
+ * options point into them, so they are kept as long as the options are used.
+ */
+struct config_arguments {
+        int argc;
+        char **argv;
+        // argv[1] to argv[line_count] are allocated
+        int line_count;
+};
+
+static void free_config_arguments(struct config_arguments *config)
 {
-        initialize_timezone();
+        if (config->argv == NULL) {
+                return;
+        }
+        for (int i = 1; i <= config->line_count; i++) {
+                free(config->argv[i]);
+        }
+        free(config->argv);
+        config->argv = NULL;
+}
 
-        struct program_options options;
-        parse_program_options(argc, argv, &options);
+static bool read_config_file(const char *path, const int argc, char **argv,
+                struct config_arguments *config)
+{
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+                char error_msg[1000];
+                snprintf(error_msg, sizeof(error_msg),
+                                "Cannot open configuration file '%s'", path);
+                perror(error_msg);
+                return false;
+        }
 
-	int ret = 0;
+        size_t capacity = argc + 16;
+        char **new_argv = malloc(capacity * sizeof(*new_argv));
+        if (new_argv == NULL) {
+                fputs("Cannot allocate memory for the configuration\n", stderr);
+                fclose(file);
+                return false;
+        }
+        int new_argc = 0;
+        new_argv[new_argc++] = argv[0];
+
+        char *line = NULL;
+        size_t line_capacity = 0;
+        ssize_t length;
+        bool ok = true;
+        while (ok && (length = getline(&line, &line_capacity, file)) != -1) {
+                while (length > 0 && strchr(" \t\r\n", line[length - 1]) != NULL) {
+                        line[--length] = '\0';
+                }
+                const char *option = line + strspn(line, " \t");
+                if (*option == '\0' || *option == '#') {
+                        continue;
+                }
+
+                // Room for the original arguments and the final NULL
+                if ((size_t) new_argc + argc >= capacity) {
+                        char **larger_argv = realloc(new_argv,
+                                        2 * capacity * sizeof(*new_argv));
+                        if (larger_argv == NULL) {
+                                ok = false;
+                                break;
+                        }
+                        new_argv = larger_argv;
+                        capacity *= 2;
+                }
+
+                char *argument = malloc(strlen(option) + 3);
+                if (argument == NULL) {
+                        ok = false;
+                        break;
+                }
+                sprintf(argument, "--%s", option);
+                new_argv[new_argc++] = argument;
+        }
+        free(line);
+
+        if (!ok) {
+                fputs("Cannot allocate memory for the configuration\n", stderr);
+        } else if (ferror(file)) {
+                fprintf(stderr, "Cannot read configuration file '%s'\n", path);
+                ok = false;
+        }
+        fclose(file);
+        config->argv = new_argv;
+        config->line_count = new_argc - 1;
+        if (!ok) {
+                free_config_arguments(config);
+                return false;
+        }
+
+        for (int i = 1; i < argc; i++) {
+                new_argv[new_argc++] = argv[i];
+        }
+        new_argv[new_argc] = NULL;
+        config->argc = new_argc;
+        return true;
+}
+
+// config->argv is NULL if there is no configuration file. Otherwise it must
+// be freed with free_config_arguments() when the options are not used any
+// more, also if false is returned.
+static bool read_program_options(const int argc, char **argv,
+                struct program_options *options, struct config_arguments *config)
+{
+        config->argv = NULL;
+        if (!parse_program_options(argc, argv, options)) {
+                return false;
+        }
+        if (options->config_path == NULL) {
+                return true;
+        }
+
+        if (!read_config_file(options->config_path, argc, argv, config)) {
+                return false;
+        }
+        return parse_program_options(config->argc, config->argv, options);
+}
+
+static bool strings_differ(const char *a, const char *b)
+{
+        if (a == NULL || b == NULL) {
+                return a != b;
+        }
+        return strcmp(a, b) != 0;
+}
+
+// The socket, the station registry and the MySQL buffer are kept on SIGHUP,
+// so options that configure them cannot change
+static void keep_fixed_options(const struct program_options *current,
+                struct program_options *new_options)
+{
+        bool changed = current->bind_address.s_addr != new_options->bind_address.s_addr
+                || current->bind_port != new_options->bind_port
+                || current->reply_to_ping_packets != new_options->reply_to_ping_packets
+                || current->allow_injecting_packets != new_options->allow_injecting_packets
+                || current->set_weather_station_time != new_options->set_weather_station_time
+                || current->max_stations != new_options->max_stations
+                || current->receive_batch_size != new_options->receive_batch_size
+                || current->metrics_port != new_options->metrics_port
+                || strings_differ(current->capture_path, new_options->capture_path)
+                || strings_differ(current->replay_path, new_options->replay_path)
+                || current->replay_original_pace != new_options->replay_original_pace;
+#ifdef HAVE_MYSQL
+        changed = changed
+                || current->mysql_buffer_size != new_options->mysql_buffer_size
+                || strings_differ(current->mysql_buffer_file, new_options->mysql_buffer_file)
+                || current->mysql_buffer_sync_interval_s
+                        != new_options->mysql_buffer_sync_interval_s;
+#endif
+
+        if (changed) {
+                fputs("Warning: --bind-address, --port, --no-reply, --inject, "
+                        "--set-time, --max-stations, --receive-batch, --metrics-port, "
+                        "--capture, --replay and --mysql-buffer-* options cannot be "
+                        "changed without a restart\n", stderr);
+        }
+
+        new_options->bind_address = current->bind_address;
+        new_options->bind_port = current->bind_port;
+        new_options->reply_to_ping_packets = current->reply_to_ping_packets;
+        new_options->allow_injecting_packets = current->allow_injecting_packets;
+        new_options->set_weather_station_time = current->set_weather_station_time;
+        new_options->max_stations = current->max_stations;
+        new_options->receive_batch_size = current->receive_batch_size;
+        new_options->metrics_port = current->metrics_port;
+        new_options->capture_path = current->capture_path;
+        new_options->replay_path = current->replay_path;
+        new_options->replay_original_pace = current->replay_original_pace;
+#ifdef HAVE_MYSQL
+        new_options->mysql_buffer_size = current->mysql_buffer_size;
+        new_options->mysql_buffer_file = current->mysql_buffer_file;
+        new_options->mysql_buffer_sync_interval_s = current->mysql_buffer_sync_interval_s;
+#endif
+}
+
+/*
+ * On SIGHUP. Runs between handling packets, so packets arriving meanwhile
+ * wait in the socket buffer. Output threads write everything queued before
+ * their outputs are reopened.
+ */
+static void reload_configuration(const int argc, char **argv,
+                struct program_options *options)
+{
+        // Of the previous reload. The options read on startup are never
+        // freed, the fixed ones (see keep_fixed_options()) still point there.
+        static struct config_arguments reloaded_config = { .argv = NULL };
+
+        struct program_options new_options;
+        struct config_arguments new_config;
+
+        fputs("Reloading configuration\n", stderr);
+        if (!read_program_options(argc, argv, &new_options, &new_config)
+                        || !check_sink_options(&new_options)) {
+                fputs("Configuration not reloaded, keeping the current one\n", stderr);
+                free_config_arguments(&new_config);
+                return;
+        }
+        keep_fixed_options(options, &new_options);
+
+        // Other modules keep pointers to the options
+        *options = new_options;
+        set_log_level(options->log_level);
+
+        if (!reload_sinks(options)) {
+                fputs("Warning: some outputs could not be reopened and are "
+                        "disabled\n", stderr);
+        }
+
+        // Nothing points into the previous arguments any more
+        free_config_arguments(&reloaded_config);
+        reloaded_config = new_config;
+}
+
+static void on_udp_socket_readable(int udp_socket, unsigned int events, void *data)
+{
+        const struct program_options *options = data;
+        struct received_udp_packet *packets;
+        (void) events;
+
+        int ret = receive_udp_batch(udp_socket, &packets);
+        if (ret == -1) {
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("Receiving packets failed");
+                }
+                // We continue anyway
+                return;
+        }
+
+#ifdef DEBUG_ALLOCATIONS
+        unsigned long allocation_count = get_allocation_count();
+#endif
 
+        uint64_t read_ns = latency_now_ns();
+        time_t packet_arrival_time = time(NULL);
+        for (int i = 0; i < ret; i++) {
+                if (packets[i].has_kernel_timestamp) {
+                        latency_record(LATENCY_RECEIVE, read_ns - packets[i].arrival_ns);
+                }
+                capture_incoming_packet(&packets[i].source,
+                                packets[i].data, packets[i].size);
+                process_incoming_packet(udp_socket, &packets[i].source,
+                                packets[i].data, packets[i].size,
+                                packet_arrival_time, packets[i].arrival_ns,
+                                options);
+                latency_record_since(LATENCY_HANDLED, packets[i].arrival_ns);
+        }
+        flush_udp_packets(udp_socket);
+
+#ifdef DEBUG_ALLOCATIONS
+        // Handling packets should only use the scratch arena
+        allocation_count = get_allocation_count() - allocation_count;
+        if (allocation_count != 0) {
+                fprintf(stderr, "Warning: handling %d packet(s) allocated memory %lu time(s)\n",
+                                ret, allocation_count);
+        }
+#endif
+}
+
+static int open_udp_socket(const struct program_options *options)
+{
         // TODO: set SOCK_CLOEXEC. Setting in in call to socket() does not
         // work on some DD-WRT routers.
 	int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -663,60 +1274,131 @@ int main(int argc, char **argv)
 
 	struct sockaddr_in bind_sockaddr = {
 		.sin_family = AF_INET,
-		.sin_port = htons(options.bind_port),
-		.sin_addr = options.bind_address,
+		.sin_port = htons(options->bind_port),
+		.sin_addr = options->bind_address,
 	};
 
-	ret = bind(udp_socket, (struct sockaddr *) &bind_sockaddr, sizeof(bind_sockaddr));
+	int ret = bind(udp_socket, (struct sockaddr *) &bind_sockaddr, sizeof(bind_sockaddr));
 	if (ret == -1) {
 		perror("Cannot bind socket");
 		exit(1);
 	}
 
-	unsigned char *received_packet = malloc(RECEIVE_PACKET_SIZE);
-	if (received_packet == NULL) {
-		perror("Cannot allocate memory");
+	// The socket is read only when the event loop reports that there is
+	// something to read. Being non-blocking, it also guards against
+	// spurious readiness notifications.
+	int socket_flags = fcntl(udp_socket, F_GETFL);
+	if (socket_flags == -1
+			|| fcntl(udp_socket, F_SETFL, socket_flags | O_NONBLOCK) == -1) {
+		perror("Cannot set socket to non-blocking mode");
 		exit(1);
 	}
 
-        init_device_logic(&options);
-        init_logging(&options);
-        init_signals();
+#ifdef SO_TIMESTAMPNS
+	// For latency statistics. Without it, packets are timestamped when read.
+	int enable_timestamps = 1;
+	if (setsockopt(udp_socket, SOL_SOCKET, SO_TIMESTAMPNS,
+				&enable_timestamps, sizeof(enable_timestamps)) != 0) {
+		perror("Warning: cannot enable receive timestamps");
+	}
+#endif
+
+	return udp_socket;
+}
+
+int main(int argc, char **argv)
+{
+        initialize_timezone();
+
+        struct program_options options;
+        // Kept until exit, the options point into it
+        struct config_arguments config;
+        if (!read_program_options(argc, argv, &options, &config)) {
+                exit(1);
+        }
+        set_log_level(options.log_level);
 
-	while (stop_execution == false) {
-		struct sockaddr_in src_addr;
-		socklen_t src_addr_size;
+	int ret = 0;
 
-		/* man socket:
-		 * SOCK_DGRAM  and  SOCK_RAW sockets allow sending of datagrams to
-		 * correspondents named in sendto(2) calls.  Datagrams are generally
-		 * received with recvfrom(2), which returns the next datagram along
-		 * with the address of its sender.
-		 */
+	// Replayed packets do not come from the network
+	int udp_socket = -1;
+	if (options.replay_path == NULL) {
+		udp_socket = open_udp_socket(&options);
+	}
 
-		src_addr_size = sizeof(src_addr);
-		ret = recvfrom(udp_socket, received_packet, RECEIVE_PACKET_SIZE, 0,
-                        (struct sockaddr *) &src_addr, &src_addr_size);
+	if (!init_udp_batch(options.receive_batch_size)) {
+		exit(1);
+	}
 
-		if (ret == -1) {
-                        if (errno != EINTR) {
-                                perror("recvfrom failed");
-                        }
-			// We continue anyway
-		} else {
-			process_incoming_packet(udp_socket, &src_addr,
-                                        received_packet, ret,
-                                        time(NULL),
-                                        &options);
+	if (!init_event_loop()) {
+		exit(1);
+	}
+
+	if (!init_scratch_arena(SCRATCH_ARENA_SIZE)) {
+		exit(1);
+	}
+
+	if (options.capture_path != NULL
+			&& !init_capture(options.capture_path, udp_socket)) {
+		exit(2);
+	}
+
+        init_device_logic(&options, udp_socket);
+        fprintf(stderr, "Warning: output formats are subject to change\n");
+        if (!init_sinks(&options)) {
+                exit(2);
+        }
+        if (!init_metrics(&options)) {
+                exit(1);
+        }
+        init_signals();
+
+	if (options.replay_path != NULL) {
+		if (!init_replay(&options)) {
+			exit(2);
 		}
+	} else if (!event_loop_add_fd(udp_socket, EVENT_READ,
+				on_udp_socket_readable, &options)) {
+		exit(1);
 	}
 
-        fprintf(stderr, "Received signal %d, terminating\n", stop_execution_signal);
+	while (stop_execution == false && !is_replay_finished()) {
+		event_loop_run_once();
 
-	free(received_packet);
-	close(udp_socket);
+		if (dump_stats_requested) {
+			dump_stats_requested = false;
+			dump_latency_stats(stderr);
+		}
+		if (reload_requested) {
+			reload_requested = false;
+			reload_configuration(argc, argv, &options);
+		}
+	}
 
-        shutdown_logging();
-	return 0;
+	if (stop_execution) {
+		fprintf(stderr, "Received signal %d, terminating\n", stop_execution_signal);
+	}
+	if (is_replay_finished()) {
+		dump_latency_stats(stderr);
+	}
+	if (replay_failed()) {
+		ret = 1;
+	}
+
+        shutdown_replay();
+        shutdown_metrics();
+        shutdown_sinks();
+        shutdown_device_logic();
+        shutdown_capture();
+        shutdown_event_loop();
+        shutdown_scratch_arena();
+
+	shutdown_udp_batch();
+	if (udp_socket != -1) {
+		close(udp_socket);
+	}
+        free_config_arguments(&config);
+
+	return ret;
 }
 
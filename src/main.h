@@ -20,6 +20,8 @@
 
 struct program_options;
 #include "emax_em3371.h"
+#include "log.h"
+#include "output_file.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -32,6 +34,10 @@ struct program_options;
 #define RECEIVE_PACKET_SIZE 1500
 
 struct program_options {
+        // Long options, one per line, see read_program_options() in main.c.
+        // Re-read on SIGHUP.
+        char *config_path;
+
         // in host byte order
 	struct in_addr bind_address;
         // in host byte order
@@ -44,6 +50,36 @@ struct program_options {
         char *csv_output_path;
         char *raw_sql_output_path;
         char *status_file_path;
+        // When buffered data is written to the files, see output_file.h
+        struct flush_policy csv_flush_policy;
+        struct flush_policy raw_sql_flush_policy;
+        struct rotation_policy csv_rotation;
+        struct rotation_policy raw_sql_rotation;
+
+        // Compressed local history, see output_history.h
+        char *history_output_path;
+        unsigned int history_block_records;
+        unsigned int history_max_age_s;
+
+        size_t max_stations;
+        unsigned int receive_batch_size;
+        // LOG_LEVEL_* from log.h
+        int log_level;
+
+        // Outputs with their own thread, see sink.h. A comma-separated list
+        // of names or "all", NULL if none.
+        char *output_threads;
+        unsigned int output_queue_size;
+        // SINK_QUEUE_* from sink.h
+        int output_queue_policy;
+
+        // HTTP server with Prometheus metrics, see metrics.h. 0 if disabled.
+        uint16_t metrics_port;
+
+        // pcapng files, see capture.h and replay.h
+        char *capture_path;
+        char *replay_path;
+        bool replay_original_pace;
 
 #ifdef HAVE_MYSQL
         char *mysql_server;
@@ -52,9 +88,25 @@ struct program_options {
         char *mysql_database;
 
         size_t mysql_buffer_size;
+        bool mysql_async;
+        bool mysql_prepared;
+        bool mysql_multi_statements;
+        unsigned int mysql_drain_batch_size;
+        unsigned int mysql_drain_time_budget_ms;
+        char *mysql_buffer_file;
+        unsigned int mysql_buffer_sync_interval_s;
 #endif
 };
 #define DEFAULT_BIND_PORT 17000
+// Used when --mysql-async or --mysql-buffer-file is given without
+// --mysql-buffer-size
+#define MYSQL_ASYNC_DEFAULT_BUFFER_SIZE (64 * 1024)
+// Number of buffered measurements uploaded in one transaction
+#define DEFAULT_MYSQL_DRAIN_BATCH_SIZE 100
+#define MAX_MYSQL_DRAIN_BATCH_SIZE 10000
+// Time spent uploading the buffer between handling incoming packets
+#define DEFAULT_MYSQL_DRAIN_TIME_BUDGET_MS 50
+#define DEFAULT_MYSQL_BUFFER_SYNC_INTERVAL_S 60
 
 void time_to_string(const time_t time_in, char *time_out,
                 const size_t buffer_size, bool use_localtime);
@@ -66,8 +118,13 @@ bool open_output_file(const char *output_path, FILE **output_stream,
 void close_output_file(FILE **output_stream, bool *output_close_on_exit);
 
 int send_udp_packet(int udp_socket, const struct sockaddr_in *packet_source, const unsigned char *received_packet, const size_t received_packet_size);
-void dump_packet(FILE *stream, const struct sockaddr_in *packet_source,
+void dump_packet(const struct sockaddr_in *packet_source,
         const unsigned char *received_packet, const size_t received_packet_size,
         bool is_incoming);
-void handle_decoded_sensor_state(const struct device_sensor_state *sensor_state,
-                const struct program_options *options);
+// Dumps the packet only if messages of the given level are printed, see log.h
+#define log_packet(level, ...)                                          \
+        do {                                                            \
+                if (log_enabled(level)) {                               \
+                        dump_packet(__VA_ARGS__);                       \
+                }                                                       \
+        } while (0)
@@ -0,0 +1,774 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Prometheus metrics, see metrics.h.
+ *
+ * The page is rendered into a buffer only when it is requested and something
+ * has changed since it was last rendered, so that frequent scrapes cost
+ * almost nothing. Stations change only when packets are received, which are
+ * counted, so the counters tell when the page is out of date.
+ *
+ * The HTTP server is minimal: it answers GET requests for /metrics (and /)
+ * and closes the connection after every response.
+ */
+
+#include "metrics.h"
+#include "main.h"
+#include "event_loop.h"
+#include "log.h"
+#include "sink.h"
+#include "station_registry.h"
+
+#ifdef HAVE_MYSQL
+# include "output_mysql.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+struct counter_description {
+        const char *name;
+        const char *help;
+};
+
+static const struct counter_description counter_descriptions[METRICS_COUNTER_COUNT] = {
+        [METRICS_PACKETS_RECEIVED] = { "em3371_packets_received_total",
+                "Packets received from weather stations" },
+        [METRICS_PACKETS_TOO_SHORT] = { "em3371_packets_too_short_total",
+                "Received packets too short to be handled" },
+        [METRICS_PACKETS_INVALID] = { "em3371_packets_invalid_total",
+                "Received packets with incorrect framing or checksum" },
+        [METRICS_PACKETS_REJECTED] = { "em3371_packets_rejected_total",
+                "Packets from new stations ignored because of --max-stations" },
+        [METRICS_PINGS_ANSWERED] = { "em3371_pings_answered_total",
+                "Ping packets sent back to weather stations" },
+};
+
+static unsigned long counters[METRICS_COUNTER_COUNT];
+static time_t start_time;
+
+static char *page = NULL;
+static size_t page_size = 0;
+static size_t page_capacity = 0;
+// Set from output threads too
+static bool page_stale = true;
+static bool page_incomplete = false;
+
+#ifdef HAVE_MYSQL
+// Its MySQL options may be changed on SIGHUP
+static const struct program_options *metrics_options = NULL;
+// The latest values, to notice changes
+static struct mysql_drain_stats page_drain_stats;
+#endif
+
+struct metrics_client {
+        int fd;
+        char request[METRICS_REQUEST_SIZE];
+        size_t request_size;
+
+        // The response: a header and a body, which is the page or an error
+        char header[256];
+        size_t header_size;
+        const char *body;
+        size_t body_size;
+        // Bytes of the header and the body already sent, 0 until the whole
+        // request has been received
+        size_t sent;
+        bool responding;
+
+        struct event_timer timeout_timer;
+};
+
+static int listen_socket = -1;
+static struct metrics_client clients[METRICS_MAX_CLIENTS];
+
+void metrics_count(enum metrics_counter counter)
+{
+        counters[counter]++;
+        metrics_changed();
+}
+
+void metrics_changed()
+{
+        __atomic_store_n(&page_stale, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Rendering the page
+ */
+
+static void page_printf(const char *format, ...)
+        __attribute__((format(printf, 1, 2)));
+
+static void page_printf(const char *format, ...)
+{
+        va_list args;
+
+        va_start(args, format);
+        int length = vsnprintf(page + page_size, page_capacity - page_size,
+                        format, args);
+        va_end(args);
+        if (length < 0) {
+                page_incomplete = true;
+                return;
+        }
+
+        if ((size_t) length >= page_capacity - page_size) {
+                size_t new_capacity = page_capacity * 2;
+                while ((size_t) length >= new_capacity - page_size) {
+                        new_capacity *= 2;
+                }
+                char *new_page = realloc(page, new_capacity);
+                if (new_page == NULL) {
+                        page_incomplete = true;
+                        return;
+                }
+                page = new_page;
+                page_capacity = new_capacity;
+
+                va_start(args, format);
+                vsnprintf(page + page_size, page_capacity - page_size, format, args);
+                va_end(args);
+        }
+        page_size += length;
+}
+
+static void render_family_header(const char *name, const char *type, const char *help)
+{
+        page_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void render_counters()
+{
+        for (int i = 0; i < METRICS_COUNTER_COUNT; i++) {
+                const struct counter_description *counter = &counter_descriptions[i];
+
+                render_family_header(counter->name, "counter", counter->help);
+                page_printf("%s %lu\n", counter->name, counters[i]);
+        }
+
+        render_family_header("em3371_stations", "gauge",
+                        "Weather stations that have sent a valid packet");
+        page_printf("em3371_stations %zu\n", get_station_count());
+
+        render_family_header("em3371_start_time_seconds", "gauge",
+                        "Start time of the program since the Unix epoch");
+        page_printf("em3371_start_time_seconds %lld\n", (long long) start_time);
+}
+
+static void render_sinks()
+{
+        struct sink_stats stats;
+
+        render_family_header("em3371_output_errors_total", "counter",
+                        "Measurements that could not be written to an output. "
+                        "For MySQL, these are put into the buffer instead.");
+        for (int i = 0; i < get_sink_count(); i++) {
+                get_sink_stats(i, &stats);
+                page_printf("em3371_output_errors_total{output=\"%s\"} %lu\n",
+                                stats.name, stats.errors);
+        }
+
+        render_family_header("em3371_output_dropped_total", "counter",
+                        "Measurements dropped because the queue of an output "
+                        "thread was full");
+        for (int i = 0; i < get_sink_count(); i++) {
+                get_sink_stats(i, &stats);
+                if (stats.threaded) {
+                        page_printf("em3371_output_dropped_total{output=\"%s\"} %lu\n",
+                                        stats.name, stats.dropped);
+                }
+        }
+}
+
+#ifdef HAVE_MYSQL
+static void render_mysql()
+{
+        if (metrics_options->mysql_server == NULL) {
+                return;
+        }
+
+        struct mysql_drain_stats *stats = &page_drain_stats;
+
+        render_family_header("em3371_mysql_buffer_entries", "gauge",
+                        "Measurements waiting in the MySQL buffer");
+        page_printf("em3371_mysql_buffer_entries %ld\n", stats->backlog);
+        render_family_header("em3371_mysql_draining", "gauge",
+                        "Whether the MySQL buffer is being uploaded");
+        page_printf("em3371_mysql_draining %d\n", stats->draining ? 1 : 0);
+        render_family_header("em3371_mysql_drain_rate_rows_per_second", "gauge",
+                        "Rows inserted per second during the current or last "
+                        "upload of the buffer");
+        page_printf("em3371_mysql_drain_rate_rows_per_second %.1f\n", stats->drain_rate);
+        render_family_header("em3371_mysql_buffered_states_uploaded_total", "counter",
+                        "Measurements uploaded from the MySQL buffer");
+        page_printf("em3371_mysql_buffered_states_uploaded_total %lu\n",
+                        stats->states_uploaded);
+        render_family_header("em3371_mysql_buffered_rows_inserted_total", "counter",
+                        "Rows inserted while uploading the MySQL buffer");
+        page_printf("em3371_mysql_buffered_rows_inserted_total %lu\n",
+                        stats->rows_inserted);
+}
+
+// The buffer is uploaded in the background, without packets being counted
+static void check_mysql_stats()
+{
+        if (metrics_options->mysql_server == NULL) {
+                return;
+        }
+
+        struct mysql_drain_stats stats;
+        get_mysql_drain_stats(&stats);
+        bool changed = stats.backlog != page_drain_stats.backlog
+                || stats.draining != page_drain_stats.draining
+                || stats.drain_rate != page_drain_stats.drain_rate
+                || stats.states_uploaded != page_drain_stats.states_uploaded
+                || stats.rows_inserted != page_drain_stats.rows_inserted;
+        if (changed) {
+                page_drain_stats = stats;
+                metrics_changed();
+        }
+}
+#endif
+
+/*
+ * Metrics of stations. Samples of a metric must be together, so every metric
+ * is a separate pass over all stations.
+ */
+
+// Formats the value, returns false if it is not known
+typedef bool (*station_value_formatter)(const struct station_state *station,
+                char *value, size_t value_size);
+typedef bool (*sensor_value_formatter)(const struct device_single_sensor_data *sensor,
+                char *value, size_t value_size);
+
+static bool format_packets_received(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        snprintf(value, value_size, "%lu", station->packets_received);
+        return true;
+}
+
+static bool format_ping_packets_received(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        snprintf(value, value_size, "%lu", station->ping_packets_received);
+        return true;
+}
+
+static bool format_sensor_packets_received(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        snprintf(value, value_size, "%lu", station->sensor_packets_received);
+        return true;
+}
+
+static bool format_last_packet_time(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        snprintf(value, value_size, "%lld", (long long) station->last_packet_time);
+        return true;
+}
+
+static bool format_report_interval(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        if (station->report_interval == 0) {
+                return false;
+        }
+        snprintf(value, value_size, "%lld", (long long) station->report_interval);
+        return true;
+}
+
+static bool format_atmospheric_pressure(const struct station_state *station,
+                char *value, size_t value_size)
+{
+        if (!station->has_last_sensor_state
+                        || station->last_sensor_state.atmospheric_pressure
+                                == DEVICE_INCORRECT_PRESSURE) {
+                return false;
+        }
+        snprintf(value, value_size, "%u",
+                        (unsigned int) station->last_sensor_state.atmospheric_pressure);
+        return true;
+}
+
+static bool format_temperature(const struct device_single_sensor_data *sensor,
+                char *value, size_t value_size)
+{
+        if (DEVICE_IS_INCORRECT_TEMPERATURE(sensor->current.temperature)) {
+                return false;
+        }
+        temperature_to_string(sensor->current.temperature, value, value_size);
+        return true;
+}
+
+static bool format_humidity(const struct device_single_sensor_data *sensor,
+                char *value, size_t value_size)
+{
+        if (sensor->current.humidity == DEVICE_INCORRECT_HUMIDITY) {
+                return false;
+        }
+        snprintf(value, value_size, "%d", (int) sensor->current.humidity);
+        return true;
+}
+
+static bool format_dew_point(const struct device_single_sensor_data *sensor,
+                char *value, size_t value_size)
+{
+        if (DEVICE_IS_INCORRECT_TEMPERATURE(sensor->current.dew_point)) {
+                return false;
+        }
+        temperature_to_string(sensor->current.dew_point, value, value_size);
+        return true;
+}
+
+static bool format_battery_low(const struct device_single_sensor_data *sensor,
+                char *value, size_t value_size)
+{
+        snprintf(value, value_size, "%d", sensor->battery_low ? 1 : 0);
+        return true;
+}
+
+static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        station_value_formatter format;
+} station_metrics[] = {
+        { "em3371_station_packets_received_total", "counter",
+                "Valid packets received from the station",
+                format_packets_received },
+        { "em3371_station_ping_packets_received_total", "counter",
+                "Ping packets received from the station",
+                format_ping_packets_received },
+        { "em3371_station_sensor_packets_received_total", "counter",
+                "Packets with measurements received from the station",
+                format_sensor_packets_received },
+        { "em3371_station_last_packet_timestamp_seconds", "gauge",
+                "Arrival time of the last packet since the Unix epoch",
+                format_last_packet_time },
+        { "em3371_station_report_interval_seconds", "gauge",
+                "Time between the last two packets with measurements",
+                format_report_interval },
+        { "em3371_atmospheric_pressure_hpa", "gauge",
+                "Atmospheric pressure", format_atmospheric_pressure },
+};
+
+// Sensor 0 is the one in the station itself, as in the database
+static const struct {
+        const char *name;
+        const char *help;
+        sensor_value_formatter format;
+} sensor_metrics[] = {
+        { "em3371_temperature_celsius", "Temperature", format_temperature },
+        { "em3371_humidity_percent", "Relative humidity", format_humidity },
+        { "em3371_dew_point_celsius", "Dew point", format_dew_point },
+        { "em3371_battery_low", "Whether the battery of the sensor is low",
+                format_battery_low },
+};
+
+#define STATION_METRIC_COUNT (sizeof(station_metrics) / sizeof(station_metrics[0]))
+#define SENSOR_METRIC_COUNT (sizeof(sensor_metrics) / sizeof(sensor_metrics[0]))
+
+
+static void render_stations()
+{
+        char mac[STATION_MAC_STRING_SIZE];
+        char value[32];
+
+        for (size_t i = 0; i < STATION_METRIC_COUNT; i++) {
+                render_family_header(station_metrics[i].name, station_metrics[i].type,
+                                station_metrics[i].help);
+
+                for (struct station_state *station = get_next_station(NULL);
+                                station != NULL; station = get_next_station(station)) {
+                        if (!station_metrics[i].format(station, value, sizeof(value))) {
+                                continue;
+                        }
+                        station_mac_to_string(station->mac, mac, sizeof(mac));
+                        page_printf("%s{station=\"%s\"} %s\n",
+                                        station_metrics[i].name, mac, value);
+                }
+        }
+
+        for (size_t i = 0; i < SENSOR_METRIC_COUNT; i++) {
+                render_family_header(sensor_metrics[i].name, "gauge",
+                                sensor_metrics[i].help);
+
+                for (struct station_state *station = get_next_station(NULL);
+                                station != NULL; station = get_next_station(station)) {
+                        if (!station->has_last_sensor_state) {
+                                continue;
+                        }
+                        station_mac_to_string(station->mac, mac, sizeof(mac));
+
+                        const struct device_sensor_state *state = &station->last_sensor_state;
+                        for (int sensor_id = 0; sensor_id <= 3; sensor_id++) {
+                                const struct device_single_sensor_data *sensor =
+                                        sensor_id == 0 ? &state->station_sensor
+                                                : &state->remote_sensors[sensor_id - 1];
+
+                                if (!sensor->any_data_present
+                                                || !sensor_metrics[i].format(sensor,
+                                                        value, sizeof(value))) {
+                                        continue;
+                                }
+                                page_printf("%s{station=\"%s\",sensor=\"%d\"} %s\n",
+                                                sensor_metrics[i].name, mac,
+                                                sensor_id, value);
+                        }
+                }
+        }
+}
+
+static bool is_page_being_sent()
+{
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+                if (clients[i].fd != -1 && clients[i].responding
+                                && clients[i].body == page) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+// Returns false if there was not enough memory
+static bool update_page()
+{
+#ifdef HAVE_MYSQL
+        check_mysql_stats();
+#endif
+
+        // A client still reading the page gets the previous version, which
+        // is not overwritten. The others get it too.
+        if (is_page_being_sent()
+                        || !__atomic_exchange_n(&page_stale, false, __ATOMIC_RELAXED)) {
+                return !page_incomplete;
+        }
+
+        page_size = 0;
+        page_incomplete = false;
+
+        render_counters();
+        render_sinks();
+#ifdef HAVE_MYSQL
+        render_mysql();
+#endif
+        render_stations();
+
+        if (page_incomplete) {
+                // Try again on the next request
+                metrics_changed();
+                log_error("Cannot allocate memory for the metrics page\n");
+                return false;
+        }
+        return true;
+}
+
+/*
+ * The HTTP server
+ */
+
+static void close_client(struct metrics_client *client)
+{
+        event_timer_cancel(&client->timeout_timer);
+        event_loop_remove_fd(client->fd);
+        close(client->fd);
+        client->fd = -1;
+}
+
+static void on_client_timeout(void *data)
+{
+        close_client(data);
+}
+
+static void set_response(struct metrics_client *client, const char *status,
+                const char *body, size_t body_size)
+{
+        int header_size = snprintf(client->header, sizeof(client->header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n"
+                        "\r\n", status, body_size);
+
+        client->header_size = header_size;
+        client->body = body;
+        client->body_size = body_size;
+        client->sent = 0;
+        client->responding = true;
+}
+
+static void handle_request(struct metrics_client *client)
+{
+        static const char not_found[] = "Not found, try /metrics\n";
+        static const char bad_request[] = "Bad request\n";
+        static const char not_allowed[] = "Only GET requests are supported\n";
+        static const char no_memory[] = "Cannot allocate memory\n";
+
+        char *line_end = strpbrk(client->request, "\r\n");
+        if (line_end == NULL) {
+                set_response(client, "400 Bad Request", bad_request,
+                                sizeof(bad_request) - 1);
+                return;
+        }
+        *line_end = '\0';
+
+        // "GET /metrics HTTP/1.1"
+        char *path = strchr(client->request, ' ');
+        if (path == NULL) {
+                set_response(client, "400 Bad Request", bad_request,
+                                sizeof(bad_request) - 1);
+                return;
+        }
+        *path++ = '\0';
+        char *path_end = strpbrk(path, " ?");
+        if (path_end != NULL) {
+                *path_end = '\0';
+        }
+
+        if (strcmp(client->request, "GET") != 0) {
+                set_response(client, "405 Method Not Allowed", not_allowed,
+                                sizeof(not_allowed) - 1);
+        } else if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+                set_response(client, "404 Not Found", not_found, sizeof(not_found) - 1);
+        } else if (!update_page()) {
+                set_response(client, "500 Internal Server Error", no_memory,
+                                sizeof(no_memory) - 1);
+        } else {
+                set_response(client, "200 OK", page, page_size);
+        }
+}
+
+// Returns false if the client should be disconnected
+static bool send_response(struct metrics_client *client)
+{
+        while (client->sent < client->header_size + client->body_size) {
+                const char *data;
+                size_t size;
+
+                if (client->sent < client->header_size) {
+                        data = client->header + client->sent;
+                        size = client->header_size - client->sent;
+                } else {
+                        data = client->body + (client->sent - client->header_size);
+                        size = client->body_size - (client->sent - client->header_size);
+                }
+
+                // MSG_NOSIGNAL: a client that has gone away must not kill us
+                // with SIGPIPE
+                ssize_t ret = send(client->fd, data, size, MSG_NOSIGNAL);
+                if (ret == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return event_loop_modify_fd(client->fd, EVENT_WRITE);
+                        }
+                        return false;
+                }
+                client->sent += ret;
+        }
+        // Done
+        return false;
+}
+
+static bool receive_request(struct metrics_client *client)
+{
+        ssize_t ret = recv(client->fd, client->request + client->request_size,
+                        sizeof(client->request) - 1 - client->request_size, 0);
+        if (ret == -1) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        if (ret == 0) {
+                return false;
+        }
+        client->request_size += ret;
+        client->request[client->request_size] = '\0';
+
+        if (strstr(client->request, "\r\n\r\n") != NULL
+                        || strstr(client->request, "\n\n") != NULL
+                        || client->request_size == sizeof(client->request) - 1) {
+                // Too long requests get a "400 Bad Request" if the first line
+                // is not complete, otherwise the rest is not needed
+                handle_request(client);
+                return send_response(client);
+        }
+        return true;
+}
+
+static void on_client_event(int fd, unsigned int events, void *data)
+{
+        struct metrics_client *client = data;
+        (void) fd;
+        (void) events;
+
+        bool keep;
+        if (client->responding) {
+                keep = send_response(client);
+        } else {
+                keep = receive_request(client);
+        }
+
+        if (!keep) {
+                close_client(client);
+        }
+}
+
+static void accept_client()
+{
+        int fd = accept(listen_socket, NULL, NULL);
+        if (fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        log_warning("Cannot accept a connection to the metrics "
+                                        "server: %s\n", strerror(errno));
+                }
+                return;
+        }
+
+        struct metrics_client *client = NULL;
+        for (int i = 0; i < METRICS_MAX_CLIENTS && client == NULL; i++) {
+                if (clients[i].fd == -1) {
+                        client = &clients[i];
+                }
+        }
+
+        int flags = fcntl(fd, F_GETFL);
+        if (client == NULL || flags == -1
+                        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+                close(fd);
+                return;
+        }
+
+        client->fd = fd;
+        client->request_size = 0;
+        client->request[0] = '\0';
+        client->responding = false;
+
+        if (!event_loop_add_fd(fd, EVENT_READ, on_client_event, client)) {
+                close(fd);
+                client->fd = -1;
+                return;
+        }
+        event_timer_schedule(&client->timeout_timer, METRICS_CLIENT_TIMEOUT_MS);
+}
+
+static void on_listen_socket_readable(int fd, unsigned int events, void *data)
+{
+        (void) fd;
+        (void) events;
+        (void) data;
+
+        accept_client();
+}
+
+static bool open_listen_socket(const struct program_options *options)
+{
+        listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_socket == -1) {
+                perror("Cannot create the metrics server socket");
+                return false;
+        }
+
+        // Allows restarting the program while old connections linger
+        int reuse_address = 1;
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
+                        &reuse_address, sizeof(reuse_address));
+
+        struct sockaddr_in bind_sockaddr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(options->metrics_port),
+                .sin_addr = options->bind_address,
+        };
+
+        int flags;
+        if (bind(listen_socket, (struct sockaddr *) &bind_sockaddr,
+                                sizeof(bind_sockaddr)) != 0
+                        || listen(listen_socket, METRICS_MAX_CLIENTS) != 0
+                        || (flags = fcntl(listen_socket, F_GETFL)) == -1
+                        || fcntl(listen_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+                perror("Cannot open the metrics server socket");
+                close(listen_socket);
+                listen_socket = -1;
+                return false;
+        }
+
+        if (!event_loop_add_fd(listen_socket, EVENT_READ,
+                                on_listen_socket_readable, NULL)) {
+                close(listen_socket);
+                listen_socket = -1;
+                return false;
+        }
+        return true;
+}
+
+bool init_metrics(const struct program_options *options)
+{
+        start_time = time(NULL);
+        metrics_changed();
+
+#ifdef HAVE_MYSQL
+        metrics_options = options;
+#endif
+
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+                clients[i].fd = -1;
+                event_timer_init(&clients[i].timeout_timer, on_client_timeout,
+                                &clients[i]);
+        }
+
+        if (options->metrics_port == 0) {
+                return true;
+        }
+
+        page_capacity = 4096;
+        page = malloc(page_capacity);
+        if (page == NULL) {
+                perror("Cannot allocate memory for the metrics page");
+                return false;
+        }
+
+        return open_listen_socket(options);
+}
+
+void shutdown_metrics()
+{
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+                if (clients[i].fd != -1) {
+                        close_client(&clients[i]);
+                }
+        }
+
+        if (listen_socket != -1) {
+                event_loop_remove_fd(listen_socket);
+                close(listen_socket);
+                listen_socket = -1;
+        }
+
+        free(page);
+        page = NULL;
+        page_size = 0;
+        page_capacity = 0;
+}
@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Metrics in the Prometheus text exposition format: the last measurements
+ * of every weather station and counters of this program, served over HTTP
+ * on --metrics-port.
+ *
+ * The counters are always kept, they cost an increment each. Errors of
+ * outputs are counted in sink.c.
+ */
+
+#include <stdbool.h>
+
+struct program_options;
+
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_REQUEST_SIZE 1024
+// Clients that do not send a request or read the response in this time are
+// disconnected
+#define METRICS_CLIENT_TIMEOUT_MS (10 * 1000)
+
+enum metrics_counter {
+        // All packets read from the socket or replayed
+        METRICS_PACKETS_RECEIVED,
+        METRICS_PACKETS_TOO_SHORT,
+        // Rejected by is_packet_correct(): incorrect framing or checksum
+        METRICS_PACKETS_INVALID,
+        // From a new station when --max-stations has been reached
+        METRICS_PACKETS_REJECTED,
+        METRICS_PINGS_ANSWERED,
+
+        METRICS_COUNTER_COUNT
+};
+
+// Starts the HTTP server if options->metrics_port is not 0
+bool init_metrics(const struct program_options *options);
+void shutdown_metrics();
+
+void metrics_count(enum metrics_counter counter);
+// For other statistics shown on the page, e.g. of outputs (see sink.h).
+// May be called from any thread.
+void metrics_changed();
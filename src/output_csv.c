@@ -17,10 +17,12 @@
  */
 
 #include "output_csv.h"
+#include "main.h"
+#include "output_file.h"
+#include "station_registry.h"
 #include <string.h>
 
-static FILE *csv_output_stream = NULL;
-static bool csv_output_stream_close_on_exit = false;
+static struct output_file csv_output;
 
 static void display_CSV_header(FILE *stream)
 {
@@ -29,32 +31,33 @@ static void display_CSV_header(FILE *stream)
                 "sensor1_temp;sensor1_humidity;sensor1_dew_point;"
                 "sensor2_temp;sensor2_humidity;sensor2_dew_point;"
                 "sensor3_temp;sensor3_humidity;sensor3_dew_point;"
+                "station_mac;"
                 "\n", stream);
         fflush(stream);
 }
 
-bool init_CSV_output(const char *csv_output_path)
+bool init_CSV_output(const char *csv_output_path, const struct flush_policy *policy,
+                const struct rotation_policy *rotation)
 {
-        bool ret = open_output_file(csv_output_path, &csv_output_stream,
-                        &csv_output_stream_close_on_exit, "CSV");
-
-        if (ret) {
-                display_CSV_header(csv_output_stream);
-        }
-        return ret;
+        // Every rotated file gets the header as well
+        return open_buffered_output_file(&csv_output, csv_output_path,
+                        policy, rotation, display_CSV_header, "CSV");
 }
 
 void shutdown_CSV_output()
 {
-        close_output_file(&csv_output_stream, &csv_output_stream_close_on_exit);
+        close_buffered_output_file(&csv_output);
 }
 
 static void display_single_measurement_CSV(FILE *stream, const struct device_single_measurement *state)
 {
+        char temperature[TEMPERATURE_STRING_SIZE];
+
         if (DEVICE_IS_INCORRECT_TEMPERATURE(state->temperature)) {
                 fprintf(stream, ";");
         } else {
-		fprintf(stream, "%.2f;", (double) state->temperature);
+                temperature_to_string(state->temperature, temperature, sizeof(temperature));
+		fprintf(stream, "%s;", temperature);
         }
 
         if (state->humidity == DEVICE_INCORRECT_HUMIDITY) {
@@ -66,13 +69,15 @@ static void display_single_measurement_CSV(FILE *stream, const struct device_sin
         if (DEVICE_IS_INCORRECT_TEMPERATURE(state->dew_point)) {
                 fprintf(stream, ";");
         } else {
-		fprintf(stream, "%.2f;", (double) state->dew_point);
+                temperature_to_string(state->dew_point, temperature, sizeof(temperature));
+		fprintf(stream, "%s;", temperature);
         }
 }
 
-void display_sensor_state_CSV(const struct device_sensor_state *state)
+bool display_sensor_state_CSV(const struct device_sensor_state *state)
 {
-        FILE *stream = csv_output_stream;
+        rotate_output_file_if_needed(&csv_output);
+        FILE *stream = csv_output.stream;
 
 	char packet_arrival_time_str[30];
 	time_to_string(state->packet_arrival_time,
@@ -86,13 +91,47 @@ void display_sensor_state_CSV(const struct device_sensor_state *state)
                 display_single_measurement_CSV(stream, &(state->remote_sensors[i].current));
         }
 
-        fprintf(stream, "\n");
+        char station_mac_str[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(state->station_mac,
+                        station_mac_str, sizeof(station_mac_str));
+        output_file_written(&csv_output);
+        return fprintf(stream, "%s;\n", station_mac_str) > 0;
+}
 
+bool flush_CSV_output()
+{
         // When redirecting CSV output to file, there was quite a long delay
         // (even several minutes or more) before the data was actually written
         // to file and accessible.
         //
-        // Using fflush manually fixes this.
-        // (fflush() does not have undesirable side-effects of fsync())
-        fflush(stream);
+        // Flushing manually fixes this, how often is set with --csv-flush.
+        return flush_output_file(&csv_output, false);
+}
+
+static long get_CSV_flush_timeout_ms()
+{
+        return get_output_file_flush_timeout_ms(&csv_output);
+}
+
+static bool is_CSV_output_enabled(const struct program_options *options)
+{
+        return options->csv_output_path != NULL;
 }
+
+static bool init_CSV_sink(const struct program_options *options)
+{
+        return init_CSV_output(options->csv_output_path, &options->csv_flush_policy,
+                        &options->csv_rotation);
+}
+
+const struct sink csv_sink = {
+        .name = "csv",
+        .is_enabled = is_CSV_output_enabled,
+        .init = init_CSV_sink,
+        .submit = display_sensor_state_CSV,
+        .flush = flush_CSV_output,
+        .get_flush_timeout_ms = get_CSV_flush_timeout_ms,
+        .shutdown = shutdown_CSV_output,
+        .threadable = true,
+        .latency_stage = LATENCY_OUTPUT_CSV,
+};
@@ -19,8 +19,16 @@
 #pragma once
 
 #include "emax_em3371.h"
+#include "output_file.h"
+#include "sink.h"
 #include <stdio.h>
 
-bool init_CSV_output(const char *csv_output_path);
+extern const struct sink csv_sink;
+
+bool init_CSV_output(const char *csv_output_path, const struct flush_policy *policy,
+                const struct rotation_policy *rotation);
 void shutdown_CSV_output();
-void display_sensor_state_CSV(const struct device_sensor_state *state);
+// Returns false if writing failed. The data is written out by flush_CSV_output(),
+// according to the flush policy.
+bool display_sensor_state_CSV(const struct device_sensor_state *state);
+bool flush_CSV_output();
@@ -0,0 +1,601 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// fopencookie()
+#define _GNU_SOURCE
+
+#include "output_file.h"
+#include "event_loop.h"
+#include "log.h"
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+struct output_segment {
+        int fd;
+#ifdef HAVE_ZLIB
+        gzFile gz;
+#endif
+        // Of the file on disk
+        uint64_t size;
+};
+
+// Returns false if the value is not a number between 0 and max_value.
+// With allow_size_suffix, "k" and "M" multiply it by 1024 and 1024 * 1024.
+static bool parse_policy_value(const char *text, size_t length,
+                unsigned long max_value, bool allow_size_suffix,
+                unsigned long *value)
+{
+        char number[32];
+        if (length == 0 || length >= sizeof(number)) {
+                return false;
+        }
+        memcpy(number, text, length);
+        number[length] = '\0';
+
+        char *endptr = NULL;
+        errno = 0;
+        unsigned long result = strtoul(number, &endptr, 10);
+        if (endptr == number || number[0] == '-' || errno != 0) {
+                return false;
+        }
+
+        if (allow_size_suffix && strcmp(endptr, "k") == 0) {
+                endptr++;
+                result = result <= max_value / 1024 ? result * 1024 : max_value + 1;
+        } else if (allow_size_suffix && strcmp(endptr, "M") == 0) {
+                endptr++;
+                result = result <= max_value / (1024 * 1024)
+                        ? result * 1024 * 1024 : max_value + 1;
+        }
+
+        if (*endptr != '\0' || result > max_value) {
+                return false;
+        }
+        *value = result;
+        return true;
+}
+
+bool parse_flush_policy(const char *text, struct flush_policy *policy,
+                const char *option_name)
+{
+        memset(policy, 0, sizeof(*policy));
+
+        while (*text != '\0') {
+                size_t length = strcspn(text, ",");
+                const char *equals = memchr(text, '=', length);
+                if (equals == NULL) {
+                        fprintf(stderr, "Incorrect %s: expected name=value "
+                                        "instead of '%.*s'\n",
+                                        option_name, (int) length, text);
+                        return false;
+                }
+
+                size_t name_length = equals - text;
+                const char *value_text = equals + 1;
+                size_t value_length = length - name_length - 1;
+                unsigned long value = 0;
+                bool ok;
+
+                if (name_length == 7 && strncmp(text, "records", 7) == 0) {
+                        ok = parse_policy_value(value_text, value_length,
+                                        1000000, false, &value);
+                        policy->records = value;
+                } else if (name_length == 8 && strncmp(text, "interval", 8) == 0) {
+                        ok = parse_policy_value(value_text, value_length,
+                                        24 * 3600 * 1000, false, &value);
+                        policy->interval_ms = value;
+                } else if (name_length == 5 && strncmp(text, "bytes", 5) == 0) {
+                        ok = parse_policy_value(value_text, value_length,
+                                        MAX_FLUSH_BUFFER_SIZE, true, &value)
+                                && value > 0;
+                        policy->bytes = value;
+                } else if (name_length == 4 && strncmp(text, "sync", 4) == 0) {
+                        ok = parse_policy_value(value_text, value_length,
+                                        24 * 3600 * 1000, false, &value);
+                        policy->sync = true;
+                        policy->sync_interval_ms = value;
+                } else {
+                        fprintf(stderr, "Incorrect %s: unknown setting '%.*s', "
+                                        "use records, interval, bytes or sync\n",
+                                        option_name, (int) name_length, text);
+                        return false;
+                }
+
+                if (!ok) {
+                        fprintf(stderr, "Incorrect %s: wrong value in '%.*s'\n",
+                                        option_name, (int) length, text);
+                        return false;
+                }
+
+                text += length;
+                if (*text == ',') {
+                        text++;
+                }
+        }
+
+        if (policy->records == 0 && policy->interval_ms == 0 && policy->bytes == 0) {
+                fprintf(stderr, "Incorrect %s: give at least one of records, "
+                                "interval or bytes\n", option_name);
+                return false;
+        }
+        return true;
+}
+
+bool parse_rotation_policy(const char *text, struct rotation_policy *policy,
+                const char *option_name)
+{
+        memset(policy, 0, sizeof(*policy));
+
+        while (*text != '\0') {
+                size_t length = strcspn(text, ",");
+                const char *equals = memchr(text, '=', length);
+                if (equals == NULL) {
+                        fprintf(stderr, "Incorrect %s: expected name=value "
+                                        "instead of '%.*s'\n",
+                                        option_name, (int) length, text);
+                        return false;
+                }
+
+                size_t name_length = equals - text;
+                const char *value_text = equals + 1;
+                size_t value_length = length - name_length - 1;
+                unsigned long value = 0;
+                bool ok;
+
+                if (name_length == 4 && strncmp(text, "size", 4) == 0) {
+                        ok = parse_policy_value(value_text, value_length,
+                                        MAX_ROTATION_SIZE, true, &value)
+                                && value > 0;
+                        policy->size = value;
+                } else if (name_length == 6 && strncmp(text, "period", 6) == 0) {
+                        ok = true;
+                        if (value_length == 6 && strncmp(value_text, "hourly", 6) == 0) {
+                                policy->period = ROTATION_PERIOD_HOURLY;
+                        } else if (value_length == 5
+                                        && strncmp(value_text, "daily", 5) == 0) {
+                                policy->period = ROTATION_PERIOD_DAILY;
+                        } else {
+                                ok = false;
+                        }
+                } else if (name_length == 8 && strncmp(text, "compress", 8) == 0) {
+                        ok = value_length == 4 && strncmp(value_text, "gzip", 4) == 0;
+                        policy->gzip = true;
+#ifndef HAVE_ZLIB
+                        if (ok) {
+                                fprintf(stderr, "Incorrect %s: gzip support not "
+                                                "compiled in!\n", option_name);
+                                return false;
+                        }
+#endif
+                } else {
+                        fprintf(stderr, "Incorrect %s: unknown setting '%.*s', "
+                                        "use size, period or compress\n",
+                                        option_name, (int) name_length, text);
+                        return false;
+                }
+
+                if (!ok) {
+                        fprintf(stderr, "Incorrect %s: wrong value in '%.*s'\n",
+                                        option_name, (int) length, text);
+                        return false;
+                }
+
+                text += length;
+                if (*text == ',') {
+                        text++;
+                }
+        }
+        return true;
+}
+
+/*
+ * Files with rotation or compression are written through a stdio stream
+ * with our own write function, so that the outputs can use fprintf().
+ */
+
+static ssize_t write_to_segment(void *cookie, const char *data, size_t size)
+{
+        struct output_segment *segment = cookie;
+
+#ifdef HAVE_ZLIB
+        if (segment->gz != NULL) {
+                if (size == 0) {
+                        return 0;
+                }
+                int ret = gzwrite(segment->gz, data, size);
+                z_off_t offset = gzoffset(segment->gz);
+                if (offset >= 0) {
+                        segment->size = offset;
+                }
+                // stdio treats 0 as an error
+                return ret > 0 ? ret : 0;
+        }
+#endif
+
+        size_t written = 0;
+        while (written < size) {
+                ssize_t ret = write(segment->fd, data + written, size - written);
+                if (ret == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                written += ret;
+        }
+        segment->size += written;
+        return written;
+}
+
+static int close_segment(void *cookie)
+{
+        struct output_segment *segment = cookie;
+        int ret;
+
+#ifdef HAVE_ZLIB
+        if (segment->gz != NULL) {
+                // Also closes the file descriptor
+                ret = gzclose(segment->gz) == Z_OK ? 0 : EOF;
+                free(segment);
+                return ret;
+        }
+#endif
+        ret = close(segment->fd) == 0 ? 0 : EOF;
+        free(segment);
+        return ret;
+}
+
+static time_t get_next_rotation_time(int period, time_t now)
+{
+        if (period == ROTATION_PERIOD_NONE) {
+                return 0;
+        }
+
+        struct tm now_tm;
+        localtime_r(&now, &now_tm);
+        now_tm.tm_min = 0;
+        now_tm.tm_sec = 0;
+        if (period == ROTATION_PERIOD_HOURLY) {
+                now_tm.tm_hour++;
+        } else {
+                now_tm.tm_hour = 0;
+                now_tm.tm_mday++;
+        }
+        // Let mktime() decide about daylight saving time
+        now_tm.tm_isdst = -1;
+        return mktime(&now_tm);
+}
+
+// Opens file->path and sets file->stream, file->segment. The file may
+// already exist, new data is appended to it. The header is not written.
+static bool open_segment(struct output_file *file)
+{
+        struct output_segment *segment = calloc(1, sizeof(*segment));
+        if (segment == NULL) {
+                log_error("Cannot allocate memory for %s output\n", file->type_name);
+                return false;
+        }
+
+        segment->fd = open(file->path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+        if (segment->fd == -1) {
+                log_error("Cannot open '%s' for %s output: %s\n",
+                                file->path, file->type_name, strerror(errno));
+                free(segment);
+                return false;
+        }
+
+        struct stat file_stat;
+        if (fstat(segment->fd, &file_stat) == 0) {
+                segment->size = file_stat.st_size;
+        }
+
+#ifdef HAVE_ZLIB
+        if (file->rotation.gzip) {
+                // Starts a new gzip member at the end of the file
+                segment->gz = gzdopen(segment->fd, "ab");
+                if (segment->gz == NULL) {
+                        log_error("Cannot start compressing %s output\n",
+                                        file->type_name);
+                        close(segment->fd);
+                        free(segment);
+                        return false;
+                }
+        }
+#endif
+
+        cookie_io_functions_t functions = {
+                .write = write_to_segment,
+                .close = close_segment,
+        };
+        FILE *stream = fopencookie(segment, "a", functions);
+        if (stream == NULL) {
+                log_error("Cannot create a stream for %s output\n", file->type_name);
+                close_segment(segment);
+                return false;
+        }
+
+        if (file->buffer != NULL) {
+                setvbuf(stream, file->buffer, _IOFBF, file->policy.bytes);
+        }
+
+        file->stream = stream;
+        file->segment = segment;
+        file->segment_start_time = time(NULL);
+        file->next_rotation_time = get_next_rotation_time(file->rotation.period,
+                        file->segment_start_time);
+        return true;
+}
+
+static void write_file_header(struct output_file *file)
+{
+        if (file->write_header != NULL) {
+                file->write_header(file->stream);
+        }
+}
+
+// log.csv.20210301-000000 or log.csv.20210301-000000.gz for log.csv.gz,
+// with a number added if that file already exists
+static void get_rotated_path(const struct output_file *file,
+                char *rotated_path, size_t rotated_path_size)
+{
+        char start_time[20];
+        struct tm start_tm;
+        localtime_r(&file->segment_start_time, &start_tm);
+        strftime(start_time, sizeof(start_time), "%Y%m%d-%H%M%S", &start_tm);
+
+        size_t path_length = strlen(file->path);
+        const char *extension = "";
+        if (path_length > 3 && strcmp(file->path + path_length - 3, ".gz") == 0) {
+                path_length -= 3;
+                extension = ".gz";
+        }
+
+        snprintf(rotated_path, rotated_path_size, "%.*s.%s%s",
+                        (int) path_length, file->path, start_time, extension);
+        for (int i = 1; access(rotated_path, F_OK) == 0 && i < 1000; i++) {
+                snprintf(rotated_path, rotated_path_size, "%.*s.%s-%d%s",
+                                (int) path_length, file->path, start_time, i,
+                                extension);
+        }
+}
+
+static bool rotate_output_file(struct output_file *file)
+{
+        char rotated_path[4096];
+        get_rotated_path(file, rotated_path, sizeof(rotated_path));
+
+        // The data written so far goes to the old file
+        flush_output_file(file, true);
+
+        // The old file stays open until the new one is ready
+        FILE *old_stream = file->stream;
+        struct output_segment *old_segment = file->segment;
+
+        if (rename(file->path, rotated_path) != 0) {
+                log_error("Cannot rename '%s' to '%s': %s\n",
+                                file->path, rotated_path, strerror(errno));
+                return false;
+        }
+        if (!open_segment(file)) {
+                // Continue writing to the old file
+                rename(rotated_path, file->path);
+                file->stream = old_stream;
+                file->segment = old_segment;
+                return false;
+        }
+
+        // Both streams use file->buffer, the old one must be closed first
+        if (fclose(old_stream) != 0) {
+                log_error("Cannot write to '%s'\n", rotated_path);
+        }
+        write_file_header(file);
+        // Already synced above
+        file->unsynced = false;
+        log_info("%s output rotated to '%s'\n", file->type_name, rotated_path);
+        return true;
+}
+
+void rotate_output_file_if_needed(struct output_file *file)
+{
+        if (file->segment == NULL) {
+                return;
+        }
+
+        bool needed = (file->rotation.size != 0
+                        && file->segment->size >= file->rotation.size)
+                || (file->next_rotation_time != 0
+                        && time(NULL) >= file->next_rotation_time);
+        if (!needed) {
+                return;
+        }
+
+        if (rotate_output_file(file)) {
+                file->rotation_error_reported = false;
+        } else if (!file->rotation_error_reported) {
+                log_error("Cannot rotate %s output, continuing with the "
+                                "current file\n", file->type_name);
+                file->rotation_error_reported = true;
+                // Do not try again for every measurement
+                file->next_rotation_time = get_next_rotation_time(
+                                file->rotation.period, time(NULL));
+        }
+}
+
+bool open_buffered_output_file(struct output_file *file, const char *path,
+                const struct flush_policy *policy,
+                const struct rotation_policy *rotation,
+                void (*write_header)(FILE *stream), const char *type_name)
+{
+        memset(file, 0, sizeof(*file));
+        file->type_name = type_name;
+        file->policy = *policy;
+        file->path = path;
+        file->rotation = *rotation;
+        file->write_header = write_header;
+
+        bool use_segments = rotation->size != 0
+                || rotation->period != ROTATION_PERIOD_NONE || rotation->gzip;
+        bool is_stdout = strcmp(path, "-") == 0;
+
+        if (use_segments && is_stdout) {
+                fprintf(stderr, "%s output to standard output cannot be rotated "
+                                "or compressed\n", type_name);
+                return false;
+        }
+
+        // Standard output may be shared by several outputs and may have
+        // been written to already, so its buffer is left alone
+        if (policy->bytes != 0 && !is_stdout) {
+                file->buffer = malloc(policy->bytes);
+                if (file->buffer == NULL) {
+                        fprintf(stderr, "Cannot allocate the buffer of %s output\n",
+                                        type_name);
+                        return false;
+                }
+        }
+
+        if (use_segments) {
+                if (!open_segment(file)) {
+                        free(file->buffer);
+                        file->buffer = NULL;
+                        return false;
+                }
+        } else {
+                if (!open_output_file(path, &file->stream, &file->close_on_exit,
+                                        type_name)) {
+                        free(file->buffer);
+                        file->buffer = NULL;
+                        return false;
+                }
+                if (file->buffer != NULL) {
+                        setvbuf(file->stream, file->buffer, _IOFBF, policy->bytes);
+                }
+        }
+        write_file_header(file);
+
+        file->last_sync_ms = event_loop_now_ms();
+        return true;
+}
+
+bool close_buffered_output_file(struct output_file *file)
+{
+        if (file->stream == NULL) {
+                return true;
+        }
+
+        bool ok = flush_output_file(file, true);
+        if (!ok) {
+                fprintf(stderr, "Cannot write buffered data to %s output\n",
+                                file->type_name);
+        }
+
+        if (file->segment != NULL) {
+                // Also finishes the gzip member
+                if (fclose(file->stream) != 0) {
+                        fprintf(stderr, "Cannot close %s output\n", file->type_name);
+                        ok = false;
+                }
+                file->segment = NULL;
+        } else {
+                close_output_file(&file->stream, &file->close_on_exit);
+        }
+        file->stream = NULL;
+        // Not used by standard output
+        free(file->buffer);
+        file->buffer = NULL;
+        return ok;
+}
+
+void output_file_written(struct output_file *file)
+{
+        if (file->unflushed_records == 0) {
+                file->first_unflushed_ms = event_loop_now_ms();
+        }
+        file->unflushed_records++;
+        file->unsynced = true;
+}
+
+bool flush_output_file(struct output_file *file, bool force)
+{
+        const struct flush_policy *policy = &file->policy;
+        uint64_t now_ms = event_loop_now_ms();
+        bool ok = true;
+
+        if (file->unflushed_records > 0 && (force
+                        || (policy->records != 0
+                                && file->unflushed_records >= policy->records)
+                        || (policy->interval_ms != 0
+                                && now_ms - file->first_unflushed_ms >= policy->interval_ms))) {
+                ok = fflush(file->stream) == 0;
+#ifdef HAVE_ZLIB
+                // Makes the data written so far readable, at a small cost
+                // in compression ratio
+                if (file->segment != NULL && file->segment->gz != NULL
+                                && gzflush(file->segment->gz, Z_SYNC_FLUSH) != Z_OK) {
+                        ok = false;
+                }
+#endif
+                file->unflushed_records = 0;
+        }
+
+        // Syncs only what has reached the kernel. With a buffer size alone in
+        // the policy, stdio writes the data out by itself.
+        if (policy->sync && file->unsynced && (force
+                        || now_ms - file->last_sync_ms >= policy->sync_interval_ms)) {
+                int fd = file->segment != NULL
+                        ? file->segment->fd : fileno(file->stream);
+                // Pipes and terminals cannot be synced
+                if (fdatasync(fd) != 0 && errno != EINVAL) {
+                        ok = false;
+                }
+                file->unsynced = false;
+                file->last_sync_ms = now_ms;
+        }
+
+        return ok;
+}
+
+long get_output_file_flush_timeout_ms(const struct output_file *file)
+{
+        const struct flush_policy *policy = &file->policy;
+        uint64_t deadline_ms = UINT64_MAX;
+
+        if (file->unflushed_records > 0 && policy->interval_ms != 0) {
+                deadline_ms = file->first_unflushed_ms + policy->interval_ms;
+        }
+        if (policy->sync && file->unsynced
+                        && file->last_sync_ms + policy->sync_interval_ms < deadline_ms) {
+                deadline_ms = file->last_sync_ms + policy->sync_interval_ms;
+        }
+
+        if (deadline_ms == UINT64_MAX) {
+                return -1;
+        }
+        uint64_t now_ms = event_loop_now_ms();
+        return deadline_ms > now_ms ? (long) (deadline_ms - now_ms) : 0;
+}
@@ -0,0 +1,143 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Text output files (CSV and raw SQL) written in batches.
+ *
+ * Flushing stdio buffers after every measurement results in many small
+ * writes, which on flash memory (e.g. /jffs on routers) is slow and wears
+ * it out. A flush policy, given per output on the command line, decides when
+ * buffered measurements are written to the file instead: after a number of
+ * measurements, when the oldest one waited long enough, or when the buffer
+ * reaches a given size. Optionally, the data is also written to the disk
+ * with fdatasync() at most every given interval.
+ *
+ * Everything is flushed and, if configured, synced when the file is closed,
+ * also after SIGTERM or SIGINT.
+ *
+ * A rotation policy starts a new file when the current one reaches a given
+ * size or at the start of every hour or day. The old file is renamed, adding
+ * the time it was started to its name, e.g. log.csv.20210301-000000, and
+ * writing continues in a new log.csv. Rotation happens before a measurement
+ * is written, in the thread that writes it, so nothing is lost. The files
+ * may also be compressed with gzip while they are written (requires zlib).
+ * The file (e.g. log.csv.gz) then consists of a gzip member for every start
+ * of the program, which gzip and zcat handle as a single file.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+struct flush_policy {
+        // Flush after this many measurements, 0 if not used
+        unsigned int records;
+        // Flush when the oldest measurement not flushed is this old,
+        // 0 if not used
+        unsigned int interval_ms;
+        // Size of the stdio buffer, e.g. the erase block size of flash memory.
+        // The buffer is written out when full. 0 for the default size.
+        size_t bytes;
+
+        // Call fdatasync() at most every sync_interval_ms after writing
+        bool sync;
+        unsigned int sync_interval_ms;
+};
+
+// Flushes after every measurement, as before flush policies were added
+#define DEFAULT_FLUSH_POLICY { .records = 1 }
+#define MAX_FLUSH_BUFFER_SIZE (16 * 1024 * 1024)
+
+// Parses e.g. "records=100,interval=5000,bytes=128k,sync=60000". Options not
+// given are not used. Returns false and prints a message on errors.
+bool parse_flush_policy(const char *text, struct flush_policy *policy,
+                const char *option_name);
+
+enum rotation_period {
+        ROTATION_PERIOD_NONE,
+        ROTATION_PERIOD_HOURLY,
+        // At midnight, local time
+        ROTATION_PERIOD_DAILY,
+};
+
+struct rotation_policy {
+        // Start a new file when the current one reaches this size (after
+        // compression), 0 if not used
+        uint64_t size;
+        // ROTATION_PERIOD_*
+        int period;
+        bool gzip;
+};
+
+#define MAX_ROTATION_SIZE (1024UL * 1024 * 1024)
+
+// Parses e.g. "size=1M,period=daily,compress=gzip". Returns false and prints
+// a message on errors.
+bool parse_rotation_policy(const char *text, struct rotation_policy *policy,
+                const char *option_name);
+
+// The file being written, with rotation or compression
+struct output_segment;
+
+struct output_file {
+        FILE *stream;
+        bool close_on_exit;
+        const char *type_name;
+        struct flush_policy policy;
+        char *buffer;
+
+        const char *path;
+        struct rotation_policy rotation;
+        // Called for every new file, may be NULL
+        void (*write_header)(FILE *stream);
+        // NULL without rotation and compression
+        struct output_segment *segment;
+        time_t segment_start_time;
+        time_t next_rotation_time;
+        bool rotation_error_reported;
+
+        unsigned int unflushed_records;
+        // From event_loop_now_ms()
+        uint64_t first_unflushed_ms;
+        bool unsynced;
+        uint64_t last_sync_ms;
+};
+
+// path may be "-" for standard output. The buffer size in the policy is not
+// used then, rotation and compression are not possible.
+bool open_buffered_output_file(struct output_file *file, const char *path,
+                const struct flush_policy *policy,
+                const struct rotation_policy *rotation,
+                void (*write_header)(FILE *stream), const char *type_name);
+// Flushes and syncs everything
+bool close_buffered_output_file(struct output_file *file);
+
+// To be called before every measurement is written, may replace file->stream
+void rotate_output_file_if_needed(struct output_file *file);
+// To be called after every measurement written to file->stream
+void output_file_written(struct output_file *file);
+// Flushes and syncs the file if the policy says so, or always if force is
+// true. Returns false on errors.
+bool flush_output_file(struct output_file *file, bool force);
+// Milliseconds until flush_output_file() should be called again even if
+// nothing more is written, or -1 if there is no such deadline
+long get_output_file_flush_timeout_ms(const struct output_file *file);
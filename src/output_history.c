@@ -0,0 +1,321 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// fdatasync(), ftruncate(), fileno()
+#define _POSIX_C_SOURCE 200809L
+
+#include "output_history.h"
+#include "event_loop.h"
+#include "history.h"
+#include "log.h"
+#include "main.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Measurements of a single station not written yet
+struct history_block {
+        uint32_t station_mac;
+        // Of block_records entries, in history_records
+        struct history_record *records;
+        unsigned int count;
+        // From event_loop_now_ms(), of the first record
+        uint64_t started_ms;
+};
+
+static FILE *history_stream = NULL;
+static bool history_close_on_exit = false;
+static const char *history_path;
+
+// One for every station, by its index in the station registry
+static struct history_block *history_blocks = NULL;
+static size_t history_block_count;
+// Allocated at once, so measurements never allocate memory
+static struct history_record *history_records = NULL;
+static unsigned int block_records;
+static uint64_t max_age_ms;
+// For encoding a block
+static unsigned char *encode_buffer = NULL;
+static size_t encode_buffer_size;
+
+// Finds the end of the last complete block. A crash may leave a partial block
+// after it, which would hide everything appended later from readers. Other
+// damage is not repaired, nor are files that are not history files touched.
+static bool cut_off_partial_block(const char *path)
+{
+        FILE *stream = fopen(path, "rb");
+        if (stream == NULL) {
+                // Does not exist yet
+                return true;
+        }
+
+        unsigned char header_data[HISTORY_HEADER_SIZE];
+        struct history_block_header header;
+        long valid_size = 0;
+
+        fseek(stream, 0, SEEK_END);
+        long file_size = ftell(stream);
+        fseek(stream, 0, SEEK_SET);
+
+        while (fread(header_data, sizeof(header_data), 1, stream) == 1
+                        && history_parse_header(header_data, &header)
+                        && valid_size + HISTORY_HEADER_SIZE + (long) header.payload_size
+                                <= file_size
+                        && fseek(stream, header.payload_size, SEEK_CUR) == 0) {
+                valid_size = ftell(stream);
+        }
+
+        // The start of a block is left after a crash
+        size_t tail_size = file_size - valid_size;
+        size_t magic_size = tail_size < HISTORY_MAGIC_SIZE ? tail_size : HISTORY_MAGIC_SIZE;
+        bool partial_block = fseek(stream, valid_size, SEEK_SET) == 0
+                && fread(header_data, magic_size, 1, stream) == 1
+                && memcmp(header_data, HISTORY_MAGIC, magic_size) == 0
+                && tail_size < HISTORY_MAX_BLOCK_SIZE(HISTORY_MAX_BLOCK_RECORDS);
+        fclose(stream);
+
+        if (tail_size == 0) {
+                return true;
+        }
+        if (!partial_block) {
+                fprintf(stderr, "'%s' is not a history file or is corrupted at offset %ld\n",
+                                path, valid_size);
+                return false;
+        }
+
+        fprintf(stderr, "Removing %zu bytes of an incomplete block from the end of '%s'\n",
+                        tail_size, path);
+        if (truncate(path, valid_size) != 0) {
+                perror("Cannot truncate the history file");
+                return false;
+        }
+        return true;
+}
+
+static void shutdown_history_output();
+
+static bool init_history_output(const struct program_options *options)
+{
+        history_path = options->history_output_path;
+        block_records = options->history_block_records;
+        max_age_ms = (uint64_t) options->history_max_age_s * 1000;
+
+        if (strcmp(history_path, "-") != 0 && !cut_off_partial_block(history_path)) {
+                return false;
+        }
+        if (!open_output_file(history_path, &history_stream,
+                                &history_close_on_exit, "history")) {
+                return false;
+        }
+
+        history_block_count = options->max_stations;
+        history_blocks = calloc(history_block_count, sizeof(*history_blocks));
+        if (history_block_count <= SIZE_MAX / sizeof(*history_records) / block_records) {
+                history_records = malloc(history_block_count * block_records
+                                * sizeof(*history_records));
+        }
+        encode_buffer_size = HISTORY_MAX_BLOCK_SIZE(block_records);
+        encode_buffer = malloc(encode_buffer_size);
+        if (history_blocks == NULL || history_records == NULL || encode_buffer == NULL) {
+                fputs("Cannot allocate memory for the history output\n", stderr);
+                shutdown_history_output();
+                return false;
+        }
+        for (size_t i = 0; i < history_block_count; i++) {
+                history_blocks[i].records = &history_records[i * block_records];
+        }
+        return true;
+}
+
+static bool write_history_block(struct history_block *block)
+{
+        if (block->count == 0) {
+                return true;
+        }
+
+        size_t size = history_encode_block(encode_buffer, encode_buffer_size,
+                        block->station_mac, block->records, block->count);
+        block->count = 0;
+
+        if (size == 0) {
+                log_error("Cannot encode a history block\n");
+                return false;
+        }
+        if (fwrite(encode_buffer, size, 1, history_stream) != 1
+                        || fflush(history_stream) != 0) {
+                log_error("Cannot write to the history file '%s'\n", history_path);
+                return false;
+        }
+        // Blocks are written rarely, every one can be synced to the disk
+        if (history_close_on_exit && fdatasync(fileno(history_stream)) != 0) {
+                log_error("Cannot sync the history file '%s'\n", history_path);
+                return false;
+        }
+        return true;
+}
+
+static void shutdown_history_output()
+{
+        if (history_blocks != NULL) {
+                for (size_t i = 0; i < history_block_count; i++) {
+                        write_history_block(&history_blocks[i]);
+                }
+                free(history_blocks);
+                history_blocks = NULL;
+        }
+        free(history_records);
+        history_records = NULL;
+        free(encode_buffer);
+        encode_buffer = NULL;
+
+        close_output_file(&history_stream, &history_close_on_exit);
+}
+
+static int16_t temperature_to_history(device_temperature_t temperature)
+{
+        if (DEVICE_IS_INCORRECT_TEMPERATURE(temperature)) {
+                return HISTORY_MISSING;
+        }
+#ifdef FIXED_POINT_MEASUREMENTS
+        return temperature;
+#else
+        long hundredths = lroundf(temperature * 100.f);
+        if (hundredths <= HISTORY_MISSING || hundredths > INT16_MAX) {
+                return HISTORY_MISSING;
+        }
+        return hundredths;
+#endif
+}
+
+static void fill_history_record(struct history_record *record,
+                const struct device_sensor_state *state)
+{
+        record->time = state->packet_arrival_time;
+        if (state->atmospheric_pressure == DEVICE_INCORRECT_PRESSURE
+                        || state->atmospheric_pressure > INT16_MAX) {
+                record->values[HISTORY_PRESSURE] = HISTORY_MISSING;
+        } else {
+                record->values[HISTORY_PRESSURE] = state->atmospheric_pressure;
+        }
+
+        for (int sensor = 0; sensor < 4; sensor++) {
+                const struct device_single_measurement *current = sensor == 0
+                        ? &state->station_sensor.current
+                        : &state->remote_sensors[sensor - 1].current;
+                int16_t *values = &record->values[HISTORY_SENSOR_COLUMN(sensor, 0)];
+
+                values[HISTORY_TEMPERATURE] = temperature_to_history(current->temperature);
+                values[HISTORY_DEW_POINT] = temperature_to_history(current->dew_point);
+                if (current->humidity == DEVICE_INCORRECT_HUMIDITY
+                                || current->humidity > INT16_MAX) {
+                        values[HISTORY_HUMIDITY] = HISTORY_MISSING;
+                } else {
+                        values[HISTORY_HUMIDITY] = current->humidity;
+                }
+        }
+}
+
+static bool store_sensor_state_history(const struct device_sensor_state *state)
+{
+        if (state->station_index >= history_block_count) {
+                log_error("Cannot store the history of more than %zu stations\n",
+                                history_block_count);
+                return false;
+        }
+
+        struct history_block *block = &history_blocks[state->station_index];
+        bool ok = true;
+        int64_t time = state->packet_arrival_time;
+
+        // Times in a block must not go back, e.g. after the clock was set
+        if (block->count > 0 && (time < block->records[block->count - 1].time
+                                || time - block->records[0].time > HISTORY_MAX_BLOCK_SPAN_S)) {
+                ok = write_history_block(block);
+        }
+
+        if (block->count == 0) {
+                block->station_mac = state->station_mac;
+                block->started_ms = event_loop_now_ms();
+        }
+        fill_history_record(&block->records[block->count++], state);
+
+        if (block->count == block_records) {
+                ok = write_history_block(block) && ok;
+        }
+        return ok;
+}
+
+static bool flush_history_output()
+{
+        bool ok = true;
+        uint64_t now = event_loop_now_ms();
+
+        if (max_age_ms == 0) {
+                return true;
+        }
+        for (size_t i = 0; i < history_block_count; i++) {
+                struct history_block *block = &history_blocks[i];
+                if (block->count > 0 && now - block->started_ms >= max_age_ms) {
+                        ok = write_history_block(block) && ok;
+                }
+        }
+        return ok;
+}
+
+static long get_history_flush_timeout_ms()
+{
+        long timeout = -1;
+        uint64_t now = event_loop_now_ms();
+
+        if (max_age_ms == 0) {
+                return -1;
+        }
+        for (size_t i = 0; i < history_block_count; i++) {
+                struct history_block *block = &history_blocks[i];
+                if (block->count == 0) {
+                        continue;
+                }
+
+                uint64_t age = now - block->started_ms;
+                long remaining = age >= max_age_ms ? 0 : (long) (max_age_ms - age);
+                if (timeout < 0 || remaining < timeout) {
+                        timeout = remaining;
+                }
+        }
+        return timeout;
+}
+
+static bool is_history_output_enabled(const struct program_options *options)
+{
+        return options->history_output_path != NULL;
+}
+
+const struct sink history_sink = {
+        .name = "history",
+        .is_enabled = is_history_output_enabled,
+        .init = init_history_output,
+        .submit = store_sensor_state_history,
+        .flush = flush_history_output,
+        .get_flush_timeout_ms = get_history_flush_timeout_ms,
+        .shutdown = shutdown_history_output,
+        .threadable = true,
+        .latency_stage = LATENCY_OUTPUT_HISTORY,
+};
@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "emax_em3371.h"
+#include "sink.h"
+
+/*
+ * Local history of measurements in a compact binary file, see history.h.
+ *
+ * Measurements of every station are collected in memory and written as
+ * a compressed block when --history-block of them have been collected, when
+ * the oldest one is --history-max-age old, and when the program exits or
+ * reloads its configuration. Blocks are only appended to the file; a partial
+ * block left at its end after a crash is cut off when the file is opened.
+ */
+
+extern const struct sink history_sink;
+
+#define DEFAULT_HISTORY_BLOCK_RECORDS 512
+#define DEFAULT_HISTORY_MAX_AGE_S 3600
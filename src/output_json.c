@@ -20,15 +20,19 @@
 #include "emax_em3371.h"
 #include "main.h"
 #include "output_json.h"
+#include "station_registry.h"
+#include "log.h"
 #include <stdio.h>
 
 static void display_single_measurement_json(FILE *stream, const struct device_single_measurement *state)
 {
+	char temperature[TEMPERATURE_STRING_SIZE];
+
 	fprintf(stream, "{");
 
 	if (!DEVICE_IS_INCORRECT_TEMPERATURE(state->temperature)) {
-		fprintf(stream, " \"temperature\": %.2f",
-			(double) state->temperature);
+		temperature_to_string(state->temperature, temperature, sizeof(temperature));
+		fprintf(stream, " \"temperature\": %s", temperature);
 
                 if (state->humidity != DEVICE_INCORRECT_HUMIDITY) {
                         fputs(",", stream);
@@ -40,7 +44,8 @@ static void display_single_measurement_json(FILE *stream, const struct device_si
 	}
 
         if (!DEVICE_IS_INCORRECT_TEMPERATURE(state->dew_point)) {
-		fprintf(stream, ", \"dew_point\": %.2f", (double) state->dew_point);
+		temperature_to_string(state->dew_point, temperature, sizeof(temperature));
+		fprintf(stream, ", \"dew_point\": %s", temperature);
         }
 
 	fprintf(stream, " }");
@@ -73,6 +78,11 @@ void display_sensor_state_json(FILE *stream, const struct device_sensor_state *s
 	char device_time_str[30];
 	time_to_string(state->device_time, device_time_str, sizeof(device_time_str), true);
 
+        char station_mac_str[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(state->station_mac,
+                        station_mac_str, sizeof(station_mac_str));
+
+        fprintf(stream, "\"station_mac\": \"%s\",\n", station_mac_str);
         fprintf(stream, "\"device_time\": \"%s\",\n", device_time_str);
 	if (state->atmospheric_pressure != DEVICE_INCORRECT_PRESSURE) {
 		fprintf(stream, "\"atmospheric_pressure\": %u,\n", state->atmospheric_pressure);
@@ -93,21 +103,94 @@ void display_sensor_state_json(FILE *stream, const struct device_sensor_state *s
 	fprintf(stream, "\n}\n");
 }
 
-void update_status_file(const char *status_file_path,
+bool update_status_file(const char *status_file_path,
                 const struct device_sensor_state *sensor_state)
 {
         if (status_file_path == NULL) {
-                return;
+                return true;
         }
 
         FILE *status_file = fopen(status_file_path, "w");
 
         if (status_file == NULL) {
                 perror("Cannot open status file for writing");
-                return;
+                return false;
         }
 
         display_sensor_state_json(status_file, sensor_state);
 
-        fclose(status_file);
+        return fclose(status_file) == 0;
+}
+
+/*
+ * The measurements are printed on standard error with --log-level=info or
+ * debug. The messages are not written with a single call, so this output
+ * must not have its own thread.
+ */
+
+static bool is_log_output_enabled(const struct program_options *options)
+{
+        (void) options;
+        return log_enabled(LOG_LEVEL_INFO);
+}
+
+static bool init_log_output(const struct program_options *options)
+{
+        (void) options;
+        return true;
+}
+
+static bool log_sensor_state(const struct device_sensor_state *state)
+{
+        display_sensor_state_json(stderr, state);
+        return true;
+}
+
+static void shutdown_log_output()
+{
+}
+
+const struct sink log_sink = {
+        .name = "log",
+        .is_enabled = is_log_output_enabled,
+        .init = init_log_output,
+        .submit = log_sensor_state,
+        .flush = NULL,
+        .shutdown = shutdown_log_output,
+        .threadable = false,
+        .latency_stage = LATENCY_OUTPUT_LOG,
+};
+
+static const char *status_file_path = NULL;
+
+static bool is_status_file_enabled(const struct program_options *options)
+{
+        return options->status_file_path != NULL;
+}
+
+static bool init_status_file(const struct program_options *options)
+{
+        status_file_path = options->status_file_path;
+        return true;
+}
+
+static bool write_status_file(const struct device_sensor_state *state)
+{
+        return update_status_file(status_file_path, state);
 }
+
+static void shutdown_status_file()
+{
+        status_file_path = NULL;
+}
+
+const struct sink status_file_sink = {
+        .name = "status_file",
+        .is_enabled = is_status_file_enabled,
+        .init = init_status_file,
+        .submit = write_status_file,
+        .flush = NULL,
+        .shutdown = shutdown_status_file,
+        .threadable = true,
+        .latency_stage = LATENCY_OUTPUT_STATUS_FILE,
+};
@@ -19,8 +19,14 @@
 #pragma once
 
 #include "emax_em3371.h"
+#include "sink.h"
 #include <stdio.h>
 
+// The measurements on standard error, and the status file
+extern const struct sink log_sink;
+extern const struct sink status_file_sink;
+
 void display_sensor_state_json(FILE *stream, const struct device_sensor_state *state);
-void update_status_file(const char *status_file_path,
+// Returns false if writing failed
+bool update_status_file(const char *status_file_path,
                 const struct device_sensor_state *sensor_state);
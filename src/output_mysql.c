@@ -17,11 +17,18 @@
  */
 
 #include "output_mysql.h"
+#include "output_mysql_async.h"
 #include "output_mysql_buffer.h"
+#include "output_mysql_stmt.h"
 #include "output_sql.h"
+#include "event_loop.h"
+#include "latency.h"
+#include "scratch_arena.h"
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <mysql.h>
 
@@ -32,10 +39,46 @@ static const char *mysql_user;
 static const char *mysql_password;
 static const char *mysql_database;
 static bool mysql_connected=false;
+static bool mysql_async=false;
+static bool mysql_prepared=false;
+static bool mysql_multi_statements=false;
+static struct sql_text multi_statement_text;
+
+static unsigned int drain_batch_size = 1;
+static struct sql_bulk_insert bulk_insert;
+static bool bulk_insert_constructed = false;
+
+static unsigned int drain_time_budget_ms = 0;
+static struct event_timer drain_timer;
+static struct mysql_drain_stats drain_stats;
+// Statistics of the current or last continuous upload of the buffer
+static uint64_t drain_episode_start_ms;
+static uint64_t drain_last_report_ms;
+static unsigned long drain_episode_states;
+static unsigned long drain_episode_rows;
+
+static void on_drain_timer(void *data);
+static void unregister_connect_socket();
+
+enum mysql_circuit_state {
+        // Measurements are stored in the database
+        MYSQL_CIRCUIT_CLOSED,
+        // Waiting for reconnect_timer
+        MYSQL_CIRCUIT_OPEN,
+        MYSQL_CIRCUIT_CONNECTING,
+};
+
+static enum mysql_circuit_state circuit_state = MYSQL_CIRCUIT_OPEN;
+static unsigned int reconnect_delay_ms = MYSQL_RECONNECT_MIN_DELAY_MS;
+static struct event_timer reconnect_timer;
+static struct event_timer connect_timeout_timer;
+static int connect_fd = -1;
+static MYSQL *connect_result = NULL;
 
 
 static bool mysql_disconnect()
 {
+        close_mysql_statements();
         if (mysql_ptr != NULL) {
                 mysql_close(mysql_ptr);
                 mysql_ptr = NULL;
@@ -44,20 +87,189 @@ static bool mysql_disconnect()
         return true;
 }
 
+// Everything except the buffer
+static void stop_mysql_output()
+{
+        if (mysql_async) {
+                shutdown_mysql_async_output();
+        } else {
+                event_timer_cancel(&drain_timer);
+                drain_stats.draining = false;
+                event_timer_cancel(&reconnect_timer);
+                unregister_connect_socket();
+                mysql_disconnect();
+        }
+        if (bulk_insert_constructed) {
+                sql_bulk_insert_free(&bulk_insert);
+                bulk_insert_constructed = false;
+        }
+        sql_text_free(&multi_statement_text);
+}
+
 void shutdown_mysql_output()
 {
-        mysql_disconnect();
+        stop_mysql_output();
+
+        if (mysql_async && get_mysql_buffer_count() > 0) {
+                fprintf(stderr, "Warning: %ld measurements were not stored in "
+                        "the MySQL database\n", get_mysql_buffer_count());
+        }
         shutdown_mysql_buffer();
 }
 
-static bool try_mysql_connect()
+/*
+ * A circuit breaker: after any error the connection is closed and no
+ * database calls are made until a reconnection attempt succeeds. Meanwhile
+ * measurements go straight into the buffer.
+ *
+ * Connecting is done with the non-blocking API of MariaDB Connector/C, driven
+ * by the event loop, so an unreachable database server does not delay
+ * handling of packets. Attempts are made after increasing delays, with
+ * random jitter.
+ */
+static void start_connecting();
+static void finish_draining(uint64_t now_ms);
+
+static void unregister_connect_socket()
+{
+        if (connect_fd != -1) {
+                event_loop_remove_fd(connect_fd);
+                connect_fd = -1;
+        }
+        event_timer_cancel(&connect_timeout_timer);
+}
+
+static void open_circuit()
+{
+        unregister_connect_socket();
+        mysql_disconnect();
+        circuit_state = MYSQL_CIRCUIT_OPEN;
+
+        // A drain slice may be queued, it must not run without a connection.
+        // Draining is started again after reconnecting.
+        event_timer_cancel(&drain_timer);
+        if (drain_stats.draining) {
+                finish_draining(event_loop_now_ms());
+        }
+
+        // "Equal jitter": between half of and the full delay
+        unsigned int delay_ms = reconnect_delay_ms / 2
+                + rand() % (reconnect_delay_ms / 2 + 1);
+        fprintf(stderr, "MySQL server unavailable, next connection attempt "
+                        "in %.1f s\n", delay_ms / 1000.);
+        event_timer_schedule(&reconnect_timer, delay_ms);
+
+        reconnect_delay_ms *= 2;
+        if (reconnect_delay_ms > MYSQL_RECONNECT_MAX_DELAY_MS) {
+                reconnect_delay_ms = MYSQL_RECONNECT_MAX_DELAY_MS;
+        }
+}
+
+static void start_draining();
+
+static void on_connected()
+{
+        if (mysql_prepared && !prepare_mysql_statements(mysql_ptr)) {
+                // Perhaps the database schema is outdated
+                open_circuit();
+                return;
+        }
+
+        fputs("Connected to MySQL server\n", stderr);
+        mysql_connected = true;
+        circuit_state = MYSQL_CIRCUIT_CLOSED;
+        reconnect_delay_ms = MYSQL_RECONNECT_MIN_DELAY_MS;
+
+        start_draining();
+}
+
+static void on_connect_socket(int fd, unsigned int events, void *data);
+
+// Handles status returned by mysql_real_connect_start() or _cont()
+static void handle_connect_status(int status)
+{
+        if (status == 0) {
+                unregister_connect_socket();
+                if (connect_result == NULL) {
+                        fprintf(stderr, "Cannot connect to MySQL server: %s\n",
+                                        mysql_error(mysql_ptr));
+                        open_circuit();
+                } else {
+                        on_connected();
+                }
+                return;
+        }
+
+        unsigned int events = 0;
+        if (status & (MYSQL_WAIT_READ | MYSQL_WAIT_EXCEPT)) {
+                events |= EVENT_READ;
+        }
+        if (status & MYSQL_WAIT_WRITE) {
+                events |= EVENT_WRITE;
+        }
+
+        int fd = mysql_get_socket(mysql_ptr);
+        if (fd != connect_fd) {
+                unregister_connect_socket();
+        }
+        if (connect_fd == -1) {
+                if (!event_loop_add_fd(fd, events, on_connect_socket, NULL)) {
+                        open_circuit();
+                        return;
+                }
+                connect_fd = fd;
+        } else {
+                event_loop_modify_fd(fd, events);
+        }
+
+        if (status & MYSQL_WAIT_TIMEOUT) {
+                event_timer_schedule(&connect_timeout_timer,
+                                mysql_get_timeout_value_ms(mysql_ptr));
+        } else {
+                event_timer_cancel(&connect_timeout_timer);
+        }
+}
+
+static void on_connect_socket(int fd, unsigned int events, void *data)
+{
+        (void) fd;
+        (void) data;
+
+        int ready_status = 0;
+        if (events & EVENT_READ) {
+                ready_status |= MYSQL_WAIT_READ;
+        }
+        if (events & EVENT_WRITE) {
+                ready_status |= MYSQL_WAIT_WRITE;
+        }
+
+        event_timer_cancel(&connect_timeout_timer);
+        handle_connect_status(mysql_real_connect_cont(&connect_result, mysql_ptr,
+                                ready_status));
+}
+
+static void on_connect_timeout(void *data)
+{
+        (void) data;
+        handle_connect_status(mysql_real_connect_cont(&connect_result, mysql_ptr,
+                                MYSQL_WAIT_TIMEOUT));
+}
+
+static void on_reconnect_timer(void *data)
+{
+        (void) data;
+        start_connecting();
+}
+
+static void start_connecting()
 {
         mysql_disconnect();
 
         mysql_ptr = mysql_init(NULL);
         if (mysql_ptr == NULL) {
                 fputs("Cannot create MySQL object\n", stderr);
-                return false;
+                open_circuit();
+                return;
         }
 
         // mysql_optionsv() should be called before every mysql_real_connect()
@@ -68,34 +280,104 @@ static bool try_mysql_connect()
 
         mysql_optionsv(mysql_ptr, MYSQL_READ_DEFAULT_FILE, NULL);
 
-        if (mysql_real_connect(mysql_ptr, mysql_server,
-                        mysql_user, mysql_password,
-                        mysql_database,
-                        0,
-                        NULL, 0) == NULL) {
-                fprintf(stderr, "Cannot connect to MySQL server: %s\n",
-                                mysql_error(mysql_ptr));
+        // Blocking calls may still be used on this connection once it is
+        // established.
+        mysql_options(mysql_ptr, MYSQL_OPT_NONBLOCK, 0);
 
-                mysql_connected=false;
-        } else {
-                mysql_connected=true;
+        unsigned long client_flags = 0;
+        if (mysql_multi_statements) {
+                client_flags |= CLIENT_MULTI_STATEMENTS;
+        }
+
+        circuit_state = MYSQL_CIRCUIT_CONNECTING;
+        handle_connect_status(mysql_real_connect_start(&connect_result, mysql_ptr,
+                                mysql_server, mysql_user, mysql_password,
+                                mysql_database, 0, NULL, client_flags));
+}
+
+static bool start_mysql_output(const struct program_options *options);
+
+bool init_mysql_output(const struct program_options *options)
+{
+        size_t buffer_size = options->mysql_buffer_size;
+        if ((options->mysql_async || options->mysql_buffer_file != NULL)
+                        && buffer_size == 0) {
+                // In asynchronous mode the buffer is also the queue of
+                // measurements waiting to be stored. A buffer file implies
+                // that a buffer is wanted.
+                buffer_size = MYSQL_ASYNC_DEFAULT_BUFFER_SIZE;
+        }
+        if (!init_mysql_buffer(buffer_size, options->mysql_buffer_file,
+                                options->mysql_buffer_sync_interval_s)) {
+                return false;
         }
 
-        return mysql_connected;
+        // Once, stop_mysql_output() cancels the timers whether they have been
+        // used or not, also in asynchronous mode and after start_mysql_output()
+        // has failed
+        event_timer_init(&drain_timer, on_drain_timer, NULL);
+        event_timer_init(&reconnect_timer, on_reconnect_timer, NULL);
+        event_timer_init(&connect_timeout_timer, on_connect_timeout, NULL);
+        connect_fd = -1;
+
+        return start_mysql_output(options);
+}
+
+/*
+ * On SIGHUP: connects again with the new parameters. The buffer is kept, its
+ * size cannot be changed (see keep_fixed_options() in main.c). Measurements
+ * of an interrupted transaction are still in the buffer and are stored again.
+ * Also switches between synchronous and asynchronous mode. See README.md for
+ * how to check reloading.
+ */
+static bool reload_mysql_output(const struct program_options *options)
+{
+        stop_mysql_output();
+        return start_mysql_output(options);
 }
 
-bool init_mysql_output(struct program_options *options)
+static bool start_mysql_output(const struct program_options *options)
 {
         mysql_server = options->mysql_server;
         mysql_user = options->mysql_user;
         mysql_password = options->mysql_password;
         mysql_database = options->mysql_database;
+        mysql_async = options->mysql_async;
+        mysql_prepared = options->mysql_prepared;
+        mysql_multi_statements = options->mysql_multi_statements;
+        drain_batch_size = options->mysql_drain_batch_size;
+        drain_time_budget_ms = options->mysql_drain_time_budget_ms;
 
-        init_mysql_buffer(options->mysql_buffer_size);
+        memset(&drain_stats, 0, sizeof(drain_stats));
 
         mysql_ptr = NULL;
         mysql_connected=false;
 
+        if (!mysql_async && drain_batch_size > 1 && get_mysql_buffer_capacity() > 0) {
+                if (!sql_bulk_insert_construct(&bulk_insert)) {
+                        fputs("Cannot allocate memory for SQL statements\n", stderr);
+                        return false;
+                }
+                bulk_insert_constructed = true;
+        }
+
+        if (mysql_async) {
+                return init_mysql_async_output(options);
+        }
+
+        if (mysql_multi_statements && !sql_text_construct(&multi_statement_text)) {
+                fputs("Cannot allocate memory for SQL statements\n", stderr);
+                return false;
+        }
+
+        reconnect_delay_ms = MYSQL_RECONNECT_MIN_DELAY_MS;
+        // Only used for jitter of reconnection delays
+        srand(time(NULL));
+
+        // Measurements received before the connection is established are
+        // kept in the buffer.
+        start_connecting();
+
         return true;
 }
 
@@ -105,7 +387,8 @@ static bool output_mysql_execute_statement(const char *statement)
         const char *error_string = mysql_error(mysql_ptr);
         if (ret != 0 || strlen(error_string) != 0) {
                 fprintf(stderr,
-                        "mysql_query \"%s\" failed with return value %d and message \"%s\"\n",
+                        // Multi-row statements may be very long
+                        "mysql_query \"%.200s\" failed with return value %d and message \"%s\"\n",
                         statement, ret, error_string);
 
                 return false;
@@ -119,65 +402,394 @@ static bool output_mysql_execute_statement(const char *statement)
         return true;
 }
 
-static bool store_sensor_state_mysql_real(const struct device_sensor_state *state)
+static bool execute_sql_text_statements(const struct device_sensor_state *state)
 {
-        bool return_value = false;
+        bool return_value = true;
 
-        struct sql_statements_list statements;
-        sql_statements_list_construct(&statements);
-        get_sensor_state_sql(&statements, state);
+        size_t scratch = scratch_mark();
+        struct sql_statements_list *statements = scratch_alloc(sizeof(*statements));
+        if (statements == NULL) {
+                return false;
+        }
+        sql_statements_list_construct(statements);
+        get_sensor_state_sql(statements, state);
 
-        if (!mysql_connected && !try_mysql_connect()) {
-                // TODO: store the data in a temporary buffer
-                goto out;
+        for (unsigned i = 0; i < statements->count; i++) {
+                if (!output_mysql_execute_statement(statements->statements[i])) {
+                        return_value = false;
+                        break;
+                }
+        }
+
+        scratch_release(scratch);
+        return return_value;
+}
+
+/*
+ * Sends all statements for one measurement, together with START TRANSACTION
+ * and COMMIT, as a single multi-statement query, so that storing a
+ * measurement takes one round trip to the database server instead of about
+ * a dozen. The server stops executing the statements after the first error.
+ */
+static bool execute_sql_multi_statement(const struct device_sensor_state *state)
+{
+        size_t scratch = scratch_mark();
+        struct sql_statements_list *statements = scratch_alloc(sizeof(*statements));
+        if (statements == NULL) {
+                return false;
+        }
+        sql_statements_list_construct(statements);
+        get_sensor_state_sql(statements, state);
+
+        // The buffer grows only until it fits the longest query
+        bool text_ok = true;
+        sql_text_clear(&multi_statement_text);
+        text_ok = sql_text_append(&multi_statement_text, "START TRANSACTION");
+        for (unsigned i = 0; i < statements->count && text_ok; i++) {
+                text_ok = sql_text_append(&multi_statement_text, ";%s",
+                                statements->statements[i]);
+        }
+        text_ok = text_ok && sql_text_append(&multi_statement_text, ";COMMIT");
+        scratch_release(scratch);
+
+        if (!text_ok) {
+                fputs("Cannot allocate memory for SQL statements\n", stderr);
+                return false;
+        }
+
+        if (mysql_real_query(mysql_ptr, multi_statement_text.data,
+                                multi_statement_text.length) != 0) {
+                fprintf(stderr, "MySQL multi-statement query failed with "
+                                "message \"%s\"\n", mysql_error(mysql_ptr));
+                return false;
+        }
+
+        // Results of all statements must be consumed before the connection
+        // may be used again. mysql_next_result() returns -1 after the last
+        // one and a positive value if a statement failed.
+        int status;
+        do {
+                MYSQL_RES *result = mysql_store_result(mysql_ptr);
+                if (result != NULL) {
+                        mysql_free_result(result);
+                }
+                status = mysql_next_result(mysql_ptr);
+        } while (status == 0);
+
+        if (status > 0) {
+                fprintf(stderr, "MySQL multi-statement query failed with "
+                                "message \"%s\"\n", mysql_error(mysql_ptr));
+                // The transaction may still be open
+                mysql_rollback(mysql_ptr);
+                return false;
+        }
+
+        return true;
+}
+
+static bool store_sensor_state_mysql_real(const struct device_sensor_state *state)
+{
+        if (!mysql_connected) {
+                return false;
+        }
+
+        if (mysql_multi_statements) {
+                if (!execute_sql_multi_statement(state)) {
+                        return false;
+                }
+                latency_record_since(LATENCY_COMMIT, state->arrival_ns);
+                return true;
         }
 
         if (! output_mysql_execute_statement("START TRANSACTION")) {
                 // If we are not able to start a transaction, something is
-                // not right. Perhaps the connection was lost. Try to reconnect.
-                if (!try_mysql_connect() ||
-                        ! output_mysql_execute_statement("START TRANSACTION")) {
-                        goto out;
-                }
+                // not right. Perhaps the connection was lost.
+                return false;
         };
 
-        for (unsigned i = 0; i < statements.count; i++) {
-                if (!output_mysql_execute_statement(statements.statements[i])) {
-                        mysql_rollback(mysql_ptr);
+        bool statements_ok;
+        if (mysql_prepared) {
+                statements_ok = execute_mysql_statements(state);
+        } else {
+                statements_ok = execute_sql_text_statements(state);
+        }
+
+        if (!statements_ok) {
+                mysql_rollback(mysql_ptr);
+                return false;
+        }
+
+        if (mysql_commit(mysql_ptr) != 0) {
+                return false;
+        }
+        latency_record_since(LATENCY_COMMIT, state->arrival_ns);
+        return true;
+}
 
-                        goto out;
+// Number of rows inserted into all tables for a single measurement
+static unsigned long count_sensor_state_rows(const struct device_sensor_state *state)
+{
+        unsigned long rows = 1;
+        if (state->station_sensor.any_data_present) {
+                rows += 2;
+        }
+        for (int i = 0; i < 3; i++) {
+                if (state->remote_sensors[i].any_data_present) {
+                        rows += 2;
                 }
         }
+        return rows;
+}
 
-        if (mysql_commit(mysql_ptr) == 0) {
+// Returns the highest metrics_state_id in the database. FOR UPDATE locks the
+// end of the primary key index, so that nobody else can insert rows with the
+// identifiers we are going to use until the transaction is committed.
+static bool get_max_metrics_state_id(unsigned long *max_id)
+{
+        if (mysql_query(mysql_ptr, "SELECT COALESCE(MAX(metrics_state_id), 0) "
+                                "FROM metrics_state FOR UPDATE") != 0) {
+                fprintf(stderr, "Cannot get the last metrics_state_id: %s\n",
+                                mysql_error(mysql_ptr));
+                return false;
+        }
+
+        MYSQL_RES *result = mysql_store_result(mysql_ptr);
+        if (result == NULL) {
+                fprintf(stderr, "Cannot read the last metrics_state_id: %s\n",
+                                mysql_error(mysql_ptr));
+                return false;
+        }
+
+        bool return_value = false;
+        MYSQL_ROW row = mysql_fetch_row(result);
+        if (row != NULL && row[0] != NULL) {
+                *max_id = strtoul(row[0], NULL, 10);
                 return_value = true;
         }
 
-out:
-        sql_statements_list_free(&statements);
+        mysql_free_result(result);
         return return_value;
 }
 
-bool store_sensor_state_mysql(const struct device_sensor_state *state)
+// Stores up to drain_batch_size oldest entries of the buffer in a single
+// transaction with three multi-row INSERT statements, then removes them from
+// the buffer. Returns the number of measurements stored, 0 on error.
+static long store_buffered_states_mysql_bulk(unsigned long *rows_inserted)
 {
-        if (! store_sensor_state_mysql_real(state)) {
-                store_in_mysql_buffer(state);
-                return false;
+        long count = get_mysql_buffer_count();
+        if (count > (long) drain_batch_size) {
+                count = drain_batch_size;
         }
 
-        while (get_mysql_buffer_count() > 0) {
+        if (! output_mysql_execute_statement("START TRANSACTION")) {
+                return 0;
+        }
+
+        unsigned long max_id;
+        if (!get_max_metrics_state_id(&max_id)) {
+                goto rollback;
+        }
+
+        sql_bulk_insert_clear(&bulk_insert);
+        for (long i = 0; i < count; i++) {
                 struct device_sensor_state state;
 
-                if (!peek_from_mysql_buffer(&state)) {
-                        break;
+                if (!peek_at_mysql_buffer(i, &state)) {
+                        goto rollback;
+                }
+                if (!sql_bulk_insert_add(&bulk_insert, &state, max_id + 1 + i)) {
+                        fputs("Cannot allocate memory for SQL statements\n", stderr);
+                        goto rollback;
                 }
+        }
 
-                if (store_sensor_state_mysql_real(&state)) {
-                        discard_from_mysql_buffer();
-                } else {
-                        break;
+        if (!output_mysql_execute_statement(bulk_insert.metrics_state.data)) {
+                goto rollback;
+        }
+        if (bulk_insert.sensor_reading_rows > 0) {
+                if (!output_mysql_execute_statement(bulk_insert.sensor_reading.data)
+                                || !output_mysql_execute_statement(
+                                        bulk_insert.sensor_reading_debug.data)) {
+                        goto rollback;
+                }
+        }
+
+        if (mysql_commit(mysql_ptr) != 0) {
+                fprintf(stderr, "MySQL commit failed: %s\n", mysql_error(mysql_ptr));
+                return 0;
+        }
+
+        *rows_inserted += bulk_insert.metrics_state_rows
+                + 2 * bulk_insert.sensor_reading_rows;
+
+        for (long i = 0; i < count; i++) {
+                latency_record_since(LATENCY_COMMIT, get_mysql_buffer_arrival_ns(0));
+                discard_from_mysql_buffer();
+        }
+        return count;
+
+rollback:
+        mysql_rollback(mysql_ptr);
+        return 0;
+}
+
+// Uploads one batch (or one entry if multi-row INSERTs are disabled) from
+// the buffer. Returns false on error.
+static bool drain_mysql_buffer_step()
+{
+        if (!mysql_connected) {
+                return false;
+        }
+
+        if (bulk_insert_constructed) {
+                unsigned long rows_inserted = 0;
+                long stored = store_buffered_states_mysql_bulk(&rows_inserted);
+                if (stored == 0) {
+                        return false;
+                }
+                drain_stats.states_uploaded += stored;
+                drain_stats.rows_inserted += rows_inserted;
+                drain_episode_states += stored;
+                drain_episode_rows += rows_inserted;
+                return true;
+        }
+
+        struct device_sensor_state state;
+
+        if (!peek_from_mysql_buffer(&state)
+                        || !store_sensor_state_mysql_real(&state)) {
+                return false;
+        }
+        discard_from_mysql_buffer();
+
+        unsigned long rows_inserted = count_sensor_state_rows(&state);
+        drain_stats.states_uploaded++;
+        drain_stats.rows_inserted += rows_inserted;
+        drain_episode_states++;
+        drain_episode_rows += rows_inserted;
+        return true;
+}
+
+static void update_drain_rate(uint64_t now_ms)
+{
+        uint64_t elapsed_ms = now_ms - drain_episode_start_ms;
+        double elapsed_s = (elapsed_ms > 0 ? elapsed_ms : 1) / 1000.0;
+        drain_stats.drain_rate = drain_episode_rows / elapsed_s;
+}
+
+static void finish_draining(uint64_t now_ms)
+{
+        drain_stats.draining = false;
+        update_drain_rate(now_ms);
+
+        if (drain_episode_states == 0) {
+                return;
+        }
+        fprintf(stderr, "Uploaded %lu buffered measurements (%lu rows) to MySQL "
+                        "in %.3f s, %.0f rows/s; %ld measurements left in the buffer\n",
+                        drain_episode_states, drain_episode_rows,
+                        (now_ms - drain_episode_start_ms) / 1000.0,
+                        drain_stats.drain_rate, get_mysql_buffer_count());
+}
+
+/*
+ * Uploading the buffer is split into short slices, so that packets from
+ * weather stations are handled in between. Every slice uploads at least one
+ * batch and goes on while drain_time_budget_ms has not elapsed. The next
+ * slice runs after the event loop has handled all pending packets.
+ */
+static void on_drain_timer(void *data)
+{
+        (void) data;
+
+        uint64_t slice_start_ms = event_loop_now_ms();
+        uint64_t now_ms;
+
+        do {
+                if (!drain_mysql_buffer_step()) {
+                        // Also ends draining
+                        open_circuit();
+                        return;
                 }
+                now_ms = event_loop_now_ms();
+        } while (get_mysql_buffer_count() > 0
+                        && now_ms - slice_start_ms < drain_time_budget_ms);
+
+        if (get_mysql_buffer_count() == 0) {
+                finish_draining(now_ms);
+                return;
+        }
+
+        update_drain_rate(now_ms);
+        if (now_ms - drain_last_report_ms >= MYSQL_DRAIN_REPORT_INTERVAL_MS) {
+                fprintf(stderr, "Uploading the MySQL buffer: %ld measurements "
+                                "left, %.0f rows/s\n",
+                                get_mysql_buffer_count(), drain_stats.drain_rate);
+                drain_last_report_ms = now_ms;
         }
 
+        event_timer_schedule(&drain_timer, 0);
+}
+
+static void start_draining()
+{
+        if (drain_stats.draining || get_mysql_buffer_count() == 0) {
+                return;
+        }
+
+        drain_stats.draining = true;
+        drain_episode_start_ms = event_loop_now_ms();
+        drain_last_report_ms = drain_episode_start_ms;
+        drain_episode_states = 0;
+        drain_episode_rows = 0;
+
+        event_timer_schedule(&drain_timer, 0);
+}
+
+void get_mysql_drain_stats(struct mysql_drain_stats *stats)
+{
+        *stats = drain_stats;
+        stats->backlog = get_mysql_buffer_count();
+}
+
+static bool is_mysql_output_enabled(const struct program_options *options)
+{
+        return options->mysql_server != NULL;
+}
+
+// Uses the event loop, so it has no thread of its own
+const struct sink mysql_sink = {
+        .name = "mysql",
+        .is_enabled = is_mysql_output_enabled,
+        .init = init_mysql_output,
+        .submit = store_sensor_state_mysql,
+        .flush = NULL,
+        .shutdown = shutdown_mysql_output,
+        .reload = reload_mysql_output,
+        .threadable = false,
+        .latency_stage = LATENCY_OUTPUT_MYSQL,
+};
+
+bool store_sensor_state_mysql(const struct device_sensor_state *state)
+{
+        if (mysql_async) {
+                return store_sensor_state_mysql_async(state);
+        }
+
+        if (circuit_state != MYSQL_CIRCUIT_CLOSED) {
+                store_in_mysql_buffer(state);
+                return false;
+        }
+
+        // Current measurements are stored right away, before any older
+        // ones waiting in the buffer.
+        if (! store_sensor_state_mysql_real(state)) {
+                store_in_mysql_buffer(state);
+                open_circuit();
+                return false;
+        }
+
+        start_draining();
+
         return true;
 }
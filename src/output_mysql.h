@@ -20,7 +20,34 @@
 
 #include <stdbool.h>
 #include "main.h"
+#include "sink.h"
 
-bool init_mysql_output();
+extern const struct sink mysql_sink;
+
+bool init_mysql_output(const struct program_options *options);
 void shutdown_mysql_output();
+// Returns false when the measurement has been put into the buffer instead
+// of being stored
 bool store_sensor_state_mysql(const struct device_sensor_state *state);
+
+// Delays between attempts to reconnect to the database server. The delay is
+// doubled after every failed attempt.
+#define MYSQL_RECONNECT_MIN_DELAY_MS 1000
+#define MYSQL_RECONNECT_MAX_DELAY_MS (5 * 60 * 1000)
+
+// How often progress of uploading the buffer is reported on stderr
+#define MYSQL_DRAIN_REPORT_INTERVAL_MS (10 * 1000)
+
+struct mysql_drain_stats {
+        // Measurements waiting in the buffer
+        long backlog;
+        bool draining;
+        // Rows inserted per second during the current or last upload
+        double drain_rate;
+
+        // Totals since the program was started
+        unsigned long states_uploaded;
+        unsigned long rows_inserted;
+};
+
+void get_mysql_drain_stats(struct mysql_drain_stats *stats);
@@ -0,0 +1,372 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Asynchronous MySQL / MariaDB output, using the non-blocking API of MariaDB
+ * Connector/C:
+ *      https://mariadb.com/kb/en/using-the-non-blocking-library/
+ *
+ * Every decoded sensor state is put into the MySQL buffer
+ * (output_mysql_buffer.c), which serves as a queue. The oldest entry is
+ * stored in the database in a transaction, statement by statement, just
+ * like in store_sensor_state_mysql_real(). The connection socket is
+ * watched by the event loop, so waiting for the database server never
+ * delays handling of incoming packets.
+ *
+ * An entry is removed from the buffer only after its transaction has been
+ * committed. On any error the connection is closed and reestablished after
+ * MYSQL_ASYNC_RETRY_INTERVAL_MS, then the entry is stored again.
+ */
+
+#include "output_mysql_async.h"
+#include "output_mysql_buffer.h"
+#include "output_sql.h"
+#include "event_loop.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mysql.h>
+
+enum mysql_async_state {
+        MYSQL_ASYNC_DISCONNECTED,
+        MYSQL_ASYNC_WAITING_FOR_RETRY,
+        MYSQL_ASYNC_CONNECTING,
+        MYSQL_ASYNC_IDLE,
+        MYSQL_ASYNC_IN_TRANSACTION,
+};
+
+static const char *mysql_server;
+static const char *mysql_user;
+static const char *mysql_password;
+static const char *mysql_database;
+
+static MYSQL *mysql_ptr = NULL;
+static enum mysql_async_state state = MYSQL_ASYNC_DISCONNECTED;
+
+// Results of the pending non-blocking operation
+static MYSQL *connect_result = NULL;
+static int query_result = 0;
+
+// The transaction being executed: step 0 is START TRANSACTION, then
+// statements from the list, the last step is COMMIT. Kept in static memory,
+// as it is needed until the transaction is committed.
+static struct sql_statements_list statements;
+static unsigned int transaction_step = 0;
+// The entry being stored has already been removed from the buffer
+static bool current_entry_overwritten = false;
+// For latency statistics
+static uint64_t current_entry_arrival_ns = 0;
+
+static int registered_fd = -1;
+static struct event_timer operation_timeout_timer;
+static struct event_timer retry_timer;
+
+static void start_next_transaction();
+static void start_connecting();
+
+static void unregister_socket()
+{
+        if (registered_fd != -1) {
+                event_loop_remove_fd(registered_fd);
+                registered_fd = -1;
+        }
+        event_timer_cancel(&operation_timeout_timer);
+}
+
+static void free_transaction()
+{
+        transaction_step = 0;
+        current_entry_overwritten = false;
+}
+
+static void disconnect_and_retry_later()
+{
+        unregister_socket();
+        free_transaction();
+
+        if (mysql_ptr != NULL) {
+                // Sending COM_QUIT on a broken connection should not block
+                // for long, the socket has write timeout set.
+                mysql_close(mysql_ptr);
+                mysql_ptr = NULL;
+        }
+
+        state = MYSQL_ASYNC_WAITING_FOR_RETRY;
+        event_timer_schedule(&retry_timer, MYSQL_ASYNC_RETRY_INTERVAL_MS);
+}
+
+static void on_mysql_socket(int fd, unsigned int events, void *data);
+
+// Arranges for the pending operation to be continued when the database
+// connection becomes ready, according to status returned by *_start() or
+// *_cont() functions.
+static void wait_for_mysql(int status)
+{
+        unsigned int events = 0;
+        if (status & (MYSQL_WAIT_READ | MYSQL_WAIT_EXCEPT)) {
+                events |= EVENT_READ;
+        }
+        if (status & MYSQL_WAIT_WRITE) {
+                events |= EVENT_WRITE;
+        }
+
+        int fd = mysql_get_socket(mysql_ptr);
+        if (fd != registered_fd || events == 0) {
+                unregister_socket();
+        }
+
+        if (events != 0) {
+                if (registered_fd == -1) {
+                        if (!event_loop_add_fd(fd, events, on_mysql_socket, NULL)) {
+                                disconnect_and_retry_later();
+                                return;
+                        }
+                        registered_fd = fd;
+                } else {
+                        event_loop_modify_fd(fd, events);
+                }
+        }
+
+        if (status & MYSQL_WAIT_TIMEOUT) {
+                event_timer_schedule(&operation_timeout_timer,
+                                mysql_get_timeout_value_ms(mysql_ptr));
+        } else {
+                event_timer_cancel(&operation_timeout_timer);
+        }
+}
+
+static void on_operation_finished()
+{
+        unregister_socket();
+
+        switch (state) {
+        case MYSQL_ASYNC_CONNECTING:
+                if (connect_result == NULL) {
+                        fprintf(stderr, "Cannot connect to MySQL server: %s\n",
+                                        mysql_error(mysql_ptr));
+                        disconnect_and_retry_later();
+                        return;
+                }
+                fputs("Connected to MySQL server\n", stderr);
+                state = MYSQL_ASYNC_IDLE;
+                start_next_transaction();
+                break;
+
+        case MYSQL_ASYNC_IN_TRANSACTION:
+                if (query_result != 0) {
+                        fprintf(stderr, "Asynchronous MySQL query failed with "
+                                "message \"%s\"\n", mysql_error(mysql_ptr));
+                        // Closing the connection rolls the transaction back
+                        disconnect_and_retry_later();
+                        return;
+                }
+                if (mysql_field_count(mysql_ptr) != 0) {
+                        // None of our statements returns rows
+                        fputs("Unexpected result set from MySQL server\n", stderr);
+                        disconnect_and_retry_later();
+                        return;
+                }
+
+                transaction_step++;
+                if (transaction_step > statements.count + 1) {
+                        // COMMIT succeeded
+                        latency_record_since(LATENCY_COMMIT, current_entry_arrival_ns);
+                        if (!current_entry_overwritten) {
+                                discard_from_mysql_buffer();
+                        }
+                        free_transaction();
+                        state = MYSQL_ASYNC_IDLE;
+                        start_next_transaction();
+                } else {
+                        start_next_transaction();
+                }
+                break;
+
+        default:
+                break;
+        }
+}
+
+static void handle_mysql_status(int status)
+{
+        if (status == 0) {
+                on_operation_finished();
+        } else {
+                wait_for_mysql(status);
+        }
+}
+
+static int continue_operation(int ready_status)
+{
+        if (state == MYSQL_ASYNC_CONNECTING) {
+                return mysql_real_connect_cont(&connect_result, mysql_ptr, ready_status);
+        } else {
+                return mysql_real_query_cont(&query_result, mysql_ptr, ready_status);
+        }
+}
+
+static void on_mysql_socket(int fd, unsigned int events, void *data)
+{
+        (void) fd;
+        (void) data;
+
+        int ready_status = 0;
+        if (events & EVENT_READ) {
+                ready_status |= MYSQL_WAIT_READ;
+        }
+        if (events & EVENT_WRITE) {
+                ready_status |= MYSQL_WAIT_WRITE;
+        }
+
+        event_timer_cancel(&operation_timeout_timer);
+        handle_mysql_status(continue_operation(ready_status));
+}
+
+static void on_operation_timeout(void *data)
+{
+        (void) data;
+        handle_mysql_status(continue_operation(MYSQL_WAIT_TIMEOUT));
+}
+
+static void on_retry_timer(void *data)
+{
+        (void) data;
+        start_connecting();
+}
+
+static void start_connecting()
+{
+        mysql_ptr = mysql_init(NULL);
+        if (mysql_ptr == NULL) {
+                fputs("Cannot create MySQL object\n", stderr);
+                disconnect_and_retry_later();
+                return;
+        }
+
+        unsigned int timeout=2;
+        mysql_options(mysql_ptr, MYSQL_OPT_NONBLOCK, 0);
+        mysql_optionsv(mysql_ptr, MYSQL_OPT_CONNECT_TIMEOUT, (void *)&timeout);
+        mysql_optionsv(mysql_ptr, MYSQL_OPT_READ_TIMEOUT, (void *)&timeout);
+        mysql_optionsv(mysql_ptr, MYSQL_OPT_WRITE_TIMEOUT, (void *)&timeout);
+        mysql_optionsv(mysql_ptr, MYSQL_READ_DEFAULT_FILE, NULL);
+
+        state = MYSQL_ASYNC_CONNECTING;
+        handle_mysql_status(mysql_real_connect_start(&connect_result, mysql_ptr,
+                                mysql_server, mysql_user, mysql_password,
+                                mysql_database, 0, NULL, 0));
+}
+
+static void start_query(const char *query)
+{
+        handle_mysql_status(mysql_real_query_start(&query_result, mysql_ptr,
+                                query, strlen(query)));
+}
+
+// Starts the next step of the current transaction or a new transaction
+// for the oldest entry in the buffer.
+static void start_next_transaction()
+{
+        if (state == MYSQL_ASYNC_IDLE) {
+                struct device_sensor_state sensor_state;
+
+                if (!peek_from_mysql_buffer(&sensor_state)) {
+                        return;
+                }
+
+                sql_statements_list_construct(&statements);
+                get_sensor_state_sql(&statements, &sensor_state);
+                current_entry_arrival_ns = sensor_state.arrival_ns;
+
+                transaction_step = 0;
+                state = MYSQL_ASYNC_IN_TRANSACTION;
+        }
+
+        if (transaction_step == 0) {
+                start_query("START TRANSACTION");
+        } else if (transaction_step <= statements.count) {
+                start_query(statements.statements[transaction_step - 1]);
+        } else {
+                start_query("COMMIT");
+        }
+}
+
+bool init_mysql_async_output(const struct program_options *options)
+{
+        mysql_server = options->mysql_server;
+        mysql_user = options->mysql_user;
+        mysql_password = options->mysql_password;
+        mysql_database = options->mysql_database;
+
+        event_timer_init(&operation_timeout_timer, on_operation_timeout, NULL);
+        event_timer_init(&retry_timer, on_retry_timer, NULL);
+
+        mysql_ptr = NULL;
+        registered_fd = -1;
+        state = MYSQL_ASYNC_DISCONNECTED;
+
+        return true;
+}
+
+void shutdown_mysql_async_output()
+{
+        unregister_socket();
+        event_timer_cancel(&retry_timer);
+        free_transaction();
+
+        if (state == MYSQL_ASYNC_IN_TRANSACTION) {
+                fputs("Warning: a MySQL transaction was interrupted, it will be "
+                        "rolled back\n", stderr);
+        }
+
+        if (mysql_ptr != NULL) {
+                mysql_close(mysql_ptr);
+                mysql_ptr = NULL;
+        }
+        state = MYSQL_ASYNC_DISCONNECTED;
+}
+
+bool store_sensor_state_mysql_async(const struct device_sensor_state *sensor_state)
+{
+        if (state == MYSQL_ASYNC_IN_TRANSACTION
+                        && get_mysql_buffer_count() >= get_mysql_buffer_capacity()) {
+                // The buffer is full, so the oldest entry - the one being
+                // stored right now - is going to be overwritten.
+                current_entry_overwritten = true;
+        }
+
+        if (!store_in_mysql_buffer(sensor_state)) {
+                return false;
+        }
+
+        switch (state) {
+        case MYSQL_ASYNC_DISCONNECTED:
+                start_connecting();
+                break;
+        case MYSQL_ASYNC_IDLE:
+                start_next_transaction();
+                break;
+        default:
+                // The entry will be stored after the current transaction
+                // or after reconnecting.
+                break;
+        }
+
+        return true;
+}
@@ -0,0 +1,29 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "main.h"
+
+// Delay before reconnecting after an error
+#define MYSQL_ASYNC_RETRY_INTERVAL_MS (10 * 1000)
+
+bool init_mysql_async_output(const struct program_options *options);
+void shutdown_mysql_async_output();
+bool store_sensor_state_mysql_async(const struct device_sensor_state *state);
@@ -16,13 +16,80 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/*
+ * A ring buffer for measurements that could not be stored in the database.
+ *
+ * The buffer may be kept in a file mapped into memory (--mysql-buffer-file),
+ * so that its contents survive restarts of the program and of the router.
+ * The file consists of a header with positions in the ring, the entries
+ * and a CRC-32 checksum of every entry:
+ *
+ *      struct mysql_buffer_file_header (MYSQL_BUFFER_FILE_HEADER_SIZE bytes)
+ *      struct device_sensor_state_compact entries[max_entries]
+ *      uint32_t entry_crcs[max_entries]
+ *
+ * Changes reach the file through the page cache; msync() is called every
+ * sync_interval_s seconds (or after every change if it is 0), which bounds
+ * both the number of flash writes and the data lost on power failure.
+ *
+ * On startup, valid entries from an existing file are loaded again, even if
+ * the buffer size has changed. Entries with an incorrect checksum - e.g.
+ * written partially before a crash - are dropped.
+ *
+ * The arrival times of entries, used only for latency statistics, are kept
+ * in memory next to the buffer and are not known for entries loaded from
+ * the file.
+ */
+
+#define _DEFAULT_SOURCE // ftruncate(), msync()
+
 #include "output_mysql_buffer.h"
+#include "crc32.h"
+#include "event_loop.h"
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MYSQL_BUFFER_FILE_MAGIC "EM3371BF"
+#define MYSQL_BUFFER_FILE_VERSION 1
+#define MYSQL_BUFFER_FILE_HEADER_SIZE 64
+
+struct mysql_buffer_file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        uint32_t max_entries;
+        uint32_t push_position;
+        uint32_t pop_position;
+        uint32_t entries_in_buffer;
+        // Of all the fields above
+        uint32_t header_crc;
+};
 
 static long mysql_buffer_max_entries = 0;
-static struct device_sensor_state* mysql_buffer = NULL;
+// Entries are packed, so that more of them fit in the same amount of memory.
+// They are unpacked only when uploaded to the database.
+static struct device_sensor_state_compact* mysql_buffer = NULL;
+// device_sensor_state.arrival_ns of every entry
+static uint64_t *mysql_buffer_arrival_ns = NULL;
+
+// Only if the buffer is kept in a file
+static int buffer_file_fd = -1;
+static void *buffer_file_map = NULL;
+static size_t buffer_file_size = 0;
+static struct mysql_buffer_file_header *buffer_file_header = NULL;
+static uint32_t *buffer_file_crcs = NULL;
+static unsigned int buffer_file_sync_interval_s = 0;
+static bool buffer_file_dirty = false;
+static struct event_timer buffer_file_sync_timer;
 
 long push_position;
 long pop_position;
@@ -49,28 +116,301 @@ static void assert_internal_state()
         }
 }
 
-bool init_mysql_buffer(size_t buffer_size)
+static uint32_t get_file_header_crc(const struct mysql_buffer_file_header *header)
+{
+        return crc32_update(0, header, offsetof(struct mysql_buffer_file_header, header_crc));
+}
+
+static void sync_buffer_file()
+{
+        if (buffer_file_map == NULL || !buffer_file_dirty) {
+                return;
+        }
+        if (msync(buffer_file_map, buffer_file_size, MS_SYNC) != 0) {
+                perror("Cannot synchronize the MySQL buffer file");
+                return;
+        }
+        buffer_file_dirty = false;
+}
+
+static void on_buffer_file_sync_timer(void *data)
+{
+        (void) data;
+        sync_buffer_file();
+}
+
+// Called after every change of the buffer
+static void buffer_changed()
+{
+        assert_internal_state();
+
+        if (buffer_file_header == NULL) {
+                return;
+        }
+
+        buffer_file_header->push_position = push_position;
+        buffer_file_header->pop_position = pop_position;
+        buffer_file_header->entries_in_buffer = entries_in_buffer;
+        buffer_file_header->header_crc = get_file_header_crc(buffer_file_header);
+        buffer_file_dirty = true;
+
+        if (buffer_file_sync_interval_s == 0) {
+                sync_buffer_file();
+        } else if (!event_timer_is_scheduled(&buffer_file_sync_timer)) {
+                event_timer_schedule(&buffer_file_sync_timer,
+                                buffer_file_sync_interval_s * 1000);
+        }
+}
+
+static void push_compact_entry(const struct device_sensor_state_compact *entry,
+                uint64_t arrival_ns)
+{
+        if (entries_in_buffer >= mysql_buffer_max_entries) {
+                // Overwrite the oldest entry
+                pop_position = (pop_position+1) % mysql_buffer_max_entries;
+                entries_in_buffer--;
+
+                //        XXXXXX*XXXXXXX
+                //        XXXXXXX*XXXXXX
+
+                // In this case, after the function will have finished,
+                // pop_position == push_position
+        }
+
+        mysql_buffer[push_position] = *entry;
+        mysql_buffer_arrival_ns[push_position] = arrival_ns;
+        if (buffer_file_crcs != NULL) {
+                buffer_file_crcs[push_position] =
+                        crc32_update(0, entry, sizeof(*entry));
+        }
+
+        //        00XXXXXX000000
+        //        00XXXXXXX00000
+        push_position = (push_position + 1) % mysql_buffer_max_entries;
+        entries_in_buffer++;
+}
+
+/*
+ * Reads valid entries from a buffer file written previously, oldest first.
+ * Returns the number of entries read into *entries_out (to be freed by the
+ * caller), 0 if there are none.
+ */
+static long read_old_buffer_file(int fd, const char *path,
+                struct device_sensor_state_compact **entries_out)
+{
+        struct mysql_buffer_file_header header;
+        *entries_out = NULL;
+
+        ssize_t ret = pread(fd, &header, sizeof(header), 0);
+        if (ret == 0) {
+                // A new file
+                return 0;
+        }
+        if (ret != sizeof(header)
+                        || memcmp(header.magic, MYSQL_BUFFER_FILE_MAGIC, sizeof(header.magic)) != 0
+                        || header.header_crc != get_file_header_crc(&header)) {
+                fprintf(stderr, "Warning: %s is not a valid MySQL buffer file, "
+                                "its contents will be overwritten.\n", path);
+                return 0;
+        }
+        if (header.version != MYSQL_BUFFER_FILE_VERSION
+                        || header.entry_size != sizeof(struct device_sensor_state_compact)
+                        || header.max_entries == 0
+                        || header.pop_position >= header.max_entries
+                        || header.entries_in_buffer > header.max_entries) {
+                fprintf(stderr, "Warning: MySQL buffer file %s has an unsupported "
+                                "format, its contents will be overwritten.\n", path);
+                return 0;
+        }
+        if (header.entries_in_buffer == 0) {
+                return 0;
+        }
+
+        size_t entries_size = (size_t) header.max_entries * header.entry_size;
+        size_t crcs_size = (size_t) header.max_entries * sizeof(uint32_t);
+        struct device_sensor_state_compact *old_entries = malloc(entries_size);
+        uint32_t *old_crcs = malloc(crcs_size);
+        struct device_sensor_state_compact *entries =
+                malloc(header.entries_in_buffer * sizeof(*entries));
+
+        if (old_entries == NULL || old_crcs == NULL || entries == NULL) {
+                fputs("Cannot allocate memory to read the MySQL buffer file\n", stderr);
+                goto error;
+        }
+        if (pread(fd, old_entries, entries_size, MYSQL_BUFFER_FILE_HEADER_SIZE)
+                                != (ssize_t) entries_size
+                        || pread(fd, old_crcs, crcs_size,
+                                MYSQL_BUFFER_FILE_HEADER_SIZE + entries_size)
+                                != (ssize_t) crcs_size) {
+                fprintf(stderr, "Warning: MySQL buffer file %s is truncated, "
+                                "its contents will be overwritten.\n", path);
+                goto error;
+        }
+
+        long count = 0;
+        long dropped = 0;
+        for (uint32_t i = 0; i < header.entries_in_buffer; i++) {
+                uint32_t position = (header.pop_position + i) % header.max_entries;
+                const struct device_sensor_state_compact *entry = &old_entries[position];
+
+                if (crc32_update(0, entry, sizeof(*entry)) != old_crcs[position]) {
+                        dropped++;
+                        continue;
+                }
+                entries[count++] = *entry;
+        }
+
+        if (dropped > 0) {
+                fprintf(stderr, "Warning: dropped %ld damaged entries from "
+                                "the MySQL buffer file.\n", dropped);
+        }
+
+        free(old_entries);
+        free(old_crcs);
+        *entries_out = entries;
+        return count;
+
+error:
+        free(old_entries);
+        free(old_crcs);
+        free(entries);
+        return 0;
+}
+
+static bool open_buffer_file(const char *path, size_t buffer_size)
+{
+        buffer_file_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (buffer_file_fd == -1) {
+                fprintf(stderr, "Cannot open MySQL buffer file %s: %s\n",
+                                path, strerror(errno));
+                return false;
+        }
+
+        struct device_sensor_state_compact *old_entries;
+        long old_count = read_old_buffer_file(buffer_file_fd, path, &old_entries);
+
+        mysql_buffer_max_entries = buffer_size
+                / (sizeof(struct device_sensor_state_compact) + sizeof(uint32_t));
+        if (mysql_buffer_max_entries == 0) {
+                fputs("MySQL buffer size is too small!\n", stderr);
+                goto error;
+        }
+
+        mysql_buffer_arrival_ns = calloc(mysql_buffer_max_entries, sizeof(uint64_t));
+        if (mysql_buffer_arrival_ns == NULL) {
+                fputs("Cannot allocate memory for the MySQL buffer\n", stderr);
+                goto error;
+        }
+
+        size_t entries_size =
+                mysql_buffer_max_entries * sizeof(struct device_sensor_state_compact);
+        buffer_file_size = MYSQL_BUFFER_FILE_HEADER_SIZE + entries_size
+                + mysql_buffer_max_entries * sizeof(uint32_t);
+
+        if (ftruncate(buffer_file_fd, buffer_file_size) != 0) {
+                fprintf(stderr, "Cannot resize MySQL buffer file %s: %s\n",
+                                path, strerror(errno));
+                goto error;
+        }
+
+        buffer_file_map = mmap(NULL, buffer_file_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, buffer_file_fd, 0);
+        if (buffer_file_map == MAP_FAILED) {
+                buffer_file_map = NULL;
+                fprintf(stderr, "Cannot map MySQL buffer file %s: %s\n",
+                                path, strerror(errno));
+                goto error;
+        }
+
+        buffer_file_header = buffer_file_map;
+        mysql_buffer = (struct device_sensor_state_compact *)
+                ((char *) buffer_file_map + MYSQL_BUFFER_FILE_HEADER_SIZE);
+        buffer_file_crcs = (uint32_t *) ((char *) mysql_buffer + entries_size);
+
+        memset(buffer_file_header, 0, MYSQL_BUFFER_FILE_HEADER_SIZE);
+        memcpy(buffer_file_header->magic, MYSQL_BUFFER_FILE_MAGIC,
+                        sizeof(buffer_file_header->magic));
+        buffer_file_header->version = MYSQL_BUFFER_FILE_VERSION;
+        buffer_file_header->entry_size = sizeof(struct device_sensor_state_compact);
+        buffer_file_header->max_entries = mysql_buffer_max_entries;
+
+        push_position = 0;
+        pop_position = 0;
+        entries_in_buffer = 0;
+
+        // If the buffer became smaller, the oldest entries are dropped
+        for (long i = 0; i < old_count; i++) {
+                push_compact_entry(&old_entries[i], 0);
+        }
+        free(old_entries);
+        old_entries = NULL;
+
+        buffer_changed();
+        sync_buffer_file();
+
+        if (old_count > 0) {
+                fprintf(stderr, "Loaded %ld measurements from MySQL buffer file %s.\n",
+                                entries_in_buffer, path);
+        }
+
+        return true;
+
+error:
+        free(old_entries);
+        free(mysql_buffer_arrival_ns);
+        mysql_buffer_arrival_ns = NULL;
+        close(buffer_file_fd);
+        buffer_file_fd = -1;
+        mysql_buffer_max_entries = 0;
+        return false;
+}
+
+bool init_mysql_buffer(size_t buffer_size, const char *file_path,
+                unsigned int sync_interval_s)
 {
         if (buffer_size == 0) {
                 return true;
         }
 
+        push_position = 0;
+        pop_position = 0;
+        entries_in_buffer = 0;
+
+        if (file_path != NULL) {
+                buffer_file_sync_interval_s = sync_interval_s;
+                event_timer_init(&buffer_file_sync_timer, on_buffer_file_sync_timer, NULL);
+
+                if (!open_buffer_file(file_path, buffer_size)) {
+                        return false;
+                }
+
+                fprintf(stderr, "MySQL buffer file %s of size %zd bytes mapped, "
+                        "can store %lu entries (%zd bytes each).\n",
+                        file_path, buffer_file_size, mysql_buffer_max_entries,
+                        sizeof(struct device_sensor_state_compact) + sizeof(uint32_t));
+                return true;
+        }
+
         mysql_buffer = malloc(buffer_size);
-        if (mysql_buffer == NULL) {
+        long max_entries = buffer_size / sizeof(struct device_sensor_state_compact);
+        mysql_buffer_arrival_ns = calloc(max_entries > 0 ? max_entries : 1,
+                        sizeof(uint64_t));
+        if (mysql_buffer == NULL || mysql_buffer_arrival_ns == NULL) {
                 fprintf(stderr, "Cannot allocate MySQL buffer of %zd bytes.\n",
                                 buffer_size);
+                free(mysql_buffer);
+                mysql_buffer = NULL;
+                free(mysql_buffer_arrival_ns);
+                mysql_buffer_arrival_ns = NULL;
                 return false;
         }
 
-        mysql_buffer_max_entries = buffer_size / sizeof(struct device_sensor_state);
+        mysql_buffer_max_entries = max_entries;
 
         fprintf(stderr, "MySQL buffer of size %zd bytes allocated, "
-                "can store %lu entries.\n",
-                buffer_size, mysql_buffer_max_entries);
-
-        push_position = 0;
-        pop_position = 0;
-        entries_in_buffer = 0;
+                "can store %lu entries (%zd bytes each).\n",
+                buffer_size, mysql_buffer_max_entries,
+                sizeof(struct device_sensor_state_compact));
 
         assert_internal_state();
 
@@ -79,10 +419,25 @@ bool init_mysql_buffer(size_t buffer_size)
 
 void shutdown_mysql_buffer()
 {
-        free(mysql_buffer);
+        if (buffer_file_map != NULL) {
+                event_timer_cancel(&buffer_file_sync_timer);
+                sync_buffer_file();
+                munmap(buffer_file_map, buffer_file_size);
+                close(buffer_file_fd);
+
+                buffer_file_map = NULL;
+                buffer_file_header = NULL;
+                buffer_file_crcs = NULL;
+                buffer_file_fd = -1;
+                buffer_file_size = 0;
+        } else {
+                free(mysql_buffer);
+        }
 
         mysql_buffer = NULL;
         mysql_buffer_max_entries = 0;
+        free(mysql_buffer_arrival_ns);
+        mysql_buffer_arrival_ns = NULL;
 
         push_position = 0;
         pop_position = 0;
@@ -97,24 +452,11 @@ bool store_in_mysql_buffer(const struct device_sensor_state *state)
                 return false;
         }
 
-        if (entries_in_buffer >= mysql_buffer_max_entries) {
-                discard_from_mysql_buffer();
-
-                //        XXXXXX*XXXXXXX
-                //        XXXXXXX*XXXXXX
+        struct device_sensor_state_compact entry;
+        pack_sensor_state(&entry, state);
+        push_compact_entry(&entry, state->arrival_ns);
 
-                // In this case, after the function will have finished,
-                // pop_position == push_position
-        }
-
-        memcpy(&mysql_buffer[push_position], state, sizeof(*state));
-
-        //        00XXXXXX000000
-        //        00XXXXXXX00000
-        push_position = (push_position + 1) % mysql_buffer_max_entries;
-        entries_in_buffer++;
-
-        assert_internal_state();
+        buffer_changed();
 
         return true;
 }
@@ -127,7 +469,23 @@ bool peek_from_mysql_buffer(struct device_sensor_state *state) {
                 return false;
         }
 
-        memcpy(state, &mysql_buffer[pop_position], sizeof(*state));
+        unpack_sensor_state(state, &mysql_buffer[pop_position]);
+        state->arrival_ns = mysql_buffer_arrival_ns[pop_position];
+        return true;
+}
+
+bool peek_at_mysql_buffer(long index, struct device_sensor_state *state)
+{
+        if (mysql_buffer_max_entries == 0) {
+                return false;
+        }
+        if (index < 0 || index >= entries_in_buffer) {
+                return false;
+        }
+
+        long position = (pop_position + index) % mysql_buffer_max_entries;
+        unpack_sensor_state(state, &mysql_buffer[position]);
+        state->arrival_ns = mysql_buffer_arrival_ns[position];
         return true;
 }
 
@@ -144,7 +502,7 @@ bool discard_from_mysql_buffer()
         //        000000XXXXX000
         entries_in_buffer--;
 
-        assert_internal_state();
+        buffer_changed();
 
         return true;
 }
@@ -154,7 +512,20 @@ bool pop_from_mysql_buffer(struct device_sensor_state *state)
         return peek_from_mysql_buffer(state) && discard_from_mysql_buffer();
 }
 
+uint64_t get_mysql_buffer_arrival_ns(long index)
+{
+        if (index < 0 || index >= entries_in_buffer) {
+                return 0;
+        }
+        return mysql_buffer_arrival_ns[(pop_position + index) % mysql_buffer_max_entries];
+}
+
 long get_mysql_buffer_count()
 {
         return entries_in_buffer;
 }
+
+long get_mysql_buffer_capacity()
+{
+        return mysql_buffer_max_entries;
+}
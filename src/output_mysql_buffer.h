@@ -19,17 +19,27 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "emax_em3371.h"
 
-bool init_mysql_buffer(size_t buffer_size);
+// If file_path is not NULL, the buffer is kept in this file, see
+// output_mysql_buffer.c
+bool init_mysql_buffer(size_t buffer_size, const char *file_path,
+                unsigned int sync_interval_s);
 void shutdown_mysql_buffer();
 
 bool store_in_mysql_buffer(const struct device_sensor_state *state);
 
 bool peek_from_mysql_buffer(struct device_sensor_state *state);
+// Index 0 is the oldest entry, the same as returned by peek_from_mysql_buffer()
+bool peek_at_mysql_buffer(long index, struct device_sensor_state *state);
 bool discard_from_mysql_buffer();
 
 bool pop_from_mysql_buffer(struct device_sensor_state *state);
 
+// Of the entry at the index, as with peek_at_mysql_buffer(). 0 if not known.
+uint64_t get_mysql_buffer_arrival_ns(long index);
+
 long get_mysql_buffer_count();
+long get_mysql_buffer_capacity();
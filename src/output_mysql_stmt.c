@@ -0,0 +1,298 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Storing measurements in MySQL / MariaDB with prepared statements.
+ *
+ * The three INSERT statements are prepared once per connection and the
+ * values are sent in the binary protocol, bound directly to fields of
+ * struct device_sensor_state. Neither this program nor the database server
+ * has to format or parse SQL text for every measurement.
+ *
+ * The rows inserted are the same as with the statements generated by
+ * get_sensor_state_sql(): missing values are stored as NULL.
+ */
+
+// gmtime_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "output_mysql_stmt.h"
+#include "station_registry.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static MYSQL_STMT *metrics_state_stmt = NULL;
+static MYSQL_STMT *sensor_reading_stmt = NULL;
+static MYSQL_STMT *sensor_reading_debug_stmt = NULL;
+
+static const char metrics_state_sql[] =
+        "INSERT INTO metrics_state(time_utc, device_time, station_mac) "
+        "VALUES (?, ?, ?)";
+
+static const char sensor_reading_sql[] =
+        "INSERT INTO sensor_reading(metrics_state_id, sensor_id, "
+        "temperature, humidity, dew_point, atmospheric_pressure, battery_low) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+static const char sensor_reading_debug_sql[] =
+        "INSERT INTO sensor_reading_debug(metrics_state_id, sensor_id, "
+        "temperature_min, temperature_max, humidity_min, humidity_max, "
+        "payload_0x31) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+static MYSQL_STMT *prepare_statement(MYSQL *mysql, const char *sql)
+{
+        MYSQL_STMT *stmt = mysql_stmt_init(mysql);
+        if (stmt == NULL) {
+                fputs("Cannot create MySQL statement object\n", stderr);
+                return NULL;
+        }
+
+        if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+                fprintf(stderr, "Cannot prepare MySQL statement \"%s\": %s\n",
+                                sql, mysql_stmt_error(stmt));
+                mysql_stmt_close(stmt);
+                return NULL;
+        }
+
+        return stmt;
+}
+
+bool prepare_mysql_statements(MYSQL *mysql)
+{
+        close_mysql_statements();
+
+        metrics_state_stmt = prepare_statement(mysql, metrics_state_sql);
+        sensor_reading_stmt = prepare_statement(mysql, sensor_reading_sql);
+        sensor_reading_debug_stmt = prepare_statement(mysql, sensor_reading_debug_sql);
+
+        if (metrics_state_stmt == NULL || sensor_reading_stmt == NULL
+                        || sensor_reading_debug_stmt == NULL) {
+                close_mysql_statements();
+                return false;
+        }
+        return true;
+}
+
+void close_mysql_statements()
+{
+        if (metrics_state_stmt != NULL) {
+                mysql_stmt_close(metrics_state_stmt);
+                metrics_state_stmt = NULL;
+        }
+        if (sensor_reading_stmt != NULL) {
+                mysql_stmt_close(sensor_reading_stmt);
+                sensor_reading_stmt = NULL;
+        }
+        if (sensor_reading_debug_stmt != NULL) {
+                mysql_stmt_close(sensor_reading_debug_stmt);
+                sensor_reading_debug_stmt = NULL;
+        }
+}
+
+// The database library only reads from input buffers, so casting away
+// const is safe.
+static void bind_param(MYSQL_BIND *bind, enum enum_field_types type,
+                const void *buffer, bool is_unsigned, my_bool *is_null)
+{
+        memset(bind, 0, sizeof(*bind));
+        bind->buffer_type = type;
+        bind->buffer = (void *) buffer;
+        bind->is_unsigned = is_unsigned;
+        bind->is_null = is_null;
+}
+
+#ifdef FIXED_POINT_MEASUREMENTS
+// Temperatures in hundredths of °C are sent as text, the server converts them
+struct temperature_param {
+        char text[TEMPERATURE_STRING_SIZE];
+        unsigned long length;
+};
+
+static void bind_temperature(MYSQL_BIND *bind, struct temperature_param *param,
+                const device_temperature_t *temperature, my_bool *is_null)
+{
+        temperature_to_string(*temperature, param->text, sizeof(param->text));
+        param->length = strlen(param->text);
+
+        bind_param(bind, MYSQL_TYPE_STRING, param->text, false, is_null);
+        bind->buffer_length = sizeof(param->text);
+        bind->length = &param->length;
+}
+#else
+struct temperature_param {
+        char unused;
+};
+
+static void bind_temperature(MYSQL_BIND *bind, struct temperature_param *param,
+                const device_temperature_t *temperature, my_bool *is_null)
+{
+        (void) param;
+        bind_param(bind, MYSQL_TYPE_FLOAT, temperature, false, is_null);
+}
+#endif
+
+static bool execute_statement(MYSQL_STMT *stmt, MYSQL_BIND *binds)
+{
+        if (mysql_stmt_bind_param(stmt, binds) != 0
+                        || mysql_stmt_execute(stmt) != 0) {
+                fprintf(stderr, "Executing prepared MySQL statement failed: %s\n",
+                                mysql_stmt_error(stmt));
+                return false;
+        }
+        return true;
+}
+
+// The database stores time in UTC, just as in get_sensor_state_sql()
+static void time_to_mysql_time(const time_t time_in, MYSQL_TIME *time_out)
+{
+        struct tm time_tm;
+        gmtime_r(&time_in, &time_tm);
+
+        memset(time_out, 0, sizeof(*time_out));
+        time_out->year = time_tm.tm_year + 1900;
+        time_out->month = time_tm.tm_mon + 1;
+        time_out->day = time_tm.tm_mday;
+        time_out->hour = time_tm.tm_hour;
+        time_out->minute = time_tm.tm_min;
+        time_out->second = time_tm.tm_sec;
+        time_out->time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
+static bool insert_sensor_reading(unsigned long long metrics_state_id,
+                int sensor_id, const struct device_single_sensor_data *sensor,
+                const uint16_t *atmospheric_pressure)
+{
+        MYSQL_BIND binds[7];
+        struct temperature_param temperature_param, dew_point_param;
+
+        my_bool temperature_null =
+                DEVICE_IS_INCORRECT_TEMPERATURE(sensor->current.temperature);
+        my_bool humidity_null = sensor->current.humidity == DEVICE_INCORRECT_HUMIDITY;
+        my_bool dew_point_null =
+                DEVICE_IS_INCORRECT_TEMPERATURE(sensor->current.dew_point);
+        my_bool pressure_null = *atmospheric_pressure == DEVICE_INCORRECT_PRESSURE;
+        unsigned char battery_low = sensor->battery_low ? 1 : 0;
+
+        bind_param(&binds[0], MYSQL_TYPE_LONGLONG, &metrics_state_id, true, NULL);
+        bind_param(&binds[1], MYSQL_TYPE_LONG, &sensor_id, false, NULL);
+        bind_temperature(&binds[2], &temperature_param, &sensor->current.temperature,
+                        &temperature_null);
+        bind_param(&binds[3], MYSQL_TYPE_SHORT, &sensor->current.humidity,
+                        true, &humidity_null);
+        bind_temperature(&binds[4], &dew_point_param, &sensor->current.dew_point,
+                        &dew_point_null);
+        bind_param(&binds[5], MYSQL_TYPE_SHORT, atmospheric_pressure,
+                        true, &pressure_null);
+        bind_param(&binds[6], MYSQL_TYPE_TINY, &battery_low, true, NULL);
+
+        return execute_statement(sensor_reading_stmt, binds);
+}
+
+static bool insert_sensor_reading_debug(unsigned long long metrics_state_id,
+                int sensor_id, const struct device_single_sensor_data *sensor,
+                const unsigned char *payload_byte_0x31)
+{
+        MYSQL_BIND binds[7];
+        struct temperature_param temperature_min_param, temperature_max_param;
+
+        const struct device_single_measurement *min = &sensor->historical_min;
+        const struct device_single_measurement *max = &sensor->historical_max;
+
+        my_bool temperature_min_null = DEVICE_IS_INCORRECT_TEMPERATURE(min->temperature);
+        my_bool temperature_max_null = DEVICE_IS_INCORRECT_TEMPERATURE(max->temperature);
+        my_bool humidity_min_null = min->humidity == DEVICE_INCORRECT_HUMIDITY;
+        my_bool humidity_max_null = max->humidity == DEVICE_INCORRECT_HUMIDITY;
+        // Byte 0x31 is stored only with data of the station itself
+        my_bool payload_0x31_null = sensor_id != 0;
+
+        bind_param(&binds[0], MYSQL_TYPE_LONGLONG, &metrics_state_id, true, NULL);
+        bind_param(&binds[1], MYSQL_TYPE_LONG, &sensor_id, false, NULL);
+        bind_temperature(&binds[2], &temperature_min_param, &min->temperature,
+                        &temperature_min_null);
+        bind_temperature(&binds[3], &temperature_max_param, &max->temperature,
+                        &temperature_max_null);
+        bind_param(&binds[4], MYSQL_TYPE_SHORT, &min->humidity,
+                        true, &humidity_min_null);
+        bind_param(&binds[5], MYSQL_TYPE_SHORT, &max->humidity,
+                        true, &humidity_max_null);
+        bind_param(&binds[6], MYSQL_TYPE_TINY, payload_byte_0x31,
+                        true, &payload_0x31_null);
+
+        return execute_statement(sensor_reading_debug_stmt, binds);
+}
+
+bool execute_mysql_statements(const struct device_sensor_state *state)
+{
+        if (metrics_state_stmt == NULL) {
+                return false;
+        }
+
+        MYSQL_BIND binds[3];
+        MYSQL_TIME packet_arrival_time;
+        MYSQL_TIME device_time;
+        char station_mac[STATION_MAC_STRING_SIZE];
+        unsigned long station_mac_length;
+
+        time_to_mysql_time(state->packet_arrival_time, &packet_arrival_time);
+        time_to_mysql_time(state->device_time, &device_time);
+        station_mac_to_string(state->station_mac, station_mac, sizeof(station_mac));
+        station_mac_length = strlen(station_mac);
+
+        bind_param(&binds[0], MYSQL_TYPE_DATETIME, &packet_arrival_time, false, NULL);
+        bind_param(&binds[1], MYSQL_TYPE_DATETIME, &device_time, false, NULL);
+        bind_param(&binds[2], MYSQL_TYPE_STRING, station_mac, false, NULL);
+        binds[2].buffer_length = sizeof(station_mac);
+        binds[2].length = &station_mac_length;
+
+        if (!execute_statement(metrics_state_stmt, binds)) {
+                return false;
+        }
+
+        unsigned long long metrics_state_id = mysql_stmt_insert_id(metrics_state_stmt);
+
+        const uint16_t no_pressure = DEVICE_INCORRECT_PRESSURE;
+        const unsigned char no_payload_byte = 0;
+
+        if (state->station_sensor.any_data_present) {
+                if (!insert_sensor_reading(metrics_state_id, 0,
+                                        &state->station_sensor,
+                                        &state->atmospheric_pressure)
+                                || !insert_sensor_reading_debug(metrics_state_id, 0,
+                                        &state->station_sensor,
+                                        &state->payload_byte_0x31)) {
+                        return false;
+                }
+        }
+
+        for (int i = 0; i < 3; i++) {
+                if (!state->remote_sensors[i].any_data_present) {
+                        continue;
+                }
+                if (!insert_sensor_reading(metrics_state_id, i + 1,
+                                        &state->remote_sensors[i], &no_pressure)
+                                || !insert_sensor_reading_debug(metrics_state_id, i + 1,
+                                        &state->remote_sensors[i], &no_payload_byte)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "emax_em3371.h"
+
+#include <mysql.h>
+
+// Must be called after every successful mysql_real_connect()
+bool prepare_mysql_statements(MYSQL *mysql);
+// Must be called before mysql_close()
+void close_mysql_statements();
+
+// Executes the inserts for one measurement. The caller is responsible for
+// starting and committing the transaction.
+bool execute_mysql_statements(const struct device_sensor_state *state);
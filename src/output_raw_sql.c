@@ -17,39 +17,75 @@
  */
 
 #include "output_raw_sql.h"
+#include "output_file.h"
 #include "output_sql.h"
 #include "main.h"
 
 #include <stdio.h>
 
-static FILE *sql_output_stream = NULL;
-static bool sql_output_stream_close_on_exit = false;
+static struct output_file sql_output;
+// Not in the scratch arena, this output may have its own thread (see sink.h)
+static struct sql_statements_list sql_statements;
 
-bool init_sql_output(const char *output_path)
+bool init_sql_output(const char *output_path, const struct flush_policy *policy,
+                const struct rotation_policy *rotation)
 {
-        return open_output_file(output_path, &sql_output_stream,
-                        &sql_output_stream_close_on_exit, "SQL");
+        return open_buffered_output_file(&sql_output, output_path, policy, rotation,
+                        NULL, "SQL");
 }
 
 void shutdown_sql_output()
 {
-        close_output_file(&sql_output_stream, &sql_output_stream_close_on_exit);
+        close_buffered_output_file(&sql_output);
 }
 
-void display_sensor_state_sql(const struct device_sensor_state *state)
+bool display_sensor_state_sql(const struct device_sensor_state *state)
 {
-        struct sql_statements_list statements;
-        FILE *stream = sql_output_stream;
+        rotate_output_file_if_needed(&sql_output);
+        FILE *stream = sql_output.stream;
+        struct sql_statements_list *statements = &sql_statements;
 
         fprintf(stream, "START TRANSACTION;\n");
 
-        sql_statements_list_construct(&statements);
-        get_sensor_state_sql(&statements, state);
-        for (unsigned i = 0; i < statements.count; i++) {
-                fprintf(stream, "%s;\n", statements.statements[i]);
+        sql_statements_list_construct(statements);
+        get_sensor_state_sql(statements, state);
+        for (unsigned i = 0; i < statements->count; i++) {
+                fprintf(stream, "%s;\n", statements->statements[i]);
         }
-        sql_statements_list_free(&statements);
 
-        fprintf(stream, "COMMIT;\n");
-        fflush(stream);
+        output_file_written(&sql_output);
+        return fprintf(stream, "COMMIT;\n") > 0;
 }
+
+bool flush_sql_output()
+{
+        return flush_output_file(&sql_output, false);
+}
+
+static long get_sql_flush_timeout_ms()
+{
+        return get_output_file_flush_timeout_ms(&sql_output);
+}
+
+static bool is_sql_output_enabled(const struct program_options *options)
+{
+        return options->raw_sql_output_path != NULL;
+}
+
+static bool init_sql_sink(const struct program_options *options)
+{
+        return init_sql_output(options->raw_sql_output_path,
+                        &options->raw_sql_flush_policy, &options->raw_sql_rotation);
+}
+
+const struct sink raw_sql_sink = {
+        .name = "raw_sql",
+        .is_enabled = is_sql_output_enabled,
+        .init = init_sql_sink,
+        .submit = display_sensor_state_sql,
+        .flush = flush_sql_output,
+        .get_flush_timeout_ms = get_sql_flush_timeout_ms,
+        .shutdown = shutdown_sql_output,
+        .threadable = true,
+        .latency_stage = LATENCY_OUTPUT_RAW_SQL,
+};
@@ -19,7 +19,14 @@
 #pragma once
 
 #include "emax_em3371.h"
+#include "output_file.h"
+#include "sink.h"
 
-bool init_sql_output(const char *output_path);
+extern const struct sink raw_sql_sink;
+
+bool init_sql_output(const char *output_path, const struct flush_policy *policy,
+                const struct rotation_policy *rotation);
 void shutdown_sql_output();
-void display_sensor_state_sql(const struct device_sensor_state *state);
+// Returns false if writing failed
+bool display_sensor_state_sql(const struct device_sensor_state *state);
+bool flush_sql_output();
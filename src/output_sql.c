@@ -19,7 +19,10 @@
 
 #include "output_sql.h"
 #include "main.h"
+#include "station_registry.h"
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -33,22 +36,27 @@
                                 ", " FORMAT, SOURCE);                   \
         }
 
+#define SQL_INSERT_TEMPERATURE(NAME, SOURCE)                            \
+        const char *NAME##_field = "";                                  \
+        char NAME##_str[TEMPERATURE_STRING_SIZE + 2] = "";              \
+        if (!DEVICE_IS_INCORRECT_TEMPERATURE(SOURCE)) {                 \
+                NAME##_field = ", " #NAME;                              \
+                NAME##_str[0] = ',';                                    \
+                NAME##_str[1] = ' ';                                    \
+                temperature_to_string(SOURCE, NAME##_str + 2,           \
+                                sizeof(NAME##_str) - 2);                \
+        }
+
 static size_t get_single_sensor_state_debug_sql(char *output, size_t output_space,
                 const int sensor_id,
                 const struct device_single_sensor_data *sensor_data,
                 const unsigned char payload_byte_0x31)
 {
-        SQL_INSERT_CONDITIONAL(temperature_min,
-                sensor_data->historical_min.temperature,
-                "%.2f",
-                !DEVICE_IS_INCORRECT_TEMPERATURE(sensor_data->historical_min.temperature)
-                )
+        SQL_INSERT_TEMPERATURE(temperature_min,
+                sensor_data->historical_min.temperature)
 
-        SQL_INSERT_CONDITIONAL(temperature_max,
-                sensor_data->historical_max.temperature,
-                "%.2f",
-                !DEVICE_IS_INCORRECT_TEMPERATURE(sensor_data->historical_max.temperature)
-                )
+        SQL_INSERT_TEMPERATURE(temperature_max,
+                sensor_data->historical_max.temperature)
 
         SQL_INSERT_CONDITIONAL(humidity_min,
                 (int) sensor_data->historical_min.humidity,
@@ -90,11 +98,8 @@ static size_t get_single_sensor_state_sql(char *output, size_t output_space,
                 const struct device_single_sensor_data *sensor_data,
                 uint16_t atmospheric_pressure)
 {
-        SQL_INSERT_CONDITIONAL(temperature,
-                sensor_data->current.temperature,
-                "%.2f",
-                !DEVICE_IS_INCORRECT_TEMPERATURE(sensor_data->current.temperature)
-                )
+        SQL_INSERT_TEMPERATURE(temperature,
+                sensor_data->current.temperature)
 
         SQL_INSERT_CONDITIONAL(humidity,
                 sensor_data->current.humidity,
@@ -102,11 +107,8 @@ static size_t get_single_sensor_state_sql(char *output, size_t output_space,
                 sensor_data->current.humidity != DEVICE_INCORRECT_HUMIDITY
                 )
 
-        SQL_INSERT_CONDITIONAL(dew_point,
-                sensor_data->current.dew_point,
-                "%.2f",
-                !DEVICE_IS_INCORRECT_TEMPERATURE(sensor_data->current.dew_point)
-                )
+        SQL_INSERT_TEMPERATURE(dew_point,
+                sensor_data->current.dew_point)
 
         SQL_INSERT_CONDITIONAL(atmospheric_pressure,
                 atmospheric_pressure,
@@ -136,45 +138,17 @@ static size_t get_single_sensor_state_sql(char *output, size_t output_space,
                 battery_low_str);
 }
 
-bool sql_statements_list_construct(struct sql_statements_list *statements)
+void sql_statements_list_construct(struct sql_statements_list *statements)
 {
-        statements->count=0;
-        statements->statements = malloc(SQL_STATEMENTS_MAX_COUNT
-                        * sizeof(statements->statements[0]));
-        if (statements->statements == NULL) {
-                return false;
-        }
-        statements->max_count = SQL_STATEMENTS_MAX_COUNT;
-
-        statements->memory = malloc(SQL_STATEMENTS_MEMORY_SIZE);
-        if (statements->memory == NULL) {
-                free(statements->statements);
-                statements->statements = NULL;
-
-                return false;
-        }
-
-        statements->memory_left = SQL_STATEMENTS_MEMORY_SIZE;
+        statements->count = 0;
+        statements->memory_left = sizeof(statements->memory);
         statements->next_statement_place = statements->memory;
-        return true;
-}
-
-void sql_statements_list_free(struct sql_statements_list *statements)
-{
-        free(statements->statements);
-        statements->statements = NULL;
-
-        free(statements->memory);
-        statements->memory = NULL;
-
-        statements->max_count = 0;
-        statements->memory_left = 0;
-        statements->next_statement_place = NULL;
+        statements->memory[0] = '\0';
 }
 
 bool sql_statements_list_arrange_next(struct sql_statements_list *statements)
 {
-        if (statements->count >= statements->max_count) {
+        if (statements->count >= SQL_STATEMENTS_MAX_COUNT) {
                 return false;
         }
 
@@ -217,6 +191,10 @@ void get_sensor_state_sql(
 	time_to_string(state->device_time,
                         device_time_str, sizeof(device_time_str), false);
 
+        char station_mac_str[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(state->station_mac,
+                        station_mac_str, sizeof(station_mac_str));
+
 // TODO: Grafana really requires time stored in the database to be in UTC timezone:
 //
 //      https://community.grafana.com/t/preset-time-frames-broken-shows-no-data-points-date-is-5-hours-ahead/10683/9
@@ -229,9 +207,9 @@ void get_sensor_state_sql(
 
         snprintf(statements->next_statement_place,
                 statements->memory_left,
-                "INSERT INTO metrics_state(time_utc, device_time) "
-                "VALUES ('%s', '%s')",
-                packet_arrival_time_str, device_time_str);
+                "INSERT INTO metrics_state(time_utc, device_time, station_mac) "
+                "VALUES ('%s', '%s', '%s')",
+                packet_arrival_time_str, device_time_str, station_mac_str);
         sql_statements_list_arrange_next(statements);
 
         snprintf(statements->next_statement_place,
@@ -272,3 +250,236 @@ void get_sensor_state_sql(
                 }
         }
 }
+
+#define SQL_TEXT_INITIAL_CAPACITY 4096
+
+bool sql_text_construct(struct sql_text *text)
+{
+        text->data = malloc(SQL_TEXT_INITIAL_CAPACITY);
+        if (text->data == NULL) {
+                text->length = 0;
+                text->capacity = 0;
+                return false;
+        }
+        text->capacity = SQL_TEXT_INITIAL_CAPACITY;
+        sql_text_clear(text);
+        return true;
+}
+
+void sql_text_free(struct sql_text *text)
+{
+        free(text->data);
+        text->data = NULL;
+        text->length = 0;
+        text->capacity = 0;
+}
+
+void sql_text_clear(struct sql_text *text)
+{
+        text->length = 0;
+        if (text->data != NULL) {
+                text->data[0] = '\0';
+        }
+}
+
+bool sql_text_append(struct sql_text *text, const char *format, ...)
+{
+        va_list args;
+
+        while (true) {
+                size_t space = text->capacity - text->length;
+
+                va_start(args, format);
+                int ret = vsnprintf(text->data + text->length, space, format, args);
+                va_end(args);
+
+                if (ret < 0) {
+                        return false;
+                }
+                if ((size_t) ret < space) {
+                        text->length += ret;
+                        return true;
+                }
+
+                // Not enough space, grow the buffer and format again
+                size_t new_capacity = text->capacity * 2;
+                while (new_capacity - text->length <= (size_t) ret) {
+                        new_capacity *= 2;
+                }
+                char *new_data = realloc(text->data, new_capacity);
+                if (new_data == NULL) {
+                        text->data[text->length] = '\0';
+                        return false;
+                }
+                text->data = new_data;
+                text->capacity = new_capacity;
+        }
+}
+
+bool sql_bulk_insert_construct(struct sql_bulk_insert *bulk)
+{
+        bulk->metrics_state_rows = 0;
+        bulk->sensor_reading_rows = 0;
+
+        bool ok = sql_text_construct(&bulk->metrics_state);
+        ok = sql_text_construct(&bulk->sensor_reading) && ok;
+        ok = sql_text_construct(&bulk->sensor_reading_debug) && ok;
+
+        if (!ok) {
+                sql_bulk_insert_free(bulk);
+        }
+        return ok;
+}
+
+void sql_bulk_insert_free(struct sql_bulk_insert *bulk)
+{
+        sql_text_free(&bulk->metrics_state);
+        sql_text_free(&bulk->sensor_reading);
+        sql_text_free(&bulk->sensor_reading_debug);
+        bulk->metrics_state_rows = 0;
+        bulk->sensor_reading_rows = 0;
+}
+
+void sql_bulk_insert_clear(struct sql_bulk_insert *bulk)
+{
+        sql_text_clear(&bulk->metrics_state);
+        sql_text_clear(&bulk->sensor_reading);
+        sql_text_clear(&bulk->sensor_reading_debug);
+        bulk->metrics_state_rows = 0;
+        bulk->sensor_reading_rows = 0;
+}
+
+// In a multi-row INSERT every row must have all columns, missing values are
+// given as NULL.
+static const char *temperature_to_sql(char *output, size_t output_space,
+                device_temperature_t temperature)
+{
+        if (DEVICE_IS_INCORRECT_TEMPERATURE(temperature)) {
+                return "NULL";
+        }
+        temperature_to_string(temperature, output, output_space);
+        return output;
+}
+
+static const char *integer_to_sql(char *output, size_t output_space,
+                int value, bool is_present)
+{
+        if (!is_present) {
+                return "NULL";
+        }
+        snprintf(output, output_space, "%d", value);
+        return output;
+}
+
+static bool sql_bulk_insert_add_sensor(struct sql_bulk_insert *bulk,
+                unsigned long metrics_state_id, const int sensor_id,
+                const struct device_single_sensor_data *sensor_data,
+                uint16_t atmospheric_pressure,
+                const unsigned char payload_byte_0x31)
+{
+        char temperature[12], humidity[12], dew_point[12], pressure[12];
+        char temperature_min[12], temperature_max[12];
+        char humidity_min[12], humidity_max[12], payload_0x31[12];
+
+        const struct device_single_measurement *current = &sensor_data->current;
+        const struct device_single_measurement *min = &sensor_data->historical_min;
+        const struct device_single_measurement *max = &sensor_data->historical_max;
+
+        const char *separator = ",";
+        if (bulk->sensor_reading_rows == 0) {
+                separator = "";
+                if (!sql_text_append(&bulk->sensor_reading,
+                                "INSERT INTO sensor_reading(metrics_state_id, "
+                                "sensor_id, temperature, humidity, dew_point, "
+                                "atmospheric_pressure, battery_low) VALUES ")
+                        || !sql_text_append(&bulk->sensor_reading_debug,
+                                "INSERT INTO sensor_reading_debug(metrics_state_id, "
+                                "sensor_id, temperature_min, temperature_max, "
+                                "humidity_min, humidity_max, payload_0x31) VALUES ")) {
+                        return false;
+                }
+        }
+
+        if (!sql_text_append(&bulk->sensor_reading,
+                        "%s(%lu, %d, %s, %s, %s, %s, b'%d')",
+                        separator, metrics_state_id, sensor_id,
+                        temperature_to_sql(temperature, sizeof(temperature),
+                                current->temperature),
+                        integer_to_sql(humidity, sizeof(humidity), current->humidity,
+                                current->humidity != DEVICE_INCORRECT_HUMIDITY),
+                        temperature_to_sql(dew_point, sizeof(dew_point),
+                                current->dew_point),
+                        integer_to_sql(pressure, sizeof(pressure), atmospheric_pressure,
+                                atmospheric_pressure != DEVICE_INCORRECT_PRESSURE),
+                        sensor_data->battery_low ? 1 : 0)) {
+                return false;
+        }
+
+        if (!sql_text_append(&bulk->sensor_reading_debug,
+                        "%s(%lu, %d, %s, %s, %s, %s, %s)",
+                        separator, metrics_state_id, sensor_id,
+                        temperature_to_sql(temperature_min, sizeof(temperature_min),
+                                min->temperature),
+                        temperature_to_sql(temperature_max, sizeof(temperature_max),
+                                max->temperature),
+                        integer_to_sql(humidity_min, sizeof(humidity_min), min->humidity,
+                                min->humidity != DEVICE_INCORRECT_HUMIDITY),
+                        integer_to_sql(humidity_max, sizeof(humidity_max), max->humidity,
+                                max->humidity != DEVICE_INCORRECT_HUMIDITY),
+                        integer_to_sql(payload_0x31, sizeof(payload_0x31),
+                                payload_byte_0x31, sensor_id == 0))) {
+                return false;
+        }
+
+        bulk->sensor_reading_rows++;
+        return true;
+}
+
+bool sql_bulk_insert_add(struct sql_bulk_insert *bulk,
+                const struct device_sensor_state *state,
+                unsigned long metrics_state_id)
+{
+	char packet_arrival_time_str[30];
+	time_to_string(state->packet_arrival_time, packet_arrival_time_str,
+                        sizeof(packet_arrival_time_str), false);
+
+	char device_time_str[30];
+	time_to_string(state->device_time,
+                        device_time_str, sizeof(device_time_str), false);
+
+        char station_mac_str[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(state->station_mac,
+                        station_mac_str, sizeof(station_mac_str));
+
+        if (!sql_text_append(&bulk->metrics_state, "%s(%lu, '%s', '%s', '%s')",
+                        bulk->metrics_state_rows == 0 ?
+                                "INSERT INTO metrics_state(metrics_state_id, "
+                                "time_utc, device_time, station_mac) VALUES "
+                                : ",",
+                        metrics_state_id, packet_arrival_time_str,
+                        device_time_str, station_mac_str)) {
+                return false;
+        }
+        bulk->metrics_state_rows++;
+
+        if (state->station_sensor.any_data_present) {
+                if (!sql_bulk_insert_add_sensor(bulk, metrics_state_id, 0,
+                                        &state->station_sensor,
+                                        state->atmospheric_pressure,
+                                        state->payload_byte_0x31)) {
+                        return false;
+                }
+        }
+        for (int i=0; i<3; i++) {
+                if (!state->remote_sensors[i].any_data_present) {
+                        continue;
+                }
+                if (!sql_bulk_insert_add_sensor(bulk, metrics_state_id, i+1,
+                                        &state->remote_sensors[i],
+                                        DEVICE_INCORRECT_PRESSURE, 0)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
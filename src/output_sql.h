@@ -19,21 +19,60 @@
 
 #include "emax_em3371.h"
 
+#define SQL_STATEMENTS_MAX_COUNT 20
+#define SQL_STATEMENTS_MEMORY_SIZE 8*1024
+
+// Does not allocate memory by itself, so that it may be placed in static or
+// scratch memory (see scratch_arena.h).
 struct sql_statements_list {
         unsigned int count;
-        char **statements;
+        char *statements[SQL_STATEMENTS_MAX_COUNT];
 
 // private
-        unsigned int max_count;
-        char *memory;
         char *next_statement_place;
         size_t memory_left;
+        char memory[SQL_STATEMENTS_MEMORY_SIZE];
 };
-#define SQL_STATEMENTS_MAX_COUNT 20
-#define SQL_STATEMENTS_MEMORY_SIZE 8*1024
 
-bool sql_statements_list_construct(struct sql_statements_list *statements);
-void sql_statements_list_free(struct sql_statements_list *statements);
+void sql_statements_list_construct(struct sql_statements_list *statements);
 
 void get_sensor_state_sql(struct sql_statements_list *statements,
                 const struct device_sensor_state *state);
+
+// A growing buffer for long SQL statements
+struct sql_text {
+        char *data;
+        size_t length;
+
+// private
+        size_t capacity;
+};
+
+bool sql_text_construct(struct sql_text *text);
+void sql_text_free(struct sql_text *text);
+void sql_text_clear(struct sql_text *text);
+bool sql_text_append(struct sql_text *text, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+/*
+ * Multi-row INSERT statements for many measurements at once, used to upload
+ * the contents of the MySQL buffer quickly.
+ *
+ * Identifiers of metrics_state rows are assigned by the caller, so that the
+ * sensor_reading rows can refer to them without LAST_INSERT_ID().
+ */
+struct sql_bulk_insert {
+        struct sql_text metrics_state;
+        struct sql_text sensor_reading;
+        struct sql_text sensor_reading_debug;
+
+        unsigned long metrics_state_rows;
+        unsigned long sensor_reading_rows;
+};
+
+bool sql_bulk_insert_construct(struct sql_bulk_insert *bulk);
+void sql_bulk_insert_free(struct sql_bulk_insert *bulk);
+void sql_bulk_insert_clear(struct sql_bulk_insert *bulk);
+bool sql_bulk_insert_add(struct sql_bulk_insert *bulk,
+                const struct device_sensor_state *state,
+                unsigned long metrics_state_id);
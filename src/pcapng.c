@@ -0,0 +1,398 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "pcapng.h"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define BLOCK_TYPE_SECTION_HEADER 0x0a0d0d0a
+#define BLOCK_TYPE_INTERFACE_DESCRIPTION 1
+#define BLOCK_TYPE_ENHANCED_PACKET 6
+#define BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define OPTION_END 0
+#define OPTION_EPB_FLAGS 2
+#define OPTION_IF_TSRESOL 9
+
+#define IPV4_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+#define IPPROTO_UDP_NUMBER 17
+#define ETHERTYPE_IPV4_NUMBER 0x0800
+#define ETHERTYPE_VLAN_NUMBER 0x8100
+
+// Blocks are written in the byte order of this computer, as the format
+// allows. The reader only accepts files in the same byte order.
+static void put_u16(unsigned char *out, uint16_t value)
+{
+        memcpy(out, &value, sizeof(value));
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+        memcpy(out, &value, sizeof(value));
+}
+
+static void put_u64(unsigned char *out, uint64_t value)
+{
+        memcpy(out, &value, sizeof(value));
+}
+
+static uint16_t get_u16(const unsigned char *in)
+{
+        uint16_t value;
+        memcpy(&value, in, sizeof(value));
+        return value;
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+        uint32_t value;
+        memcpy(&value, in, sizeof(value));
+        return value;
+}
+
+// Network byte order, for packet headers
+static void put_be16(unsigned char *out, uint16_t value)
+{
+        out[0] = value >> 8;
+        out[1] = value & 0xff;
+}
+
+static uint16_t get_be16(const unsigned char *in)
+{
+        return ((uint16_t) in[0] << 8) | in[1];
+}
+
+static size_t padded_size(size_t size)
+{
+        return (size + 3) & ~(size_t) 3;
+}
+
+bool pcapng_write_header(FILE *file)
+{
+        unsigned char section_header[28];
+        put_u32(section_header, BLOCK_TYPE_SECTION_HEADER);
+        put_u32(section_header + 4, sizeof(section_header));
+        put_u32(section_header + 8, BYTE_ORDER_MAGIC);
+        put_u16(section_header + 12, 1);        // major version
+        put_u16(section_header + 14, 0);        // minor version
+        put_u64(section_header + 16, UINT64_MAX); // section length not known
+        put_u32(section_header + 24, sizeof(section_header));
+
+        unsigned char interface[32];
+        memset(interface, 0, sizeof(interface));
+        put_u32(interface, BLOCK_TYPE_INTERFACE_DESCRIPTION);
+        put_u32(interface + 4, sizeof(interface));
+        put_u16(interface + 8, PCAPNG_LINKTYPE_IPV4);
+        put_u32(interface + 12, 0);             // no snapshot length limit
+        put_u16(interface + 16, OPTION_IF_TSRESOL);
+        put_u16(interface + 18, 1);
+        interface[20] = 9;                      // nanoseconds
+        put_u16(interface + 24, OPTION_END);
+        put_u32(interface + 28, sizeof(interface));
+
+        return fwrite(section_header, sizeof(section_header), 1, file) == 1
+                && fwrite(interface, sizeof(interface), 1, file) == 1;
+}
+
+static uint16_t ipv4_header_checksum(const unsigned char *header)
+{
+        uint32_t sum = 0;
+        for (int i = 0; i < IPV4_HEADER_SIZE; i += 2) {
+                sum += get_be16(header + i);
+        }
+        while (sum > 0xffff) {
+                sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return ~sum;
+}
+
+bool pcapng_write_udp_packet(FILE *file, uint64_t timestamp_ns,
+                enum pcapng_direction direction,
+                const struct sockaddr_in *source, const struct sockaddr_in *destination,
+                const unsigned char *payload, size_t size)
+{
+        const size_t ip_size = IPV4_HEADER_SIZE + UDP_HEADER_SIZE + size;
+        if (ip_size > UINT16_MAX) {
+                return false;
+        }
+        const size_t data_size = padded_size(ip_size);
+        const uint32_t block_size = 28 + data_size + 12 + 4;
+
+        unsigned char header[28 + IPV4_HEADER_SIZE + UDP_HEADER_SIZE];
+        put_u32(header, BLOCK_TYPE_ENHANCED_PACKET);
+        put_u32(header + 4, block_size);
+        put_u32(header + 8, 0);                 // interface
+        put_u32(header + 12, timestamp_ns >> 32);
+        put_u32(header + 16, timestamp_ns & 0xffffffff);
+        put_u32(header + 20, ip_size);          // captured length
+        put_u32(header + 24, ip_size);          // original length
+
+        unsigned char *ip = header + 28;
+        memset(ip, 0, IPV4_HEADER_SIZE);
+        ip[0] = 0x45;                           // version 4, 20 bytes of header
+        put_be16(ip + 2, ip_size);
+        put_be16(ip + 6, 0x4000);               // don't fragment
+        ip[8] = 64;                             // TTL
+        ip[9] = IPPROTO_UDP_NUMBER;
+        memcpy(ip + 12, &source->sin_addr, 4);
+        memcpy(ip + 16, &destination->sin_addr, 4);
+        put_be16(ip + 10, ipv4_header_checksum(ip));
+
+        unsigned char *udp = ip + IPV4_HEADER_SIZE;
+        memcpy(udp, &source->sin_port, 2);
+        memcpy(udp + 2, &destination->sin_port, 2);
+        put_be16(udp + 4, UDP_HEADER_SIZE + size);
+        put_be16(udp + 6, 0);                   // no checksum
+
+        unsigned char trailer[3 + 12 + 4];
+        size_t padding = data_size - ip_size;
+        memset(trailer, 0, padding);
+        unsigned char *options = trailer + padding;
+        put_u16(options, OPTION_EPB_FLAGS);
+        put_u16(options + 2, 4);
+        put_u32(options + 4, direction);
+        put_u16(options + 8, OPTION_END);
+        put_u16(options + 10, 0);
+        put_u32(options + 12, block_size);
+
+        return fwrite(header, sizeof(header), 1, file) == 1
+                && (size == 0 || fwrite(payload, size, 1, file) == 1)
+                && fwrite(trailer, padding + 16, 1, file) == 1;
+}
+
+bool pcapng_reader_open(struct pcapng_reader *reader, const char *path)
+{
+        reader->path = path;
+        reader->interface_count = 0;
+        reader->file = fopen(path, "rb");
+        if (reader->file == NULL) {
+                char error_msg[1000];
+                snprintf(error_msg, sizeof(error_msg), "Cannot open capture file '%s'", path);
+                perror(error_msg);
+                return false;
+        }
+        return true;
+}
+
+void pcapng_reader_close(struct pcapng_reader *reader)
+{
+        if (reader->file != NULL) {
+                fclose(reader->file);
+                reader->file = NULL;
+        }
+}
+
+static void read_interface_description(struct pcapng_reader *reader, uint32_t block_size)
+{
+        if (reader->interface_count >= PCAPNG_MAX_INTERFACES || block_size < 20) {
+                // Packets from this interface will be skipped
+                reader->interface_count++;
+                return;
+        }
+
+        struct pcapng_interface *interface = &reader->interfaces[reader->interface_count++];
+        interface->link_type = get_u16(reader->block + 8);
+        interface->resolution = 1000000;
+
+        const unsigned char *option = reader->block + 16;
+        const unsigned char *end = reader->block + block_size - 4;
+        while (option + 4 <= end) {
+                uint16_t code = get_u16(option);
+                uint16_t length = get_u16(option + 2);
+                if (code == OPTION_END || option + 4 + length > end) {
+                        break;
+                }
+                if (code == OPTION_IF_TSRESOL && length >= 1) {
+                        unsigned char exponent = option[4] & 0x7f;
+                        uint64_t resolution = 1;
+                        for (unsigned char i = 0; i < exponent && resolution < UINT64_MAX / 10; i++) {
+                                resolution *= (option[4] & 0x80) ? 2 : 10;
+                        }
+                        interface->resolution = resolution;
+                }
+                option += 4 + padded_size(length);
+        }
+}
+
+static uint64_t timestamp_to_ns(uint64_t timestamp, uint64_t resolution)
+{
+        if (resolution == 1000000000) {
+                return timestamp;
+        }
+        return timestamp / resolution * 1000000000
+                + timestamp % resolution * 1000000000 / resolution;
+}
+
+// Finds the UDP payload in a captured packet.
+static bool parse_udp_packet(struct pcapng_udp_packet *packet, uint16_t link_type,
+                const unsigned char *data, size_t size)
+{
+        if (link_type == PCAPNG_LINKTYPE_ETHERNET) {
+                if (size < 14) {
+                        return false;
+                }
+                size_t offset = 12;
+                if (get_be16(data + offset) == ETHERTYPE_VLAN_NUMBER && size >= 18) {
+                        offset += 4;
+                }
+                if (get_be16(data + offset) != ETHERTYPE_IPV4_NUMBER) {
+                        return false;
+                }
+                data += offset + 2;
+                size -= offset + 2;
+        } else if (link_type != PCAPNG_LINKTYPE_RAW && link_type != PCAPNG_LINKTYPE_IPV4) {
+                return false;
+        }
+
+        if (size < IPV4_HEADER_SIZE || (data[0] >> 4) != 4) {
+                return false;
+        }
+        size_t header_size = (data[0] & 0x0f) * 4;
+        size_t ip_size = get_be16(data + 2);
+        // Fragments are not supported
+        if (header_size < IPV4_HEADER_SIZE || data[9] != IPPROTO_UDP_NUMBER
+                        || (get_be16(data + 6) & 0x3fff) != 0
+                        || ip_size > size || ip_size < header_size + UDP_HEADER_SIZE) {
+                return false;
+        }
+
+        const unsigned char *udp = data + header_size;
+        size_t udp_size = get_be16(udp + 4);
+        if (udp_size < UDP_HEADER_SIZE || udp_size > ip_size - header_size) {
+                return false;
+        }
+
+        memset(&packet->source, 0, sizeof(packet->source));
+        packet->source.sin_family = AF_INET;
+        memcpy(&packet->source.sin_addr, data + 12, 4);
+        memcpy(&packet->source.sin_port, udp, 2);
+
+        memset(&packet->destination, 0, sizeof(packet->destination));
+        packet->destination.sin_family = AF_INET;
+        memcpy(&packet->destination.sin_addr, data + 16, 4);
+        memcpy(&packet->destination.sin_port, udp + 2, 2);
+
+        packet->payload = udp + UDP_HEADER_SIZE;
+        packet->size = udp_size - UDP_HEADER_SIZE;
+        return true;
+}
+
+static bool read_enhanced_packet(struct pcapng_reader *reader, uint32_t block_size,
+                struct pcapng_udp_packet *packet)
+{
+        if (block_size < 32) {
+                return false;
+        }
+        uint32_t interface_id = get_u32(reader->block + 8);
+        uint32_t captured_size = get_u32(reader->block + 20);
+        if (interface_id >= reader->interface_count
+                        || interface_id >= PCAPNG_MAX_INTERFACES
+                        || 28 + padded_size(captured_size) + 4 > block_size) {
+                return false;
+        }
+        const struct pcapng_interface *interface = &reader->interfaces[interface_id];
+
+        uint64_t timestamp = ((uint64_t) get_u32(reader->block + 12) << 32)
+                | get_u32(reader->block + 16);
+        packet->timestamp_ns = timestamp_to_ns(timestamp, interface->resolution);
+
+        packet->direction = PCAPNG_DIRECTION_UNKNOWN;
+        const unsigned char *option = reader->block + 28 + padded_size(captured_size);
+        const unsigned char *end = reader->block + block_size - 4;
+        while (option + 4 <= end) {
+                uint16_t code = get_u16(option);
+                uint16_t length = get_u16(option + 2);
+                if (code == OPTION_END || option + 4 + length > end) {
+                        break;
+                }
+                if (code == OPTION_EPB_FLAGS && length == 4) {
+                        packet->direction = get_u32(option + 4) & 0x3;
+                }
+                option += 4 + padded_size(length);
+        }
+
+        return parse_udp_packet(packet, interface->link_type,
+                        reader->block + 28, captured_size);
+}
+
+int pcapng_read_udp_packet(struct pcapng_reader *reader,
+                struct pcapng_udp_packet *packet)
+{
+        while (true) {
+                size_t ret = fread(reader->block, 1, 8, reader->file);
+                if (ret == 0 && feof(reader->file)) {
+                        return 0;
+                }
+                if (ret != 8) {
+                        break;
+                }
+
+                uint32_t block_type = get_u32(reader->block);
+                uint32_t block_size = get_u32(reader->block + 4);
+
+                if (block_type == BLOCK_TYPE_SECTION_HEADER) {
+                        if (fread(reader->block + 8, 1, 4, reader->file) != 4) {
+                                break;
+                        }
+                        if (get_u32(reader->block + 8) != BYTE_ORDER_MAGIC) {
+                                fprintf(stderr, "Capture file '%s' has a different "
+                                                "byte order, not supported\n", reader->path);
+                                return -1;
+                        }
+                        reader->interface_count = 0;
+                        if (block_size < 28 || block_size % 4 != 0
+                                        || fseek(reader->file, block_size - 12, SEEK_CUR) != 0) {
+                                break;
+                        }
+                        continue;
+                }
+
+                if (block_size < 12 || block_size % 4 != 0) {
+                        break;
+                }
+                if (block_size > sizeof(reader->block)) {
+                        if (fseek(reader->file, block_size - 8, SEEK_CUR) != 0) {
+                                break;
+                        }
+                        continue;
+                }
+                if (fread(reader->block + 8, 1, block_size - 8, reader->file)
+                                != block_size - 8) {
+                        break;
+                }
+
+                if (block_type == BLOCK_TYPE_INTERFACE_DESCRIPTION) {
+                        read_interface_description(reader, block_size);
+                } else if (block_type == BLOCK_TYPE_ENHANCED_PACKET
+                                && read_enhanced_packet(reader, block_size, packet)) {
+                        return 1;
+                }
+        }
+
+        if (ferror(reader->file)) {
+                fprintf(stderr, "Cannot read capture file '%s': %s\n",
+                                reader->path, strerror(errno));
+        } else {
+                fprintf(stderr, "Capture file '%s' is truncated or corrupted\n",
+                                reader->path);
+        }
+        return -1;
+}
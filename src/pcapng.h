@@ -0,0 +1,91 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Reading and writing of UDP datagrams in pcapng files (the PCAP Next
+ * Generation format, as described in the IETF draft draft-ietf-opsawg-pcapng),
+ * which can be opened e.g. in Wireshark.
+ *
+ * Written files contain IPv4 packets (LINKTYPE_IPV4) with headers
+ * reconstructed from the socket addresses, timestamps with nanosecond
+ * resolution and the direction of every packet. Besides such files, the
+ * reader accepts captures of UDP over IPv4 made e.g. by tcpdump on Ethernet.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_LINKTYPE_RAW 101
+#define PCAPNG_LINKTYPE_IPV4 228
+
+#define PCAPNG_MAX_INTERFACES 16
+// Blocks with bigger packets are skipped
+#define PCAPNG_MAX_BLOCK_SIZE (64 * 1024 + 128)
+
+enum pcapng_direction {
+        PCAPNG_DIRECTION_UNKNOWN = 0,
+        PCAPNG_DIRECTION_INBOUND = 1,
+        PCAPNG_DIRECTION_OUTBOUND = 2,
+};
+
+struct pcapng_udp_packet {
+        uint64_t timestamp_ns;
+        enum pcapng_direction direction;
+        struct sockaddr_in source;
+        struct sockaddr_in destination;
+        // Points into the reader, valid until the next read
+        const unsigned char *payload;
+        size_t size;
+};
+
+// Writes the section header and interface description blocks. Must be
+// called before writing packets, may be called again when appending to
+// an existing file.
+bool pcapng_write_header(FILE *file);
+bool pcapng_write_udp_packet(FILE *file, uint64_t timestamp_ns,
+                enum pcapng_direction direction,
+                const struct sockaddr_in *source, const struct sockaddr_in *destination,
+                const unsigned char *payload, size_t size);
+
+struct pcapng_interface {
+        uint16_t link_type;
+        // Timestamp units per second
+        uint64_t resolution;
+};
+
+struct pcapng_reader {
+        FILE *file;
+        const char *path;
+        unsigned int interface_count;
+        struct pcapng_interface interfaces[PCAPNG_MAX_INTERFACES];
+        unsigned char block[PCAPNG_MAX_BLOCK_SIZE];
+};
+
+bool pcapng_reader_open(struct pcapng_reader *reader, const char *path);
+void pcapng_reader_close(struct pcapng_reader *reader);
+
+// Returns 1 if a packet was read, 0 at the end of the file or -1 on error.
+// Packets other than UDP over IPv4 are skipped.
+int pcapng_read_udp_packet(struct pcapng_reader *reader,
+                struct pcapng_udp_packet *packet);
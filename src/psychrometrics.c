@@ -78,7 +78,10 @@
  * Z(T) = (b - T/d) * T / (T + c)
  */
 
+#include "psychrometrics.h"
+
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 static inline double sqr(double x)
@@ -119,3 +122,71 @@ double dew_point(double dry_bulb_temperature, double rel_humidity)
                 return dew_point_on_ice(dry_bulb_temperature, rel_humidity);
         }
 }
+
+#ifdef DEW_POINT_TABLE_STATIC
+static const int16_t dew_point_table[DEW_POINT_TABLE_ENTRIES] = {
+#include "dew_point_table.inc"
+};
+#else
+static int16_t dew_point_table[DEW_POINT_TABLE_ENTRIES];
+static bool dew_point_table_filled = false;
+#endif
+
+// For every humidity, the dew points for all temperatures are next to each
+// other, so that interpolation reads adjacent entries.
+void fill_dew_point_table(int16_t *table)
+{
+        for (int humidity = 1; humidity <= 100; humidity++) {
+                int16_t *row = table + (humidity - 1) * DEW_POINT_TABLE_POINTS;
+
+                for (int i = 0; i < DEW_POINT_TABLE_ICE_POINTS; i++) {
+                        double temperature = DEW_POINT_TABLE_MIN_TEMPERATURE
+                                + i * DEW_POINT_TABLE_STEP;
+                        row[i] = lround(dew_point_on_ice(temperature, humidity) * 100.);
+                }
+                for (int i = 0; i < DEW_POINT_TABLE_WATER_POINTS; i++) {
+                        double temperature = i * DEW_POINT_TABLE_STEP;
+                        row[DEW_POINT_TABLE_ICE_POINTS + i] =
+                                lround(dew_point_on_water(temperature, humidity) * 100.);
+                }
+        }
+}
+
+int16_t dew_point_from_table(int temperature, unsigned int rel_humidity)
+{
+        const int step = DEW_POINT_TABLE_STEP * 100;
+
+        if (rel_humidity < 1 || rel_humidity > 100
+                        || temperature < DEW_POINT_TABLE_MIN_TEMPERATURE * 100
+                        || temperature > DEW_POINT_TABLE_MAX_TEMPERATURE * 100) {
+                return DEW_POINT_NOT_IN_TABLE;
+        }
+
+#ifndef DEW_POINT_TABLE_STATIC
+        if (!dew_point_table_filled) {
+                fill_dew_point_table(dew_point_table);
+                dew_point_table_filled = true;
+        }
+#endif
+
+        const int16_t *row = dew_point_table + (rel_humidity - 1) * DEW_POINT_TABLE_POINTS;
+        int offset, index;
+        if (temperature < 0) {
+                offset = temperature - DEW_POINT_TABLE_MIN_TEMPERATURE * 100;
+                index = offset / step;
+        } else {
+                offset = temperature;
+                index = DEW_POINT_TABLE_ICE_POINTS + offset / step;
+        }
+
+        int fraction = offset % step;
+        if (fraction == 0) {
+                return row[index];
+        }
+
+        // Rounded to nearest
+        int difference = row[index + 1] - row[index];
+        int correction = difference * fraction;
+        correction += correction >= 0 ? step / 2 : -step / 2;
+        return row[index] + correction / step;
+}
@@ -18,4 +18,39 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 double dew_point(double dry_bulb_temperature, double rel_humidity);
+
+/*
+ * Dew point from a precomputed table, for devices with software floating
+ * point emulation.
+ *
+ * The table contains dew points in hundredths of °C for every integer
+ * relative humidity and temperatures every DEW_POINT_TABLE_STEP °C, which
+ * covers the range of the weather station sensors. Values in between are
+ * interpolated linearly. Below 0°C the dew point is calculated over ice and
+ * above over water (see dew_point()), so there are separate parts of the
+ * table for both, each including 0°C.
+ *
+ * By default the table is calculated on first use. "make DEW_POINT_TABLE=static"
+ * generates it at build time into read-only memory.
+ */
+#define DEW_POINT_TABLE_MIN_TEMPERATURE (-40)
+#define DEW_POINT_TABLE_MAX_TEMPERATURE 70
+#define DEW_POINT_TABLE_STEP 2
+#define DEW_POINT_TABLE_ICE_POINTS (-DEW_POINT_TABLE_MIN_TEMPERATURE / DEW_POINT_TABLE_STEP + 1)
+#define DEW_POINT_TABLE_WATER_POINTS (DEW_POINT_TABLE_MAX_TEMPERATURE / DEW_POINT_TABLE_STEP + 1)
+#define DEW_POINT_TABLE_POINTS (DEW_POINT_TABLE_ICE_POINTS + DEW_POINT_TABLE_WATER_POINTS)
+#define DEW_POINT_TABLE_ENTRIES (100 * DEW_POINT_TABLE_POINTS)
+
+// Returned by dew_point_from_table() for values outside of the table
+#define DEW_POINT_NOT_IN_TABLE INT16_MIN
+
+// Temperature and the result in hundredths of °C, relative humidity in %.
+// Uses only integer operations once the table is ready.
+int16_t dew_point_from_table(int temperature, unsigned int rel_humidity);
+
+// Used to generate the table at build time
+void fill_dew_point_table(int16_t *table);
@@ -18,9 +18,14 @@
 
 #include "psychrometrics.h"
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/time.h>
 
+// Differences between the dew point table and dew_point() come from rounding
+// to hundredths of °C and interpolation.
+#define DEW_POINT_TABLE_MAX_ERROR 0.015
+
 void print_dew_point(double temperature, double humidity, double reference)
 {
         fprintf(stdout, "%.2f °C, %.2f %% humidity => dew point %.2f (reference: %.1f)\n",
@@ -62,6 +67,91 @@ void dew_point_calculation_benchmarks()
         fprintf(stderr, "Sum = %f\n", sum);
 }
 
+static double elapsed_time(const struct timeval *start, const struct timeval *end)
+{
+        return (end->tv_sec - start->tv_sec)
+                + (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+// Checks every temperature that the weather station may report (in steps of
+// 0.1°F) within the range of the table, with every humidity.
+bool dew_point_table_validation()
+{
+        double max_error = 0;
+        double max_error_temperature = 0;
+        int max_error_humidity = 0;
+
+        for (int i = -400; i <= 1580; i++) {
+                double temperature = fahrenheit_to_celcius(i / 10.0);
+
+                for (int humidity = 1; humidity <= 100; humidity++) {
+                        int16_t value = dew_point_from_table(
+                                        lround(temperature * 100), humidity);
+                        if (value == DEW_POINT_NOT_IN_TABLE) {
+                                fprintf(stdout, "Dew point table: no value for "
+                                                "%.2f °C, %d %% humidity\n",
+                                                temperature, humidity);
+                                return false;
+                        }
+
+                        double error = fabs(value / 100.0 - dew_point(temperature, humidity));
+                        if (error > max_error) {
+                                max_error = error;
+                                max_error_temperature = temperature;
+                                max_error_humidity = humidity;
+                        }
+                }
+        }
+
+        fprintf(stdout, "Dew point table: %zu bytes, maximum error %.4f °C "
+                        "(at %.2f °C, %d %% humidity)\n",
+                        sizeof(int16_t) * DEW_POINT_TABLE_ENTRIES, max_error,
+                        max_error_temperature, max_error_humidity);
+
+        return max_error <= DEW_POINT_TABLE_MAX_ERROR;
+}
+
+void dew_point_table_benchmarks()
+{
+        const int repeats = 10;
+        double sum = 0;
+        long table_sum = 0;
+        struct timeval start;
+        struct timeval middle;
+        struct timeval end;
+
+        // Fill the table before measuring
+        dew_point_from_table(0, 50);
+
+        gettimeofday(&start, NULL);
+        for (int k = 0; k < repeats; k++) {
+                for (int i = DEW_POINT_TABLE_MIN_TEMPERATURE; i < DEW_POINT_TABLE_MAX_TEMPERATURE; i++) {
+                        for (int j = 1; j <= 100; j++) {
+                                sum += dew_point(i + 0.37, j);
+                        }
+                }
+        }
+        gettimeofday(&middle, NULL);
+        for (int k = 0; k < repeats; k++) {
+                for (int i = DEW_POINT_TABLE_MIN_TEMPERATURE; i < DEW_POINT_TABLE_MAX_TEMPERATURE; i++) {
+                        for (int j = 1; j <= 100; j++) {
+                                table_sum += dew_point_from_table(i * 100 + 37, j);
+                        }
+                }
+        }
+        gettimeofday(&end, NULL);
+
+        double calculation_time = elapsed_time(&start, &middle);
+        double table_time = elapsed_time(&middle, &end);
+        int count = repeats * (DEW_POINT_TABLE_MAX_TEMPERATURE - DEW_POINT_TABLE_MIN_TEMPERATURE) * 100;
+
+        fprintf(stderr, "%d dew point calculations: %f s, from the table: %f s "
+                        "(%.1f times faster)\n",
+                        count, calculation_time, table_time,
+                        calculation_time / (table_time > 0 ? table_time : 1e-6));
+        fprintf(stderr, "Sum = %f, from the table: %f\n", sum, table_sum / 100.0);
+}
+
 int main()
 {
         fprintf(stdout, "Small differences are normal as there is some variation in formulas\n");
@@ -101,9 +191,16 @@ int main()
 
         dew_point_calculation_benchmarks();
 
+        bool table_correct = dew_point_table_validation();
+        dew_point_table_benchmarks();
+
         fprintf(stdout, "\n\nShould display \"nan\" and possibly an error message:\n");
 
         print_dew_point( 10, 0, nan(""));
 
+        if (!table_correct) {
+                fprintf(stdout, "Dew point table differs too much from dew_point()!\n");
+                return 1;
+        }
         return 0;
 }
@@ -0,0 +1,161 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "replay.h"
+#include "main.h"
+#include "event_loop.h"
+#include "pcapng.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+static struct pcapng_reader reader;
+static const struct program_options *replay_options = NULL;
+static struct event_timer replay_timer;
+
+static bool replay_running = false;
+static bool replay_finished = false;
+static bool replay_error = false;
+
+// The packet that has been read, but is not due yet
+static struct pcapng_udp_packet pending_packet;
+static bool have_pending_packet = false;
+
+static uint64_t first_packet_timestamp_ns;
+static uint64_t replay_start_ms;
+static struct timespec replay_start_time;
+static unsigned long packets_replayed = 0;
+static unsigned long packets_skipped = 0;
+
+static void finish_replay()
+{
+        struct timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double elapsed = (end_time.tv_sec - replay_start_time.tv_sec)
+                + (end_time.tv_nsec - replay_start_time.tv_nsec) / 1e9;
+
+        fprintf(stderr, "Replayed %lu packets (%lu other packets skipped) "
+                        "in %.3f s, %.0f packets/s\n",
+                        packets_replayed, packets_skipped, elapsed,
+                        elapsed > 0 ? packets_replayed / elapsed : 0.0);
+
+        pcapng_reader_close(&reader);
+        replay_running = false;
+        replay_finished = true;
+}
+
+// Packets sent by this program are in the capture too
+static bool is_packet_for_us(const struct pcapng_udp_packet *packet)
+{
+        if (packet->direction != PCAPNG_DIRECTION_UNKNOWN) {
+                return packet->direction == PCAPNG_DIRECTION_INBOUND;
+        }
+        return ntohs(packet->destination.sin_port) == replay_options->bind_port;
+}
+
+static void replay_packet(const struct pcapng_udp_packet *packet)
+{
+        if (!is_packet_for_us(packet)) {
+                packets_skipped++;
+                return;
+        }
+
+        packets_replayed++;
+        // Latency is measured from the time the packet is replayed
+        uint64_t arrival_ns = latency_now_ns();
+        process_incoming_packet(-1, &packet->source, packet->payload, packet->size,
+                        packet->timestamp_ns / 1000000000, arrival_ns, replay_options);
+        latency_record_since(LATENCY_HANDLED, arrival_ns);
+}
+
+static void on_replay_timer(void *data)
+{
+        (void) data;
+
+        for (int i = 0; i < REPLAY_BATCH_SIZE; i++) {
+                if (!have_pending_packet) {
+                        int ret = pcapng_read_udp_packet(&reader, &pending_packet);
+                        if (ret != 1) {
+                                replay_error = ret == -1;
+                                finish_replay();
+                                return;
+                        }
+                        if (packets_replayed == 0 && packets_skipped == 0) {
+                                first_packet_timestamp_ns = pending_packet.timestamp_ns;
+                        }
+                        have_pending_packet = true;
+                }
+
+                if (replay_options->replay_original_pace
+                                && pending_packet.timestamp_ns > first_packet_timestamp_ns) {
+                        uint64_t due_ms = replay_start_ms
+                                + (pending_packet.timestamp_ns - first_packet_timestamp_ns)
+                                / 1000000;
+                        uint64_t now_ms = event_loop_now_ms();
+                        if (due_ms > now_ms) {
+                                event_timer_schedule(&replay_timer, due_ms - now_ms);
+                                return;
+                        }
+                }
+
+                replay_packet(&pending_packet);
+                have_pending_packet = false;
+        }
+
+        // Let the event loop run other timers, e.g. of outputs
+        event_timer_schedule(&replay_timer, 0);
+}
+
+bool init_replay(const struct program_options *options)
+{
+        if (!pcapng_reader_open(&reader, options->replay_path)) {
+                return false;
+        }
+
+        replay_options = options;
+        replay_running = true;
+        replay_start_ms = event_loop_now_ms();
+        clock_gettime(CLOCK_MONOTONIC, &replay_start_time);
+
+        event_timer_init(&replay_timer, on_replay_timer, NULL);
+        return event_timer_schedule(&replay_timer, 0);
+}
+
+void shutdown_replay()
+{
+        if (replay_running) {
+                event_timer_cancel(&replay_timer);
+                pcapng_reader_close(&reader);
+                replay_running = false;
+        }
+}
+
+bool is_replay_finished()
+{
+        return replay_finished;
+}
+
+bool replay_failed()
+{
+        return replay_error;
+}
@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Offline replay of packets saved with --capture (or by tcpdump) to a pcapng
+ * file. Packets sent to this program are handled by
+ * process_incoming_packet(), just as if they had been received from the
+ * network, and measurements go to all configured outputs. The arrival time
+ * of every packet is taken from the capture, not from the clock.
+ *
+ * Packets are replayed from the event loop, either as fast as possible or
+ * with the original intervals between them.
+ */
+
+#include <stdbool.h>
+
+struct program_options;
+
+// Packets handled in one pass of the event loop when replaying as fast as
+// possible
+#define REPLAY_BATCH_SIZE 100
+
+bool init_replay(const struct program_options *options);
+void shutdown_replay();
+
+// Whether all packets have been replayed. Always false if not replaying.
+bool is_replay_finished();
+// Whether the capture file could not be read completely
+bool replay_failed();
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "scratch_arena.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Enough for any type on the supported platforms
+#define SCRATCH_ALIGNMENT 16
+
+static char *arena_memory = NULL;
+static size_t arena_size = 0;
+static size_t arena_used = 0;
+
+bool init_scratch_arena(size_t size)
+{
+        arena_memory = malloc(size);
+        if (arena_memory == NULL) {
+                fprintf(stderr, "Cannot allocate scratch memory of %zu bytes.\n", size);
+                return false;
+        }
+        arena_size = size;
+        arena_used = 0;
+        return true;
+}
+
+void shutdown_scratch_arena()
+{
+        free(arena_memory);
+        arena_memory = NULL;
+        arena_size = 0;
+        arena_used = 0;
+}
+
+void *scratch_alloc(size_t size)
+{
+        size_t start = (arena_used + SCRATCH_ALIGNMENT - 1) & ~(size_t) (SCRATCH_ALIGNMENT - 1);
+
+        if (start > arena_size || size > arena_size - start) {
+                fprintf(stderr, "Scratch memory exhausted, cannot allocate %zu bytes.\n",
+                                size);
+                return NULL;
+        }
+
+        arena_used = start + size;
+        return arena_memory + start;
+}
+
+size_t scratch_mark()
+{
+        return arena_used;
+}
+
+void scratch_release(size_t mark)
+{
+        assert(mark <= arena_used);
+        arena_used = mark;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Preallocated memory for temporary data needed while handling a packet:
+ * the decoded sensor state and SQL statements generated by outputs. After
+ * startup, handling packets does not allocate memory from the heap (which is
+ * slow and fragments memory with uClibc).
+ *
+ * The arena works like a stack: memory obtained after scratch_mark() is
+ * given back with scratch_release().
+ */
+
+// Enough for a decoded packet and SQL statements of all outputs
+#define SCRATCH_ARENA_SIZE (64 * 1024)
+
+bool init_scratch_arena(size_t size);
+void shutdown_scratch_arena();
+
+// Returns NULL if there is not enough space left
+void *scratch_alloc(size_t size);
+
+size_t scratch_mark();
+void scratch_release(size_t mark);
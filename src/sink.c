@@ -0,0 +1,616 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Outputs of decoded measurements, see sink.h.
+ *
+ * The queue of an output thread is a ring buffer with a single producer (the
+ * thread receiving packets) and a single consumer (the output thread),
+ * without locks. Positions in the ring only grow; both threads read the
+ * position written by the other one with acquire semantics and publish their
+ * own with release semantics. Semaphores are used only for waiting: the
+ * output thread sleeps on "available" when the queue is empty, and with
+ * SINK_QUEUE_BLOCK the receiving thread sleeps on "free_slots" when it is full.
+ *
+ * With SINK_QUEUE_DROP_OLDEST, the receiving thread discards the oldest
+ * entry by advancing the head with compare-and-swap, and then overwrites it.
+ * The output thread also takes entries with compare-and-swap: it copies the
+ * entry first and throws the copy away if the head has moved meanwhile,
+ * because the copy may have been overwritten.
+ *
+ * Outputs with a flush policy based on time (see output_file.h) are flushed
+ * by an event loop timer, or after a timeout of waiting for the queue in
+ * output threads.
+ */
+
+// pthread_sigmask()
+#define _POSIX_C_SOURCE 200809L
+
+#include "sink.h"
+#include "event_loop.h"
+#include "main.h"
+#include "metrics.h"
+#include "output_csv.h"
+#include "output_history.h"
+#include "output_json.h"
+#include "output_raw_sql.h"
+
+#ifdef HAVE_MYSQL
+# include "output_mysql.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct sink *const all_sinks[] = {
+        &log_sink,
+        &csv_sink,
+        &raw_sql_sink,
+        &status_file_sink,
+        &history_sink,
+#ifdef HAVE_MYSQL
+        &mysql_sink,
+#endif
+};
+#define SINK_COUNT (sizeof(all_sinks) / sizeof(all_sinks[0]))
+
+struct sink_ring {
+        struct device_sensor_state *entries;
+        // A power of two
+        unsigned long size;
+        // Next position to be taken by the output thread
+        unsigned long head;
+        // Next position to be written by the receiving thread
+        unsigned long tail;
+
+        // Posted for every entry added
+        sem_t available;
+        // Only with SINK_QUEUE_BLOCK, posted for every entry taken
+        sem_t free_slots;
+};
+
+struct active_sink {
+        const struct sink *sink;
+
+        bool threaded;
+        struct sink_ring ring;
+        pthread_t thread;
+        bool stopping;
+
+        // Only for outputs without a thread
+        struct event_timer flush_timer;
+
+        // Updated atomically, the errors may be counted by the output thread
+        unsigned long errors;
+        unsigned long dropped;
+};
+
+static struct active_sink active_sinks[SINK_COUNT];
+static int active_sink_count = 0;
+static int queue_policy = SINK_QUEUE_DROP_OLDEST;
+
+int sink_queue_policy_from_string(const char *name)
+{
+        static const char *const policy_names[] = {
+                [SINK_QUEUE_DROP_OLDEST] = "drop-oldest",
+                [SINK_QUEUE_DROP_NEWEST] = "drop-newest",
+                [SINK_QUEUE_BLOCK] = "block",
+        };
+
+        for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+                if (strcmp(name, policy_names[i]) == 0) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+static void wait_for_semaphore(sem_t *semaphore)
+{
+        while (sem_wait(semaphore) != 0 && errno == EINTR) {
+        }
+}
+
+// Waits forever if timeout_ms is negative. Returns false on timeout.
+static bool wait_for_semaphore_timeout(sem_t *semaphore, long timeout_ms)
+{
+        if (timeout_ms < 0) {
+                wait_for_semaphore(semaphore);
+                return true;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+        }
+
+        while (sem_timedwait(semaphore, &deadline) != 0) {
+                if (errno == ETIMEDOUT) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+static void write_to_sink(struct active_sink *active,
+                const struct device_sensor_state *state)
+{
+        uint64_t start_ns = latency_now_ns();
+        bool ok = active->sink->submit(state);
+        latency_record_since(active->sink->latency_stage, start_ns);
+
+        if (!ok) {
+                __atomic_add_fetch(&active->errors, 1, __ATOMIC_RELAXED);
+                metrics_changed();
+        }
+}
+
+static void flush_sink(struct active_sink *active)
+{
+        if (active->sink->flush != NULL && !active->sink->flush()) {
+                __atomic_add_fetch(&active->errors, 1, __ATOMIC_RELAXED);
+                metrics_changed();
+        }
+}
+
+static long get_flush_timeout_ms(const struct active_sink *active)
+{
+        if (active->sink->get_flush_timeout_ms == NULL) {
+                return -1;
+        }
+        return active->sink->get_flush_timeout_ms();
+}
+
+static void on_flush_timer(void *data)
+{
+        struct active_sink *active = data;
+
+        flush_sink(active);
+        long timeout_ms = get_flush_timeout_ms(active);
+        if (timeout_ms >= 0) {
+                event_timer_schedule(&active->flush_timer, timeout_ms);
+        }
+}
+
+static void schedule_flush_timer(struct active_sink *active)
+{
+        if (event_timer_is_scheduled(&active->flush_timer)) {
+                // on_flush_timer() schedules it again if needed
+                return;
+        }
+        long timeout_ms = get_flush_timeout_ms(active);
+        if (timeout_ms >= 0) {
+                event_timer_schedule(&active->flush_timer, timeout_ms);
+        }
+}
+
+/*
+ * The queue
+ */
+
+static bool init_ring(struct sink_ring *ring, unsigned int size)
+{
+        ring->size = 1;
+        while (ring->size < size) {
+                ring->size *= 2;
+        }
+        ring->head = 0;
+        ring->tail = 0;
+
+        ring->entries = malloc(ring->size * sizeof(ring->entries[0]));
+        if (ring->entries == NULL) {
+                perror("Cannot allocate memory for an output queue");
+                return false;
+        }
+
+        if (sem_init(&ring->available, 0, 0) != 0
+                        || sem_init(&ring->free_slots, 0, ring->size) != 0) {
+                perror("Cannot create semaphores of an output queue");
+                free(ring->entries);
+                return false;
+        }
+        return true;
+}
+
+static void destroy_ring(struct sink_ring *ring)
+{
+        sem_destroy(&ring->available);
+        sem_destroy(&ring->free_slots);
+        free(ring->entries);
+        ring->entries = NULL;
+}
+
+// Called by the receiving thread
+static void push_to_ring(struct active_sink *active,
+                const struct device_sensor_state *state)
+{
+        struct sink_ring *ring = &active->ring;
+        unsigned long tail = ring->tail;
+
+        if (queue_policy == SINK_QUEUE_BLOCK) {
+                wait_for_semaphore(&ring->free_slots);
+        } else {
+                unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+                if (tail - head == ring->size) {
+                        if (queue_policy == SINK_QUEUE_DROP_NEWEST) {
+                                active->dropped++;
+                                metrics_changed();
+                                return;
+                        }
+                        // If this fails, the output thread has just taken
+                        // the entry, which makes room as well
+                        if (__atomic_compare_exchange_n(&ring->head, &head, head + 1,
+                                                false, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                                active->dropped++;
+                                metrics_changed();
+                        }
+                }
+        }
+
+        memcpy(&ring->entries[tail & (ring->size - 1)], state, sizeof(*state));
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        sem_post(&ring->available);
+}
+
+// Called by the output thread. Returns false if the queue is empty.
+static bool pop_from_ring(struct sink_ring *ring, struct device_sensor_state *state)
+{
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (true) {
+                unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+                if (head == tail) {
+                        return false;
+                }
+
+                memcpy(state, &ring->entries[head & (ring->size - 1)], sizeof(*state));
+                // On failure, head is set to the current value
+                if (__atomic_compare_exchange_n(&ring->head, &head, head + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        return true;
+                }
+        }
+}
+
+static bool is_ring_empty(struct sink_ring *ring)
+{
+        return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+                == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Output threads
+ */
+
+static void *sink_thread(void *data)
+{
+        struct active_sink *active = data;
+        struct sink_ring *ring = &active->ring;
+        struct device_sensor_state state;
+        bool flush_needed = false;
+
+        while (true) {
+                // Posted also for dropped entries and on shutdown
+                if (!wait_for_semaphore_timeout(&ring->available,
+                                        get_flush_timeout_ms(active))) {
+                        flush_sink(active);
+                        continue;
+                }
+
+                if (pop_from_ring(ring, &state)) {
+                        if (queue_policy == SINK_QUEUE_BLOCK) {
+                                sem_post(&ring->free_slots);
+                        }
+                        write_to_sink(active, &state);
+                        flush_needed = true;
+                }
+
+                // Many measurements waiting are written out together. The
+                // flush policy may delay writing them further.
+                if (flush_needed && is_ring_empty(ring)) {
+                        flush_sink(active);
+                        flush_needed = false;
+                }
+
+                // Nothing is queued after shutdown_sinks() has been called
+                if (__atomic_load_n(&active->stopping, __ATOMIC_ACQUIRE)
+                                && is_ring_empty(ring)) {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+static bool start_sink_thread(struct active_sink *active, unsigned int queue_size)
+{
+        if (!init_ring(&active->ring, queue_size)) {
+                return false;
+        }
+        active->stopping = false;
+
+        // Signals are handled by the main thread
+        sigset_t all_signals, old_signals;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+        int ret = pthread_create(&active->thread, NULL, sink_thread, active);
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+        if (ret != 0) {
+                fprintf(stderr, "Cannot start a thread for output '%s': %s\n",
+                                active->sink->name, strerror(ret));
+                destroy_ring(&active->ring);
+                return false;
+        }
+        active->threaded = true;
+        return true;
+}
+
+static void stop_sink_thread(struct active_sink *active)
+{
+        __atomic_store_n(&active->stopping, true, __ATOMIC_RELEASE);
+        sem_post(&active->ring.available);
+        pthread_join(active->thread, NULL);
+
+        destroy_ring(&active->ring);
+        active->threaded = false;
+}
+
+/*
+ * The list of output threads, e.g. "csv,status_file" or "all"
+ */
+
+static bool is_in_thread_list(const char *list, const char *name)
+{
+        size_t name_length = strlen(name);
+
+        while (*list != '\0') {
+                size_t length = strcspn(list, ",");
+                if ((length == name_length && strncmp(list, name, length) == 0)
+                                || (length == 3 && strncmp(list, "all", 3) == 0)) {
+                        return true;
+                }
+                list += length;
+                if (*list == ',') {
+                        list++;
+                }
+        }
+        return false;
+}
+
+static bool check_thread_list(const char *list, const struct program_options *options)
+{
+        while (*list != '\0') {
+                size_t length = strcspn(list, ",");
+                const struct sink *sink = NULL;
+
+                for (size_t i = 0; i < SINK_COUNT && sink == NULL; i++) {
+                        if (strlen(all_sinks[i]->name) == length
+                                        && strncmp(list, all_sinks[i]->name, length) == 0) {
+                                sink = all_sinks[i];
+                        }
+                }
+
+                if (length == 3 && strncmp(list, "all", 3) == 0) {
+                        // Every output that can have a thread
+                } else if (sink == NULL) {
+                        fprintf(stderr, "Unknown output '%.*s' in --output-threads\n",
+                                        (int) length, list);
+                        return false;
+                } else if (!sink->threadable) {
+                        fprintf(stderr, "Output '%s' cannot have its own thread\n",
+                                        sink->name);
+                        return false;
+                } else if (!sink->is_enabled(options)) {
+                        fprintf(stderr, "Output '%s' listed in --output-threads "
+                                        "is not enabled\n", sink->name);
+                        return false;
+                }
+
+                list += length;
+                if (*list == ',') {
+                        list++;
+                }
+        }
+        return true;
+}
+
+bool check_sink_options(const struct program_options *options)
+{
+        return options->output_threads == NULL
+                || check_thread_list(options->output_threads, options);
+}
+
+static bool wants_thread(const struct sink *sink, const struct program_options *options)
+{
+        return sink->threadable && options->output_threads != NULL
+                && is_in_thread_list(options->output_threads, sink->name);
+}
+
+bool init_sinks(const struct program_options *options)
+{
+        queue_policy = options->output_queue_policy;
+
+        if (!check_sink_options(options)) {
+                return false;
+        }
+
+        active_sink_count = 0;
+        for (size_t i = 0; i < SINK_COUNT; i++) {
+                const struct sink *sink = all_sinks[i];
+                if (!sink->is_enabled(options)) {
+                        continue;
+                }
+                if (!sink->init(options)) {
+                        shutdown_sinks();
+                        return false;
+                }
+
+                struct active_sink *active = &active_sinks[active_sink_count++];
+                memset(active, 0, sizeof(*active));
+                active->sink = sink;
+                event_timer_init(&active->flush_timer, on_flush_timer, active);
+
+                if (wants_thread(sink, options)
+                                && !start_sink_thread(active, options->output_queue_size)) {
+                        shutdown_sinks();
+                        return false;
+                }
+        }
+        return true;
+}
+
+void shutdown_sinks()
+{
+        for (int i = 0; i < active_sink_count; i++) {
+                struct active_sink *active = &active_sinks[i];
+
+                if (active->threaded) {
+                        stop_sink_thread(active);
+                }
+                event_timer_cancel(&active->flush_timer);
+                active->sink->shutdown();
+        }
+        active_sink_count = 0;
+}
+
+// Calls sink->reload() or shutdown() and init() of a sink that is active
+static bool reload_sink(const struct sink *sink, bool was_active, bool enabled,
+                const struct program_options *options)
+{
+        bool ok = true;
+
+        if (was_active && enabled && sink->reload != NULL) {
+                ok = sink->reload(options);
+        } else {
+                if (was_active) {
+                        sink->shutdown();
+                }
+                if (enabled) {
+                        ok = sink->init(options);
+                }
+        }
+
+        if (!ok) {
+                fprintf(stderr, "Cannot reopen output '%s', it is disabled\n",
+                                sink->name);
+                sink->shutdown();
+        }
+        return ok;
+}
+
+bool reload_sinks(const struct program_options *options)
+{
+        struct active_sink previous_sinks[SINK_COUNT];
+        int previous_count = active_sink_count;
+        bool ok = true;
+
+        // Threads write everything queued before they stop
+        for (int i = 0; i < active_sink_count; i++) {
+                if (active_sinks[i].threaded) {
+                        stop_sink_thread(&active_sinks[i]);
+                }
+                event_timer_cancel(&active_sinks[i].flush_timer);
+        }
+        memcpy(previous_sinks, active_sinks, sizeof(previous_sinks));
+
+        queue_policy = options->output_queue_policy;
+        active_sink_count = 0;
+
+        for (size_t i = 0; i < SINK_COUNT; i++) {
+                const struct sink *sink = all_sinks[i];
+                const struct active_sink *previous = NULL;
+                for (int j = 0; j < previous_count; j++) {
+                        if (previous_sinks[j].sink == sink) {
+                                previous = &previous_sinks[j];
+                        }
+                }
+
+                bool enabled = sink->is_enabled(options);
+                if (previous == NULL && !enabled) {
+                        continue;
+                }
+                if (!reload_sink(sink, previous != NULL, enabled, options)) {
+                        ok = false;
+                        continue;
+                }
+                if (!enabled) {
+                        continue;
+                }
+
+                struct active_sink *active = &active_sinks[active_sink_count++];
+                memset(active, 0, sizeof(*active));
+                active->sink = sink;
+                event_timer_init(&active->flush_timer, on_flush_timer, active);
+                if (previous != NULL) {
+                        active->errors = previous->errors;
+                        active->dropped = previous->dropped;
+                }
+
+                if (wants_thread(sink, options)
+                                && !start_sink_thread(active, options->output_queue_size)) {
+                        fprintf(stderr, "Writing to output '%s' without a thread\n",
+                                        sink->name);
+                        ok = false;
+                }
+        }
+
+        metrics_changed();
+        return ok;
+}
+
+void submit_to_sinks(const struct device_sensor_state *state)
+{
+        for (int i = 0; i < active_sink_count; i++) {
+                struct active_sink *active = &active_sinks[i];
+
+                if (active->threaded) {
+                        push_to_ring(active, state);
+                } else {
+                        write_to_sink(active, state);
+                        flush_sink(active);
+                        schedule_flush_timer(active);
+                }
+        }
+}
+
+int get_sink_count()
+{
+        return active_sink_count;
+}
+
+void get_sink_stats(int index, struct sink_stats *stats)
+{
+        const struct active_sink *active = &active_sinks[index];
+
+        stats->name = active->sink->name;
+        stats->threaded = active->threaded;
+        stats->errors = __atomic_load_n(&active->errors, __ATOMIC_RELAXED);
+        stats->dropped = active->dropped;
+}
@@ -0,0 +1,109 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/*
+ * Outputs of decoded measurements ("sinks"): the log, CSV and raw SQL files,
+ * the status file, the history file and MySQL. Every output module defines a struct sink,
+ * which is listed in sink.c. main.c and emax_em3371.c only call the
+ * functions below.
+ *
+ * By default, every measurement is written to all outputs one after another
+ * in the thread that receives packets. An output listed in --output-threads
+ * gets its own thread instead, fed through a bounded queue. A slow disk then
+ * does not delay replies to weather stations or the other outputs. What
+ * happens when the queue is full is set with --output-queue-policy.
+ */
+
+#include "emax_em3371.h"
+#include "latency.h"
+
+#include <stdbool.h>
+
+struct program_options;
+
+struct sink {
+        // Used in --output-threads and in metrics
+        const char *name;
+        // Whether the output has been configured on the command line
+        bool (*is_enabled)(const struct program_options *options);
+
+        bool (*init)(const struct program_options *options);
+        // Returns false if the measurement could not be written
+        bool (*submit)(const struct device_sensor_state *state);
+        // Called after one or more measurements have been submitted. Writes
+        // out buffered data if the flush policy of the output says so.
+        // May be NULL. Returns false on error.
+        bool (*flush)();
+        // Milliseconds until flush() must be called again even if nothing
+        // is submitted, -1 if not needed. May be NULL.
+        long (*get_flush_timeout_ms)();
+        // Writes out all buffered data
+        void (*shutdown)();
+        // Applies new options on SIGHUP, e.g. reopens files. May be NULL,
+        // shutdown() and init() are called then.
+        bool (*reload)(const struct program_options *options);
+
+        // Outputs that use the event loop cannot have their own thread
+        bool threadable;
+        enum latency_stage latency_stage;
+};
+
+enum sink_queue_policy {
+        // Discard the oldest measurement waiting in the queue
+        SINK_QUEUE_DROP_OLDEST,
+        // Discard the new measurement
+        SINK_QUEUE_DROP_NEWEST,
+        // Wait until the output thread takes a measurement from the queue,
+        // delaying everything else
+        SINK_QUEUE_BLOCK,
+};
+
+// Measurements waiting for every output thread; rounded up to a power of two
+#define DEFAULT_OUTPUT_QUEUE_SIZE 64
+#define MAX_OUTPUT_QUEUE_SIZE 65536
+
+// Accepts "drop-oldest", "drop-newest" and "block". Returns -1 for other names.
+int sink_queue_policy_from_string(const char *name);
+
+// Checks --output-threads, prints a message on errors
+bool check_sink_options(const struct program_options *options);
+// Initializes all enabled outputs and starts their threads
+bool init_sinks(const struct program_options *options);
+// Waits until output threads write all queued measurements
+void shutdown_sinks();
+// Reopens all outputs with new options, also enabling and disabling them.
+// Nothing queued is lost. Outputs that cannot be reopened are disabled and
+// false is returned.
+bool reload_sinks(const struct program_options *options);
+
+void submit_to_sinks(const struct device_sensor_state *state);
+
+struct sink_stats {
+        const char *name;
+        bool threaded;
+        // Measurements that could not be written
+        unsigned long errors;
+        // Measurements dropped because the queue was full
+        unsigned long dropped;
+};
+
+// Of the enabled outputs
+int get_sink_count();
+void get_sink_stats(int index, struct sink_stats *stats);
@@ -0,0 +1,197 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A registry of weather stations, used when many stations report to a single
+ * instance of this program.
+ *
+ * It is an open addressing hash table with linear probing. The table is
+ * allocated once at startup and is at most half full, so that lookups on the
+ * packet handling path take constant time and do not allocate memory.
+ * Entries are never removed, therefore pointers to them stay valid until
+ * shutdown_station_registry() is called.
+ */
+
+#include "station_registry.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct station_state *station_table = NULL;
+// Always a power of two, at least 2
+static size_t station_table_size = 0;
+static unsigned int station_table_bits = 0;
+static size_t station_count = 0;
+static size_t max_station_count = 0;
+
+static bool registry_full_reported = false;
+
+static size_t station_hash(uint32_t mac)
+{
+        // Fibonacci hashing. The byte at offset 0x03 is nearly always the
+        // same (0x69), so all bits of the MAC address must be mixed well.
+        uint32_t hash = mac * UINT32_C(2654435761);
+        return (size_t) (hash >> (32 - station_table_bits));
+}
+
+bool init_station_registry(size_t max_stations)
+{
+        if (max_stations == 0) {
+                fputs("Maximum number of weather stations must be positive\n", stderr);
+                return false;
+        }
+
+        size_t table_size = 2;
+        unsigned int table_bits = 1;
+        while (table_size < max_stations * 2) {
+                table_size *= 2;
+                table_bits++;
+        }
+
+        if (table_bits > 31) {
+                fputs("Maximum number of weather stations is too big\n", stderr);
+                return false;
+        }
+
+        station_table = calloc(table_size, sizeof(*station_table));
+        if (station_table == NULL) {
+                fprintf(stderr, "Cannot allocate a registry for %zu weather stations.\n",
+                                max_stations);
+                return false;
+        }
+
+        station_table_size = table_size;
+        station_table_bits = table_bits;
+        station_count = 0;
+        max_station_count = max_stations;
+        registry_full_reported = false;
+
+        return true;
+}
+
+void shutdown_station_registry()
+{
+        free(station_table);
+        station_table = NULL;
+
+        station_table_size = 0;
+        station_table_bits = 0;
+        station_count = 0;
+        max_station_count = 0;
+}
+
+static struct station_state *find_slot(uint32_t mac)
+{
+        size_t position = station_hash(mac);
+
+        // The table is never full, so this loop always terminates
+        while (station_table[position].in_use
+                        && station_table[position].mac != mac) {
+                position = (position + 1) & (station_table_size - 1);
+        }
+
+        return &station_table[position];
+}
+
+struct station_state *find_station(uint32_t mac)
+{
+        if (station_table == NULL) {
+                return NULL;
+        }
+
+        struct station_state *station = find_slot(mac);
+        if (!station->in_use) {
+                return NULL;
+        }
+        return station;
+}
+
+struct station_state *find_or_add_station(uint32_t mac, time_t packet_arrival_time)
+{
+        if (station_table == NULL) {
+                return NULL;
+        }
+
+        struct station_state *station = find_slot(mac);
+        if (station->in_use) {
+                return station;
+        }
+
+        if (station_count >= max_station_count) {
+                if (!registry_full_reported) {
+                        log_warning("Too many weather stations (%zu), ignoring "
+                                "packets from new ones. Consider increasing "
+                                "--max-stations.\n", max_station_count);
+                        registry_full_reported = true;
+                }
+                return NULL;
+        }
+
+        memset(station, 0, sizeof(*station));
+        station->in_use = true;
+        station->mac = mac;
+        station->index = station_count;
+        station->first_packet_time = packet_arrival_time;
+        // Function numbers below 0x03 are well known
+        station->fuzzing_function_no = 0x03;
+        event_timer_init(&station->timesync_timer, NULL, station);
+
+        station_count++;
+
+        char mac_string[STATION_MAC_STRING_SIZE];
+        station_mac_to_string(mac, mac_string, sizeof(mac_string));
+        log_info("New weather station %s (%zu known)\n",
+                        mac_string, station_count);
+
+        return station;
+}
+
+size_t get_station_count()
+{
+        return station_count;
+}
+
+struct station_state *get_next_station(struct station_state *previous)
+{
+        if (station_table == NULL) {
+                return NULL;
+        }
+
+        size_t position = 0;
+        if (previous != NULL) {
+                position = (previous - station_table) + 1;
+        }
+
+        for (; position < station_table_size; position++) {
+                if (station_table[position].in_use) {
+                        return &station_table[position];
+                }
+        }
+        return NULL;
+}
+
+void station_mac_to_string(uint32_t mac, char *mac_out, size_t buffer_size)
+{
+        snprintf(mac_out, buffer_size, "%02x:%02x:%02x:%02x",
+                        (unsigned int) (mac >> 24) & 0xff,
+                        (unsigned int) (mac >> 16) & 0xff,
+                        (unsigned int) (mac >> 8) & 0xff,
+                        (unsigned int) mac & 0xff);
+}
@@ -0,0 +1,84 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "emax_em3371.h"
+#include "event_loop.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+// "69:ab:cd:ef" plus the terminating null byte
+#define STATION_MAC_STRING_SIZE 12
+#define DEFAULT_MAX_STATIONS 64
+
+/*
+ * State kept for every weather station that has sent us a valid packet.
+ *
+ * Stations are identified by the last 4 bytes of their MAC address, which are
+ * present at offset 0x03 of every packet (see Documentation/device_protocol.md).
+ */
+struct station_state {
+        bool in_use;
+        uint32_t mac;
+        // Stations are numbered from 0 in the order they were first seen, so
+        // that outputs can keep their data in an array of max_stations entries
+        size_t index;
+
+        // Where the last packet from this station came from
+        struct sockaddr_in last_address;
+
+        time_t first_packet_time;
+        time_t last_packet_time;
+        time_t last_sensor_packet_time;
+        // Period between the last two sensor data reports, in seconds.
+        // Zero if not known yet. It increases from 12.5s to around 107s
+        // after the station time has been set.
+        time_t report_interval;
+
+        bool has_timesync_packet_been_sent;
+        // Setting the station time is scheduled after the first sensor
+        // data packet and retried on failure.
+        struct event_timer timesync_timer;
+        unsigned char fuzzing_function_no;
+
+        unsigned long packets_received;
+        unsigned long ping_packets_received;
+        unsigned long sensor_packets_received;
+
+        bool has_last_sensor_state;
+        struct device_sensor_state last_sensor_state;
+};
+
+bool init_station_registry(size_t max_stations);
+void shutdown_station_registry();
+
+// Returns NULL if the station has not been seen yet
+struct station_state *find_station(uint32_t mac);
+// Returns NULL only if the registry is full
+struct station_state *find_or_add_station(uint32_t mac, time_t packet_arrival_time);
+
+size_t get_station_count();
+// Iterates over all known stations. Pass NULL to get the first one.
+struct station_state *get_next_station(struct station_state *previous);
+
+void station_mac_to_string(uint32_t mac, char *mac_out, size_t buffer_size);
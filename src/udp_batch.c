@@ -0,0 +1,361 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Receiving and sending UDP packets in batches.
+ *
+ * When many weather stations report to a single instance of this program,
+ * the cost of doing one system call per packet dominates. recvmmsg() and
+ * sendmmsg() can transfer many packets in a single system call.
+ *
+ * They are Linux-specific, were added to GNU libc in versions 2.12 and 2.14
+ * and are missing in uClibc, which is used on DD-WRT. Define NO_RECVMMSG to
+ * disable them at compile time. If the kernel does not support them, this
+ * code falls back to recvmsg() and sendto() at runtime.
+ *
+ * Kernel receive timestamps (SO_TIMESTAMPNS) are read from the control
+ * messages of every packet, for latency statistics.
+ */
+
+// recvmmsg, sendmmsg, struct mmsghdr
+#define _GNU_SOURCE
+
+#include "udp_batch.h"
+#include "main.h"
+#include "capture.h"
+#include "latency.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if !defined(NO_RECVMMSG) && defined(__linux__) && defined(__GLIBC__)         \
+        && !defined(__UCLIBC__)                                                 \
+        && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 14))
+# define HAVE_RECVMMSG
+#endif
+
+// Ping packets, which are the only ones being queued, are 14 bytes long
+#define QUEUED_PACKET_MAX_SIZE 64
+
+static unsigned int batch_size = 0;
+
+static unsigned char *receive_memory = NULL;
+static struct received_udp_packet *received_packets = NULL;
+
+// Space for the SO_TIMESTAMPNS control message of every packet
+#define RECEIVE_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+static unsigned char *receive_control = NULL;
+
+static unsigned char *send_memory = NULL;
+static struct sockaddr_in *send_destinations = NULL;
+static size_t *send_sizes = NULL;
+static unsigned int send_queue_length = 0;
+
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr *receive_headers = NULL;
+static struct iovec *receive_iovecs = NULL;
+
+static struct mmsghdr *send_headers = NULL;
+static struct iovec *send_iovecs = NULL;
+
+static bool recvmmsg_available = true;
+static bool sendmmsg_available = true;
+#endif
+
+bool init_udp_batch(unsigned int requested_batch_size)
+{
+        if (requested_batch_size == 0 || requested_batch_size > MAX_RECEIVE_BATCH_SIZE) {
+                fprintf(stderr, "Incorrect receive batch size %u\n", requested_batch_size);
+                return false;
+        }
+        batch_size = requested_batch_size;
+
+        receive_memory = malloc(batch_size * RECEIVE_PACKET_SIZE);
+        received_packets = calloc(batch_size, sizeof(*received_packets));
+        receive_control = malloc(batch_size * RECEIVE_CONTROL_SIZE);
+        send_memory = malloc(batch_size * QUEUED_PACKET_MAX_SIZE);
+        send_destinations = calloc(batch_size, sizeof(*send_destinations));
+        send_sizes = calloc(batch_size, sizeof(*send_sizes));
+
+        if (receive_memory == NULL || received_packets == NULL
+                        || receive_control == NULL || send_memory == NULL || send_destinations == NULL
+                        || send_sizes == NULL) {
+                goto err;
+        }
+
+        for (unsigned int i = 0; i < batch_size; i++) {
+                received_packets[i].data = receive_memory + i * RECEIVE_PACKET_SIZE;
+        }
+
+#ifdef HAVE_RECVMMSG
+        receive_headers = calloc(batch_size, sizeof(*receive_headers));
+        receive_iovecs = calloc(batch_size, sizeof(*receive_iovecs));
+        send_headers = calloc(batch_size, sizeof(*send_headers));
+        send_iovecs = calloc(batch_size, sizeof(*send_iovecs));
+
+        if (receive_headers == NULL || receive_iovecs == NULL
+                        || send_headers == NULL || send_iovecs == NULL) {
+                goto err;
+        }
+
+        for (unsigned int i = 0; i < batch_size; i++) {
+                receive_iovecs[i].iov_base = received_packets[i].data;
+                receive_iovecs[i].iov_len = RECEIVE_PACKET_SIZE;
+
+                receive_headers[i].msg_hdr.msg_iov = &receive_iovecs[i];
+                receive_headers[i].msg_hdr.msg_iovlen = 1;
+
+                send_iovecs[i].iov_base = send_memory + i * QUEUED_PACKET_MAX_SIZE;
+                send_headers[i].msg_hdr.msg_iov = &send_iovecs[i];
+                send_headers[i].msg_hdr.msg_iovlen = 1;
+                send_headers[i].msg_hdr.msg_name = &send_destinations[i];
+                send_headers[i].msg_hdr.msg_namelen = sizeof(send_destinations[i]);
+        }
+#else
+        if (batch_size > 1) {
+                fputs("Warning: recvmmsg() support not compiled in, "
+                        "receiving packets one by one\n", stderr);
+        }
+#endif
+
+        send_queue_length = 0;
+        return true;
+
+err:
+        fputs("Cannot allocate memory for receive buffers\n", stderr);
+        shutdown_udp_batch();
+        return false;
+}
+
+void shutdown_udp_batch()
+{
+        free(receive_memory);
+        receive_memory = NULL;
+        free(received_packets);
+        received_packets = NULL;
+        free(receive_control);
+        receive_control = NULL;
+
+        free(send_memory);
+        send_memory = NULL;
+        free(send_destinations);
+        send_destinations = NULL;
+        free(send_sizes);
+        send_sizes = NULL;
+
+#ifdef HAVE_RECVMMSG
+        free(receive_headers);
+        receive_headers = NULL;
+        free(receive_iovecs);
+        receive_iovecs = NULL;
+        free(send_headers);
+        send_headers = NULL;
+        free(send_iovecs);
+        send_iovecs = NULL;
+#endif
+
+        batch_size = 0;
+        send_queue_length = 0;
+}
+
+// Converts the kernel receive timestamp, which is in CLOCK_REALTIME, to
+// CLOCK_MONOTONIC using the time now from both clocks.
+static void set_arrival_time(struct received_udp_packet *packet, struct msghdr *header,
+                uint64_t now_ns, const struct timespec *now_realtime)
+{
+        packet->arrival_ns = now_ns;
+        packet->has_kernel_timestamp = false;
+
+#ifdef SO_TIMESTAMPNS
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != NULL;
+                        cmsg = CMSG_NXTHDR(header, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+                        continue;
+                }
+
+                struct timespec kernel_time;
+                memcpy(&kernel_time, CMSG_DATA(cmsg), sizeof(kernel_time));
+                int64_t age_ns = (int64_t) (now_realtime->tv_sec - kernel_time.tv_sec)
+                        * 1000000000 + (now_realtime->tv_nsec - kernel_time.tv_nsec);
+                // Unless the clock has just been set
+                if (age_ns >= 0 && (uint64_t) age_ns < now_ns) {
+                        packet->arrival_ns = now_ns - age_ns;
+                        packet->has_kernel_timestamp = true;
+                }
+        }
+#else
+        (void) header;
+        (void) now_realtime;
+#endif
+}
+
+static int receive_single_packet(int udp_socket)
+{
+        struct received_udp_packet *packet = &received_packets[0];
+
+        /* man socket:
+         * SOCK_DGRAM  and  SOCK_RAW sockets allow sending of datagrams to
+         * correspondents named in sendto(2) calls.  Datagrams are generally
+         * received with recvfrom(2), which returns the next datagram along
+         * with the address of its sender.
+         *
+         * recvmsg() is used instead, as it returns the receive timestamp too.
+         */
+        struct iovec iovec = {
+                .iov_base = packet->data,
+                .iov_len = RECEIVE_PACKET_SIZE,
+        };
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = &packet->source;
+        header.msg_namelen = sizeof(packet->source);
+        header.msg_iov = &iovec;
+        header.msg_iovlen = 1;
+        header.msg_control = receive_control;
+        header.msg_controllen = RECEIVE_CONTROL_SIZE;
+
+        long int ret = recvmsg(udp_socket, &header, 0);
+        if (ret == -1) {
+                return -1;
+        }
+
+        uint64_t now_ns = latency_now_ns();
+        struct timespec now_realtime;
+        clock_gettime(CLOCK_REALTIME, &now_realtime);
+
+        packet->size = ret;
+        set_arrival_time(packet, &header, now_ns, &now_realtime);
+        return 1;
+}
+
+int receive_udp_batch(int udp_socket, struct received_udp_packet **packets)
+{
+        *packets = received_packets;
+
+#ifdef HAVE_RECVMMSG
+        if (batch_size > 1 && recvmmsg_available) {
+                for (unsigned int i = 0; i < batch_size; i++) {
+                        receive_headers[i].msg_hdr.msg_name = &received_packets[i].source;
+                        receive_headers[i].msg_hdr.msg_namelen =
+                                sizeof(received_packets[i].source);
+                        receive_headers[i].msg_hdr.msg_control =
+                                receive_control + i * RECEIVE_CONTROL_SIZE;
+                        receive_headers[i].msg_hdr.msg_controllen = RECEIVE_CONTROL_SIZE;
+                }
+
+                // Block until the first packet arrives, then take
+                // whatever else is already waiting.
+                int ret = recvmmsg(udp_socket, receive_headers, batch_size,
+                                MSG_WAITFORONE, NULL);
+                if (ret == -1 && errno == ENOSYS) {
+                        fputs("recvmmsg() not supported by the kernel, "
+                                "receiving packets one by one\n", stderr);
+                        recvmmsg_available = false;
+                        return receive_single_packet(udp_socket);
+                }
+
+                uint64_t now_ns = latency_now_ns();
+                struct timespec now_realtime;
+                clock_gettime(CLOCK_REALTIME, &now_realtime);
+
+                for (int i = 0; i < ret; i++) {
+                        received_packets[i].size = receive_headers[i].msg_len;
+                        set_arrival_time(&received_packets[i],
+                                        &receive_headers[i].msg_hdr,
+                                        now_ns, &now_realtime);
+                }
+                return ret;
+        }
+#endif
+
+        return receive_single_packet(udp_socket);
+}
+
+int queue_udp_packet(int udp_socket, const struct sockaddr_in *destination,
+                const unsigned char *payload, const size_t payload_size)
+{
+#ifdef HAVE_RECVMMSG
+        if (batch_size > 1 && sendmmsg_available
+                        && payload_size <= QUEUED_PACKET_MAX_SIZE) {
+
+                if (send_queue_length >= batch_size) {
+                        flush_udp_packets(udp_socket);
+                }
+
+                unsigned int i = send_queue_length++;
+                memcpy(send_memory + i * QUEUED_PACKET_MAX_SIZE, payload, payload_size);
+                memcpy(&send_destinations[i], destination, sizeof(*destination));
+                send_sizes[i] = payload_size;
+                return 0;
+        }
+#endif
+
+        return send_udp_packet(udp_socket, destination, payload, payload_size);
+}
+
+void flush_udp_packets(int udp_socket)
+{
+        unsigned int sent = 0;
+
+#ifdef HAVE_RECVMMSG
+        if (sendmmsg_available) {
+                for (unsigned int i = 0; i < send_queue_length; i++) {
+                        send_iovecs[i].iov_len = send_sizes[i];
+                }
+
+                while (sent < send_queue_length) {
+                        int ret = sendmmsg(udp_socket, send_headers + sent,
+                                        send_queue_length - sent, 0);
+                        if (ret == -1) {
+                                if (errno == ENOSYS) {
+                                        sendmmsg_available = false;
+                                } else if (errno != EINTR) {
+                                        perror("Cannot send UDP packets");
+                                        // Skip the packet that caused the error
+                                        sent++;
+                                }
+                                if (!sendmmsg_available) {
+                                        break;
+                                }
+                                continue;
+                        }
+                        for (int i = 0; i < ret; i++, sent++) {
+                                capture_outgoing_packet(&send_destinations[sent],
+                                                send_memory + sent * QUEUED_PACKET_MAX_SIZE,
+                                                send_sizes[sent]);
+                        }
+                }
+        }
+#endif
+
+        // Fallback when sendmmsg() is not supported by the kernel
+        for (; sent < send_queue_length; sent++) {
+                send_udp_packet(udp_socket, &send_destinations[sent],
+                                send_memory + sent * QUEUED_PACKET_MAX_SIZE,
+                                send_sizes[sent]);
+        }
+
+        send_queue_length = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2020-2021 Mateusz Jończyk
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define DEFAULT_RECEIVE_BATCH_SIZE 1
+#define MAX_RECEIVE_BATCH_SIZE 1024
+
+struct received_udp_packet {
+        unsigned char *data;
+        size_t size;
+        struct sockaddr_in source;
+        // When the packet arrived, as CLOCK_MONOTONIC nanoseconds. Taken from
+        // the kernel timestamp if SO_TIMESTAMPNS has been enabled on the
+        // socket, otherwise it is the time the packet has been read.
+        uint64_t arrival_ns;
+        bool has_kernel_timestamp;
+};
+
+bool init_udp_batch(unsigned int batch_size);
+void shutdown_udp_batch();
+
+// Waits for at least one packet and returns all packets that are already
+// waiting in the socket, up to the batch size.
+// Returns the number of packets received or -1 on error (errno is set then).
+// The packets are valid until the next call.
+int receive_udp_batch(int udp_socket, struct received_udp_packet **packets);
+
+// Sends the packet in the next call to flush_udp_packets() if batching is
+// enabled, immediately otherwise.
+int queue_udp_packet(int udp_socket, const struct sockaddr_in *destination,
+                const unsigned char *payload, const size_t payload_size);
+void flush_udp_packets(int udp_socket);